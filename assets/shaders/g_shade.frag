@@ -45,7 +45,6 @@ struct Light {
   vec4 spec_colour;
 };
 
-layout (constant_id = 0) const uint num_materials = 1U;
 layout (constant_id = 1) const uint num_lights = 1U;
 
 
@@ -1,8 +1,9 @@
-#version 440
+#version 450
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
 #extension GL_ARB_shader_image_load_store : enable
+#extension GL_ARB_shader_ballot : require
 
 #define kProjViewMatricesBindingPos 0
 #define kModelMatricesBindingPos 0
@@ -12,11 +13,14 @@
 #define kVertexBufferBindingPos 4
 #define kIndexBufferBindingPos 2
 #define kMaterialIDsBindingPos 1
-#define kDiffuseTexturesArrayBindingPos 2
-#define kAmbientTexturesArrayBindingPos 3
-#define kSpecularTexturesArrayBindingPos 4
-#define kNormalTexturesArrayBindingPos 5
-#define kRoughnessTexturesArrayBindingPos 6
+// Set of the texture table, after the sets of the renderer
+#define kTextureTableSet 3
+// Texture indices of the materials, indexed by MatTextureType
+#define kAmbientTextureId 0
+#define kDiffuseTextureId 1
+#define kSpecularTextureId 2
+#define kRoughnessTextureId 3
+#define kNormalTextureId 4
 
 layout (location = 0) flat in uint draw_id;
 layout (location = 1) in vec3 norm_vs;
@@ -52,9 +56,11 @@ struct MatConsts {
   /* 32-bit padding goes here on host side, but GLSL will transform
      the ambient vec3 into a vec4 */
   vec4 emission;
+  // Entries of the textures in the texture table
+  uint texture_ids[8];
 };
 
-layout (constant_id = 0) const uint num_materials = 1U;
+layout (constant_id = 0) const uint table_size = 1U;
 layout (constant_id = 1) const uint num_lights = 1U;
 
 layout (std430, set = 0, binding = kProjViewMatricesBindingPos)
@@ -68,19 +74,31 @@ layout (std430, set = 0, binding = kProjViewMatricesBindingPos)
 
 layout (std430, set = 0, binding = kMatConstsArrayBindingPos)
     buffer MatConstsArray {
-  MatConsts mat_consts[num_materials];
+  MatConsts mat_consts[];
 };
 
-layout (set = 0, binding = kDiffuseTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] diff_textures;
-layout (set = 0, binding = kAmbientTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] amb_textures;
-layout (set = 0, binding = kSpecularTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] spec_textures;
-layout (set = 0, binding = kNormalTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] norm_textures;
-layout (set = 0, binding = kRoughnessTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] rough_textures;
+layout (set = kTextureTableSet, binding = 0)
+  uniform sampler2D[table_size] textures;
+
+// Entry in the texture table of the texture of a given type of a material
+#define MAT_TEXTURE_ID(mat_id, type) mat_consts[mat_id].texture_ids[type]
+
+// Sample an entry of the texture table. The entry may differ across the
+// invocations of a wave, and the table can only be indexed with a value
+// uniform across it, so the wave samples the distinct entries one at a time
+vec4 SampleTable(in uint texture_id, in vec2 uv, in vec2 uv_dx,
+                 in vec2 uv_dy) {
+  vec4 texel = vec4(0.f);
+  for (;;) {
+    uint wave_texture_id = readFirstInvocationARB(texture_id);
+    if (wave_texture_id == texture_id) {
+      texel = textureGrad(textures[wave_texture_id], uv, uv_dx, uv_dy);
+      break;
+    }
+  }
+
+  return texel;
+}
 
 layout (std430, set = 1, binding = kMaterialIDsBindingPos) buffer MatIDs {
   uint mat_ids[];
@@ -88,8 +106,12 @@ layout (std430, set = 1, binding = kMaterialIDsBindingPos) buffer MatIDs {
 
 void main() {
   uint mat_id = mat_ids[draw_id];
-  diffuse_albedo.rgb = 
-    texture(diff_textures[mat_id], uv_fs.xy).rgb * mat_consts[mat_id].diffuse_dissolve.rgb;
+  // Taken out of the sampling, which the wave goes through in turns
+  vec2 uv_dx = dFdx(uv_fs.xy);
+  vec2 uv_dy = dFdy(uv_fs.xy);
+  diffuse_albedo.rgb =
+    SampleTable(MAT_TEXTURE_ID(mat_id, kDiffuseTextureId), uv_fs.xy,
+                uv_dx, uv_dy).rgb * mat_consts[mat_id].diffuse_dissolve.rgb;
   diffuse_albedo.a = 1.f;
 
   mat3 tangent_frame_vs = mat3(
@@ -98,18 +120,25 @@ void main() {
     normalize(norm_vs));
 
   /* Sample the tangent space normal map */
-  vec3 normal_ts = texture(norm_textures[mat_id], uv_fs.xy).rgb;
-  normal_ts = normalize((normal_ts * 2.f) - 1.f);
+  /* Normal maps only store x and y, z is rebuilt from them */
+  vec3 normal_ts;
+  normal_ts.xy = (SampleTable(MAT_TEXTURE_ID(mat_id, kNormalTextureId),
+                              uv_fs.xy, uv_dx, uv_dy).rg * 2.f) - 1.f;
+  normal_ts.z = sqrt(max(1.f - dot(normal_ts.xy, normal_ts.xy), 0.f));
+  normal_ts = normalize(normal_ts);
 
   normal_vs = vec4(tangent_frame_vs * normal_ts, 1.f);
-  normal_vs.w = texture(rough_textures[mat_id], uv_fs.xy).r;
+  normal_vs.w = SampleTable(MAT_TEXTURE_ID(mat_id, kRoughnessTextureId),
+                            uv_fs.xy, uv_dx, uv_dy).r;
   normal_vs.w = normal_vs.w * mat_consts[mat_id].specular_shininess.a;
 
   specular_albedo = vec4(
-    texture(spec_textures[mat_id], uv_fs.xy).rgb, 1.f);
+    SampleTable(MAT_TEXTURE_ID(mat_id, kSpecularTextureId), uv_fs.xy,
+                uv_dx, uv_dy).rgb, 1.f);
   specular_albedo.rgb = specular_albedo.rgb * mat_consts[mat_id].specular_shininess.rgb;
 
   vec3 ambient_albedo =
-    texture(amb_textures[mat_id], uv_fs.xy).rgb *
+    SampleTable(MAT_TEXTURE_ID(mat_id, kAmbientTextureId), uv_fs.xy,
+                uv_dx, uv_dy).rgb *
       mat_consts[mat_id].ambient.rgb;
 }
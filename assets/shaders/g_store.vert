@@ -6,6 +6,7 @@
 
 #define kProjViewMatricesBindingPos 0
 #define kModelMatricesBindingPos 0
+#define kVisibleInstancesBindingPos 13
 
 layout (location = 0) in vec3 pos;
 layout (location = 1) in vec3 norm;
@@ -19,8 +20,14 @@ layout (location = 2) out vec3 uv_fs;
 layout (location = 3) out vec3 bitangent_vs;
 layout (location = 4) out vec3 tangent_vs;
 
-layout (constant_id = 0) const uint num_materials = 1U;
 layout (constant_id = 1) const uint num_lights = 1U;
+// Encodings of the vertex elements, indexed by VertexElementType; positions
+// and UVs are expanded by the vertex input formats
+layout (constant_id = 3) const uint normal_encoding = 0U;
+layout (constant_id = 5) const uint tangent_encoding = 0U;
+layout (constant_id = 6) const uint bitangent_encoding = 0U;
+
+#define kEncodingRaw 0
 
 layout (std430, set = 0, binding = kProjViewMatricesBindingPos)
     buffer MainStaticBuffer {
@@ -35,21 +42,45 @@ layout (std430, set = 1, binding = kModelMatricesBindingPos) buffer ModelMats {
   mat4 model_mats[];
 };
 
+// Instances left after culling, at the start of the range of each mesh
+layout (std430, set = 1, binding = kVisibleInstancesBindingPos)
+    buffer VisibleInstances {
+  uint visible_instances[];
+};
+
 layout(push_constant) uniform PushConsts {
 	uint val;
 } mesh_id;
 
+// Octahedral encodings arrive in the first two components
+vec3 DecodeDirection(in uint encoding, in vec3 element) {
+  if (encoding == kEncodingRaw) {
+    return element;
+  }
+
+  vec3 dir = vec3(element.xy, 1.f - abs(element.x) - abs(element.y));
+  if (dir.z < 0.f) {
+    dir.xy = (1.f - abs(dir.yx)) *
+      vec2(dir.x >= 0.f ? 1.f : -1.f, dir.y >= 0.f ? 1.f : -1.f);
+  }
+
+  return normalize(dir);
+}
+
 void main() {
-  mat4 model_view = view * model_mats[mesh_id.val];
+  // The push constant holds the first instance of the mesh being drawn
+  uint instance_id = visible_instances[mesh_id.val + gl_InstanceIndex];
+  mat4 model_view = view * model_mats[instance_id];
   gl_Position = proj * model_view *  vec4(pos, 1.f);
 
   mat3 transp_model_view = transpose(inverse(mat3(model_view)));
-  norm_vs = transp_model_view * norm;
+  norm_vs = transp_model_view * DecodeDirection(normal_encoding, norm);
 
-  tangent_vs = transp_model_view * tangent;
-  bitangent_vs = transp_model_view * bitangent;
+  tangent_vs = transp_model_view * DecodeDirection(tangent_encoding, tangent);
+  bitangent_vs =
+    transp_model_view * DecodeDirection(bitangent_encoding, bitangent);
 
   uv_fs = uv;
 
-  draw_id = mesh_id.val;
+  draw_id = instance_id;
 }
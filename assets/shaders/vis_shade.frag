@@ -3,6 +3,7 @@
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
 #extension GL_ARB_shader_image_load_store : enable
+#extension GL_ARB_shader_ballot : require
 
 #define kProjViewMatricesBindingPos 0
 #define kModelMatricesBindingPos 0
@@ -12,12 +13,16 @@
 #define kVertexBufferBindingPos 4
 #define kIndexBufferBindingPos 2
 #define kMaterialIDsBindingPos 1
+#define kInstanceMeshesBindingPos 11
 #define kDepthBuffBindingPos 1
-#define kDiffuseTexturesArrayBindingPos 2
-#define kAmbientTexturesArrayBindingPos 3
-#define kSpecularTexturesArrayBindingPos 4
-#define kNormalTexturesArrayBindingPos 5
-#define kRoughnessTexturesArrayBindingPos 6
+// Set of the texture table, after the sets of the renderer
+#define kTextureTableSet 3
+// Texture indices of the materials, indexed by MatTextureType
+#define kAmbientTextureId 0
+#define kDiffuseTextureId 1
+#define kSpecularTextureId 2
+#define kRoughnessTextureId 3
+#define kNormalTextureId 4
 #define kVisBufferBindingPos 7
 
 struct VkDrawIndexedIndirectCommand {
@@ -42,6 +47,8 @@ struct MatConsts {
   /* 32-bit padding goes here on host side, but GLSL will transform
      the ambient vec3 into a vec4 */
   vec4 emission;
+  // Entries of the textures in the texture table
+  uint texture_ids[8];
 };
 
 struct Vertex {
@@ -51,8 +58,16 @@ struct Vertex {
 };
 
 
-layout (constant_id = 0) const uint num_materials = 1U;
+layout (constant_id = 0) const uint table_size = 1U;
 layout (constant_id = 1) const uint num_lights = 1U;
+// Encodings of the vertex elements, indexed by VertexElementType
+layout (constant_id = 2) const uint pos_encoding = 0U;
+layout (constant_id = 3) const uint normal_encoding = 0U;
+layout (constant_id = 4) const uint uv_encoding = 0U;
+layout (constant_id = 5) const uint tangent_encoding = 0U;
+layout (constant_id = 6) const uint bitangent_encoding = 0U;
+// Whether the index buffer holds 16-bit indices, two per word
+layout (constant_id = 8) const uint indices_16bit = 0U;
 
 
 layout (std430, set = 0, binding = kProjViewMatricesBindingPos)
@@ -70,22 +85,34 @@ layout (std430, set = 0, binding = kLightsArrayBindingPos)
 
 layout (std430, set = 0, binding = kMatConstsArrayBindingPos)
     buffer MatConstsArray {
-  MatConsts mat_consts[num_materials];
+  MatConsts mat_consts[];
 };
 
 layout (set = 0, binding = kDepthBuffBindingPos) uniform
   sampler2D depth_buffer;
 
-layout (set = 0, binding = kDiffuseTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] diff_textures;
-layout (set = 0, binding = kAmbientTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] amb_textures;
-layout (set = 0, binding = kSpecularTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] spec_textures;
-layout (set = 0, binding = kNormalTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] norm_textures;
-layout (set = 0, binding = kRoughnessTexturesArrayBindingPos)
-  uniform sampler2D[num_materials] rough_textures;
+layout (set = kTextureTableSet, binding = 0)
+  uniform sampler2D[table_size] textures;
+
+// Entry in the texture table of the texture of a given type of a material
+#define MAT_TEXTURE_ID(mat_id, type) mat_consts[mat_id].texture_ids[type]
+
+// Sample an entry of the texture table. The entry may differ across the
+// invocations of a wave, and the table can only be indexed with a value
+// uniform across it, so the wave samples the distinct entries one at a time
+vec4 SampleTable(in uint texture_id, in vec2 uv, in vec2 uv_dx,
+                 in vec2 uv_dy) {
+  vec4 texel = vec4(0.f);
+  for (;;) {
+    uint wave_texture_id = readFirstInvocationARB(texture_id);
+    if (wave_texture_id == texture_id) {
+      texel = textureGrad(textures[wave_texture_id], uv, uv_dx, uv_dy);
+      break;
+    }
+  }
+
+  return texel;
+}
 
 layout (set = 0, binding = kVisBufferBindingPos)
   uniform usampler2D vis_buff;
@@ -100,38 +127,102 @@ layout (std430, set = 1, binding = kIndirectDrawCmdsBindingPos)
   VkDrawIndexedIndirectCommand indirect_draws[];
 };
 
-struct Vec3 {
-  float x, y, z;
-};
-
-struct Vec2 {
-  float x, y;
-};
+// Vertex streams are read as raw words and decoded according to the
+// encoding of each element, see VertexElementEncoding
+#define kEncodingRaw 0
+#define kEncodingOctahedral16 1
+#define kEncodingOctahedral32 2
+#define kEncodingHalfFloat 3
+#define kEncodingUnorm16 4
+#define kEncodingAabbUnorm16 5
 
 layout (std430, set = 1, binding = kVertexBufferBindingPos) buffer VtxPos {
-  Vec3 vtx_pos[];
+  uint vtx_pos[];
 };
 
 layout (std430, set = 1, binding = kVertexBufferBindingPos + 1) buffer Normal {
-  Vec3 normals[];
+  uint normals[];
 };
 
 layout (std430, set = 1, binding = kVertexBufferBindingPos + 2) buffer UVsf {
-  Vec2 uvs[];
+  uint uvs[];
 };
 
 layout (std430, set = 1, binding = kVertexBufferBindingPos + 3) buffer Tang {
-  Vec3 tangents[];
+  uint tangents[];
 };
 
 layout (std430, set = 1, binding = kVertexBufferBindingPos + 4) buffer Bitang {
-  Vec3 bitangents[];
+  uint bitangents[];
 };
 
+vec3 DecodeOctahedral(in vec2 oct) {
+  vec3 dir = vec3(oct, 1.f - abs(oct.x) - abs(oct.y));
+  if (dir.z < 0.f) {
+    dir.xy = (1.f - abs(dir.yx)) *
+      vec2(dir.x >= 0.f ? 1.f : -1.f, dir.y >= 0.f ? 1.f : -1.f);
+  }
+
+  return normalize(dir);
+}
+
+// Octahedral directions take a single word, or half of one
+#define FETCH_DIRECTION(stream, encoding, idx) \
+  ((encoding) == kEncodingRaw ? \
+    vec3(uintBitsToFloat(stream[(idx) * 3]), \
+         uintBitsToFloat(stream[(idx) * 3 + 1]), \
+         uintBitsToFloat(stream[(idx) * 3 + 2])) : \
+    ((encoding) == kEncodingOctahedral16 ? \
+      DecodeOctahedral(unpackSnorm4x8( \
+          stream[(idx) >> 1] >> (((idx) & 1) * 16)).xy) : \
+      DecodeOctahedral(unpackSnorm2x16(stream[idx]))))
+
+vec3 FetchPosition(in uint idx) {
+  if (pos_encoding == kEncodingAabbUnorm16) {
+    // Brought back to model space by the model matrix
+    return vec3(unpackUnorm2x16(vtx_pos[idx * 2]),
+                unpackUnorm2x16(vtx_pos[idx * 2 + 1]).x);
+  }
+
+  return vec3(uintBitsToFloat(vtx_pos[idx * 3]),
+              uintBitsToFloat(vtx_pos[idx * 3 + 1]),
+              uintBitsToFloat(vtx_pos[idx * 3 + 2]));
+}
+
+vec3 FetchNormal(in uint idx) {
+  return FETCH_DIRECTION(normals, normal_encoding, idx);
+}
+
+vec3 FetchTangent(in uint idx) {
+  return FETCH_DIRECTION(tangents, tangent_encoding, idx);
+}
+
+vec3 FetchBitangent(in uint idx) {
+  return FETCH_DIRECTION(bitangents, bitangent_encoding, idx);
+}
+
+vec2 FetchUV(in uint idx) {
+  if (uv_encoding == kEncodingHalfFloat) {
+    return unpackHalf2x16(uvs[idx]);
+  } else if (uv_encoding == kEncodingUnorm16) {
+    return unpackUnorm2x16(uvs[idx]);
+  }
+
+  return vec2(uintBitsToFloat(uvs[idx * 2]), uintBitsToFloat(uvs[idx * 2 + 1]));
+}
+
 layout (std430, set = 1, binding = kIndexBufferBindingPos) buffer IdxBuff {
   uint idx_buff[];
 };
 
+uint FetchIndex(in uint i) {
+  if (indices_16bit != 0U) {
+    return (idx_buff[i >> 1] >> ((i & 1) * 16)) & 0xFFFF;
+  }
+
+  return idx_buff[i];
+}
+
 layout (std430, set = 1, binding = kModelMatricesBindingPos) buffer ModelMats {
   mat4 model_mats[];
 };
@@ -140,6 +231,11 @@ layout (std430, set = 1, binding = kMaterialIDsBindingPos) buffer MatIDs {
   uint mat_ids[];
 };
 
+layout (std430, set = 1, binding = kInstanceMeshesBindingPos)
+    buffer InstanceMeshes {
+  uint instance_meshes[];
+};
+
 void ComputeBaryDerivatives(in vec2 pos_scr[3], out vec3 db_dx,
                             out vec3 db_dy, out float det) {
   det = determinant(mat2x2(
@@ -235,28 +331,25 @@ void main() {
 
   if(vis_raw != 0) {
     // Unpack data from the vis buffer
-    uint draw_id = (vis_raw >> 23) & 0x000000FF;
-    uint triangle_id = vis_raw & 0x007FFFFF;
+    uint draw_id = (vis_raw >> 19) & 0x00000FFF;
+    uint triangle_id = vis_raw & 0x0007FFFF;
     uint alpha = vis_raw >> 31;
 
-    // Retrieve the triangle's vertex indices 
-    uint start_idx = indirect_draws[draw_id].firstIndex;
+    // Retrieve the triangle's vertex indices from the mesh of the instance
+    uint start_idx = indirect_draws[instance_meshes[draw_id]].firstIndex;
     uint tri_id_0 = (triangle_id * 3 + 0) + start_idx;
     uint tri_id_1 = (triangle_id * 3 + 1) + start_idx;
     uint tri_id_2 = (triangle_id * 3 + 2) + start_idx;
 
     // TODO use filtered and culled index buffer to read indices
-    uint idx_0 = idx_buff[tri_id_0];
-    uint idx_1 = idx_buff[tri_id_1];
-    uint idx_2 = idx_buff[tri_id_2];
+    uint idx_0 = FetchIndex(tri_id_0);
+    uint idx_1 = FetchIndex(tri_id_1);
+    uint idx_2 = FetchIndex(tri_id_2);
 
     // Read vertices
-    vec4 vtx0_pos = vec4(vtx_pos[idx_0].x, vtx_pos[idx_0].y,
-                         vtx_pos[idx_0].z, 1.f);
-    vec4 vtx1_pos = vec4(vtx_pos[idx_1].x, vtx_pos[idx_1].y,
-                         vtx_pos[idx_1].z, 1.f);
-    vec4 vtx2_pos = vec4(vtx_pos[idx_2].x, vtx_pos[idx_2].y,
-                         vtx_pos[idx_2].z, 1.f);
+    vec4 vtx0_pos = model_mats[draw_id] * vec4(FetchPosition(idx_0), 1.f);
+    vec4 vtx1_pos = model_mats[draw_id] * vec4(FetchPosition(idx_1), 1.f);
+    vec4 vtx2_pos = model_mats[draw_id] * vec4(FetchPosition(idx_2), 1.f);
     // Tranform vertices to clip space
     vtx0_pos = proj * view * vtx0_pos;
     vtx1_pos = proj * view * vtx1_pos;
@@ -291,9 +384,9 @@ void main() {
     // Store the texture coordinates at the vertices in a matrix for
     // easy multiplication by the bary derivatives
     mat3x2 tex_coords_tri = {
-      vec2(uvs[idx_0].x, uvs[idx_0].y),
-      vec2(uvs[idx_1].x, uvs[idx_1].y),
-      vec2(uvs[idx_2].x, uvs[idx_2].y),
+      FetchUV(idx_0),
+      FetchUV(idx_1),
+      FetchUV(idx_2),
     };
 
 
@@ -323,9 +416,9 @@ void main() {
 
     // Interpolate the normals
     mat3x3 normals_mat = {
-      vec3(normals[idx_0].x, normals[idx_0].y, normals[idx_0].z),
-      vec3(normals[idx_1].x, normals[idx_1].y, normals[idx_1].z),
-      vec3(normals[idx_2].x, normals[idx_2].y, normals[idx_2].z),
+      FetchNormal(idx_0),
+      FetchNormal(idx_1),
+      FetchNormal(idx_2),
     };
     mat3 transp_model_view = transpose(inverse(mat3(view)));
     vec3 normal_obj = InterpAttributes(normals_mat, db_dx, db_dy, d); 
@@ -333,18 +426,18 @@ void main() {
     
     // Interpolate the tangents 
     mat3x3 tangents_mat = {
-      vec3(tangents[idx_0].x, tangents[idx_0].y, tangents[idx_0].z),
-      vec3(tangents[idx_1].x, tangents[idx_1].y, tangents[idx_1].z),
-      vec3(tangents[idx_2].x, tangents[idx_2].y, tangents[idx_2].z),
+      FetchTangent(idx_0),
+      FetchTangent(idx_1),
+      FetchTangent(idx_2),
     };
     vec3 tangent_obj = InterpAttributes(tangents_mat, db_dx, db_dy, d); 
     vec3 tangent_vs = normalize(transp_model_view * tangent_obj);
     
     // Interpolate the bitangents 
     mat3x3 bitangents_mat = {
-      vec3(bitangents[idx_0].x, bitangents[idx_0].y, bitangents[idx_0].z),
-      vec3(bitangents[idx_1].x, bitangents[idx_1].y, bitangents[idx_1].z),
-      vec3(bitangents[idx_2].x, bitangents[idx_2].y, bitangents[idx_2].z),
+      FetchBitangent(idx_0),
+      FetchBitangent(idx_1),
+      FetchBitangent(idx_2),
     };
     vec3 bitangent_obj = InterpAttributes(bitangents_mat, db_dx, db_dy, d); 
     vec3 bitangent_vs = normalize(transp_model_view * bitangent_obj);
@@ -355,26 +448,37 @@ void main() {
       normalize(norm_vs));
 
     tex_coords.y = 1- tex_coords.y;
+    // Taken out of the sampling, which the wave goes through in turns
+    vec2 uv_dx = dFdx(tex_coords);
+    vec2 uv_dy = dFdy(tex_coords);
     /* Sample the tangent space normal map */
     uint mat_id = mat_ids[draw_id];
-    vec3 normal_ts = texture(norm_textures[mat_id], tex_coords).rgb;
-    normal_ts = normalize((normal_ts * 2.f) - 1.f);
+    /* Normal maps only store x and y, z is rebuilt from them */
+    vec3 normal_ts;
+    normal_ts.xy = (SampleTable(MAT_TEXTURE_ID(mat_id, kNormalTextureId),
+                                tex_coords, uv_dx, uv_dy).rg * 2.f) - 1.f;
+    normal_ts.z = sqrt(max(1.f - dot(normal_ts.xy, normal_ts.xy), 0.f));
+    normal_ts = normalize(normal_ts);
 
     vec3 normal_vs = vec3(tangent_frame_vs * normal_ts);
 
     // Get diffuse albedo from the map
     float gamma = 2.2f;
     vec3 diff_albedo =
-      pow(texture(diff_textures[mat_id], tex_coords).rgb, vec3(gamma)) *
+      pow(SampleTable(MAT_TEXTURE_ID(mat_id, kDiffuseTextureId), tex_coords,
+                      uv_dx, uv_dy).rgb, vec3(gamma)) *
       mat_consts[mat_id].diffuse_dissolve.rgb;
     vec3 spec_albedo =
-      pow(texture(spec_textures[mat_id], tex_coords).rgb, vec3(gamma)) *
+      pow(SampleTable(MAT_TEXTURE_ID(mat_id, kSpecularTextureId), tex_coords,
+                      uv_dx, uv_dy).rgb, vec3(gamma)) *
       mat_consts[mat_id].specular_shininess.rgb;
     float spec_power =
-      pow(texture(rough_textures[mat_id], tex_coords).rgb, vec3(gamma)).r *
+      pow(SampleTable(MAT_TEXTURE_ID(mat_id, kRoughnessTextureId), tex_coords,
+                      uv_dx, uv_dy).rgb, vec3(gamma)).r *
       mat_consts[mat_id].specular_shininess.a;
     vec3 ambient_albedo =
-      pow(texture(amb_textures[mat_id], tex_coords).rgb, vec3(gamma)) *
+      pow(SampleTable(MAT_TEXTURE_ID(mat_id, kAmbientTextureId), tex_coords,
+                      uv_dx, uv_dy).rgb, vec3(gamma)) *
       mat_consts[mat_id].ambient.rgb;
 
     col = vec4(
@@ -18,9 +18,11 @@ layout (location = 0) out uvec2 id_and_barys;
 layout (location = 1) out uvec2 derivs;
 layout (location = 2) out vec4 debug_out;
 
+// 12 bits of instance and 19 bits of primitive; models beyond them are
+// rejected when they are registered
 uint calculate_output_VBID(bool opaque, uint draw_id, uint primitive_id) {
-  uint drawID_primID = ((draw_id << 23) & 0x7F800000) |
-                       (primitive_id & 0x007FFFFF);
+  uint drawID_primID = ((draw_id << 19) & 0x7FF80000) |
+                       (primitive_id & 0x0007FFFF);
   if (opaque) {
     return drawID_primID;
   }
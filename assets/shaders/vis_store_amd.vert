@@ -6,6 +6,7 @@
 
 #define kProjViewMatricesBindingPos 0
 #define kModelMatricesBindingPos 0
+#define kVisibleInstancesBindingPos 13
 
 layout (location = 0) in vec3 pos;
 layout (location = 2) in vec2 uv_in;
@@ -15,7 +16,6 @@ layout (location = 1) out vec2 uv_out;
 layout (location = 2) flat out vec4 pos0;
 layout (location = 3)      out vec4 pos1;
 
-layout (constant_id = 0) const uint num_materials = 1U;
 layout (constant_id = 1) const uint num_lights = 1U;
 
 struct Light {
@@ -28,10 +28,12 @@ struct Light {
 struct MatConsts {
   vec4 diffuse_dissolve;
   vec4 specular_shininess;
-  vec3 ambient;
+  vec4 ambient;
   /* 32-bit padding goes here on host side, but GLSL will transform
      the ambient vec3 into a vec4 */
-  vec3 emission;
+  vec4 emission;
+  // Entries of the textures in the texture table
+  uint texture_ids[8];
 };
 
 layout (std430, set = 0, binding = kProjViewMatricesBindingPos)
@@ -41,7 +43,7 @@ layout (std430, set = 0, binding = kProjViewMatricesBindingPos)
   mat4 inv_proj;
   mat4 inv_view;
   Light lights[num_lights];
-  MatConsts mat_consts[num_materials];
+  MatConsts mat_consts[];
 };
 
 
@@ -49,12 +51,19 @@ layout (std430, set = 1, binding = kModelMatricesBindingPos) buffer ModelMats {
   mat4 model_mats[];
 };
 
+// Instances left after culling, at the start of the range of each mesh
+layout (std430, set = 1, binding = kVisibleInstancesBindingPos)
+    buffer VisibleInstances {
+  uint visible_instances[];
+};
+
 layout(push_constant) uniform PushConsts {
 	uint val;
 } mesh_id;
 
 void main() {
-  draw_id = mesh_id.val;
+  // The push constant holds the first instance of the mesh being drawn
+  draw_id = visible_instances[mesh_id.val + gl_InstanceIndex];
   uv_out = uv_in;
   vec4 temp = proj * view * model_mats[draw_id] * vec4(pos, 1.f);
   pos0 = temp;
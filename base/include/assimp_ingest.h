@@ -0,0 +1,87 @@
+#ifndef VKS_ASSIMPINGEST
+#define VKS_ASSIMPINGEST
+
+#include <EASTL/vector.h>
+#include <assimp/mesh.h>
+#include <assimp/postprocess.h>
+#include <base_system.h>
+#include <cstdint>
+#include <model.h>
+#include <thread_pool.h>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+// Where the data of an imported mesh goes within a builder
+struct AssimpMeshRange {
+  AssimpMeshRange();
+
+  const aiMesh *ai_mesh;
+  uint32_t first_vertex;
+  uint32_t first_index;
+  // Added to the mesh-local indices of the faces
+  uint32_t idx_offset;
+}; // struct AssimpMeshRange
+
+// Number of indices of all the faces of a mesh
+uint32_t CountAssimpMeshIndices(const aiMesh *ai_mesh);
+
+// Tangents of a mesh, flipped where the tangent frame is left-handed
+void ReadAssimpTangents(const aiMesh *ai_mesh,
+                        eastl::vector<aiVector3D> &tangents);
+
+/**
+ * @brief IngestAssimpMeshes Convert imported meshes into the preallocated
+ *   streams of a builder, one mesh per task on the thread pool. Since every
+ *   range is laid out beforehand, the result is the same as adding the
+ *   vertices and indices one by one.
+ *
+ * @param ranges Destination of each mesh, as allocated in the builder.
+ * @param builder ModelBuilder or MeshesHeapBuilder.
+ */
+template <typename Builder>
+void IngestAssimpMeshes(const eastl::vector<AssimpMeshRange> &ranges,
+                        uint32_t assimp_post_process_steps, Builder &builder) {
+  thread_pool()->ParallelFor(SCAST_U32(ranges.size()), [&](uint32_t ri) {
+    const AssimpMeshRange &range = ranges[ri];
+    const aiMesh *ai_mesh = range.ai_mesh;
+
+    // Whole streams at once; missing ones are zeroed
+    uint32_t num_vertices = ai_mesh->mNumVertices;
+    uint32_t stride = SCAST_U32(sizeof(aiVector3D));
+    builder.SetVertexElementArray(VertexElementType::POSITION,
+                                  range.first_vertex, num_vertices,
+                                  ai_mesh->mVertices, stride);
+    builder.SetVertexElementArray(VertexElementType::NORMAL,
+                                  range.first_vertex, num_vertices,
+                                  ai_mesh->mNormals, stride);
+    builder.SetVertexElementArray(VertexElementType::UV, range.first_vertex,
+                                  num_vertices, ai_mesh->mTextureCoords[0U],
+                                  stride);
+
+    bool has_tangents =
+        (assimp_post_process_steps & aiProcess_CalcTangentSpace) != 0U;
+    eastl::vector<aiVector3D> tangents;
+    if (has_tangents) {
+      ReadAssimpTangents(ai_mesh, tangents);
+    }
+    builder.SetVertexElementArray(
+        VertexElementType::TANGENT, range.first_vertex, num_vertices,
+        has_tangents ? tangents.data() : nullptr, stride);
+    builder.SetVertexElementArray(
+        VertexElementType::BITANGENT, range.first_vertex, num_vertices,
+        has_tangents ? ai_mesh->mBitangents : nullptr, stride);
+
+    uint32_t index = range.first_index;
+    for (uint32_t i = 0U; i < ai_mesh->mNumFaces; i++) {
+      const aiFace &face = ai_mesh->mFaces[i];
+      for (uint32_t j = 0U; j < face.mNumIndices; j++) {
+        builder.SetIndex(index++, face.mIndices[j] + range.idx_offset);
+      }
+    }
+  });
+}
+
+} // namespace vks
+
+#endif
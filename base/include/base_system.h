@@ -11,6 +11,7 @@
 #include <meshes_heap_manager.h>
 #include <model_manager.h>
 #include <scene.h>
+#include <thread_pool.h>
 #include <vulkan_base.h>
 #include <vulkan_texture_manager.h>
 
@@ -31,6 +32,7 @@ MeshesHeapManager *meshes_heap_manager();
 VulkanTextureManager *texture_manager();
 LightsManager *lights_manager();
 szt::InputManager *input_manager();
+ThreadPool *thread_pool();
 
 } // namespace vks
 
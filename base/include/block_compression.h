@@ -0,0 +1,36 @@
+#ifndef VKS_BLOCKCOMPRESSION
+#define VKS_BLOCKCOMPRESSION
+
+#include <cstdint>
+
+namespace vks {
+
+// Formats made of 4x4 blocks of texels
+enum class BlockFormat : uint8_t {
+  // RGB with four colours per block
+  BC1 = 0U,
+  // BC1 plus a BC4 block for alpha
+  BC3,
+  // The red channel, with eight values per block
+  BC4,
+  // The red and green channels, each as BC4
+  BC5
+}; // enum class BlockFormat
+
+// Bytes of a block
+uint32_t GetBlockSize(BlockFormat format);
+
+/**
+ * @brief CompressBlocks Encode an RGBA8 image into blocks, one row after the
+ *        other, spreading the rows over the thread pool. Images whose size
+ *        isn't a multiple of 4 repeat their last row or column in the blocks
+ *        along the edges.
+ *
+ * @param blocks Output; room for the blocks of every row.
+ */
+void CompressBlocks(BlockFormat format, const uint8_t *rgba, uint32_t width,
+                    uint32_t height, uint8_t *blocks);
+
+} // namespace vks
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VKS_BOUNDSBVH
+#define VKS_BOUNDSBVH
+
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <frustum.h>
+#define GLM_FORCE_CXX11
+#include <glm/glm.hpp>
+#include <mesh_bounds.h>
+
+namespace vks {
+
+// Leaves are not split further once they hold this many items
+extern const uint32_t kBvhMaxLeafItems;
+// Candidate split positions per axis when building
+extern const uint32_t kBvhNumBins;
+
+struct BvhNode {
+  BvhNode();
+
+  glm::vec3 aabb_min;
+  glm::vec3 aabb_max;
+  // Range of the items of the node in the order of the tree; inner nodes
+  // cover the items of both children
+  uint32_t first_item;
+  uint32_t item_count;
+  // The second child follows the first one; zero for leaves
+  uint32_t first_child;
+  uint32_t parent;
+
+  bool IsLeaf() const { return first_child == 0U; }
+}; // struct BvhNode
+
+struct BvhRayHit {
+  BvhRayHit();
+
+  uint32_t item;
+  // Along the ray, to where it enters the box of the item
+  float distance;
+}; // struct BvhRayHit
+
+/**
+ * @brief Bounding volume hierarchy over axis aligned boxes, each one being an
+ *        item identified by its index. Built with a binned surface area
+ *        heuristic; boxes which move afterwards are refitted in place, which
+ *        keeps the tree valid but lets its quality degrade until the next
+ *        build.
+ */
+class BoundsBvh {
+public:
+  BoundsBvh();
+
+  /**
+   * @brief Build Create the tree over a set of boxes, replacing any previous
+   *   one.
+   */
+  void Build(const eastl::vector<glm::vec3> &items_min,
+             const eastl::vector<glm::vec3> &items_max);
+  void Clear();
+
+  /**
+   * @brief Refit Change the box of an item and grow or shrink the nodes above
+   *   it to match.
+   */
+  void Refit(uint32_t item, const glm::vec3 &aabb_min,
+             const glm::vec3 &aabb_max);
+
+  /**
+   * @brief QueryFrustum Find the items which may be inside a frustum. Nodes
+   *   fully inside are accepted without testing what is below them; the
+   *   items of leaves crossing a plane go through FrustumCull together.
+   *
+   * @param visible Output; non-zero for every item which may be visible,
+   *   indexed by item.
+   *
+   * @return Number of items which may be visible.
+   */
+  uint32_t QueryFrustum(const szt::FrustumPlanes &planes,
+                        eastl::vector<uint8_t> &visible) const;
+
+  /**
+   * @brief Raycast Find the item whose box is hit first by a ray.
+   *
+   * @param dir Direction of the ray; it does not need to be normalised, the
+   *   distances are then in multiples of its length.
+   *
+   * @return Whether any box is hit within max_distance.
+   */
+  bool Raycast(const glm::vec3 &origin, const glm::vec3 &dir,
+               float max_distance, BvhRayHit &hit) const;
+
+  uint32_t num_items() const {
+    return static_cast<uint32_t>(items_min_.size());
+  }
+  const eastl::vector<BvhNode> &nodes() const { return nodes_; }
+
+private:
+  eastl::vector<BvhNode> nodes_;
+  // Items sorted so that every node covers a contiguous range
+  eastl::vector<uint32_t> item_order_;
+  // Leaf of every item, for refitting
+  eastl::vector<uint32_t> item_leaves_;
+  eastl::vector<glm::vec3> items_min_;
+  eastl::vector<glm::vec3> items_max_;
+  // Bounds of the items in the order of the tree, so that the items of a
+  // leaf are culled four at a time
+  MeshBoundsTable ordered_bounds_;
+  // Position of every item in the order of the tree
+  eastl::vector<uint32_t> item_positions_;
+
+  void ComputeNodeBounds(uint32_t node_idx);
+  bool SplitNode(uint32_t node_idx);
+
+}; // class BoundsBvh
+
+} // namespace vks
+
+#endif
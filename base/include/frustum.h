@@ -1,11 +1,16 @@
 #ifndef VKS_FRUSTUM
 #define VKS_FRUSTUM
 
+#include <cstdint>
+#include <glm/mat4x4.hpp>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 
 namespace szt {
 
+const uint32_t kFrustumNumPlanes = 6U;
+
 class Frustum {
 public:
   Frustum();
@@ -35,6 +40,30 @@ private:
 
 }; // class Frustum
 
+/**
+ * @brief The six planes bounding what a view-projection matrix sees, in the
+ *        space the matrix transforms from. Points on the positive side of all
+ *        of them are inside; normals are unit length so that distances can be
+ *        compared with radii.
+ */
+class FrustumPlanes {
+public:
+  FrustumPlanes();
+  /**
+   * @param view_proj Projection times view matrix, with clip space depth
+   *   between zero and one.
+   */
+  explicit FrustumPlanes(const glm::mat4 &view_proj);
+
+  // Left, right, bottom, top, near and far; normal in xyz and distance from
+  // the origin in w
+  const glm::vec4 &plane(uint32_t i) const { return planes_[i]; }
+
+private:
+  glm::vec4 planes_[kFrustumNumPlanes];
+
+}; // class FrustumPlanes
+
 } // namespace szt
 
 #endif
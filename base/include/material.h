@@ -18,6 +18,11 @@ namespace vks {
 class VulkanDevice;
 
 extern const eastl::string kBaseShaderAssetsPath;
+// Constant ID of the encoding of the POSITION element; the other element
+// types follow in VertexElementType order
+extern const uint32_t kVertexEncodingsSpecConstBasePos;
+// Constant ID of the flag telling shaders that indices are 16-bit
+extern const uint32_t kIndices16SpecConstPos;
 
 enum class ShaderTypes : uint8_t {
   VERTEX = 0U,
@@ -43,6 +48,13 @@ public:
   void AddSpecialisationEntry(uint32_t constant_id, uint32_t size,
                               const void *data);
 
+  /**
+   * @brief AddVertexEncodingsSpecialisation Tell the shader how each element
+   *   type is encoded in the given layout, so that it can decode the vertex
+   *   streams it reads.
+   */
+  void AddVertexEncodingsSpecialisation(const VertexSetup &vertex_setup);
+
   // Also activates profiling; by default memory won't be
   // counted for that certain stage
   void ProfileBandwidth(ProfileStage stage_idx);
@@ -2,10 +2,19 @@
 #define VKS_MATERIALCONSTANTS
 
 #define GLM_FORCE_CXX11
+#include <cstdint>
 #include <glm/glm.hpp>
+#include <material_texture_type.h>
 
 namespace vks {
 
+// Texture indices of a material; a MatTextureType each, rounded up to keep
+// the constants a multiple of 16 bytes as the shaders lay them out
+const uint32_t kMaterialTextureIdsCount = 8U;
+static_assert(kMaterialTextureIdsCount >=
+                  static_cast<uint32_t>(MatTextureType::size),
+              "Every texture type needs an index");
+
 struct MaterialConstants {
   MaterialConstants();
 
@@ -15,6 +24,9 @@ struct MaterialConstants {
   float padding;
   glm::vec3 emission;
   float padding_2;
+  // Entries of the textures in the texture table, indexed by MatTextureType;
+  // see VulkanTextureManager::GetTableIndex
+  uint32_t texture_ids[kMaterialTextureIdsCount];
 
 }; // struct MaterialConstants
 
@@ -16,6 +16,7 @@ class Material;
 class VulkanDevice;
 class VulkanTexture;
 class VulkanBuffer;
+struct TextureLoadRequest;
 
 extern const uint32_t kMapsBaseBindingPos;
 
@@ -32,6 +33,10 @@ public:
 
   void AddTexture(const MaterialBuilderTexture &texture_info);
   void AddConstants(const MaterialConstants &consts);
+  // Append the textures the instance will load, for them to be loaded ahead
+  // along with the ones of other instances
+  void GetTextureLoadRequests(
+      eastl::vector<TextureLoadRequest> &requests) const;
 
   const eastl::vector<MaterialConstants> &consts() const { return consts_; }
   const eastl::vector<MaterialBuilderTexture> &textures() const {
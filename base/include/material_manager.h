@@ -19,6 +19,8 @@ public:
 
   Material *CreateMaterial(const VulkanDevice &device,
                            eastl::unique_ptr<MaterialBuilder> builder);
+  // Release a material so that it can be created again from a new builder
+  void DestroyMaterial(const VulkanDevice &device, const eastl::string &name);
   void RegisterMaterialName(const eastl::string &name);
   MaterialInstance *
   CreateMaterialInstance(const VulkanDevice &device,
@@ -36,17 +38,6 @@ public:
 
   void ReloadAllShaders(const VulkanDevice &device);
 
-  /**
-   * @brief Get all the descriptor infos of a given type of texture for all the
-   *        existing textures.
-   *
-   * @param texture_type Type of texture (eg. diffuse, specular, etc)
-   * @param descs Vector where the descriptors are returned
-   */
-  void
-  GetDescriptorImageInfosByType(const MatTextureType texture_type,
-                                eastl::vector<VkDescriptorImageInfo> &descs);
-
   void Shutdown(const VulkanDevice &device);
 
 private:
@@ -2,11 +2,38 @@
 #define VKS_MESH
 
 #define GLM_FORCE_CXX11
+#include <EASTL/vector.h>
 #include <cstdint>
 #include <glm/glm.hpp>
+#include <transform_hierarchy.h>
 
 namespace vks {
 
+// A simplified version of a mesh, stored in the same index buffer
+struct MeshLod {
+  MeshLod();
+  MeshLod(uint32_t Start_index, uint32_t Index_count, float Error);
+
+  uint32_t start_index;
+  uint32_t index_count;
+  // Deviation from the full detail mesh, as a distance in model space
+  float error;
+}; // struct MeshLod
+
+// A placement of a mesh in the model; meshes with several placements share
+// their geometry and are drawn as instances
+struct MeshInstance {
+  MeshInstance();
+  MeshInstance(uint32_t Mesh_idx, const glm::mat4 &Model_mat,
+               uint32_t Node_idx = kNoTransformNode);
+
+  uint32_t mesh_idx;
+  // World matrix of the instance
+  glm::mat4 model_mat;
+  // Node of the hierarchy the instance hangs from, if any
+  uint32_t node_idx;
+}; // struct MeshInstance
+
 class Mesh {
 public:
   Mesh();
@@ -19,11 +46,32 @@ public:
   uint32_t material_id() const { return material_id_; }
   const glm::mat4 &model_mat() const { return model_mat_; }
   uint32_t dynamic_ubo_offset() const { return dynamic_ubo_offset_; }
+  uint32_t first_cluster() const { return first_cluster_; }
+  uint32_t cluster_count() const { return cluster_count_; }
+  uint32_t first_instance() const { return first_instance_; }
+  uint32_t instance_count() const { return instance_count_; }
 
+  // LOD 0 is the full detail mesh
+  uint32_t num_lods() const {
+    return 1U + static_cast<uint32_t>(lods_.size());
+  }
+  MeshLod GetLod(uint32_t lod) const;
+
+  void set_start_index(uint32_t start_index) { start_index_ = start_index; }
+  void set_material_id(uint32_t material_id) { material_id_ = material_id; }
   void set_model_mat(const glm::mat4 &mat) { model_mat_ = mat; }
   void set_dynamic_ubo_offset(const uint32_t offset) {
     dynamic_ubo_offset_ = offset;
   }
+  void set_clusters(uint32_t first_cluster, uint32_t cluster_count) {
+    first_cluster_ = first_cluster;
+    cluster_count_ = cluster_count;
+  }
+  void set_instances(uint32_t first_instance, uint32_t instance_count) {
+    first_instance_ = first_instance;
+    instance_count_ = instance_count;
+  }
+  void AddLod(const MeshLod &lod) { lods_.push_back(lod); }
 
 private:
   uint32_t start_index_;
@@ -35,6 +83,14 @@ private:
   // The offset within the model's dynamic ubo for the model mat of this
   // mesh
   uint32_t dynamic_ubo_offset_;
+  // Range of the clusters of this mesh within the model's clusters
+  uint32_t first_cluster_;
+  uint32_t cluster_count_;
+  // Range of the instances of this mesh within the model's instances
+  uint32_t first_instance_;
+  uint32_t instance_count_;
+  // Simplified versions, from the most detailed to the coarsest
+  eastl::vector<MeshLod> lods_;
 
 }; // class Mesh
 
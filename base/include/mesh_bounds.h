@@ -0,0 +1,113 @@
+#ifndef VKS_MESHBOUNDS
+#define VKS_MESHBOUNDS
+
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <frustum.h>
+#define GLM_FORCE_CXX11
+#include <glm/glm.hpp>
+
+namespace vks {
+
+// Bounds of a whole mesh, in model space. The layout matches the std430
+// struct used by shaders, hence the vec4s
+struct MeshBounds {
+  MeshBounds();
+
+  glm::vec4 aabb_min;
+  glm::vec4 aabb_max;
+  // Centre and radius
+  glm::vec4 bounding_sphere;
+}; // struct MeshBounds
+
+/**
+ * @brief ComputeMeshBounds Bound the vertices referenced by a range of the
+ *   index buffer with a box and a sphere centred on the box.
+ *
+ * @param positions Position of the first vertex, as three floats.
+ * @param stride Distance in bytes between two positions.
+ * @param indices The whole index buffer of the model.
+ * @param bounds Output; left empty, at the origin, if the range is.
+ */
+void ComputeMeshBounds(const uint8_t *positions, uint32_t stride,
+                       const uint32_t *indices, uint32_t first_index,
+                       uint32_t index_count, MeshBounds &bounds);
+
+/**
+ * @brief TransformMeshBounds Move bounds to another space. The box becomes
+ *   the box of the transformed box, and the sphere grows with the largest
+ *   scale of the matrix.
+ */
+MeshBounds TransformMeshBounds(const MeshBounds &bounds, const glm::mat4 &mat);
+
+/**
+ * @brief Bounds of every mesh of a model, one array per component so that
+ *        culling and LOD selection can test several meshes at once.
+ */
+class MeshBoundsTable {
+public:
+  MeshBoundsTable();
+
+  void Clear();
+  void Resize(uint32_t num_meshes);
+  void Set(uint32_t mesh_idx, const MeshBounds &bounds);
+  MeshBounds Get(uint32_t mesh_idx) const;
+  glm::vec4 GetSphere(uint32_t mesh_idx) const {
+    return glm::vec4(centre_x_[mesh_idx], centre_y_[mesh_idx],
+                     centre_z_[mesh_idx], radius_[mesh_idx]);
+  }
+
+  uint32_t size() const { return static_cast<uint32_t>(radius_.size()); }
+  const float *min_x() const { return min_x_.data(); }
+  const float *min_y() const { return min_y_.data(); }
+  const float *min_z() const { return min_z_.data(); }
+  const float *max_x() const { return max_x_.data(); }
+  const float *max_y() const { return max_y_.data(); }
+  const float *max_z() const { return max_z_.data(); }
+  const float *centre_x() const { return centre_x_.data(); }
+  const float *centre_y() const { return centre_y_.data(); }
+  const float *centre_z() const { return centre_z_.data(); }
+  const float *radius() const { return radius_.data(); }
+
+private:
+  eastl::vector<float> min_x_;
+  eastl::vector<float> min_y_;
+  eastl::vector<float> min_z_;
+  eastl::vector<float> max_x_;
+  eastl::vector<float> max_y_;
+  eastl::vector<float> max_z_;
+  eastl::vector<float> centre_x_;
+  eastl::vector<float> centre_y_;
+  eastl::vector<float> centre_z_;
+  eastl::vector<float> radius_;
+
+}; // class MeshBoundsTable
+
+/**
+ * @brief FrustumCull Test every entry of a bounds table against the planes of
+ *   a frustum, four entries at a time. An entry is culled if either its
+ *   sphere or its box is fully outside one of the planes.
+ *
+ * @param planes Planes, in the same space as the bounds.
+ * @param visible Output; non-zero for every entry which may be visible.
+ *
+ * @return Number of entries which may be visible.
+ */
+uint32_t FrustumCull(const szt::FrustumPlanes &planes,
+                     const MeshBoundsTable &bounds,
+                     eastl::vector<uint8_t> &visible);
+
+/**
+ * @brief FrustumCull Same as above, for the entries first to first + count
+ *   only.
+ *
+ * @param visible Output; indexed like the table, only the entries of the
+ *   range are written.
+ */
+uint32_t FrustumCull(const szt::FrustumPlanes &planes,
+                     const MeshBoundsTable &bounds, uint32_t first,
+                     uint32_t count, uint8_t *visible);
+
+} // namespace vks
+
+#endif
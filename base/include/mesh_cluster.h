@@ -0,0 +1,51 @@
+#ifndef VKS_MESHCLUSTER
+#define VKS_MESHCLUSTER
+
+#include <EASTL/vector.h>
+#include <cstdint>
+#define GLM_FORCE_CXX11
+#include <glm/glm.hpp>
+
+namespace vks {
+
+extern const uint32_t kMeshClusterMaxVertices;
+extern const uint32_t kMeshClusterMaxTriangles;
+
+// A run of consecutive triangles of a mesh in the index buffer. The layout
+// matches the std430 struct used by shaders, hence the vec4s
+struct MeshCluster {
+  MeshCluster();
+
+  // Centre and radius
+  glm::vec4 bounding_sphere;
+  glm::vec4 aabb_min;
+  glm::vec4 aabb_max;
+  // Apex of the normal cone and its cutoff; the whole cluster is backfacing
+  // for a viewer at v if dot(normalize(apex - v), axis) >= cutoff
+  glm::vec4 cone_apex_cutoff;
+  glm::vec4 cone_axis;
+  uint32_t first_index;
+  uint32_t index_count;
+  uint32_t mesh_idx;
+  uint32_t num_vertices;
+}; // struct MeshCluster
+
+/**
+ * @brief BuildMeshClusters Split the triangles of a mesh into clusters of at
+ *   most kMeshClusterMaxVertices unique vertices and kMeshClusterMaxTriangles
+ *   triangles. Triangles are taken in index buffer order, so the index buffer
+ *   is left untouched and stays in its vertex cache friendly order.
+ *
+ * @param positions Position of the first vertex, as three floats.
+ * @param stride Distance in bytes between two positions.
+ * @param indices The whole index buffer of the model.
+ * @param clusters Output; clusters are appended to it.
+ */
+void BuildMeshClusters(const uint8_t *positions, uint32_t stride,
+                       const uint32_t *indices, uint32_t first_index,
+                       uint32_t index_count, uint32_t mesh_idx,
+                       eastl::vector<MeshCluster> &clusters);
+
+} // namespace vks
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef VKS_MESHOPTIMISER
+#define VKS_MESHOPTIMISER
+
+#include <EASTL/vector.h>
+#include <cstdint>
+
+namespace vks {
+
+// Size of the FIFO post-transform cache simulated by AnalyseVertexCache
+extern const uint32_t kVertexCacheAnalysisSize;
+
+struct VertexCacheStats {
+  VertexCacheStats();
+
+  uint32_t transformed_vertices;
+  uint32_t num_triangles;
+  uint32_t num_unique_vertices;
+
+  // Average cache miss ratio; transformed vertices per triangle
+  float acmr() const;
+  // Average transform to vertex ratio; transformed vertices per vertex
+  float atvr() const;
+
+  void Accumulate(const VertexCacheStats &other);
+}; // struct VertexCacheStats
+
+/**
+ * @brief AnalyseVertexCache Simulate a FIFO post-transform cache over a list
+ *   of triangles.
+ *
+ * @param indices Triangle list, with indices in [0, num_vertices).
+ */
+VertexCacheStats AnalyseVertexCache(const uint32_t *indices,
+                                    uint32_t num_indices,
+                                    uint32_t num_vertices,
+                                    uint32_t cache_size);
+
+/**
+ * @brief OptimiseVertexCache Reorder the triangles of a list in place so that
+ *   consecutive triangles reuse recently transformed vertices. Uses Tom
+ *   Forsyth's linear-speed greedy algorithm.
+ *
+ * @param indices Triangle list, with indices in [0, num_vertices).
+ */
+void OptimiseVertexCache(uint32_t *indices, uint32_t num_indices,
+                         uint32_t num_vertices);
+
+/**
+ * @brief GetVertexFetchRemap Compute the new position of every vertex so that
+ *   vertices are stored in the order they are first referenced; vertices
+ *   which are never referenced are moved at the end.
+ *
+ * @param remap Output; remap[old_idx] is the new index of a vertex.
+ */
+void GetVertexFetchRemap(const uint32_t *indices, uint32_t num_indices,
+                         uint32_t num_vertices, eastl::vector<uint32_t> &remap);
+
+} // namespace vks
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef VKS_MESHSIMPLIFIER
+#define VKS_MESHSIMPLIFIER
+
+#include <EASTL/vector.h>
+#include <cstdint>
+
+namespace vks {
+
+// Number of detail levels of a mesh, the full detail one included
+extern const uint32_t kMaxMeshLods;
+// Fraction of the indices of a LOD that the next one aims for
+extern const float kMeshLodIndexRatio;
+// A LOD which keeps more than this fraction of the indices of the previous
+// one is not worth having; the chain stops there
+extern const float kMeshLodMaxKeptRatio;
+
+/**
+ * @brief SimplifyMesh Reduce the number of triangles of a mesh by collapsing
+ *   edges in order of quadric error. Vertices are neither moved nor created,
+ *   so the result indexes the same vertices as the input. Vertices on a
+ *   border or split by an attribute seam never move, to avoid cracks.
+ *
+ * @param indices Triangle list to simplify.
+ * @param positions Position of the first vertex, as three floats.
+ * @param stride Distance in bytes between two positions.
+ * @param target_num_indices Stop once the list is this small.
+ * @param result Output triangle list.
+ *
+ * @return Largest deviation introduced, as a distance in model space.
+ */
+float SimplifyMesh(const uint32_t *indices, uint32_t num_indices,
+                   const uint8_t *positions, uint32_t stride,
+                   uint32_t target_num_indices,
+                   eastl::vector<uint32_t> &result);
+
+} // namespace vks
+
+#endif
@@ -7,12 +7,12 @@
 #define GLM_FORCE_CXX11
 #include <glm/glm.hpp>
 #include <mesh.h>
+#include <vertex_setup.h>
 #include <vulkan_buffer.h>
 
 namespace vks {
 
 struct Vertex;
-class VertexSetup;
 class VulkanDevice;
 
 struct BuilderMesh {
@@ -35,11 +35,26 @@ public:
   void AddIndex(uint32_t index);
   void AddVertex(const Vertex &vertex);
 
-  const eastl::vector<uint8_t> vertices_data(uint32_t i) const {
+  // Grow the streams by count vertices/indices, to be filled in with
+  // SetVertex/SetIndex; returns the first allocated slot
+  uint32_t AllocateVertices(uint32_t count);
+  uint32_t AllocateIndices(uint32_t count);
+
+  // Distinct slots can be written from different threads at the same time
+  void SetVertex(uint32_t vtx_idx, const Vertex &vertex);
+  void SetIndex(uint32_t idx_idx, uint32_t index) {
+    indices_data_[idx_idx] = index;
+  }
+  // See ModelBuilder::SetVertexElementArray
+  void SetVertexElementArray(VertexElementType type, uint32_t first_vertex,
+                             uint32_t num_vertices, const void *data,
+                             uint32_t stride);
+
+  const eastl::vector<uint8_t> &vertices_data(uint32_t i) const {
     return vertices_data_[i];
   }
-  const eastl::vector<uint32_t> indices_data() const { return indices_data_; }
-  const eastl::vector<Mesh> meshes() const { return meshes_; }
+  const eastl::vector<uint32_t> &indices_data() const { return indices_data_; }
+  const eastl::vector<Mesh> &meshes() const { return meshes_; }
   uint32_t current_vertex() const { return current_vertex_; }
   const VertexSetup *vtx_setup() const { return vtx_setup_; }
   VkDescriptorPool desc_pool() const { return desc_pool_; }
@@ -69,6 +84,7 @@ public:
               uint32_t desc_set_slot) const;
 
   uint32_t NumMeshes() const;
+  VkIndexType index_type() const { return index_type_; }
 
 private:
   void CreateBuffers(const VulkanDevice &device,
@@ -79,6 +95,7 @@ private:
   eastl::vector<Mesh> meshes_;
   eastl::vector<VulkanBuffer> vertex_buffers_;
   VulkanBuffer index_buffer_;
+  VkIndexType index_type_;
   VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info_;
   eastl::vector<VkVertexInputBindingDescription> bindings_;
   eastl::vector<VkVertexInputAttributeDescription> attributes_;
@@ -2,6 +2,7 @@
 #define VKS_MODEL
 
 #include <EASTL/vector.h>
+#include <frustum.h>
 #include <mesh.h>
 #include <vulkan_buffer.h>
 #define GLM_ENABLE_EXPERIMENTAL
@@ -9,7 +10,10 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/hash.hpp>
 #include <map>
+#include <mesh_bounds.h>
+#include <mesh_cluster.h>
 #include <renderer_type.h>
+#include <transform_hierarchy.h>
 #include <vertex_setup.h>
 #include <vulkan_tools.h>
 
@@ -34,6 +38,12 @@ struct Vertex {
 
 }; // struct Vertex
 
+/**
+ * @brief HashVertex Hash of every attribute of a vertex. Vertices which
+ *   compare equal hash the same, signed zeroes included.
+ */
+uint32_t HashVertex(const Vertex &vertex);
+
 } // namespace vks
 
 namespace std {
@@ -41,10 +51,7 @@ namespace std {
 // Used by std::map to hash a Vertex
 template <> struct hash<vks::Vertex> {
   size_t operator()(const vks::Vertex &vertex) const {
-    return ((hash<glm::vec3>()(vertex.pos) ^
-             (hash<glm::vec3>()(vertex.normal) << 1)) >>
-            1) ^
-           (hash<glm::vec2>()(vertex.uv) << 1);
+    return vks::HashVertex(vertex);
   }
 }; // template<> struct hash<vks::Vertex>
 
@@ -53,9 +60,31 @@ template <> struct hash<vks::Vertex> {
 namespace vks {
 
 extern const uint32_t kModelMatsBindingPos;
+// Largest error, in pixels, a LOD can have to be picked by Model::SelectLods
+extern const float kLodMaxPixelError;
 
 class VulkanDevice;
 class VertexSetup;
+class ModelCacheFile;
+
+// Address of the data of a given element within a vertex
+const void *GetVertexElementData(const Vertex &vertex, VertexElementType type);
+
+/**
+ * @brief GetIndexType Smallest index type which can address the given number
+ *   of vertices.
+ */
+VkIndexType GetIndexType(uint32_t num_vertices);
+
+/**
+ * @brief PackIndices Lay indices out as the given index type expects them.
+ *   16-bit indices are padded to a whole number of 32-bit words, so that
+ *   shaders can read the buffer as an array of uint.
+ *
+ * @param packed Output, ready to be uploaded.
+ */
+void PackIndices(const uint32_t *indices, uint32_t num_indices,
+                 VkIndexType index_type, eastl::vector<uint8_t> &packed);
 
 class ModelBuilder {
 public:
@@ -63,29 +92,122 @@ public:
 
   void AddIndex(uint32_t index);
   void AddVertex(const Vertex &vertex);
-  void AddMesh(const Mesh *mesh);
+  void AddMesh(Mesh *mesh);
+  /**
+   * @brief AddInstance Place a mesh in the model. Meshes which are never
+   *   placed get a single instance, with their own model matrix.
+   *
+   * @param mesh_idx Index of the mesh, in the order meshes were added.
+   */
+  void AddInstance(uint32_t mesh_idx, const glm::mat4 &model_mat);
+  // Place a mesh at a node, so that it follows the node when it moves
+  void AddInstance(uint32_t mesh_idx, uint32_t node_idx);
+  /**
+   * @brief AddNode Add a node to the transform hierarchy of the model.
+   *
+   * @param parent A node added before, or kNoTransformNode.
+   * @param local_mat Transform relative to the parent.
+   *
+   * @return Index of the node.
+   */
+  uint32_t AddNode(uint32_t parent, const glm::mat4 &local_mat);
+
+  /**
+   * @brief AllocateVertices Grow every vertex stream by count vertices, to be
+   *   filled in with SetVertex.
+   *
+   * @return Index of the first allocated vertex.
+   */
+  uint32_t AllocateVertices(uint32_t count);
+  uint32_t AllocateIndices(uint32_t count);
+
+  // Write an already allocated vertex or index; distinct slots can be written
+  // from different threads at the same time
+  void SetVertex(uint32_t vtx_idx, const Vertex &vertex);
+  void SetIndex(uint32_t idx_idx, uint32_t index) {
+    indices_data_[idx_idx] = index;
+  }
+
+  /**
+   * @brief SetVertexElementArray Write one element of already allocated
+   *   vertices in bulk, converting it to the encoding of the layout. Ignored
+   *   if the layout has no such element. Distinct ranges or elements can be
+   *   written from different threads at the same time.
+   *
+   * @param data Elements as floats, laid out as in Vertex; nullptr zeroes
+   *   them.
+   * @param stride Distance in bytes between two elements in data.
+   */
+  void SetVertexElementArray(VertexElementType type, uint32_t first_vertex,
+                             uint32_t num_vertices, const void *data,
+                             uint32_t stride);
 
-  void AddVertexElementArray(const void *data, uint32_t size,
-                             VertexElementType type);
+  /**
+   * @brief InstanceDuplicateMeshes Find the meshes whose geometry and
+   *   material are identical, keep a single copy of each and turn the others
+   *   into instances of it. Unreferenced vertices are dropped. Must run
+   *   before GenerateLods.
+   */
+  void InstanceDuplicateMeshes();
+
+  /**
+   * @brief OptimiseVertexOrder Reorder the triangles of every mesh for the
+   *   post-transform cache, then store the vertices in the order they are
+   *   first fetched. Logs the ACMR/ATVR before and after.
+   */
+  void OptimiseVertexOrder();
 
-  const eastl::vector<uint8_t> vertices_data(uint32_t i) const {
+  /**
+   * @brief GenerateLods Simplify every mesh into a chain of up to
+   *   kMaxMeshLods - 1 coarser versions, appended to the index buffer and
+   *   recorded in the meshes. Vertices are shared with the full mesh.
+   */
+  void GenerateLods();
+
+  /**
+   * @brief QuantisePositions Encode the positions relative to the bounds of
+   *   the model, when the layout asks for AABB_UNORM_16 positions. Must run
+   *   after every pass which reads positions as floats.
+   */
+  void QuantisePositions();
+
+  const eastl::vector<uint8_t> &vertices_data(uint32_t i) const {
     return vertices_data_[i];
   }
-  const eastl::vector<uint32_t> indices_data() const { return indices_data_; }
-  const eastl::vector<const Mesh *> meshes() const { return meshes_; }
+  const eastl::vector<uint32_t> &indices_data() const { return indices_data_; }
+  const eastl::vector<Mesh *> &meshes() const { return meshes_; }
+  const eastl::vector<MeshInstance> &instances() const { return instances_; }
+  const TransformHierarchy &nodes() const { return nodes_; }
   uint32_t current_vertex() const { return current_vertex_; }
   uint32_t vertex_size() const { return vertex_size_; }
   const VertexSetup *vertex_setup() const { return vertex_setup_; }
   VkDescriptorPool desc_pool() const { return desc_pool_; }
+  bool pending_position_quantisation() const {
+    return pending_position_quantisation_;
+  }
+  // Offset and scale which bring quantised positions back to model space
+  const glm::vec4 &position_dequant() const { return position_dequant_; }
 
 private:
   eastl::vector<eastl::vector<uint8_t>> vertices_data_;
   eastl::vector<uint32_t> indices_data_;
-  eastl::vector<const Mesh *> meshes_;
+  eastl::vector<Mesh *> meshes_;
+  eastl::vector<MeshInstance> instances_;
+  TransformHierarchy nodes_;
   uint32_t vertex_size_;
   uint32_t current_vertex_;
   const VertexSetup *vertex_setup_;
   VkDescriptorPool desc_pool_;
+  // Positions are kept as floats until QuantisePositions
+  bool pending_position_quantisation_;
+  glm::vec4 position_dequant_;
+
+  uint32_t GetStreamElementSize(uint32_t elm_idx) const;
+  // Move every vertex to remap[vertex], keeping the first num_vertices
+  void RemapVertices(const eastl::vector<uint32_t> &remap,
+                     uint32_t num_vertices);
+  // Whether two meshes reference the same vertex data in the same order
+  bool IsSameGeometry(const Mesh &lhs, const Mesh &rhs) const;
 }; // class ModelBuilder
 
 class Model {
@@ -93,6 +215,16 @@ public:
   Model();
 
   void Init(const VulkanDevice &device, const ModelBuilder &model_builder);
+
+  /**
+   * @brief Init Create the model straight from a cooked model file; the
+   *   mapped vertex streams and indices are uploaded as they are.
+   *
+   * @param mat_idx_offset Material ID of the first material of the model.
+   */
+  void Init(const VulkanDevice &device, const ModelCacheFile &cache,
+            const VertexSetup &vertex_setup, VkDescriptorPool desc_pool,
+            uint32_t mat_idx_offset);
   void Shutdown(const VulkanDevice &device);
 
   void CreateAndWriteDescriptorSets(const VulkanDevice &device,
@@ -105,10 +237,23 @@ public:
 
   const eastl::vector<Mesh> &meshes() const { return meshes_; }
   uint32_t GetMeshesCount() const { return SCAST_U32(meshes_.size()); }
+  // Sorted by mesh; each mesh knows its range
+  const eastl::vector<MeshInstance> &instances() const { return instances_; }
+  uint32_t GetInstancesCount() const { return SCAST_U32(instances_.size()); }
+  const eastl::vector<MeshCluster> &clusters() const { return clusters_; }
+  // Empty when the model has no usable position stream
+  const MeshBoundsTable &bounds() const { return bounds_; }
+  VkIndexType index_type() const { return index_type_; }
 
   void BindVertexBuffer(VkCommandBuffer cmd_buff) const;
   void BindIndexBuffer(VkCommandBuffer cmd_buff) const;
 
+  /**
+   * @brief RenderMeshesByMaterial Draws all the instances of every mesh, one
+   *        indirect draw per mesh. The first instance of the mesh is pushed as
+   *        a constant, which the vertex stage adds to gl_InstanceIndex to
+   *        find the instance in the list of visible ones.
+   */
   void RenderMeshesByMaterial(VkCommandBuffer cmd_buff,
                               VkPipelineLayout pipe_layout,
                               uint32_t desc_set_slot) const;
@@ -116,28 +261,153 @@ public:
   uint32_t NumMeshes() const;
 
   /**
-   * @brief SetModelMatrixForAllMeshes Set a specific model matrix for all the
-   *   meshes in the model.
+   * @brief SetModelMatrixForAllMeshes Place the whole model, by setting the
+   *   matrix of the root of its hierarchy. Applied by UpdateTransforms.
    *
    * @param mat The matrix to set.
    */
   void SetModelMatrixForAllMeshes(const glm::mat4 &mat);
 
+  /**
+   * @brief SetNodeLocalMatrix Move a node of the hierarchy, along with every
+   *   node and instance below it. Applied by UpdateTransforms.
+   *
+   * @param node_idx Node 0 is the root of the model, the nodes of the model
+   *   builder follow, then the node of every instance.
+   */
+  void SetNodeLocalMatrix(uint32_t node_idx, const glm::mat4 &local_mat);
+
+  /**
+   * @brief UpdateTransforms Recompute the world matrices of the nodes which
+   *   moved and of the nodes below them, then write the matrices and bounds
+   *   of the instances which moved as a result. Only the ranges of the model
+   *   matrices which changed are flushed. Must not be called while the GPU
+   *   reads the model matrices.
+   *
+   * @param moved_instances Output; the instances which moved, in increasing
+   *   order.
+   *
+   * @return Whether any instance moved.
+   */
+  bool UpdateTransforms(eastl::vector<uint32_t> &moved_instances);
+
+  /**
+   * @brief SelectLods Pick for every mesh the coarsest LOD whose error,
+   *   projected on screen, stays within max_pixel_error for all of its
+   *   instances, and write it to the indirect draws. Must not be called
+   *   while the GPU reads them.
+   *
+   * @param view_pos Position of the viewer, in world space.
+   * @param frustum Frustum of the camera.
+   * @param viewport_height Height of the viewport, in pixels.
+   */
+  void SelectLods(const glm::vec3 &view_pos, const szt::Frustum &frustum,
+                  float viewport_height, float max_pixel_error);
+
+  /**
+   * @brief GetMaterialScreenSizes Raise the pixels each material may span on
+   *   screen to the projected diameter of the nearest visible instance using
+   *   it, so that its textures get enough detail. Meshes without bounds ask
+   *   for full detail.
+   *
+   * @param screen_sizes Indexed by material id; grown to fit every material
+   *   of the model.
+   */
+  void GetMaterialScreenSizes(const glm::vec3 &view_pos,
+                              const szt::Frustum &frustum,
+                              float viewport_height,
+                              eastl::vector<float> &screen_sizes) const;
+
+  /**
+   * @brief SetInstancesVisibility Only draw the given instances. The
+   *   indirect draws and the list of visible instances are only rewritten
+   *   when the visibility changes. Must not be called while the GPU reads
+   *   them.
+   *
+   * @param visibility Non-zero for every instance to draw, indexed by
+   *   instance.
+   *
+   * @return Number of instances drawn.
+   */
+  uint32_t SetInstancesVisibility(const uint8_t *visibility);
+
+  /**
+   * @brief SetInstanceModelMatrix Move an instance alone, so that its world
+   *   matrix becomes mat while its parent node stays where it was at the last
+   *   update. Applied by UpdateTransforms.
+   */
+  void SetInstanceModelMatrix(uint32_t instance_idx, const glm::mat4 &mat);
+
+  const TransformHierarchy &transforms() const { return transforms_; }
+  uint32_t GetInstanceNode(uint32_t instance_idx) const {
+    return first_instance_node_ + instance_idx;
+  }
+
+  uint32_t num_visible_instances() const { return num_visible_instances_; }
+  // Empty when the model has no bounds
+  const MeshBoundsTable &instance_bounds() const { return instance_bounds_; }
+
 private:
   void CreateBuffers(const VulkanDevice &device, const ModelBuilder &builder);
+  void CreateGeometryBuffers(const VulkanDevice &device,
+                             const eastl::vector<const void *> &elms_data,
+                             const eastl::vector<uint32_t> &elms_sizes,
+                             uint32_t num_vertices, const uint32_t *indices,
+                             uint32_t num_indices);
+  /**
+   * @brief BuildClusters Split every mesh into clusters and compute their
+   *   bounds, from the position stream. Also bounds each mesh as a whole.
+   */
+  void BuildClusters(const eastl::vector<const void *> &elms_data,
+                     uint32_t num_vertices, const uint32_t *indices);
+  /**
+   * @brief SetupInstances Sort the instances by mesh and give each mesh its
+   *   range; meshes without any instance get one. Then build the hierarchy
+   *   from the nodes the instances hang from.
+   */
+  void SetupInstances(const eastl::vector<MeshInstance> &instances,
+                      const TransformHierarchy &nodes);
+  void CreateMeshesBuffers(const VulkanDevice &device);
   void CreateDescriptorSet(const VulkanDevice &device,
                            VkDescriptorSetLayout heap_set_layout);
   void WriteDescriptorSet(const VulkanDevice &device);
 
   eastl::vector<Mesh> meshes_;
+  eastl::vector<MeshInstance> instances_;
+  // Root, nodes of the source, then one leaf per instance, in their order
+  TransformHierarchy transforms_;
+  uint32_t first_instance_node_;
+  // Nodes recomputed by the last update
+  eastl::vector<uint32_t> changed_nodes_;
   eastl::vector<VulkanBuffer> vertex_buffers_;
   VulkanBuffer index_buffer_;
+  VkIndexType index_type_;
   VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info_;
   eastl::vector<VkVertexInputBindingDescription> bindings_;
   eastl::vector<VkVertexInputAttributeDescription> attributes_;
   VulkanBuffer model_matxs_buff_;
+  // One MeshBounds per mesh, next to the model matrices
+  VulkanBuffer bounds_buff_;
   VulkanBuffer materialIDs_buff_;
+  // Mesh of every instance, for the passes which start from an instance
+  VulkanBuffer instance_meshes_buff_;
+  // Visible instances of every mesh, at the start of its range of instances
+  VulkanBuffer visible_instances_buff_;
   VulkanBuffer indirect_draws_buff_;
+  eastl::vector<MeshCluster> clusters_;
+  VulkanBuffer clusters_buff_;
+  // Bounds of every mesh, in model space
+  MeshBoundsTable bounds_;
+  // Bounds of every instance, in world space
+  MeshBoundsTable instance_bounds_;
+  // Non-zero for the instances which passed the last culling
+  eastl::vector<uint8_t> instance_visibility_;
+  uint32_t num_visible_instances_;
+  // LOD currently written in the indirect draw of every mesh; it is shared
+  // by all the instances of the mesh
+  eastl::vector<uint32_t> selected_lods_;
+  // Folded into the model matrices when positions are quantised
+  glm::vec4 position_dequant_;
   VkDescriptorSet desc_set_;
   VkDescriptorPool desc_pool_;
   VertexSetup vtx_setup_;
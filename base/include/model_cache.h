@@ -0,0 +1,126 @@
+#ifndef VKS_MODELCACHE
+#define VKS_MODELCACHE
+
+#include <EASTL/string.h>
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <material_constants.h>
+#include <material_instance.h>
+#include <mesh.h>
+#include <transform_hierarchy.h>
+
+namespace vks {
+
+class ModelBuilder;
+class VertexSetup;
+
+// Bump whenever the layout of the cooked file changes; caches written with
+// a different version are ignored and rebuilt from the source asset
+extern const uint32_t kModelCacheVersion;
+
+// Load-time passes baked into a cooked model; they are part of its key
+extern const uint32_t kCookVertexOrderOptimised;
+extern const uint32_t kCookLodsGenerated;
+
+// Description of a material as read from the source asset, before any of
+// its textures is loaded
+struct CookedMaterial {
+  CookedMaterial();
+
+  eastl::string name;
+  MaterialConstants consts;
+  eastl::vector<MaterialBuilderTexture> textures;
+}; // struct CookedMaterial
+
+/**
+ * @brief Read-only view over a cooked model file.
+ *
+ * The file is memory-mapped; vertex streams and indices point straight into
+ * the mapping so they can be handed to the upload path without going
+ * through a ModelBuilder.
+ */
+class ModelCacheFile {
+public:
+  ModelCacheFile();
+  ~ModelCacheFile();
+
+  /**
+   * @brief Open Map the cache of a source model.
+   *
+   * @param source_filename Path of the model the cache was cooked from.
+   * @param post_process_steps Assimp flags used when cooking.
+   * @param cook_flags Load-time passes which have to be baked in.
+   * @param vertex_setup The layout the vertex streams must be in.
+   *
+   * @return False if the cache is missing, stale, or was cooked with
+   *   different flags or a different vertex layout.
+   */
+  bool Open(const eastl::string &source_filename, uint32_t post_process_steps,
+            uint32_t cook_flags, const VertexSetup &vertex_setup);
+  void Close();
+
+  /**
+   * @brief Write Cook the content of a builder to disk.
+   *
+   * @param mat_idx_offset Material ID of the first material of the model;
+   *   mesh material IDs are stored relative to it.
+   *
+   * @return Whether the cache could be written.
+   */
+  static bool Write(const eastl::string &source_filename,
+                    uint32_t post_process_steps, uint32_t cook_flags,
+                    const ModelBuilder &builder, uint32_t mat_idx_offset,
+                    const eastl::vector<CookedMaterial> &materials);
+
+  static eastl::string GetCachePath(const eastl::string &source_filename,
+                                    uint32_t post_process_steps,
+                                    uint32_t cook_flags);
+
+  bool IsOpen() const { return data_ != nullptr; }
+
+  uint32_t num_elements() const { return num_elements_; }
+  const void *vertices_data(uint32_t i) const;
+  uint32_t vertices_data_size(uint32_t i) const;
+  const uint32_t *indices_data() const;
+  uint32_t num_indices() const { return num_indices_; }
+  uint32_t num_meshes() const { return num_meshes_; }
+  const eastl::vector<CookedMaterial> &materials() const { return materials_; }
+  // See ModelBuilder::position_dequant
+  const glm::vec4 &position_dequant() const { return position_dequant_; }
+
+  /**
+   * @brief GetMeshes Rebuild the meshes of the model.
+   *
+   * @param mat_idx_offset Material ID of the first material of the model.
+   * @param meshes Output meshes.
+   */
+  void GetMeshes(uint32_t mat_idx_offset, eastl::vector<Mesh> &meshes) const;
+  /**
+   * @brief GetInstances Placements the model was cooked with; meshes without
+   *        any are placed once by the model.
+   */
+  void GetInstances(eastl::vector<MeshInstance> &instances) const;
+  // Transform hierarchy the instances hang from
+  void GetNodes(TransformHierarchy &nodes) const;
+
+private:
+  const uint8_t *data_;
+  uint64_t size_;
+  uint32_t num_elements_;
+  uint32_t num_indices_;
+  uint32_t num_meshes_;
+  uint32_t num_lods_;
+  uint32_t num_instances_;
+  uint32_t num_nodes_;
+  glm::vec4 position_dequant_;
+  eastl::vector<CookedMaterial> materials_;
+
+  bool Map(const eastl::string &cache_path);
+  bool ReadMaterials(uint64_t offset);
+
+}; // class ModelCacheFile
+
+} // namespace vks
+
+#endif
@@ -2,12 +2,22 @@
 #define VKS_MODELMANAGER
 
 #include <EASTL/hash_map.h>
+#include <EASTL/hash_set.h>
+#include <EASTL/shared_ptr.h>
 #include <EASTL/string.h>
 #include <EASTL/unique_ptr.h>
+#include <EASTL/vector.h>
 #include <assimp/postprocess.h>
+#include <atomic>
+#include <bounds_bvh.h>
+#include <frustum.h>
+#include <mesh.h>
+#include <model_cache.h>
 #include <renderer_type.h>
 #include <vertex_setup.h>
 #include <vulkan_buffer.h>
+#include <vulkan_texture_manager.h>
+#include <vulkan_uploader.h>
 
 namespace vks {
 
@@ -23,6 +33,100 @@ struct MeshesModelMatrices {
   uint32_t num_meshes;
 };
 
+/**
+ * @brief CPU side result of loading a model, before anything is created on
+ *        the device. Mesh material IDs are relative to the first material of
+ *        the model.
+ */
+struct CookedModel {
+  CookedModel();
+  ~CookedModel();
+
+  // Set when an up to date cooked file was found
+  eastl::unique_ptr<ModelCacheFile> cache;
+  // Set otherwise; it points to the meshes below
+  eastl::unique_ptr<ModelBuilder> builder;
+  eastl::vector<Mesh> meshes;
+  eastl::vector<CookedMaterial> materials;
+  // Textures of the materials, inspected along with the model and decoded
+  // once their staging memory is reserved
+  TextureLoadBatch textures;
+}; // struct CookedModel
+
+/**
+ * @brief A model being loaded in the background. The parsing, the vertex
+ *        conversion and the decoding of the textures run on the thread pool;
+ *        ModelManager::UpdateAsyncLoads reserves the staging memory the
+ *        textures are decoded into, then creates the model on the device and
+ *        hands it out once its data is uploaded.
+ */
+class ModelLoadRequest {
+public:
+  ModelLoadRequest(const eastl::string &name, const eastl::string &material_dir,
+                   uint32_t assimp_post_process_steps, uint32_t cook_flags,
+                   const VertexSetup &vertex_setup);
+
+  // Whether the model has been created and uploaded, and can be registered
+  // for rendering
+  bool IsReady() const { return model_ != nullptr; }
+  // Whether the model couldn't be loaded; it will never become ready
+  bool IsFailed() const { return failed_; }
+
+  const eastl::string &name() const { return name_; }
+  Model *model() const { return model_; }
+  // Why the load failed, see IsFailed
+  const eastl::string &error() const { return error_; }
+
+private:
+  friend class ModelManager;
+
+  eastl::string name_;
+  eastl::string material_dir_;
+  uint32_t assimp_post_process_steps_;
+  uint32_t cook_flags_;
+  // The builder keeps a pointer to it, so it has to outlive the load
+  VertexSetup vertex_setup_;
+  CookedModel cooked_;
+  // Written by the cook task before cooked_done_ is set
+  eastl::string error_;
+  bool cook_failed_;
+  std::atomic<bool> cooked_done_;
+  // Whether the staging memory of the textures is reserved, and then whether
+  // they are decoded into it
+  bool staged_;
+  std::atomic<bool> decoded_done_;
+  // Set on shutdown, the tasks of the load then skip what they haven't
+  // started
+  std::atomic<bool> cancelled_;
+  // Created, but only handed out once the upload ticket is complete
+  Model *uploading_model_;
+  UploadTicket upload_ticket_;
+  Model *model_;
+  bool failed_;
+
+}; // class ModelLoadRequest
+
+typedef eastl::shared_ptr<ModelLoadRequest> ModelLoadHandle;
+
+// An instance of a model, as stored in the scene BVH
+struct SceneBvhItem {
+  SceneBvhItem(Model *Model, uint32_t Instance_idx);
+
+  Model *model;
+  uint32_t instance_idx;
+}; // struct SceneBvhItem
+
+// Instance hit by a ray, see ModelManager::Pick
+struct ScenePick {
+  ScenePick();
+
+  Model *model;
+  uint32_t instance_idx;
+  uint32_t mesh_idx;
+  // Along the ray, to where it enters the bounding box of the instance
+  float distance;
+}; // struct ScenePick
+
 class ModelManager {
 public:
   ModelManager();
@@ -36,9 +140,46 @@ public:
                       uint32_t assimp_post_process_steps,
                       const VertexSetup &vertex_setup, Model **model) const;
 
+  /**
+   * @brief CreateModel Create a model used internally by a renderer, such as
+   *   a fullscreen quad; it is left out of the scene BVH.
+   */
   void CreateModel(const VulkanDevice &device, const eastl::string &name,
                    const ModelBuilder &model_builder, Model **model) const;
 
+  /**
+   * @brief Start loading a model in the background, see LoadOtherModel.
+   *
+   * @return Handle which becomes ready once UpdateAsyncLoads has created the
+   *   model and its uploads are complete; it is ready straight away if the
+   *   model was already loaded. It fails instead if the model can't be
+   *   imported.
+   */
+  ModelLoadHandle LoadOtherModelAsync(const VulkanDevice &device,
+                                      const eastl::string &name,
+                                      const eastl::string &material_dir,
+                                      uint32_t assimp_post_process_steps,
+                                      const VertexSetup &vertex_setup);
+
+  /**
+   * @brief Create on the device the next background load whose CPU side is
+   *        done, if any, and hand out the loads whose uploads completed.
+   *        Loads complete in the order they were requested, at most one is
+   *        created per call so that a frame only pays for one upload. The
+   *        staging memory of a load is reserved by an earlier call, which
+   *        then has its textures decoded into it on the thread pool.
+   *
+   * @param device The device
+   */
+  void UpdateAsyncLoads(const VulkanDevice &device);
+
+  /**
+   * @brief Make the background loads skip the cooking and the decoding they
+   *        haven't started yet. Call before the thread pool is shut down, as
+   *        it still runs the queued tasks, and before any manager they use.
+   */
+  void CancelAsyncLoads();
+
   /**
    * @brief Create UBO array of all the model matrices, for each model
    *
@@ -48,6 +189,52 @@ public:
 
   void Shutdown(const VulkanDevice &device);
 
+  /**
+   * @brief CullInstances Find the instances which may be inside a frustum,
+   *        through the scene BVH, and only draw those. See
+   *        Model::SetInstancesVisibility.
+   *
+   * @param planes Planes of the frustum, in world space.
+   * @param models Models to cull; models without bounds stay fully visible.
+   *
+   * @return Number of instances, between the models, which may be visible.
+   */
+  uint32_t CullInstances(const szt::FrustumPlanes &planes,
+                         const eastl::vector<Model *> &models);
+
+  /**
+   * @brief Pick Find the instance whose bounding box is hit first by a ray.
+   *
+   * @return Whether any instance is hit within max_distance.
+   */
+  bool Pick(const glm::vec3 &origin, const glm::vec3 &dir, float max_distance,
+            ScenePick &pick) const;
+
+  /**
+   * @brief SetInstanceModelMatrix Move an instance of a model; it moves on
+   *        the next UpdateTransforms. See Model::SetInstanceModelMatrix.
+   */
+  void SetInstanceModelMatrix(Model *model, uint32_t instance_idx,
+                              const glm::mat4 &mat);
+
+  /**
+   * @brief UpdateTransforms Apply the transforms which changed since the last
+   *        update, and refit the scene BVH around the instances which moved.
+   *        See Model::UpdateTransforms.
+   */
+  void UpdateTransforms(const eastl::vector<Model *> &models);
+
+  /**
+   * @brief RequestTextureDetail Ask the texture manager for the mip levels
+   *        the textures of the visible instances need at their size on
+   *        screen. See Model::GetMaterialScreenSizes and
+   *        VulkanTextureManager::RequestTextureDetail.
+   */
+  void RequestTextureDetail(const eastl::vector<Model *> &models,
+                            const glm::vec3 &view_pos,
+                            const szt::Frustum &frustum,
+                            float viewport_height) const;
+
   /**
    * @brief Total number of meshes between all models.
    *
@@ -79,6 +266,14 @@ public:
     sets_desc_pool_ = sets_desc_pool;
   }
 
+  // Whether loaded models go through ModelBuilder::OptimiseVertexOrder
+  void set_optimise_vertex_order(bool optimise) {
+    optimise_vertex_order_ = optimise;
+  }
+
+  // Whether loaded models go through ModelBuilder::GenerateLods
+  void set_generate_lods(bool generate) { generate_lods_ = generate; }
+
 private:
   // List of all models
   typedef eastl::hash_map<eastl::string, eastl::unique_ptr<Model>> NameModelMap;
@@ -87,10 +282,68 @@ private:
   VkSampler aniso_sampler_;
   eastl::string shade_material_name_;
   VkDescriptorPool sets_desc_pool_;
+  bool optimise_vertex_order_;
+  bool generate_lods_;
+  // Background loads, in the order they were requested
+  eastl::vector<ModelLoadHandle> pending_loads_;
+  // Loads created on the device whose uploads may not be complete yet
+  eastl::vector<ModelLoadHandle> uploading_loads_;
+  // World space bounds of the instances of every model with bounds; rebuilt
+  // the first time it is used after models are created, refitted when an
+  // instance moves
+  mutable BoundsBvh scene_bvh_;
+  mutable bool scene_bvh_dirty_;
+  mutable eastl::vector<SceneBvhItem> scene_bvh_items_;
+  // First item of every model in the scene BVH
+  typedef eastl::hash_map<const Model *, uint32_t> ModelFirstItemMap;
+  mutable ModelFirstItemMap scene_bvh_first_items_;
+  // Models created for the renderers, which are not part of the scene
+  mutable eastl::hash_set<const Model *> internal_models_;
+
+  uint32_t GetCookFlags() const;
+
+  void RebuildSceneBvh() const;
+  // Rebuild the scene BVH if models were created since it was last built,
+  // so that loading several models only pays for one build
+  void UpdateSceneBvh() const;
+
+  // Import the model, or map its cooked file, and inspect the textures of
+  // its materials without creating anything on the device or touching the
+  // managers; safe to call from any thread. Returns false, and why in
+  // error, if the model can't be imported
+  bool CookOtherModel(const VulkanDevice &device,
+                      const eastl::string &filename,
+                      const eastl::string &material_dir,
+                      uint32_t assimp_post_process_steps, uint32_t cook_flags,
+                      const VertexSetup &vertex_setup, CookedModel &cooked,
+                      eastl::string &error) const;
+  // See VulkanTextureManager::InspectTextures; safe to call from any thread
+  void InspectMaterialTextures(const VulkanDevice &device,
+                               const eastl::string &material_dir,
+                               const eastl::vector<CookedMaterial> &materials,
+                               TextureLoadBatch &textures) const;
+  // Stage and decode inspected textures straight away
+  void DecodeMaterialTextures(const VulkanDevice &device,
+                              TextureLoadBatch &textures) const;
+  void FinishModel(const VulkanDevice &device, const eastl::string &name,
+                   const eastl::string &material_dir,
+                   const VertexSetup &vertex_setup, CookedModel &cooked,
+                   Model **model) const;
 
   void CreateUniqueModel(const VulkanDevice &device,
                          const ModelBuilder &init_info,
-                         const eastl::string &name, Model **model) const;
+                         const eastl::string &name, bool in_scene,
+                         Model **model) const;
+  void CreateUniqueModel(const VulkanDevice &device,
+                         const ModelCacheFile &cache,
+                         const VertexSetup &vertex_setup,
+                         const eastl::string &name, uint32_t mat_idx_offset,
+                         Model **model) const;
+
+  void CreateMaterialInstances(const VulkanDevice &device,
+                               const eastl::string &material_dir,
+                               const eastl::vector<CookedMaterial> &materials,
+                               TextureLoadBatch &textures) const;
 }; // class ModelManager
 
 } // namespace vks
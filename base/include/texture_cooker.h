@@ -0,0 +1,80 @@
+#ifndef VKS_TEXTURECOOKER
+#define VKS_TEXTURECOOKER
+
+#include <EASTL/string.h>
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <gli/texture2d.hpp>
+#include <vulkan/vulkan.h>
+
+namespace vks {
+
+// Bump whenever the cooked data changes; textures cooked with a different
+// version get a different path and are cooked again
+extern const uint32_t kTextureCacheVersion;
+
+// How a texture is block compressed when it is cooked, picked from what it
+// holds
+enum class TextureCompression : uint8_t {
+  NONE = 0U,
+  // BC1, or BC3 when some texels aren't opaque
+  COLOUR,
+  // BC4 of the red channel, in linear space, when the texture is grey;
+  // COLOUR otherwise
+  MASK,
+  // BC5 of the red and green channels
+  NORMAL_MAP
+}; // enum class TextureCompression
+
+/**
+ * @brief GetCookedTexturePath Where the cooked version of a texture goes,
+ *        next to its source. The path depends on the content of the source,
+ *        the format and the compression, so editing the source cooks it
+ *        again.
+ *
+ * @param source_data Content of the source file.
+ */
+eastl::string GetCookedTexturePath(const eastl::string &source_filename,
+                                   const eastl::vector<uint8_t> &source_data,
+                                   VkFormat format,
+                                   TextureCompression compression);
+
+/**
+ * @brief GetCompressedFormats Formats a texture may be cooked to with a
+ *        compression, depending on its content.
+ *
+ * @param formats Output.
+ */
+void GetCompressedFormats(TextureCompression compression, VkFormat format,
+                          eastl::vector<VkFormat> &formats);
+
+/**
+ * @brief GetMipChainSize Bytes taken by a full chain of RGBA8 mip levels.
+ */
+uint64_t GetMipChainSize(uint32_t width, uint32_t height);
+
+/**
+ * @brief CookPNGTexture Decode a PNG file to RGBA8 and build its full mip
+ *        chain, halving each level with a box filter, then block compress
+ *        the levels unless compression is NONE. Colours of sRGB formats are
+ *        averaged in linear space, and alpha always is.
+ *
+ * @param png_data Content of the file.
+ * @param format VK_FORMAT_R8G8B8A8_SRGB or VK_FORMAT_R8G8B8A8_UNORM.
+ * @param cooked Output; its format says what the texture was cooked to.
+ *
+ * @return Whether the file could be decoded.
+ */
+bool CookPNGTexture(const eastl::vector<uint8_t> &png_data, VkFormat format,
+                    TextureCompression compression, gli::texture2d &cooked);
+
+/**
+ * @brief SaveCookedTexture Write a cooked texture as KTX, through a
+ *        temporary file so that a crash never leaves a truncated one behind.
+ */
+bool SaveCookedTexture(const gli::texture2d &cooked,
+                       const eastl::string &cooked_path);
+
+} // namespace vks
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef VKS_THREADPOOL
+#define VKS_THREADPOOL
+
+#include <EASTL/deque.h>
+#include <EASTL/vector.h>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace vks {
+
+class ThreadPool {
+public:
+  ThreadPool();
+  ~ThreadPool();
+
+  /**
+   * @brief Init Spawn the worker threads.
+   *
+   * @param num_workers Number of workers; 0 uses one per hardware thread,
+   *   minus the calling one.
+   */
+  void Init(uint32_t num_workers = 0U);
+  void Shutdown();
+
+  void Enqueue(std::function<void()> task);
+
+  /**
+   * @brief ParallelFor Call func for every index in [0, count), spreading
+   *   the indices between the workers and the calling thread. Returns once
+   *   all the calls have completed. Runs serially if there are no workers.
+   *   The calling thread only ever runs indices of this call, never other
+   *   queued tasks.
+   */
+  void ParallelFor(uint32_t count, const std::function<void(uint32_t)> &func);
+
+  uint32_t num_workers() const {
+    return static_cast<uint32_t>(workers_.size());
+  }
+
+private:
+  eastl::vector<std::thread> workers_;
+  eastl::deque<std::function<void()>> tasks_;
+  std::mutex tasks_mutex_;
+  std::condition_variable tasks_cv_;
+  bool stop_;
+
+  void WorkerLoop();
+
+}; // class ThreadPool
+
+} // namespace vks
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef VKS_TRANSFORMHIERARCHY
+#define VKS_TRANSFORMHIERARCHY
+
+#include <EASTL/vector.h>
+#include <cstdint>
+#define GLM_FORCE_CXX11
+#include <glm/glm.hpp>
+
+namespace vks {
+
+// Parent of the root nodes, and node of the instances which have none
+extern const uint32_t kNoTransformNode;
+
+/**
+ * @brief Nodes of a transform hierarchy, one array per attribute. A node is
+ *        always added after its parent, so the world matrices are brought up
+ *        to date with a single pass in order. Changing a local matrix only
+ *        marks the node as dirty; the next Update recomputes it and the nodes
+ *        below it, and nothing else.
+ */
+class TransformHierarchy {
+public:
+  TransformHierarchy();
+
+  void Clear();
+
+  /**
+   * @brief AddNode Append a node, with its world matrix already computed.
+   *
+   * @param parent An existing node, or kNoTransformNode for a root.
+   *
+   * @return Index of the node.
+   */
+  uint32_t AddNode(uint32_t parent, const glm::mat4 &local_mat);
+
+  // Takes effect on the next Update
+  void SetLocalMatrix(uint32_t node_idx, const glm::mat4 &local_mat);
+
+  /**
+   * @brief Update Recompute the world matrices of the dirty nodes and of the
+   *   nodes below them, four matrix columns at a time where SSE is available.
+   *
+   * @param changed Output; the nodes whose world matrix was recomputed, in
+   *   increasing order.
+   *
+   * @return Whether any node was recomputed.
+   */
+  bool Update(eastl::vector<uint32_t> &changed);
+
+  uint32_t size() const { return static_cast<uint32_t>(parents_.size()); }
+  bool IsDirty() const { return first_dirty_ < size(); }
+  uint32_t parent(uint32_t node_idx) const { return parents_[node_idx]; }
+  const glm::mat4 &local_mat(uint32_t node_idx) const {
+    return local_mats_[node_idx];
+  }
+  // Up to date as of the last Update
+  const glm::mat4 &world_mat(uint32_t node_idx) const {
+    return world_mats_[node_idx];
+  }
+
+private:
+  eastl::vector<uint32_t> parents_;
+  eastl::vector<glm::mat4> local_mats_;
+  eastl::vector<glm::mat4> world_mats_;
+  // Non-zero for the nodes whose local matrix changed since the last Update
+  eastl::vector<uint8_t> dirty_;
+  // Nothing before this node is dirty; size() when nothing is
+  uint32_t first_dirty_;
+
+}; // class TransformHierarchy
+
+} // namespace vks
+
+#endif
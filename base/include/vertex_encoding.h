@@ -0,0 +1,50 @@
+#ifndef VKS_VERTEXENCODING
+#define VKS_VERTEXENCODING
+
+#include <cstdint>
+#include <vertex_setup.h>
+#define GLM_FORCE_CXX11
+#include <glm/glm.hpp>
+
+namespace vks {
+
+/**
+ * @brief EncodeVertexElement Write an element in the given encoding.
+ *
+ * @param src The element as floats, as laid out in Vertex.
+ * @param dst Destination, of size_bytes bytes.
+ */
+void EncodeVertexElement(VertexElementEncoding encoding, const float *src,
+                         void *dst, uint32_t size_bytes);
+
+/**
+ * @brief EncodeVertexElementArray Write the same element of count consecutive
+ *   vertices. Raw arrays which are already tightly packed take a single copy.
+ *
+ * @param src First element, as floats; nullptr zeroes the destination.
+ * @param src_stride Distance in bytes between two source elements.
+ * @param dst Destination, of count * size_bytes bytes.
+ */
+void EncodeVertexElementArray(VertexElementEncoding encoding, const void *src,
+                              uint32_t src_stride, uint32_t count, void *dst,
+                              uint32_t size_bytes);
+
+/**
+ * @brief GetPositionDequantisation Offset and scale which bring positions
+ *   quantised within the given box back to model space. The scale is the
+ *   same along every axis, so that normals can still go through the
+ *   inverse transpose of a matrix with the dequantisation folded in.
+ *
+ * @return Offset in xyz, scale in w.
+ */
+glm::vec4 GetPositionDequantisation(const glm::vec3 &aabb_min,
+                                    const glm::vec3 &aabb_max);
+glm::mat4 GetPositionDequantisationMatrix(const glm::vec4 &dequant);
+
+void QuantisePosition(const glm::vec3 &pos, const glm::vec4 &dequant,
+                      uint16_t *dst);
+glm::vec3 DequantisePosition(const uint16_t *src, const glm::vec4 &dequant);
+
+} // namespace vks
+
+#endif
@@ -19,6 +19,23 @@ enum class VertexElementType : uint8_t {
   num_items
 }; // enum class VertexElementType
 
+// How an element is stored. The values are mirrored by the shaders, which
+// get the encoding of every element type as a specialisation constant
+enum class VertexElementEncoding : uint8_t {
+  // As laid out in Vertex, in the format of the element
+  RAW = 0U,
+  // Unit vectors mapped onto an octahedron; R8G8_SNORM and R16G16_SNORM
+  OCTAHEDRAL_16,
+  OCTAHEDRAL_32,
+  // Two component vectors; R16G16_SFLOAT and R16G16_UNORM. The latter only
+  // holds values in [0, 1], anything else is clamped
+  HALF_FLOAT,
+  UNORM_16,
+  // Positions relative to the bounding box of the model, R16G16B16A16_UNORM
+  AABB_UNORM_16,
+  num_items
+}; // enum class VertexElementEncoding
+
 struct VertexElementTypeHash {
   template <typename T> std::size_t operator()(T t) const {
     return static_cast<std::size_t>(t);
@@ -28,10 +45,13 @@ struct VertexElementTypeHash {
 struct VertexElement {
   VertexElement();
   VertexElement(VertexElementType Type, uint32_t Size_bytes, VkFormat Format);
+  // Size and format follow from the encoding
+  VertexElement(VertexElementType Type, VertexElementEncoding Encoding);
 
   VertexElementType type;
   uint32_t size_bytes;
   VkFormat format;
+  VertexElementEncoding encoding;
 }; // struct VertexElement
 
 class VertexSetup {
@@ -56,12 +76,16 @@ public:
   uint32_t GetElementSize(uint32_t idx) const;
   uint32_t GetElementSize(VertexElementType element) const;
 
+  VertexElementEncoding GetElementEncoding(uint32_t idx) const;
+  VertexElementEncoding GetElementEncoding(VertexElementType element) const;
+
   bool HasElement(VertexElementType element) const;
 
 private:
   struct LayoutElementData {
     uint32_t size_bytes;
     VkFormat format;
+    VertexElementEncoding encoding;
   };
   std::unordered_map<VertexElementType, LayoutElementData,
                      VertexElementTypeHash>
@@ -0,0 +1,48 @@
+#ifndef VKS_VERTEXWELD
+#define VKS_VERTEXWELD
+
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <model.h>
+
+namespace vks {
+
+/**
+ * @brief Open addressing table which gives every distinct vertex an index,
+ *        used to weld the corners of the faces of a mesh together.
+ */
+class VertexWeldTable {
+public:
+  /**
+   * @param expected_count Number of distinct vertices expected, so that the
+   *   table does not have to grow while being filled.
+   */
+  explicit VertexWeldTable(uint32_t expected_count = 0U);
+
+  /**
+   * @brief FindOrInsert Look a vertex up, adding it if it is not there yet.
+   *
+   * @return Index of the vertex, in the order distinct vertices were added.
+   */
+  uint32_t FindOrInsert(const Vertex &vertex);
+
+  uint32_t num_vertices() const {
+    return static_cast<uint32_t>(vertices_.size());
+  }
+  // The distinct vertices, by index
+  const eastl::vector<Vertex> &vertices() const { return vertices_; }
+
+private:
+  // Index of the vertex in each slot plus one; zero marks an empty slot
+  eastl::vector<uint32_t> slots_;
+  // Hash of the vertex in each slot, to skip most of the full comparisons
+  eastl::vector<uint32_t> slot_hashes_;
+  eastl::vector<Vertex> vertices_;
+
+  void Rehash(uint32_t num_slots);
+
+}; // class VertexWeldTable
+
+} // namespace vks
+
+#endif
@@ -47,8 +47,6 @@ public:
     return rendering_finished_semaphore_;
   }
 
-  VkCommandBuffer copy_cmd_buff() const { return copy_cmd_buff_; }
-
 private:
   // Create application-wide Vulkan instance
   void CreateInstance();
@@ -76,7 +74,6 @@ private:
   eastl::vector<VkCommandBuffer> pre_present_cmd_buffers_;
   eastl::vector<VkCommandBuffer> post_present_cmd_buffers_;
   eastl::vector<VkCommandBuffer> graphics_queue_cmd_buffers_;
-  VkCommandBuffer copy_cmd_buff_;
   VkDebugReportCallbackEXT callback_;
   VkSurfaceKHR surface_;
   VulkanSwapChain swapchain_;
@@ -2,6 +2,7 @@
 #define VKS_VULKANBUFFER
 
 #include <vulkan/vulkan.h>
+#include <vulkan_memory_allocator.h>
 
 namespace vks {
 
@@ -11,9 +12,10 @@ struct VulkanBufferInitInfo {
   VulkanBufferInitInfo();
 
   VkBufferUsageFlags buffer_usage_flags;
-  VkMemoryPropertyFlags memory_property_flags;
+  // Decides where the buffer lives; GPU_ONLY buffers are filled through the
+  // uploader of the device
+  MemoryUsage memory_usage;
   VkDeviceSize size;
-  VkCommandBuffer cmd_buff;
 };
 
 class VulkanBuffer {
@@ -25,20 +27,48 @@ public:
 
   void Shutdown(const VulkanDevice &device);
 
-  VkResult Map(const VulkanDevice &device, void **mapped_memory,
-               VkDeviceSize size = VK_WHOLE_SIZE,
-               VkDeviceSize offset = 0U) const;
+  // Host visible buffers are mapped for their whole life; this is their
+  // address, null for the other ones
+  uint8_t *mapped() const { return allocation_.mapped; };
+  template <typename T> T *MappedAs(VkDeviceSize offset = 0U) const {
+    return reinterpret_cast<T *>(allocation_.mapped + offset);
+  };
+
+  /**
+   * @brief Write Copy data into a host visible buffer and flush it.
+   */
+  void Write(const VulkanDevice &device, const void *data, VkDeviceSize size,
+             VkDeviceSize offset = 0U) const;
+  template <typename T>
+  void WriteValue(const VulkanDevice &device, const T &value,
+                  VkDeviceSize offset = 0U) const {
+    Write(device, &value, sizeof(T), offset);
+  };
 
-  void Unmap(const VulkanDevice &device) const;
+  /**
+   * @brief Flush Make writes through mapped() visible to the device; only
+   *   does something on non-coherent memory.
+   */
+  void Flush(const VulkanDevice &device, VkDeviceSize size = VK_WHOLE_SIZE,
+             VkDeviceSize offset = 0U) const;
+  /**
+   * @brief Invalidate Make writes of the device visible through mapped();
+   *   only does something on non-coherent memory.
+   */
+  void Invalidate(const VulkanDevice &device,
+                  VkDeviceSize size = VK_WHOLE_SIZE,
+                  VkDeviceSize offset = 0U) const;
 
   const VkBuffer &buffer() const { return buffer_; };
-  const VkDeviceMemory &memory() const { return memory_; };
+  const VkDeviceMemory &memory() const { return allocation_.memory; };
+  const VulkanAllocation &allocation() const { return allocation_; };
   const VkDeviceSize size() const { return size_; };
   const VkDescriptorBufferInfo &descriptor() const { return descriptor_; };
   VkDeviceSize alignment() const { return alignment_; };
   VkBufferUsageFlags buffer_usage_flags() const { return buffer_usage_flags_; };
+  MemoryUsage memory_usage() const { return memory_usage_; };
   VkMemoryPropertyFlags memory_property_flags() const {
-    return memory_property_flags_;
+    return allocation_.memory_property_flags;
   };
 
   VkDescriptorBufferInfo
@@ -47,12 +77,12 @@ public:
 
 private:
   VkBuffer buffer_;
-  VkDeviceMemory memory_;
+  VulkanAllocation allocation_;
   VkDeviceSize size_;
   VkDescriptorBufferInfo descriptor_;
   VkDeviceSize alignment_;
   VkBufferUsageFlags buffer_usage_flags_;
-  VkMemoryPropertyFlags memory_property_flags_;
+  MemoryUsage memory_usage_;
   bool initialised_;
 
 }; // class VulkanBuffer
@@ -3,6 +3,8 @@
 
 #include <cstdint>
 #include <vulkan/vulkan.h>
+#include <vulkan_memory_allocator.h>
+#include <vulkan_uploader.h>
 
 namespace vks {
 
@@ -24,19 +26,46 @@ public:
   const VulkanQueue &graphics_queue() const { return graphics_queue_; };
   const VulkanQueue &present_queue() const { return present_queue_; };
   const VulkanQueue &compute_queue() const { return compute_queue_; };
+  // A queue of its own when the device has one, the graphics one otherwise
+  const VulkanQueue &transfer_queue() const { return transfer_queue_; };
   const VkPhysicalDeviceProperties physical_properties() const {
     return physical_properties_;
   };
+  const VkPhysicalDeviceFeatures &physical_features() const {
+    return physical_features_;
+  };
+  const VkPhysicalDeviceDescriptorIndexingPropertiesEXT &
+  indexing_properties() const {
+    return indexing_properties_;
+  };
   VkFormat depth_format() const { return depth_format_; };
   uint32_t GetGraphicsQueueIndex() const { return graphics_queue_.index; };
   uint32_t GetPresentQueueIndex() const { return present_queue_.index; };
   uint32_t GetComputeQueueIndex() const { return compute_queue_.index; };
+  uint32_t GetTransferQueueIndex() const { return transfer_queue_.index; };
+  bool HasDedicatedTransferQueue() const {
+    return transfer_queue_.index != graphics_queue_.index;
+  };
 
   // Get an index to the a type of memory which respects as close as possible
   // the properties and type passed as parameters
   uint32_t GetMemoryType(uint32_t type_bits,
                          VkMemoryPropertyFlags properties_flags) const;
 
+  // Device memory of every buffer and image comes from it
+  VulkanMemoryAllocator &allocator() const { return allocator_; };
+  // Initial data of device local buffers and images goes through it
+  VulkanUploader &uploader() const { return uploader_; };
+
+  // Shared by the pipelines of every material. It starts with the data saved
+  // by the previous run when that was made by the same device and driver,
+  // and its data is saved again on Shutdown
+  VkPipelineCache pipeline_cache() const { return pipeline_cache_; };
+  // Whether the pipeline cache started with the data of a previous run
+  bool IsPipelineCacheWarm() const { return pipeline_cache_warm_; };
+  // Account for the time a pipeline took to create, reported on Shutdown
+  void AddPipelineCreationTime(double milliseconds) const;
+
   // Whether the logical device has been created and/or is still valid
   bool IsDeviceVaild() const { return device_ != VK_NULL_HANDLE; };
 
@@ -50,10 +79,18 @@ private:
   VulkanQueue graphics_queue_;
   VulkanQueue present_queue_;
   VulkanQueue compute_queue_;
+  VulkanQueue transfer_queue_;
   VkPhysicalDeviceProperties physical_properties_;
   VkPhysicalDeviceFeatures physical_features_;
+  VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexing_properties_;
   VkPhysicalDeviceMemoryProperties physical_memory_properties_;
   VkFormat depth_format_;
+  mutable VulkanMemoryAllocator allocator_;
+  mutable VulkanUploader uploader_;
+  VkPipelineCache pipeline_cache_;
+  bool pipeline_cache_warm_;
+  mutable uint32_t num_created_pipelines_;
+  mutable double pipeline_creation_ms_;
 
   // Whether a physical device supports the necessary features for the
   // application
@@ -61,6 +98,11 @@ private:
                                 struct QueueFamilyIndices &queue_families,
                                 VkSurfaceKHR surface) const;
 
+  // Create the pipeline cache from the data on disk, if it is valid
+  void CreatePipelineCache();
+  // Write the data of the pipeline cache to disk for the next run
+  void SavePipelineCache() const;
+
 }; // class VulkanDevice
 
 } // namespace vks
@@ -4,6 +4,7 @@
 #include <EASTL/vector.h>
 #include <cstdint>
 #include <vulkan/vulkan.h>
+#include <vulkan_memory_allocator.h>
 
 namespace vks {
 
@@ -12,7 +13,7 @@ class VulkanDevice;
 enum class CreateView : uint8_t { YES = 0U, NO };
 
 struct VulkanImageInitInfo {
-  VkMemoryPropertyFlags memory_properties_flags;
+  MemoryUsage memory_usage;
   VkImageCreateInfo create_info;
   CreateView create_view;
   VkImageViewType view_type;
@@ -37,12 +38,17 @@ public:
 
   void Shutdown(const VulkanDevice &device);
 
+  // Host visible images stay mapped, so this only returns their address
+  VkResult Map(const VulkanDevice &device, void **mapped_memory) const;
+  void Unmap(const VulkanDevice &device) const;
+
   const VkImage &image() const { return image_; };
-  const VkDeviceMemory &memory() const { return memory_; };
+  const VkDeviceMemory &memory() const { return allocation_.memory; };
   const VkDeviceSize size() const { return size_; };
   const VkImageView view() const { return default_view_; };
+  MemoryUsage memory_usage() const { return memory_usage_; }
   const VkMemoryPropertyFlags &memory_properties_flags() const {
-    return memory_properties_flags_;
+    return allocation_.memory_property_flags;
   }
   const VkImageLayout layout() const { return layout_; };
   uint32_t mip_levels() const { return mip_levels_; };
@@ -62,11 +68,11 @@ public:
 private:
   VkImage image_;
   bool owns_image_;
-  VkDeviceMemory memory_;
+  VulkanAllocation allocation_;
   VkDeviceSize size_;
   VkImageView default_view_;
   mutable eastl::vector<VkImageView> additional_views_;
-  VkMemoryPropertyFlags memory_properties_flags_;
+  MemoryUsage memory_usage_;
   VkImageLayout layout_;
   VkExtent3D extent_;
   uint32_t mip_levels_;
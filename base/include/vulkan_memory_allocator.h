@@ -0,0 +1,167 @@
+#ifndef VKS_VULKANMEMORYALLOCATOR
+#define VKS_VULKANMEMORYALLOCATOR
+
+#include <EASTL/unique_ptr.h>
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <mutex>
+#include <vulkan/vulkan.h>
+
+namespace vks {
+
+// Size of the memory blocks which resources are sub-allocated from, unless
+// the heap is too small for it
+extern const VkDeviceSize kVulkanMemoryBlockSize;
+// Smallest range handed out from a block
+extern const VkDeviceSize kVulkanMemoryMinAllocSize;
+
+// How a resource is accessed; the memory type is picked from it
+enum class MemoryUsage : uint8_t {
+  // Only accessed by the GPU; filled through a staging copy
+  GPU_ONLY = 0U,
+  // Written by the CPU, read by the GPU; in device local memory when the
+  // host can see some
+  CPU_TO_GPU,
+  // Written by the GPU, read back by the CPU
+  GPU_TO_CPU,
+  // Staging memory
+  CPU_ONLY
+};
+
+// Whether a resource is linear (buffers, linear images) or optimally tiled;
+// the two can't share a page of bufferImageGranularity
+enum class AllocationTiling : uint8_t { LINEAR = 0U, OPTIMAL };
+
+struct VulkanMemoryBlock;
+
+struct VulkanAllocation {
+  VulkanAllocation();
+
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  // Host address of the allocation, which stays mapped; null if the memory
+  // is not host visible
+  uint8_t *mapped;
+  uint32_t memory_type;
+  VkMemoryPropertyFlags memory_property_flags;
+  // Null for allocations with their own device memory
+  VulkanMemoryBlock *block;
+  // Log2 of the size of the range taken from the block
+  uint32_t order;
+}; // struct VulkanAllocation
+
+struct VulkanMemoryStats {
+  VulkanMemoryStats();
+
+  uint32_t num_blocks;
+  uint32_t num_dedicated;
+  uint32_t num_allocations;
+  // Device memory allocated, between blocks and dedicated allocations
+  VkDeviceSize reserved_bytes;
+  // Taken from blocks, rounded up to ranges, plus dedicated allocations
+  VkDeviceSize allocated_bytes;
+  // Asked for by the resources
+  VkDeviceSize requested_bytes;
+  VkDeviceSize free_bytes;
+  VkDeviceSize largest_free_range;
+  uint32_t num_free_ranges;
+}; // struct VulkanMemoryStats
+
+/**
+ * @brief Sub-allocates resources from large blocks of device memory, one set
+ *        of blocks per memory type, with a buddy allocator per block. Ranges
+ *        are powers of two aligned to their size, which honours any
+ *        alignment up to it. Resources bigger than half a block get their own
+ *        device memory. Host visible blocks are mapped for their whole life.
+ *        Safe to call from any thread.
+ */
+class VulkanMemoryAllocator {
+public:
+  VulkanMemoryAllocator();
+  ~VulkanMemoryAllocator();
+
+  void Init(VkDevice device, const VkPhysicalDeviceMemoryProperties &props,
+            VkDeviceSize buffer_image_granularity,
+            VkDeviceSize non_coherent_atom_size);
+
+  /**
+   * @brief Shutdown Free every block; allocations still alive are reported.
+   */
+  void Shutdown();
+
+  /**
+   * @brief Allocate Find memory for a resource, falling back to other
+   *   suitable memory types when one runs out.
+   *
+   * @return Whether any memory could be found.
+   */
+  bool Allocate(const VkMemoryRequirements &requirements, MemoryUsage usage,
+                AllocationTiling tiling, VulkanAllocation &allocation);
+  void Free(VulkanAllocation &allocation);
+
+  /**
+   * @brief Flush Make host writes to part of a mapped allocation visible to
+   *   the device. Nothing to do on coherent memory.
+   *
+   * @param offset Relative to the allocation.
+   */
+  void Flush(const VulkanAllocation &allocation, VkDeviceSize offset = 0U,
+             VkDeviceSize size = VK_WHOLE_SIZE) const;
+  /**
+   * @brief Invalidate Make device writes to part of a mapped allocation
+   *   visible to the host. Nothing to do on coherent memory.
+   *
+   * @param offset Relative to the allocation.
+   */
+  void Invalidate(const VulkanAllocation &allocation, VkDeviceSize offset = 0U,
+                  VkDeviceSize size = VK_WHOLE_SIZE) const;
+
+  /**
+   * @brief FindMemoryType Pick the memory type that best fits a usage.
+   *
+   * @param excluded_types Bit mask of the types not to consider.
+   *
+   * @return Index of the memory type, or UINT32_MAX if none fits.
+   */
+  uint32_t FindMemoryType(uint32_t type_bits, MemoryUsage usage,
+                          uint32_t excluded_types = 0U) const;
+
+  VulkanMemoryStats GetStats() const;
+  /**
+   * @brief LogReport Log the use of every block and how fragmented the free
+   *   memory is.
+   */
+  void LogReport() const;
+
+private:
+  VkDevice device_;
+  VkPhysicalDeviceMemoryProperties memory_properties_;
+  // Whether linear and optimal resources need blocks of their own
+  bool separate_tilings_;
+  VkDeviceSize non_coherent_atom_size_;
+  // Block size of every memory heap
+  eastl::vector<VkDeviceSize> heap_block_sizes_;
+  eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>> blocks_;
+  uint32_t num_dedicated_;
+  VkDeviceSize dedicated_bytes_;
+  mutable std::mutex mutex_;
+
+  VulkanMemoryBlock *CreateBlock(uint32_t memory_type, AllocationTiling tiling);
+  void DestroyBlock(VulkanMemoryBlock *block);
+  bool AllocateDedicated(VkDeviceSize size, uint32_t memory_type,
+                         VulkanAllocation &allocation);
+  bool AllocateFromBlocks(VkDeviceSize size, VkDeviceSize alignment,
+                          uint32_t memory_type, AllocationTiling tiling,
+                          VulkanAllocation &allocation);
+  // Map the whole memory if it is host visible
+  uint8_t *MapMemory(VkDeviceMemory memory, uint32_t memory_type) const;
+  VkMappedMemoryRange GetMappedRange(const VulkanAllocation &allocation,
+                                     VkDeviceSize offset,
+                                     VkDeviceSize size) const;
+
+}; // class VulkanMemoryAllocator
+
+} // namespace vks
+
+#endif
@@ -43,6 +43,16 @@ public:
   const VulkanImage *image() const { return image_.get(); };
   VulkanImage *image() { return image_.get(); };
 
+  /**
+   * @brief SwapImage Replace the image of the texture, e.g. with one holding
+   *        more or fewer mip levels. Descriptors written before keep the
+   *        view of the old image.
+   *
+   * @return The old image, for the caller to shut down once nothing uses it.
+   */
+  eastl::unique_ptr<VulkanImage>
+  SwapImage(eastl::unique_ptr<VulkanImage> image);
+
 private:
   eastl::string name_;
   eastl::unique_ptr<VulkanImage> image_;
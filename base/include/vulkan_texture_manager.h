@@ -4,16 +4,77 @@
 #include <vulkan/vulkan.h>
 #include <map>
 #include <vulkan_texture.h>
+#include <vulkan_uploader.h>
 #include <EASTL/unique_ptr.h>
 #include <EASTL/vector.h>
 #include <EASTL/hash_map.h>
 #include <EASTL/string.h>
+#include <gli/texture2d.hpp>
 
 namespace vks {
 
 class VulkanDevice;
+enum class TextureCompression : uint8_t;
 
 extern const eastl::string kBaseAssetsPath;
+// Mip levels no bigger than this on either side stay resident at all times
+extern const uint32_t kStreamingMinResidentSize;
+// Memory the levels of the streamed textures may take, unless set otherwise
+extern const VkDeviceSize kDefaultTextureBudget;
+// Entries of the bindless texture table, unless the device supports fewer
+extern const uint32_t kMaxTableTextures;
+
+// A 2D texture to load along with others; see LoadTextures
+struct TextureLoadRequest {
+  TextureLoadRequest();
+  TextureLoadRequest(const eastl::string &Filename, VkFormat Format,
+                     TextureCompression Compression);
+
+  eastl::string filename;
+  // Format of the decoded data of PNG files; other files carry their own
+  VkFormat format;
+  // How PNG files are cooked, if the device samples the compressed formats
+  TextureCompression compression;
+}; // struct TextureLoadRequest
+
+// A texture of a TextureLoadBatch, on its way from its file to its image
+struct TextureDecodeJob {
+  TextureDecodeJob();
+
+  eastl::string filename;
+  VkFormat format;
+  TextureCompression compression;
+  bool is_png;
+  // PNG files are cooked unless their cooked version exists already
+  eastl::string cooked_path;
+  bool cook;
+  bool saved;
+  // Room the decoded data may take, and where it goes in the staging memory
+  VkDeviceSize staging_size;
+  VkDeviceSize staging_offset;
+  // Set by the decode
+  bool decoded;
+  uint32_t width;
+  uint32_t height;
+  uint32_t mip_levels;
+  eastl::vector<VkBufferImageCopy> copy_regions;
+  // First level which was staged, and the bytes of the staged levels; the
+  // ones before are streamed from source
+  uint32_t base_level;
+  VkDeviceSize staged_size;
+  gli::texture2d source;
+}; // struct TextureDecodeJob
+
+// Textures loaded together, see VulkanTextureManager::LoadTextures
+struct TextureLoadBatch {
+  TextureLoadBatch();
+
+  eastl::vector<TextureDecodeJob> jobs;
+  // Staging memory the jobs need between them
+  VkDeviceSize staging_size;
+  // Reserved by StageTextures and released by UploadTextures
+  StagingRegion staging;
+}; // struct TextureLoadBatch
 
 class VulkanTextureManager {
  public:
@@ -39,6 +100,65 @@ class VulkanTextureManager {
       const VkSampler aniso_sampler,
       const VkImageUsageFlags img_flags = VK_IMAGE_USAGE_SAMPLED_BIT);
 
+  /**
+   * @brief LoadTextures Load several 2D textures at once, PNG files or the
+   *        ones Load2DTexture takes: InspectTextures, StageTextures,
+   *        DecodeTextures then UploadTextures. The files are decoded on the
+   *        thread pool straight into staging memory, so that only the
+   *        recording of the copies is left to the thread owning the device.
+   *        Only the levels up to kStreamingMinResidentSize are uploaded; the
+   *        larger ones are kept in system memory and streamed in on demand,
+   *        see RequestTextureDetail and UpdateResidency.
+   */
+  void LoadTextures(
+      const VulkanDevice &device,
+      const eastl::vector<TextureLoadRequest> &requests,
+      const VkSampler aniso_sampler,
+      const VkImageUsageFlags img_flags = VK_IMAGE_USAGE_SAMPLED_BIT);
+
+  /**
+   * @brief InspectTextures Find out, on the thread pool, how much staging
+   *        memory the files of several 2D textures may need once decoded,
+   *        without decoding them. PNG files are decoded from their cooked
+   *        version, as Load2DPNGTexture does, and cooked by the decode when
+   *        it is missing. The files which can't be found are skipped with a
+   *        warning. Nothing is created, and the device is only asked what it
+   *        supports, so this is safe to call from any thread.
+   */
+  void InspectTextures(const VulkanDevice &device,
+                       const eastl::vector<TextureLoadRequest> &requests,
+                       TextureLoadBatch &batch) const;
+
+  /**
+   * @brief StageTextures Reserve the staging memory of inspected textures;
+   *        only on the thread owning the device.
+   */
+  void StageTextures(const VulkanDevice &device,
+                     TextureLoadBatch &batch) const;
+
+  /**
+   * @brief DecodeTextures Decode staged textures on the thread pool, straight
+   *        into their staging memory. Safe to call from any thread.
+   */
+  void DecodeTextures(TextureLoadBatch &batch) const;
+
+  /**
+   * @brief UploadTextures Create the images of decoded textures, record the
+   *        copies from their staging memory and release it. Textures which
+   *        can't be decoded are skipped with a warning, and so are the ones
+   *        which were loaded meanwhile. The streamed textures keep their
+   *        larger levels in system memory.
+   */
+  void UploadTextures(
+      const VulkanDevice &device,
+      TextureLoadBatch &batch,
+      const VkSampler aniso_sampler,
+      const VkImageUsageFlags img_flags = VK_IMAGE_USAGE_SAMPLED_BIT);
+
+  // Release the staging memory of textures which won't be uploaded after all
+  void DiscardTextures(const VulkanDevice &device,
+                       TextureLoadBatch &batch) const;
+
   void Create2DTextureFromData(
       const VulkanDevice &device,
       const eastl::string &name,
@@ -82,10 +202,19 @@ class VulkanTextureManager {
       const eastl::string &name,
       VulkanTexture **texture);
 
+  /**
+   * @brief Load2DPNGTexture Load a PNG file with a full mip chain, from its
+   *        cooked KTX version next to it. The cooked version is named after
+   *        the content of the file, the format and the compression, and is
+   *        cooked and written first if it doesn't exist yet; see
+   *        CookPNGTexture. Textures are cooked uncompressed when the device
+   *        can't sample the formats the compression may pick.
+   */
   void Load2DPNGTexture(
       const VulkanDevice &device,
       const eastl::string &filename,
       VkFormat format,
+      TextureCompression compression,
       VulkanTexture **texture,
       const VkSampler aniso_sampler,
       const VkImageUsageFlags img_flags = VK_IMAGE_USAGE_SAMPLED_BIT);
@@ -93,13 +222,103 @@ class VulkanTextureManager {
   // Returns nullptr if texture isn't present
   VulkanTexture *GetTextureByName(const eastl::string &name);
 
- private:
-  VkCommandBuffer cmd_buffer_;
+  /**
+   * @brief RequestTextureDetail Ask for the mip levels a texture needs to
+   *        cover screen_size pixels on screen, as if it was mapped once over
+   *        that span. The requests are gathered until the next
+   *        UpdateResidency, which keeps the most detailed one. Textures which
+   *        aren't streamed are left alone.
+   */
+  void RequestTextureDetail(const VulkanTexture *texture, float screen_size);
+
+  /**
+   * @brief UpdateResidency Once per frame, swap in the images whose levels
+   *        finished uploading, start uploading the levels requested since
+   *        the last update, the textures lacking the most first, and evict
+   *        the larger levels of the textures unused for the longest time
+   *        while the budget is exceeded. Images are recreated with the new
+   *        levels and swapped in when their upload is complete, so the frame
+   *        never waits for them; their entries in the texture table follow.
+   *        The caller must make sure the GPU doesn't use the textures
+   *        meanwhile.
+   */
+  void UpdateResidency(const VulkanDevice &device);
+
+  void set_residency_budget(VkDeviceSize budget) { residency_budget_ = budget; }
+  VkDeviceSize residency_budget() const { return residency_budget_; }
 
+  /**
+   * @brief GetTableIndex Entry of a 2D texture in the bindless texture table,
+   *        which shaders sample through the texture indices of the
+   *        materials. Textures get an entry the first time they are asked
+   *        for; entries are written while the table may be bound, as long as
+   *        the GPU doesn't use them yet.
+   */
+  uint32_t GetTableIndex(const VulkanDevice &device,
+                         const VulkanTexture *texture);
+
+  // Layout of the texture table, for the pipeline layouts which sample it
+  VkDescriptorSetLayout table_layout() const { return table_layout_; }
+  VkDescriptorSet table_set() const { return table_set_; }
+  // Entries of the texture table, which the shaders size their array with
+  uint32_t table_size() const { return table_size_; }
+
+ private:
   typedef eastl::hash_map<eastl::string,
     eastl::unique_ptr<VulkanTexture>> NameTexMap;
   NameTexMap textures_;
 
+  // A texture whose larger mip levels are streamed in on demand. Its image
+  // holds the levels from resident_base on
+  struct StreamedTexture {
+    StreamedTexture();
+
+    VulkanTexture *texture;
+    // Every level, to upload the ones which become resident
+    gli::texture2d source;
+    VkImageUsageFlags img_usage_flags;
+    // The levels from min_base on are never evicted
+    uint32_t min_base;
+    uint32_t resident_base;
+    // Most detailed level asked for since the last update, and the last
+    // update the texture was asked for at all
+    uint32_t requested_base;
+    uint64_t last_used_frame;
+    // Image being uploaded to replace the current one, if any
+    eastl::unique_ptr<VulkanImage> pending_image;
+    uint32_t pending_base;
+    UploadTicket pending_ticket;
+  }; // struct StreamedTexture
+
+  eastl::vector<eastl::unique_ptr<StreamedTexture>> streamed_;
+  eastl::hash_map<const VulkanTexture *, uint32_t> streamed_idxs_;
+  VkDeviceSize residency_budget_;
+  uint64_t residency_frame_;
+
+  // Bindless table of the textures the materials sample, see GetTableIndex
+  VkDescriptorSetLayout table_layout_;
+  VkDescriptorPool table_pool_;
+  VkDescriptorSet table_set_;
+  uint32_t table_size_;
+  eastl::hash_map<const VulkanTexture *, uint32_t> table_idxs_;
+
+  void WriteTableEntry(const VulkanDevice &device,
+                       const VulkanTexture &texture, uint32_t index) const;
+
+  // Bytes of the levels the streamed textures hold, or will once their
+  // uploads are done
+  VkDeviceSize GetPlannedResidentSize() const;
+
+  // Start uploading a new image holding the levels of a texture from base on
+  void StreamLevels(const VulkanDevice &device, StreamedTexture &streamed,
+                    uint32_t base);
+
+  // Drop the larger levels of the textures unused this frame, the least
+  // recently used first, until bytes are freed or there is nothing left
+  // to drop
+  VkDeviceSize EvictUnusedLevels(const VulkanDevice &device,
+                                 VkDeviceSize bytes);
+
   void CreateTexture(
       const VulkanDevice &device,
       const eastl::string &name,
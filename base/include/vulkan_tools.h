@@ -145,6 +145,10 @@ void SetLayoutAndWrite(uint32_t binding, VkDescriptorType descriptor_type,
 
 bool DoesFileExist(const std::string &name);
 
+// Move a file written aside over its final path, so that readers never see
+// it half written. The file written aside is removed if that fails
+bool ReplaceFile(const std::string &tmp_path, const std::string &path);
+
 bool Replace(eastl::string &str, const eastl::string &from,
              const eastl::string &to);
 
@@ -0,0 +1,198 @@
+#ifndef VKS_VULKANUPLOADER
+#define VKS_VULKANUPLOADER
+
+#include <EASTL/vector.h>
+#include <cstdint>
+#include <mutex>
+#include <vulkan/vulkan.h>
+#include <vulkan_buffer.h>
+
+namespace vks {
+
+class VulkanDevice;
+class VulkanImage;
+
+// Size of the persistently mapped staging ring
+extern const VkDeviceSize kStagingRingSize;
+// Batches of copies which can be in flight at once
+extern const uint32_t kUploadMaxBatches;
+
+// Identifies a batch of uploads; batches complete in order, so a ticket is
+// complete once every earlier one is
+typedef uint64_t UploadTicket;
+
+// Staging memory reserved for the data of an upload
+struct StagingRegion {
+  StagingRegion();
+
+  VkBuffer buffer;
+  VkDeviceSize offset;
+  // Where the data goes, size bytes of it
+  uint8_t *mapped;
+  VkDeviceSize size;
+}; // struct StagingRegion
+
+/**
+ * @brief Uploads data to device local buffers and images. The data is copied
+ *        straight away into a mapped staging ring, and the copies are
+ *        recorded into a batch which is submitted as one, either on Flush or
+ *        once the ring or the batch is full. Batches run on the transfer
+ *        queue; when it is a queue of its own, the resources are released at
+ *        the end of the batch and acquired by the graphics queue once a
+ *        semaphore says the copies are done, so rendering already submitted
+ *        keeps going meanwhile. Either way the copies are visible to anything
+ *        submitted to the graphics queue after the Flush, so callers only
+ *        need to wait for a ticket when they read the data back on the CPU or
+ *        reuse what was written.
+ *        The state of the uploader is guarded, but batches are submitted to
+ *        the transfer and graphics queues, which the caller has to keep to
+ *        one thread.
+ */
+class VulkanUploader {
+public:
+  VulkanUploader();
+
+  void Init(const VulkanDevice &device);
+  void Shutdown(const VulkanDevice &device);
+
+  /**
+   * @brief UploadBuffer Copy data into a buffer.
+   *
+   * @return Ticket of the batch the copy is part of.
+   */
+  UploadTicket UploadBuffer(const VulkanDevice &device, VkBuffer dst,
+                            VkDeviceSize dst_offset, const void *data,
+                            VkDeviceSize size);
+
+  /**
+   * @brief UploadImage Copy data into an image, moving it from an undefined
+   *   layout to TRANSFER_DST_OPTIMAL and then to final_layout.
+   *
+   * @param regions Copies to perform, with buffer offsets relative to data.
+   *
+   * @return Ticket of the batch the copy is part of.
+   */
+  UploadTicket UploadImage(const VulkanDevice &device, VulkanImage &image,
+                           const void *data, VkDeviceSize size,
+                           const eastl::vector<VkBufferImageCopy> &regions,
+                           const VkImageSubresourceRange &subresource_range,
+                           VkImageLayout final_layout);
+
+  // Alignment the data of an image needs in the staging memory
+  VkDeviceSize GetImageCopyAlignment(const VulkanDevice &device) const;
+
+  /**
+   * @brief ReserveStaging Reserve staging memory of its own, outside of the
+   *   ring, for data which is written later and then copied with
+   *   UploadStagedImage. Only the writes may happen on other threads; the
+   *   memory stays reserved until ReleaseStaging.
+   */
+  StagingRegion ReserveStaging(const VulkanDevice &device, VkDeviceSize size);
+
+  /**
+   * @brief UploadStagedImage Same as UploadImage, from data already written
+   *   to staging memory of ReserveStaging; staging may be any part of it.
+   *
+   * @param regions Copies to perform, with buffer offsets relative to the
+   *   staging memory.
+   */
+  UploadTicket
+  UploadStagedImage(const VulkanDevice &device, const StagingRegion &staging,
+                    VulkanImage &image,
+                    const eastl::vector<VkBufferImageCopy> &regions,
+                    const VkImageSubresourceRange &subresource_range,
+                    VkImageLayout final_layout);
+
+  /**
+   * @brief ReleaseStaging Give back staging memory of ReserveStaging once
+   *   every copy from it is recorded; it is freed along with the batch of
+   *   the last ones. Memory which is never released is freed on Shutdown.
+   */
+  void ReleaseStaging(const VulkanDevice &device,
+                      const StagingRegion &staging);
+
+  /**
+   * @brief Flush Submit the copies recorded so far, if any.
+   *
+   * @return Ticket of the batch which was submitted, or of the last one if
+   *   there was nothing to submit.
+   */
+  UploadTicket Flush(const VulkanDevice &device);
+
+  bool IsComplete(const VulkanDevice &device, UploadTicket ticket);
+  // Flush if needed, then block until the batch is done on the GPU
+  void Wait(const VulkanDevice &device, UploadTicket ticket);
+
+  // Bytes copied and batches submitted since Init
+  uint64_t bytes_uploaded() const { return bytes_uploaded_; }
+  uint64_t num_batches() const { return num_batches_; }
+
+private:
+  struct UploadBatch {
+    UploadBatch();
+
+    VkCommandBuffer cmd_buff;
+    // Acquires the resources on the graphics queue after the semaphore is
+    // signalled; only used with a dedicated transfer queue
+    VkCommandBuffer acquire_cmd_buff;
+    VkSemaphore semaphore;
+    // Signalled once the resources are ready on the graphics queue
+    VkFence fence;
+    // Ownership transfers of the resources written by the batch
+    eastl::vector<VkBufferMemoryBarrier> buffer_barriers;
+    eastl::vector<VkImageMemoryBarrier> image_barriers;
+    // Position in the ring past the data of the batch
+    uint64_t ring_end;
+    // Staging buffers for uploads which did not fit the ring
+    eastl::vector<VulkanBuffer> overflow_buffers;
+    bool recording;
+  };
+
+  // Pools of the transfer and graphics families; the same pool when they
+  // are the same family
+  VkCommandPool cmd_pool_;
+  VkCommandPool acquire_cmd_pool_;
+  bool transfer_ownership_;
+  VulkanBuffer ring_;
+  // Positions in the ring only grow; the offset is the position modulo
+  // the size of the ring. Everything between tail and head is in use
+  uint64_t ring_head_;
+  uint64_t ring_tail_;
+  // The batch of a ticket is the one at the ticket modulo their number
+  eastl::vector<UploadBatch> batches_;
+  // Batches up to the submitted ticket are in flight or done; the next one
+  // is the batch being recorded, if any
+  UploadTicket submitted_ticket_;
+  UploadTicket completed_ticket_;
+  uint64_t bytes_uploaded_;
+  uint64_t num_batches_;
+  // Staging memory of ReserveStaging which hasn't been released yet
+  eastl::vector<VulkanBuffer> reserved_buffers_;
+  std::mutex mutex_;
+
+  // Reserve staging memory, which is either in the ring or in a new
+  // overflow buffer owned by the batch being recorded
+  StagingRegion Stage(const VulkanDevice &device, VkDeviceSize size,
+                      VkDeviceSize alignment);
+  // Record the copy of staged data to an image and its layout changes
+  void RecordImageCopy(const VulkanDevice &device,
+                       const StagingRegion &staging, VulkanImage &image,
+                       const eastl::vector<VkBufferImageCopy> &regions,
+                       const VkImageSubresourceRange &subresource_range,
+                       VkImageLayout final_layout);
+  // Start recording a batch unless one already is
+  UploadBatch &BeginBatch(const VulkanDevice &device);
+  void SubmitBatch(const VulkanDevice &device);
+  // Record the release of the resources of a batch by the transfer queue or
+  // their acquire by the graphics one
+  void RecordOwnershipBarriers(UploadBatch &batch, VkCommandBuffer cmd_buff,
+                               bool release);
+  // Release the batches which completed; if wait is set, block until the
+  // oldest one does
+  void RetireBatches(const VulkanDevice &device, bool wait);
+
+}; // class VulkanUploader
+
+} // namespace vks
+
+#endif
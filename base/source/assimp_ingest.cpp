@@ -0,0 +1,35 @@
+#include <assimp_ingest.h>
+
+namespace vks {
+
+AssimpMeshRange::AssimpMeshRange()
+    : ai_mesh(nullptr), first_vertex(0U), first_index(0U), idx_offset(0U) {}
+
+uint32_t CountAssimpMeshIndices(const aiMesh *ai_mesh) {
+  uint32_t num_indices = 0U;
+  for (uint32_t i = 0U; i < ai_mesh->mNumFaces; i++) {
+    num_indices += ai_mesh->mFaces[i].mNumIndices;
+  }
+
+  return num_indices;
+}
+
+void ReadAssimpTangents(const aiMesh *ai_mesh,
+                        eastl::vector<aiVector3D> &tangents) {
+  tangents.resize(ai_mesh->mNumVertices);
+  for (uint32_t i = 0U; i < ai_mesh->mNumVertices; i++) {
+    const aiVector3D &normal = ai_mesh->mNormals[i];
+    const aiVector3D &bitangent = ai_mesh->mBitangents[i];
+    aiVector3D tangent = ai_mesh->mTangents[i];
+
+    glm::vec3 cross = glm::cross(glm::vec3(normal.x, normal.y, normal.z),
+                                 glm::vec3(tangent.x, tangent.y, tangent.z));
+    if (glm::dot(cross, glm::vec3(bitangent.x, bitangent.y, bitangent.z)) <
+        0.0f) {
+      tangent = tangent * -1.0f;
+    }
+    tangents[i] = tangent;
+  }
+}
+
+} // namespace vks
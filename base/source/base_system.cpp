@@ -42,11 +42,17 @@ static void InitWindow() {
 }
 
 static void InitManagers() {
+  thread_pool()->Init();
   texture_manager()->Init(vulkan()->device());
   input_manager()->Init(window());
 }
 
 static void ShutdownManagers() {
+  // Background loads use the managers, so let the ones still queued skip
+  // their work and wait for the running ones before shutting anything down
+  model_manager()->CancelAsyncLoads();
+  thread_pool()->Shutdown();
+
   texture_manager()->Shutdown(vulkan()->device());
   model_manager()->Shutdown(vulkan()->device());
   material_manager()->Shutdown(vulkan()->device());
@@ -162,6 +168,11 @@ MeshesHeapManager *meshes_heap_manager() {
   return &meshes_heap_manager;
 }
 
+ThreadPool *thread_pool() {
+  static ThreadPool thread_pool_;
+  return &thread_pool_;
+}
+
 void Exit() { done_ = true; }
 
 } // namespace vks
@@ -0,0 +1,337 @@
+#include <EASTL/algorithm.h>
+#include <base_system.h>
+#include <block_compression.h>
+#include <cfloat>
+#include <cmath>
+#include <vulkan_tools.h>
+#if defined(__SSE__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VKS_BLOCKCOMPRESSION_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace vks {
+
+static const uint32_t kBlockTexels = 16U;
+
+// Texels of a block, one array per channel, in the range [0, 255]
+struct BlockTexels {
+  float channels[4U][kBlockTexels];
+}; // struct BlockTexels
+
+uint32_t GetBlockSize(BlockFormat format) {
+  return (format == BlockFormat::BC1 || format == BlockFormat::BC4) ? 8U
+                                                                    : 16U;
+}
+
+static void LoadBlock(const uint8_t *rgba, uint32_t width, uint32_t height,
+                      uint32_t block_x, uint32_t block_y,
+                      BlockTexels &texels) {
+  for (uint32_t y = 0U; y < 4U; ++y) {
+    uint32_t row = eastl::min(block_y * 4U + y, height - 1U);
+    for (uint32_t x = 0U; x < 4U; ++x) {
+      uint32_t col = eastl::min(block_x * 4U + x, width - 1U);
+      const uint8_t *texel =
+          rgba + (static_cast<size_t>(row) * width + col) * 4U;
+      for (uint32_t c = 0U; c < 4U; ++c) {
+        texels.channels[c][y * 4U + x] = static_cast<float>(texel[c]);
+      }
+    }
+  }
+}
+
+// Pick the palette entry nearest to every texel, comparing num_channels
+// channels from first_channel on; returns the squared error of the block
+static float FindNearestEntries(const BlockTexels &texels,
+                                uint32_t first_channel, uint32_t num_channels,
+                                const float palette[][4U],
+                                uint32_t num_entries,
+                                uint32_t indices[kBlockTexels]) {
+#ifdef VKS_BLOCKCOMPRESSION_SSE
+  // Four texels at a time, keeping the nearest entry of each in a lane
+  __m128 total = _mm_setzero_ps();
+  for (uint32_t group = 0U; group < kBlockTexels; group += 4U) {
+    __m128 best_dist = _mm_set1_ps(FLT_MAX);
+    __m128 best_idx = _mm_setzero_ps();
+    for (uint32_t e = 0U; e < num_entries; ++e) {
+      __m128 dist = _mm_setzero_ps();
+      for (uint32_t c = 0U; c < num_channels; ++c) {
+        __m128 diff =
+            _mm_sub_ps(_mm_loadu_ps(&texels.channels[first_channel + c][group]),
+                       _mm_set1_ps(palette[e][c]));
+        dist = _mm_add_ps(dist, _mm_mul_ps(diff, diff));
+      }
+      __m128 closer = _mm_cmplt_ps(dist, best_dist);
+      best_dist = _mm_min_ps(dist, best_dist);
+      best_idx =
+          _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps(static_cast<float>(e))),
+                    _mm_andnot_ps(closer, best_idx));
+    }
+    total = _mm_add_ps(total, best_dist);
+
+    float group_indices[4U];
+    _mm_storeu_ps(group_indices, best_idx);
+    for (uint32_t i = 0U; i < 4U; ++i) {
+      indices[group + i] = static_cast<uint32_t>(group_indices[i]);
+    }
+  }
+
+  float totals[4U];
+  _mm_storeu_ps(totals, total);
+  return totals[0U] + totals[1U] + totals[2U] + totals[3U];
+#else
+  float total = 0.f;
+  for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+    float best_dist = FLT_MAX;
+    for (uint32_t e = 0U; e < num_entries; ++e) {
+      float dist = 0.f;
+      for (uint32_t c = 0U; c < num_channels; ++c) {
+        float diff = texels.channels[first_channel + c][t] - palette[e][c];
+        dist += diff * diff;
+      }
+      if (dist < best_dist) {
+        best_dist = dist;
+        indices[t] = e;
+      }
+    }
+    total += best_dist;
+  }
+  return total;
+#endif
+}
+
+// The extremes are the endpoints, and the six values between them are
+// interpolated
+static void EncodeBC4Block(const BlockTexels &texels, uint32_t channel,
+                           uint8_t *block) {
+  const float *values = texels.channels[channel];
+  float min_value = values[0U];
+  float max_value = values[0U];
+  for (uint32_t t = 1U; t < kBlockTexels; ++t) {
+    min_value = eastl::min(min_value, values[t]);
+    max_value = eastl::max(max_value, values[t]);
+  }
+
+  uint32_t end0 = static_cast<uint32_t>(max_value);
+  uint32_t end1 = static_cast<uint32_t>(min_value);
+  block[0U] = static_cast<uint8_t>(end0);
+  block[1U] = static_cast<uint8_t>(end1);
+
+  // A flat block uses the first endpoint throughout
+  uint64_t bits = 0U;
+  if (end0 > end1) {
+    float palette[8U][4U];
+    palette[0U][0U] = static_cast<float>(end0);
+    palette[1U][0U] = static_cast<float>(end1);
+    for (uint32_t i = 2U; i < 8U; ++i) {
+      palette[i][0U] = static_cast<float>((8U - i) * end0 + (i - 1U) * end1) /
+                       7.f;
+    }
+
+    uint32_t indices[kBlockTexels];
+    FindNearestEntries(texels, channel, 1U, palette, 8U, indices);
+    for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+      bits |= static_cast<uint64_t>(indices[t]) << (t * 3U);
+    }
+  }
+
+  for (uint32_t b = 0U; b < 6U; ++b) {
+    block[2U + b] = static_cast<uint8_t>(bits >> (b * 8U));
+  }
+}
+
+static uint16_t PackRGB565(const float colour[3U]) {
+  uint32_t r = static_cast<uint32_t>(
+      eastl::min(eastl::max(colour[0U], 0.f), 255.f) * 31.f / 255.f + 0.5f);
+  uint32_t g = static_cast<uint32_t>(
+      eastl::min(eastl::max(colour[1U], 0.f), 255.f) * 63.f / 255.f + 0.5f);
+  uint32_t b = static_cast<uint32_t>(
+      eastl::min(eastl::max(colour[2U], 0.f), 255.f) * 31.f / 255.f + 0.5f);
+  return static_cast<uint16_t>((r << 11U) | (g << 5U) | b);
+}
+
+// Expanded the way the hardware does, replicating the top bits
+static void UnpackRGB565(uint16_t packed, float colour[4U]) {
+  uint32_t r = (packed >> 11U) & 31U;
+  uint32_t g = (packed >> 5U) & 63U;
+  uint32_t b = packed & 31U;
+  colour[0U] = static_cast<float>((r << 3U) | (r >> 2U));
+  colour[1U] = static_cast<float>((g << 2U) | (g >> 4U));
+  colour[2U] = static_cast<float>((b << 3U) | (b >> 2U));
+  colour[3U] = 255.f;
+}
+
+// Quantise a pair of endpoints, ordered so that the block is decoded with
+// four colours, and find the colour of every texel; returns the error
+static float FitBC1Endpoints(const BlockTexels &texels, const float end0[3U],
+                             const float end1[3U], uint16_t packed[2U],
+                             uint32_t indices[kBlockTexels]) {
+  packed[0U] = PackRGB565(end0);
+  packed[1U] = PackRGB565(end1);
+  if (packed[0U] < packed[1U]) {
+    eastl::swap(packed[0U], packed[1U]);
+  }
+
+  float palette[4U][4U];
+  UnpackRGB565(packed[0U], palette[0U]);
+  UnpackRGB565(packed[1U], palette[1U]);
+  for (uint32_t c = 0U; c < 3U; ++c) {
+    palette[2U][c] = (2.f * palette[0U][c] + palette[1U][c]) / 3.f;
+    palette[3U][c] = (palette[0U][c] + 2.f * palette[1U][c]) / 3.f;
+  }
+
+  // Equal endpoints would switch to three colours and transparent black, so
+  // only the first one is used
+  uint32_t num_entries = packed[0U] == packed[1U] ? 1U : 4U;
+  return FindNearestEntries(texels, 0U, 3U, palette, num_entries, indices);
+}
+
+// Endpoints along the principal axis of the colours, then refined with a
+// least squares fit to the colours picked for the texels
+static void EncodeBC1Block(const BlockTexels &texels, uint8_t *block) {
+  float mean[3U] = {0.f, 0.f, 0.f};
+  for (uint32_t c = 0U; c < 3U; ++c) {
+    for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+      mean[c] += texels.channels[c][t];
+    }
+    mean[c] /= static_cast<float>(kBlockTexels);
+  }
+
+  // rr, rg, rb, gg, gb, bb
+  float cov[6U] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+  for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+    float r = texels.channels[0U][t] - mean[0U];
+    float g = texels.channels[1U][t] - mean[1U];
+    float b = texels.channels[2U][t] - mean[2U];
+    cov[0U] += r * r;
+    cov[1U] += r * g;
+    cov[2U] += r * b;
+    cov[3U] += g * g;
+    cov[4U] += g * b;
+    cov[5U] += b * b;
+  }
+
+  // A few steps of power iteration find the principal axis
+  float axis[3U] = {1.f, 1.f, 1.f};
+  for (uint32_t iter = 0U; iter < 8U; ++iter) {
+    float next[3U] = {cov[0U] * axis[0U] + cov[1U] * axis[1U] +
+                          cov[2U] * axis[2U],
+                      cov[1U] * axis[0U] + cov[3U] * axis[1U] +
+                          cov[4U] * axis[2U],
+                      cov[2U] * axis[0U] + cov[4U] * axis[1U] +
+                          cov[5U] * axis[2U]};
+    float length = std::sqrt(next[0U] * next[0U] + next[1U] * next[1U] +
+                             next[2U] * next[2U]);
+    if (length < 1e-6f) {
+      break;
+    }
+    for (uint32_t c = 0U; c < 3U; ++c) {
+      axis[c] = next[c] / length;
+    }
+  }
+
+  float min_proj = 0.f;
+  float max_proj = 0.f;
+  for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+    float proj = 0.f;
+    for (uint32_t c = 0U; c < 3U; ++c) {
+      proj += (texels.channels[c][t] - mean[c]) * axis[c];
+    }
+    min_proj = eastl::min(min_proj, proj);
+    max_proj = eastl::max(max_proj, proj);
+  }
+
+  float end0[3U];
+  float end1[3U];
+  for (uint32_t c = 0U; c < 3U; ++c) {
+    end0[c] = mean[c] + axis[c] * max_proj;
+    end1[c] = mean[c] + axis[c] * min_proj;
+  }
+
+  uint16_t packed[2U];
+  uint32_t indices[kBlockTexels];
+  float error = FitBC1Endpoints(texels, end0, end1, packed, indices);
+
+  // Weight of the first endpoint in each of the four colours
+  static const float kWeights[4U] = {1.f, 0.f, 2.f / 3.f, 1.f / 3.f};
+  float ww = 0.f;
+  float wv = 0.f;
+  float vv = 0.f;
+  float wx[3U] = {0.f, 0.f, 0.f};
+  float vx[3U] = {0.f, 0.f, 0.f};
+  for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+    float w = kWeights[indices[t]];
+    float v = 1.f - w;
+    ww += w * w;
+    wv += w * v;
+    vv += v * v;
+    for (uint32_t c = 0U; c < 3U; ++c) {
+      wx[c] += w * texels.channels[c][t];
+      vx[c] += v * texels.channels[c][t];
+    }
+  }
+
+  float det = ww * vv - wv * wv;
+  if (std::fabs(det) > 1e-6f) {
+    for (uint32_t c = 0U; c < 3U; ++c) {
+      end0[c] = (vv * wx[c] - wv * vx[c]) / det;
+      end1[c] = (ww * vx[c] - wv * wx[c]) / det;
+    }
+
+    uint16_t refit_packed[2U];
+    uint32_t refit_indices[kBlockTexels];
+    if (FitBC1Endpoints(texels, end0, end1, refit_packed, refit_indices) <
+        error) {
+      packed[0U] = refit_packed[0U];
+      packed[1U] = refit_packed[1U];
+      eastl::copy(refit_indices, refit_indices + kBlockTexels, indices);
+    }
+  }
+
+  uint32_t bits = 0U;
+  for (uint32_t t = 0U; t < kBlockTexels; ++t) {
+    bits |= indices[t] << (t * 2U);
+  }
+  block[0U] = static_cast<uint8_t>(packed[0U]);
+  block[1U] = static_cast<uint8_t>(packed[0U] >> 8U);
+  block[2U] = static_cast<uint8_t>(packed[1U]);
+  block[3U] = static_cast<uint8_t>(packed[1U] >> 8U);
+  for (uint32_t b = 0U; b < 4U; ++b) {
+    block[4U + b] = static_cast<uint8_t>(bits >> (b * 8U));
+  }
+}
+
+void CompressBlocks(BlockFormat format, const uint8_t *rgba, uint32_t width,
+                    uint32_t height, uint8_t *blocks) {
+  uint32_t blocks_x = (width + 3U) / 4U;
+  uint32_t blocks_y = (height + 3U) / 4U;
+  uint32_t block_size = GetBlockSize(format);
+
+  thread_pool()->ParallelFor(blocks_y, [&](uint32_t block_y) {
+    uint8_t *block =
+        blocks + static_cast<size_t>(block_y) * blocks_x * block_size;
+    BlockTexels texels;
+    for (uint32_t block_x = 0U; block_x < blocks_x; ++block_x) {
+      LoadBlock(rgba, width, height, block_x, block_y, texels);
+      switch (format) {
+      case BlockFormat::BC1:
+        EncodeBC1Block(texels, block);
+        break;
+      case BlockFormat::BC3:
+        EncodeBC4Block(texels, 3U, block);
+        EncodeBC1Block(texels, block + 8U);
+        break;
+      case BlockFormat::BC4:
+        EncodeBC4Block(texels, 0U, block);
+        break;
+      case BlockFormat::BC5:
+        EncodeBC4Block(texels, 0U, block);
+        EncodeBC4Block(texels, 1U, block + 8U);
+        break;
+      }
+      block += block_size;
+    }
+  });
+}
+
+} // namespace vks
@@ -0,0 +1,401 @@
+#include <EASTL/algorithm.h>
+#include <bounds_bvh.h>
+#include <cfloat>
+#include <cmath>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+const uint32_t kBvhMaxLeafItems = 4U;
+const uint32_t kBvhNumBins = 16U;
+static const uint32_t kBvhNoParent = 0xFFFFFFFFU;
+
+BvhNode::BvhNode()
+    : aabb_min(FLT_MAX), aabb_max(-FLT_MAX), first_item(0U), item_count(0U),
+      first_child(0U), parent(kBvhNoParent) {}
+
+BvhRayHit::BvhRayHit() : item(0U), distance(FLT_MAX) {}
+
+// Half the surface area, which is all the heuristic needs
+static float HalfArea(const glm::vec3 &aabb_min, const glm::vec3 &aabb_max) {
+  glm::vec3 size = glm::max(aabb_max - aabb_min, glm::vec3(0.f));
+  return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+// Distance along the ray to where it enters the box; negative if it misses
+static float IntersectRayAabb(const glm::vec3 &origin,
+                              const glm::vec3 &inv_dir,
+                              const glm::vec3 &aabb_min,
+                              const glm::vec3 &aabb_max, float max_distance) {
+  glm::vec3 t0 = (aabb_min - origin) * inv_dir;
+  glm::vec3 t1 = (aabb_max - origin) * inv_dir;
+  glm::vec3 t_near = glm::min(t0, t1);
+  glm::vec3 t_far = glm::max(t0, t1);
+  float enter = eastl::max(eastl::max(t_near.x, t_near.y),
+                           eastl::max(t_near.z, 0.f));
+  float exit = eastl::min(eastl::min(t_far.x, t_far.y),
+                          eastl::min(t_far.z, max_distance));
+  return enter <= exit ? enter : -1.f;
+}
+
+// The table culls by box and by sphere; the sphere bounds the box
+static MeshBounds GetItemBounds(const glm::vec3 &aabb_min,
+                                const glm::vec3 &aabb_max) {
+  MeshBounds bounds;
+  bounds.aabb_min = glm::vec4(aabb_min, 0.f);
+  bounds.aabb_max = glm::vec4(aabb_max, 0.f);
+  bounds.bounding_sphere = glm::vec4((aabb_min + aabb_max) * 0.5f,
+                                     glm::length(aabb_max - aabb_min) * 0.5f);
+  return bounds;
+}
+
+BoundsBvh::BoundsBvh()
+    : nodes_(), item_order_(), item_leaves_(), items_min_(), items_max_(),
+      ordered_bounds_(), item_positions_() {}
+
+void BoundsBvh::Clear() {
+  nodes_.clear();
+  item_order_.clear();
+  item_leaves_.clear();
+  items_min_.clear();
+  items_max_.clear();
+  ordered_bounds_.Clear();
+  item_positions_.clear();
+}
+
+void BoundsBvh::Build(const eastl::vector<glm::vec3> &items_min,
+                      const eastl::vector<glm::vec3> &items_max) {
+  Clear();
+  if (items_min.empty()) {
+    return;
+  }
+
+  items_min_ = items_min;
+  items_max_ = items_max;
+  uint32_t items_count = num_items();
+  item_order_.resize(items_count);
+  for (uint32_t i = 0U; i < items_count; ++i) {
+    item_order_[i] = i;
+  }
+
+  // A binary tree with leaves of at least one item has fewer than twice as
+  // many nodes as items
+  nodes_.reserve(items_count * 2U);
+  nodes_.push_back(BvhNode());
+  nodes_[0U].item_count = items_count;
+
+  eastl::vector<uint32_t> pending(1U, 0U);
+  while (!pending.empty()) {
+    uint32_t node_idx = pending.back();
+    pending.pop_back();
+
+    ComputeNodeBounds(node_idx);
+    if (SplitNode(node_idx)) {
+      pending.push_back(nodes_[node_idx].first_child);
+      pending.push_back(nodes_[node_idx].first_child + 1U);
+    }
+  }
+
+  item_leaves_.resize(items_count);
+  uint32_t node_idx = 0U;
+  for (eastl::vector<BvhNode>::const_iterator itor = nodes_.begin();
+       itor != nodes_.end(); ++itor, ++node_idx) {
+    if (!itor->IsLeaf()) {
+      continue;
+    }
+    for (uint32_t i = 0U; i < itor->item_count; ++i) {
+      item_leaves_[item_order_[itor->first_item + i]] = node_idx;
+    }
+  }
+
+  ordered_bounds_.Resize(items_count);
+  item_positions_.resize(items_count);
+  for (uint32_t i = 0U; i < items_count; ++i) {
+    uint32_t item = item_order_[i];
+    ordered_bounds_.Set(i, GetItemBounds(items_min_[item], items_max_[item]));
+    item_positions_[item] = i;
+  }
+}
+
+void BoundsBvh::ComputeNodeBounds(uint32_t node_idx) {
+  BvhNode &node = nodes_[node_idx];
+  node.aabb_min = glm::vec3(FLT_MAX);
+  node.aabb_max = glm::vec3(-FLT_MAX);
+
+  if (!node.IsLeaf()) {
+    const BvhNode &left = nodes_[node.first_child];
+    const BvhNode &right = nodes_[node.first_child + 1U];
+    node.aabb_min = glm::min(left.aabb_min, right.aabb_min);
+    node.aabb_max = glm::max(left.aabb_max, right.aabb_max);
+    return;
+  }
+
+  for (uint32_t i = 0U; i < node.item_count; ++i) {
+    uint32_t item = item_order_[node.first_item + i];
+    node.aabb_min = glm::min(node.aabb_min, items_min_[item]);
+    node.aabb_max = glm::max(node.aabb_max, items_max_[item]);
+  }
+}
+
+bool BoundsBvh::SplitNode(uint32_t node_idx) {
+  uint32_t first_item = nodes_[node_idx].first_item;
+  uint32_t item_count = nodes_[node_idx].item_count;
+  if (item_count <= kBvhMaxLeafItems) {
+    return false;
+  }
+
+  // Items are binned by the centre of their box
+  glm::vec3 centres_min(FLT_MAX);
+  glm::vec3 centres_max(-FLT_MAX);
+  for (uint32_t i = 0U; i < item_count; ++i) {
+    uint32_t item = item_order_[first_item + i];
+    glm::vec3 centre = (items_min_[item] + items_max_[item]) * 0.5f;
+    centres_min = glm::min(centres_min, centre);
+    centres_max = glm::max(centres_max, centre);
+  }
+
+  // Split where the items on either side, weighted by the area of their
+  // bounds, cost the least
+  float best_cost = FLT_MAX;
+  uint32_t best_axis = 0U;
+  uint32_t best_split = 0U;
+  for (uint32_t axis = 0U; axis < 3U; ++axis) {
+    float extent = centres_max[axis] - centres_min[axis];
+    if (extent <= 0.f) {
+      continue;
+    }
+    float bin_scale = SCAST_FLOAT(kBvhNumBins) / extent;
+
+    eastl::vector<glm::vec3> bins_min(kBvhNumBins, glm::vec3(FLT_MAX));
+    eastl::vector<glm::vec3> bins_max(kBvhNumBins, glm::vec3(-FLT_MAX));
+    eastl::vector<uint32_t> bins_count(kBvhNumBins, 0U);
+    for (uint32_t i = 0U; i < item_count; ++i) {
+      uint32_t item = item_order_[first_item + i];
+      float centre = (items_min_[item][axis] + items_max_[item][axis]) * 0.5f;
+      uint32_t bin = eastl::min(
+          static_cast<uint32_t>((centre - centres_min[axis]) * bin_scale),
+          kBvhNumBins - 1U);
+      bins_min[bin] = glm::min(bins_min[bin], items_min_[item]);
+      bins_max[bin] = glm::max(bins_max[bin], items_max_[item]);
+      ++bins_count[bin];
+    }
+
+    // Sweep from the right first, then evaluate every split from the left
+    eastl::vector<float> right_costs(kBvhNumBins, 0.f);
+    glm::vec3 right_min(FLT_MAX);
+    glm::vec3 right_max(-FLT_MAX);
+    uint32_t right_count = 0U;
+    for (uint32_t bin = kBvhNumBins - 1U; bin > 0U; --bin) {
+      right_min = glm::min(right_min, bins_min[bin]);
+      right_max = glm::max(right_max, bins_max[bin]);
+      right_count += bins_count[bin];
+      right_costs[bin] =
+          SCAST_FLOAT(right_count) * HalfArea(right_min, right_max);
+    }
+
+    glm::vec3 left_min(FLT_MAX);
+    glm::vec3 left_max(-FLT_MAX);
+    uint32_t left_count = 0U;
+    for (uint32_t split = 1U; split < kBvhNumBins; ++split) {
+      left_min = glm::min(left_min, bins_min[split - 1U]);
+      left_max = glm::max(left_max, bins_max[split - 1U]);
+      left_count += bins_count[split - 1U];
+      if (left_count == 0U || left_count == item_count) {
+        continue;
+      }
+
+      float cost = SCAST_FLOAT(left_count) * HalfArea(left_min, left_max) +
+                   right_costs[split];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = split;
+      }
+    }
+  }
+
+  // Keep a leaf if all the centres are in the same place, or if splitting
+  // costs more than testing every item
+  const BvhNode &node = nodes_[node_idx];
+  if (best_split == 0U ||
+      best_cost >=
+          SCAST_FLOAT(item_count) * HalfArea(node.aabb_min, node.aabb_max)) {
+    return false;
+  }
+
+  float extent = centres_max[best_axis] - centres_min[best_axis];
+  float bin_scale = SCAST_FLOAT(kBvhNumBins) / extent;
+  // Move the items of the left bins to the front of the range
+  uint32_t left_count = 0U;
+  for (uint32_t i = 0U; i < item_count; ++i) {
+    uint32_t item = item_order_[first_item + i];
+    float centre =
+        (items_min_[item][best_axis] + items_max_[item][best_axis]) * 0.5f;
+    uint32_t bin = eastl::min(
+        static_cast<uint32_t>((centre - centres_min[best_axis]) * bin_scale),
+        kBvhNumBins - 1U);
+    if (bin < best_split) {
+      eastl::swap(item_order_[first_item + left_count],
+                  item_order_[first_item + i]);
+      ++left_count;
+    }
+  }
+  if (left_count == 0U || left_count == item_count) {
+    return false;
+  }
+
+  uint32_t first_child = static_cast<uint32_t>(nodes_.size());
+  BvhNode left;
+  left.first_item = first_item;
+  left.item_count = left_count;
+  left.parent = node_idx;
+  BvhNode right;
+  right.first_item = first_item + left_count;
+  right.item_count = item_count - left_count;
+  right.parent = node_idx;
+  nodes_.push_back(left);
+  nodes_.push_back(right);
+  nodes_[node_idx].first_child = first_child;
+
+  return true;
+}
+
+void BoundsBvh::Refit(uint32_t item, const glm::vec3 &aabb_min,
+                      const glm::vec3 &aabb_max) {
+  items_min_[item] = aabb_min;
+  items_max_[item] = aabb_max;
+  ordered_bounds_.Set(item_positions_[item],
+                      GetItemBounds(aabb_min, aabb_max));
+
+  // Walk up until a node does not change
+  uint32_t node_idx = item_leaves_[item];
+  while (node_idx != kBvhNoParent) {
+    glm::vec3 old_min = nodes_[node_idx].aabb_min;
+    glm::vec3 old_max = nodes_[node_idx].aabb_max;
+    ComputeNodeBounds(node_idx);
+    if (old_min == nodes_[node_idx].aabb_min &&
+        old_max == nodes_[node_idx].aabb_max) {
+      break;
+    }
+    node_idx = nodes_[node_idx].parent;
+  }
+}
+
+uint32_t BoundsBvh::QueryFrustum(const szt::FrustumPlanes &planes,
+                                 eastl::vector<uint8_t> &visible) const {
+  visible.assign(num_items(), 0U);
+  if (nodes_.empty()) {
+    return 0U;
+  }
+
+  uint32_t num_visible = 0U;
+  // Results of the leaves, in the order of the tree
+  eastl::vector<uint8_t> ordered_visible(num_items(), 0U);
+  eastl::vector<uint32_t> pending(1U, 0U);
+  while (!pending.empty()) {
+    const BvhNode &node = nodes_[pending.back()];
+    pending.pop_back();
+
+    // Outside if the box is behind any plane, inside if it is in front of
+    // all of them
+    glm::vec3 centre = (node.aabb_min + node.aabb_max) * 0.5f;
+    glm::vec3 extents = (node.aabb_max - node.aabb_min) * 0.5f;
+    bool outside = false;
+    bool inside = true;
+    for (uint32_t p = 0U; p < szt::kFrustumNumPlanes && !outside; ++p) {
+      const glm::vec4 &plane = planes.plane(p);
+      float distance = glm::dot(glm::vec3(plane), centre) + plane.w;
+      float radius = glm::dot(glm::abs(glm::vec3(plane)), extents);
+      outside = distance < -radius;
+      inside = inside && distance >= radius;
+    }
+    if (outside) {
+      continue;
+    }
+
+    if (inside || node.item_count == 1U) {
+      for (uint32_t i = 0U; i < node.item_count; ++i) {
+        visible[item_order_[node.first_item + i]] = 1U;
+      }
+      num_visible += node.item_count;
+    } else if (node.IsLeaf()) {
+      // Test the items on their own; a leaf holds at most four of them
+      num_visible += FrustumCull(planes, ordered_bounds_, node.first_item,
+                                 node.item_count, ordered_visible.data());
+      for (uint32_t i = 0U; i < node.item_count; ++i) {
+        visible[item_order_[node.first_item + i]] =
+            ordered_visible[node.first_item + i];
+      }
+    } else {
+      pending.push_back(node.first_child);
+      pending.push_back(node.first_child + 1U);
+    }
+  }
+
+  return num_visible;
+}
+
+bool BoundsBvh::Raycast(const glm::vec3 &origin, const glm::vec3 &dir,
+                        float max_distance, BvhRayHit &hit) const {
+  hit = BvhRayHit();
+  if (nodes_.empty()) {
+    return false;
+  }
+
+  // Axes the ray is parallel to never get crossed
+  glm::vec3 inv_dir;
+  for (uint32_t i = 0U; i < 3U; ++i) {
+    inv_dir[i] = dir[i] != 0.f ? 1.f / dir[i] : FLT_MAX;
+  }
+
+  float closest = max_distance;
+  bool found = false;
+  eastl::vector<uint32_t> pending(1U, 0U);
+  while (!pending.empty()) {
+    const BvhNode &node = nodes_[pending.back()];
+    pending.pop_back();
+
+    if (IntersectRayAabb(origin, inv_dir, node.aabb_min, node.aabb_max,
+                         closest) < 0.f) {
+      continue;
+    }
+
+    if (node.IsLeaf()) {
+      for (uint32_t i = 0U; i < node.item_count; ++i) {
+        uint32_t item = item_order_[node.first_item + i];
+        float distance = IntersectRayAabb(origin, inv_dir, items_min_[item],
+                                          items_max_[item], closest);
+        if (distance >= 0.f && (!found || distance < closest)) {
+          closest = distance;
+          hit.item = item;
+          hit.distance = distance;
+          found = true;
+        }
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, so that it shortens the ray early
+    const BvhNode &left = nodes_[node.first_child];
+    const BvhNode &right = nodes_[node.first_child + 1U];
+    float left_distance = IntersectRayAabb(origin, inv_dir, left.aabb_min,
+                                           left.aabb_max, closest);
+    float right_distance = IntersectRayAabb(origin, inv_dir, right.aabb_min,
+                                            right.aabb_max, closest);
+    if (left_distance >= 0.f && right_distance >= 0.f) {
+      bool left_first = left_distance <= right_distance;
+      pending.push_back(left_first ? node.first_child + 1U
+                                   : node.first_child);
+      pending.push_back(left_first ? node.first_child
+                                   : node.first_child + 1U);
+    } else if (left_distance >= 0.f) {
+      pending.push_back(node.first_child);
+    } else if (right_distance >= 0.f) {
+      pending.push_back(node.first_child + 1U);
+    }
+  }
+
+  return found;
+}
+
+} // namespace vks
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <frustum.h>
+#include <glm/geometric.hpp>
 #include <glm/trigonometric.hpp>
 
 namespace szt {
@@ -30,4 +31,31 @@ Frustum::Frustum(float near, float far, float fov_y, float aspect_ratio)
   fbr_ = far_centre - (up * half_sizes_far.y) + (right * half_sizes_far.x);
 }
 
+FrustumPlanes::FrustumPlanes() {
+  for (uint32_t i = 0U; i < kFrustumNumPlanes; ++i) {
+    planes_[i] = glm::vec4(0.f, 0.f, 0.f, 1.f);
+  }
+}
+
+FrustumPlanes::FrustumPlanes(const glm::mat4 &view_proj) {
+  // Rows of the matrix; a point is inside if -w <= x, y <= w and 0 <= z <= w
+  // in clip space
+  glm::vec4 rows[4];
+  for (uint32_t i = 0U; i < 4U; ++i) {
+    rows[i] = glm::vec4(view_proj[0][i], view_proj[1][i], view_proj[2][i],
+                        view_proj[3][i]);
+  }
+
+  planes_[0U] = rows[3] + rows[0];
+  planes_[1U] = rows[3] - rows[0];
+  planes_[2U] = rows[3] + rows[1];
+  planes_[3U] = rows[3] - rows[1];
+  planes_[4U] = rows[2];
+  planes_[5U] = rows[3] - rows[2];
+
+  for (uint32_t i = 0U; i < kFrustumNumPlanes; ++i) {
+    planes_[i] /= glm::length(glm::vec3(planes_[i]));
+  }
+}
+
 } // namespace szt
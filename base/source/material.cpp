@@ -1,3 +1,4 @@
+#include <Timer.h>
 #include <base_system.h>
 #include <fstream>
 #include <logger.hpp>
@@ -17,6 +18,9 @@ const Decoration NoPrecision = Decoration::Max;
 
 namespace vks {
 
+extern const uint32_t kVertexEncodingsSpecConstBasePos = 2U;
+extern const uint32_t kIndices16SpecConstPos = 8U;
+
 //
 // SPIR-V IR instruction.
 //
@@ -125,6 +129,16 @@ void MaterialShader::AddSpecialisationEntry(uint32_t constant_id, uint32_t size,
   memcpy(infos_data_.data() + curr_size, data, size);
 }
 
+void MaterialShader::AddVertexEncodingsSpecialisation(
+    const VertexSetup &vertex_setup) {
+  for (uint32_t i = 0U; i < SCAST_U32(VertexElementType::num_items); ++i) {
+    uint32_t encoding = SCAST_U32(
+        vertex_setup.GetElementEncoding(static_cast<VertexElementType>(i)));
+    AddSpecialisationEntry(kVertexEncodingsSpecConstBasePos + i,
+                           SCAST_U32(sizeof(uint32_t)), &encoding);
+  }
+}
+
 void MaterialShader::ShutdownModule(const VulkanDevice &device) {
   if (current_stage_create_info_.module != VK_NULL_HANDLE) {
     vkDestroyShaderModule(device.device(), current_stage_create_info_.module,
@@ -789,9 +803,20 @@ void Material::CreatePipeline(
   pipe_create_info.basePipelineHandle = VK_NULL_HANDLE;
   pipe_create_info.basePipelineIndex = 0U;
 
-  VK_CHECK_RESULT(vkCreateGraphicsPipelines(device.device(), VK_NULL_HANDLE, 1U,
+  // Timed to compare a cold pipeline cache with a warm one
+  Timer timer;
+  timer.start();
+  VK_CHECK_RESULT(vkCreateGraphicsPipelines(device.device(),
+                                            device.pipeline_cache(), 1U,
                                             &pipe_create_info, nullptr,
                                             &pipeline_));
+  double creation_ms = timer.getElapsedTimeInMilliSec();
+  device.AddPipelineCreationTime(creation_ms);
+
+  LOG("Created pipe of Mat " << name_ << " in " << creation_ms << " ms, "
+                             << (device.IsPipelineCacheWarm() ? "warm"
+                                                              : "cold")
+                             << " pipeline cache");
 }
 
 void Material::InitPipeline(const VulkanDevice &device,
@@ -4,6 +4,6 @@ namespace vks {
 
 MaterialConstants::MaterialConstants()
     : diffuse_dissolve(0.f), specular_shininess(0.f), ambient(0.f),
-      emission(0.f) {}
+      emission(0.f), texture_ids() {}
 
 } // namespace vks
@@ -4,14 +4,49 @@
 #include <material.h>
 #include <material.h>
 #include <material_instance.h>
+#include <texture_cooker.h>
 #include <utility>
 #include <vulkan_buffer.h>
 #include <vulkan_device.h>
 #include <vulkan_texture.h>
+#include <vulkan_texture_manager.h>
 #include <vulkan_tools.h>
 
 namespace vks {
 
+// PNG files hold colours in sRGB, except for normal maps; DDS files carry
+// their own format
+static VkFormat GetTextureFormat(const MaterialBuilderTexture &texture) {
+  if (texture.type != MatTextureType::NORMAL) {
+    return VK_FORMAT_R8G8B8A8_SRGB;
+  }
+  return VK_FORMAT_R8G8B8A8_UNORM;
+}
+
+// Normal maps only need two channels, and the masks one
+static TextureCompression
+GetTextureCompression(const MaterialBuilderTexture &texture) {
+  switch (texture.type) {
+  case MatTextureType::NORMAL:
+    return TextureCompression::NORMAL_MAP;
+  case MatTextureType::SPECULAR:
+  case MatTextureType::SPECULAR_HIGHLIGHT:
+  case MatTextureType::DISPLACEMENT:
+  case MatTextureType::ALPHA:
+    return TextureCompression::MASK;
+  default:
+    return TextureCompression::COLOUR;
+  }
+}
+
+static bool IsPNGTexture(const MaterialBuilderTexture &texture) {
+  return texture.name.find("png") != eastl::string::npos;
+}
+
+static bool IsDDSTexture(const MaterialBuilderTexture &texture) {
+  return texture.name.find("dds") != eastl::string::npos;
+}
+
 MaterialInstanceBuilder::MaterialInstanceBuilder(
     const eastl::string &inst_name, const eastl::string &mats_directory,
     const VkSampler aniso_sampler)
@@ -27,6 +62,19 @@ void MaterialInstanceBuilder::AddConstants(const MaterialConstants &consts) {
   consts_.push_back(consts);
 }
 
+void MaterialInstanceBuilder::GetTextureLoadRequests(
+    eastl::vector<TextureLoadRequest> &requests) const {
+  for (eastl::vector<MaterialBuilderTexture>::const_iterator itor =
+           textures_.begin();
+       itor != textures_.end(); ++itor) {
+    if (IsPNGTexture(*itor) || IsDDSTexture(*itor)) {
+      requests.push_back(TextureLoadRequest(mats_directory_ + itor->name,
+                                            GetTextureFormat(*itor),
+                                            GetTextureCompression(*itor)));
+    }
+  }
+}
+
 MaterialInstance::MaterialInstance()
     : name_(), consts_(), textures_({nullptr}), material_(nullptr),
       maps_desc_set_(VK_NULL_HANDLE) {}
@@ -40,15 +88,13 @@ void MaterialInstance::Init(const VulkanDevice &device,
   for (uint32_t i = 0U; i < builder_textures_count; i++) {
     VulkanTexture *loaded_texture = nullptr;
     if (builder.textures()[i].name != "") {
-      VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
-      if (builder.textures()[i].name.find("png") != -1) {
-        if (builder.textures()[i].type != MatTextureType::NORMAL) {
-          format = VK_FORMAT_R8G8B8A8_SRGB;
-        }
+      if (IsPNGTexture(builder.textures()[i])) {
         texture_manager()->Load2DPNGTexture(
-            device, builder.mats_directory() + builder.textures()[i].name, format,
-            &loaded_texture, builder.aniso_sampler());
-      } else if (builder.textures()[i].name.find("dds") != -1) {
+            device, builder.mats_directory() + builder.textures()[i].name,
+            GetTextureFormat(builder.textures()[i]),
+            GetTextureCompression(builder.textures()[i]), &loaded_texture,
+            builder.aniso_sampler());
+      } else if (IsDDSTexture(builder.textures()[i])) {
         texture_manager()->Load2DTexture(
             device, builder.mats_directory() + builder.textures()[i].name,
             &loaded_texture, builder.aniso_sampler());
@@ -69,6 +115,9 @@ void MaterialInstance::Init(const VulkanDevice &device,
       textures_[i] =
           texture_manager()->GetTextureByName(STR(ASSETS_FOLDER) "dummy.ktx");
     }
+    // Shaders find the textures through the constants
+    consts_.texture_ids[i] =
+        texture_manager()->GetTableIndex(device, textures_[i]);
   }
 
   name_ = builder.inst_name();
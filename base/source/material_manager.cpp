@@ -54,6 +54,18 @@ Returning existing one!");
   return material;
 }
 
+void MaterialManager::DestroyMaterial(const VulkanDevice &device,
+                                      const eastl::string &name) {
+  NameMaterialMap::iterator itor = materials_map_.find(name);
+  if (itor == materials_map_.end()) {
+    return;
+  }
+
+  itor->second->Shutdown(device);
+  materials_map_.erase(itor);
+  LOG("Destroyed Material " << name << ".");
+}
+
 MaterialInstance *MaterialManager::CreateMaterialInstance(
     const VulkanDevice &device, const MaterialInstanceBuilder &builder) {
   NameMaterialInstMap::iterator instance_found =
@@ -97,43 +109,23 @@ void MaterialManager::GetMaterialConstantsBuffer(const VulkanDevice &device,
   // Create a large enough buffer
   VulkanBufferInitInfo init_info;
   init_info.size = num_mat_instances * mat_constant_size;
-  init_info.memory_property_flags = /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
   buffer.Init(device, init_info);
 
-  // Upload the material constants data to it
+  // Write the material constants straight into the mapped buffer
+  MaterialConstants *mat_consts = buffer.MappedAs<MaterialConstants>();
   for (uint32_t i = 0U; i < num_mat_instances; i++) {
-    void *data = nullptr;
-    buffer.Map(device, &data, mat_constant_size, i * mat_constant_size);
-    MaterialConstants *mat_const_ptr = static_cast<MaterialConstants *>(data);
-    *mat_const_ptr = material_instances_[i].consts();
-    buffer.Unmap(device);
+    mat_consts[i] = material_instances_[i].consts();
   }
+  buffer.Flush(device);
 }
 
 uint32_t MaterialManager::GetMaterialInstancesCount() const {
   return SCAST_U32(material_instances_.size());
 }
 
-void MaterialManager::GetDescriptorImageInfosByType(
-    const MatTextureType texture_type,
-    eastl::vector<VkDescriptorImageInfo> &descs) {
-  uint32_t num_mat_instances = GetMaterialInstancesCount();
-
-  // For all the material instances
-  for (uint32_t i = 0U; i < num_mat_instances; i++) {
-    // Read their texture of given type
-    VulkanTexture &texture =
-        *material_instances_[i].textures()[tools::ToUnderlying(texture_type)];
-
-    // Save it in the list
-    descs.push_back(texture.GetDescriptorImageInfo());
-  }
-}
-
 eastl::vector<MaterialConstants> MaterialManager::GetMaterialConstants() const {
   eastl::vector<MaterialConstants> constants;
 
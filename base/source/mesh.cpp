@@ -2,14 +2,36 @@
 
 namespace vks {
 
+MeshLod::MeshLod() : start_index(0U), index_count(0U), error(0.f) {}
+
+MeshLod::MeshLod(uint32_t Start_index, uint32_t Index_count, float Error)
+    : start_index(Start_index), index_count(Index_count), error(Error) {}
+
+MeshInstance::MeshInstance()
+    : mesh_idx(0U), model_mat(1.f), node_idx(kNoTransformNode) {}
+
+MeshInstance::MeshInstance(uint32_t Mesh_idx, const glm::mat4 &Model_mat,
+                           uint32_t Node_idx)
+    : mesh_idx(Mesh_idx), model_mat(Model_mat), node_idx(Node_idx) {}
+
 Mesh::Mesh()
     : start_index_(0U), index_count_(0U), vertex_offset_(0U), material_id_(0U),
-      model_mat_(1.f), dynamic_ubo_offset_(0U) {}
+      model_mat_(1.f), dynamic_ubo_offset_(0U), first_cluster_(0U),
+      cluster_count_(0U), first_instance_(0U), instance_count_(0U), lods_() {}
 
 Mesh::Mesh(uint32_t start_index, uint32_t index_count, uint32_t vertex_offset,
            uint32_t material_id)
     : start_index_(start_index), index_count_(index_count),
       vertex_offset_(vertex_offset), material_id_(material_id), model_mat_(1.f),
-      dynamic_ubo_offset_(0U) {}
+      dynamic_ubo_offset_(0U), first_cluster_(0U), cluster_count_(0U),
+      first_instance_(0U), instance_count_(0U), lods_() {}
+
+MeshLod Mesh::GetLod(uint32_t lod) const {
+  if (lod == 0U) {
+    return MeshLod(start_index_, index_count_, 0.f);
+  }
+
+  return lods_[lod - 1U];
+}
 
 } // namespace vks
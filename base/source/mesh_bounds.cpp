@@ -0,0 +1,295 @@
+#include <EASTL/algorithm.h>
+#include <cmath>
+#include <cstring>
+#include <mesh_bounds.h>
+#if defined(__SSE__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VKS_MESHBOUNDS_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace vks {
+
+MeshBounds::MeshBounds()
+    : aabb_min(0.f), aabb_max(0.f), bounding_sphere(0.f) {}
+
+static glm::vec3 ReadPosition(const uint8_t *positions, uint32_t stride,
+                              uint32_t idx) {
+  glm::vec3 pos;
+  memcpy(&pos, positions + static_cast<size_t>(idx) * stride,
+         sizeof(glm::vec3));
+  return pos;
+}
+
+#ifdef VKS_MESHBOUNDS_SSE
+// Gather the positions of four vertices, one component per register
+static void ReadPositions4(const uint8_t *positions, uint32_t stride,
+                           const uint32_t *indices, __m128 &xs, __m128 &ys,
+                           __m128 &zs) {
+  glm::vec3 p0 = ReadPosition(positions, stride, indices[0U]);
+  glm::vec3 p1 = ReadPosition(positions, stride, indices[1U]);
+  glm::vec3 p2 = ReadPosition(positions, stride, indices[2U]);
+  glm::vec3 p3 = ReadPosition(positions, stride, indices[3U]);
+  xs = _mm_setr_ps(p0.x, p1.x, p2.x, p3.x);
+  ys = _mm_setr_ps(p0.y, p1.y, p2.y, p3.y);
+  zs = _mm_setr_ps(p0.z, p1.z, p2.z, p3.z);
+}
+
+static float HorizontalMin(__m128 v) {
+  v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+  v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(v);
+}
+
+static float HorizontalMax(__m128 v) {
+  v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+  v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(v);
+}
+#endif
+
+void ComputeMeshBounds(const uint8_t *positions, uint32_t stride,
+                       const uint32_t *indices, uint32_t first_index,
+                       uint32_t index_count, MeshBounds &bounds) {
+  bounds = MeshBounds();
+  if (index_count == 0U) {
+    return;
+  }
+
+  const uint32_t *mesh_indices = indices + first_index;
+  glm::vec3 aabb_min(ReadPosition(positions, stride, mesh_indices[0U]));
+  glm::vec3 aabb_max(aabb_min);
+  uint32_t i = 0U;
+
+#ifdef VKS_MESHBOUNDS_SSE
+  // Four vertices per iteration, the remainder is done one by one below
+  __m128 min_x = _mm_set1_ps(aabb_min.x);
+  __m128 min_y = _mm_set1_ps(aabb_min.y);
+  __m128 min_z = _mm_set1_ps(aabb_min.z);
+  __m128 max_x = min_x;
+  __m128 max_y = min_y;
+  __m128 max_z = min_z;
+  for (; i + 4U <= index_count; i += 4U) {
+    __m128 xs, ys, zs;
+    ReadPositions4(positions, stride, mesh_indices + i, xs, ys, zs);
+    min_x = _mm_min_ps(min_x, xs);
+    min_y = _mm_min_ps(min_y, ys);
+    min_z = _mm_min_ps(min_z, zs);
+    max_x = _mm_max_ps(max_x, xs);
+    max_y = _mm_max_ps(max_y, ys);
+    max_z = _mm_max_ps(max_z, zs);
+  }
+  aabb_min = glm::vec3(HorizontalMin(min_x), HorizontalMin(min_y),
+                       HorizontalMin(min_z));
+  aabb_max = glm::vec3(HorizontalMax(max_x), HorizontalMax(max_y),
+                       HorizontalMax(max_z));
+#endif
+  for (; i < index_count; ++i) {
+    glm::vec3 pos = ReadPosition(positions, stride, mesh_indices[i]);
+    aabb_min = glm::min(aabb_min, pos);
+    aabb_max = glm::max(aabb_max, pos);
+  }
+
+  // The sphere shares the centre of the box but only reaches the furthest
+  // vertex, which is tighter than half the diagonal
+  glm::vec3 centre = (aabb_min + aabb_max) * 0.5f;
+  float radius_sq = 0.f;
+  i = 0U;
+
+#ifdef VKS_MESHBOUNDS_SSE
+  __m128 centre_x = _mm_set1_ps(centre.x);
+  __m128 centre_y = _mm_set1_ps(centre.y);
+  __m128 centre_z = _mm_set1_ps(centre.z);
+  __m128 max_dist_sq = _mm_setzero_ps();
+  for (; i + 4U <= index_count; i += 4U) {
+    __m128 xs, ys, zs;
+    ReadPositions4(positions, stride, mesh_indices + i, xs, ys, zs);
+    xs = _mm_sub_ps(xs, centre_x);
+    ys = _mm_sub_ps(ys, centre_y);
+    zs = _mm_sub_ps(zs, centre_z);
+    __m128 dist_sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(xs, xs),
+                                           _mm_mul_ps(ys, ys)),
+                                _mm_mul_ps(zs, zs));
+    max_dist_sq = _mm_max_ps(max_dist_sq, dist_sq);
+  }
+  radius_sq = HorizontalMax(max_dist_sq);
+#endif
+  for (; i < index_count; ++i) {
+    glm::vec3 diff =
+        ReadPosition(positions, stride, mesh_indices[i]) - centre;
+    radius_sq = eastl::max(radius_sq, glm::dot(diff, diff));
+  }
+
+  bounds.aabb_min = glm::vec4(aabb_min, 0.f);
+  bounds.aabb_max = glm::vec4(aabb_max, 0.f);
+  bounds.bounding_sphere = glm::vec4(centre, sqrtf(radius_sq));
+}
+
+MeshBounds TransformMeshBounds(const MeshBounds &bounds,
+                               const glm::mat4 &mat) {
+  glm::vec3 centre =
+      (glm::vec3(bounds.aabb_min) + glm::vec3(bounds.aabb_max)) * 0.5f;
+  glm::vec3 extents =
+      (glm::vec3(bounds.aabb_max) - glm::vec3(bounds.aabb_min)) * 0.5f;
+
+  // Each axis of the new box is reached by the extents along the absolute
+  // value of the rotated axes
+  glm::mat3 abs_mat(glm::abs(glm::vec3(mat[0])), glm::abs(glm::vec3(mat[1])),
+                    glm::abs(glm::vec3(mat[2])));
+  glm::vec3 new_centre = glm::vec3(mat * glm::vec4(centre, 1.f));
+  glm::vec3 new_extents = abs_mat * extents;
+
+  float scale = eastl::max(glm::length(glm::vec3(mat[0])),
+                           eastl::max(glm::length(glm::vec3(mat[1])),
+                                      glm::length(glm::vec3(mat[2]))));
+
+  MeshBounds transformed;
+  transformed.aabb_min = glm::vec4(new_centre - new_extents, 0.f);
+  transformed.aabb_max = glm::vec4(new_centre + new_extents, 0.f);
+  transformed.bounding_sphere = glm::vec4(
+      glm::vec3(mat * glm::vec4(glm::vec3(bounds.bounding_sphere), 1.f)),
+      bounds.bounding_sphere.w * scale);
+  return transformed;
+}
+
+MeshBoundsTable::MeshBoundsTable()
+    : min_x_(), min_y_(), min_z_(), max_x_(), max_y_(), max_z_(),
+      centre_x_(), centre_y_(), centre_z_(), radius_() {}
+
+void MeshBoundsTable::Clear() { Resize(0U); }
+
+void MeshBoundsTable::Resize(uint32_t num_meshes) {
+  min_x_.resize(num_meshes, 0.f);
+  min_y_.resize(num_meshes, 0.f);
+  min_z_.resize(num_meshes, 0.f);
+  max_x_.resize(num_meshes, 0.f);
+  max_y_.resize(num_meshes, 0.f);
+  max_z_.resize(num_meshes, 0.f);
+  centre_x_.resize(num_meshes, 0.f);
+  centre_y_.resize(num_meshes, 0.f);
+  centre_z_.resize(num_meshes, 0.f);
+  radius_.resize(num_meshes, 0.f);
+}
+
+void MeshBoundsTable::Set(uint32_t mesh_idx, const MeshBounds &bounds) {
+  min_x_[mesh_idx] = bounds.aabb_min.x;
+  min_y_[mesh_idx] = bounds.aabb_min.y;
+  min_z_[mesh_idx] = bounds.aabb_min.z;
+  max_x_[mesh_idx] = bounds.aabb_max.x;
+  max_y_[mesh_idx] = bounds.aabb_max.y;
+  max_z_[mesh_idx] = bounds.aabb_max.z;
+  centre_x_[mesh_idx] = bounds.bounding_sphere.x;
+  centre_y_[mesh_idx] = bounds.bounding_sphere.y;
+  centre_z_[mesh_idx] = bounds.bounding_sphere.z;
+  radius_[mesh_idx] = bounds.bounding_sphere.w;
+}
+
+MeshBounds MeshBoundsTable::Get(uint32_t mesh_idx) const {
+  MeshBounds bounds;
+  bounds.aabb_min =
+      glm::vec4(min_x_[mesh_idx], min_y_[mesh_idx], min_z_[mesh_idx], 0.f);
+  bounds.aabb_max =
+      glm::vec4(max_x_[mesh_idx], max_y_[mesh_idx], max_z_[mesh_idx], 0.f);
+  bounds.bounding_sphere = GetSphere(mesh_idx);
+  return bounds;
+}
+
+// Whether the sphere or the box of one entry is fully outside a plane
+static bool IsOutsideFrustum(const szt::FrustumPlanes &planes,
+                             const MeshBoundsTable &bounds, uint32_t i) {
+  glm::vec3 sphere_centre(bounds.centre_x()[i], bounds.centre_y()[i],
+                          bounds.centre_z()[i]);
+  glm::vec3 aabb_min(bounds.min_x()[i], bounds.min_y()[i], bounds.min_z()[i]);
+  glm::vec3 aabb_max(bounds.max_x()[i], bounds.max_y()[i], bounds.max_z()[i]);
+  glm::vec3 box_centre = (aabb_min + aabb_max) * 0.5f;
+  glm::vec3 box_extents = (aabb_max - aabb_min) * 0.5f;
+
+  for (uint32_t p = 0U; p < szt::kFrustumNumPlanes; ++p) {
+    const glm::vec4 &plane = planes.plane(p);
+    glm::vec3 normal(plane);
+    if (glm::dot(normal, sphere_centre) + plane.w < -bounds.radius()[i] ||
+        glm::dot(normal, box_centre) + plane.w <
+            -glm::dot(glm::abs(normal), box_extents)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint32_t FrustumCull(const szt::FrustumPlanes &planes,
+                     const MeshBoundsTable &bounds,
+                     eastl::vector<uint8_t> &visible) {
+  visible.resize(bounds.size());
+  return FrustumCull(planes, bounds, 0U, bounds.size(), visible.data());
+}
+
+uint32_t FrustumCull(const szt::FrustumPlanes &planes,
+                     const MeshBoundsTable &bounds, uint32_t first,
+                     uint32_t count, uint8_t *visible) {
+  uint32_t last = first + count;
+  uint32_t num_visible = 0U;
+  uint32_t i = first;
+
+#ifdef VKS_MESHBOUNDS_SSE
+  __m128 half = _mm_set1_ps(0.5f);
+  __m128 sign_mask = _mm_set1_ps(-0.f);
+  for (; i + 4U <= last; i += 4U) {
+    __m128 sphere_x = _mm_loadu_ps(bounds.centre_x() + i);
+    __m128 sphere_y = _mm_loadu_ps(bounds.centre_y() + i);
+    __m128 sphere_z = _mm_loadu_ps(bounds.centre_z() + i);
+    __m128 neg_radius = _mm_xor_ps(_mm_loadu_ps(bounds.radius() + i),
+                                   sign_mask);
+    __m128 min_x = _mm_loadu_ps(bounds.min_x() + i);
+    __m128 min_y = _mm_loadu_ps(bounds.min_y() + i);
+    __m128 min_z = _mm_loadu_ps(bounds.min_z() + i);
+    __m128 max_x = _mm_loadu_ps(bounds.max_x() + i);
+    __m128 max_y = _mm_loadu_ps(bounds.max_y() + i);
+    __m128 max_z = _mm_loadu_ps(bounds.max_z() + i);
+    __m128 box_x = _mm_mul_ps(_mm_add_ps(min_x, max_x), half);
+    __m128 box_y = _mm_mul_ps(_mm_add_ps(min_y, max_y), half);
+    __m128 box_z = _mm_mul_ps(_mm_add_ps(min_z, max_z), half);
+    __m128 ext_x = _mm_mul_ps(_mm_sub_ps(max_x, min_x), half);
+    __m128 ext_y = _mm_mul_ps(_mm_sub_ps(max_y, min_y), half);
+    __m128 ext_z = _mm_mul_ps(_mm_sub_ps(max_z, min_z), half);
+
+    __m128 outside = _mm_setzero_ps();
+    for (uint32_t p = 0U; p < szt::kFrustumNumPlanes; ++p) {
+      const glm::vec4 &plane = planes.plane(p);
+      __m128 n_x = _mm_set1_ps(plane.x);
+      __m128 n_y = _mm_set1_ps(plane.y);
+      __m128 n_z = _mm_set1_ps(plane.z);
+      __m128 d = _mm_set1_ps(plane.w);
+
+      __m128 sphere_dist = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(n_x, sphere_x), _mm_mul_ps(n_y, sphere_y)),
+          _mm_add_ps(_mm_mul_ps(n_z, sphere_z), d));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(sphere_dist, neg_radius));
+
+      __m128 box_dist = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(n_x, box_x), _mm_mul_ps(n_y, box_y)),
+          _mm_add_ps(_mm_mul_ps(n_z, box_z), d));
+      __m128 box_radius = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_mask, n_x), ext_x),
+                     _mm_mul_ps(_mm_andnot_ps(sign_mask, n_y), ext_y)),
+          _mm_mul_ps(_mm_andnot_ps(sign_mask, n_z), ext_z));
+      outside = _mm_or_ps(
+          outside, _mm_cmplt_ps(box_dist, _mm_xor_ps(box_radius, sign_mask)));
+    }
+
+    int outside_mask = _mm_movemask_ps(outside);
+    for (uint32_t lane = 0U; lane < 4U; ++lane) {
+      visible[i + lane] = (outside_mask & (1 << lane)) == 0 ? 1U : 0U;
+      num_visible += visible[i + lane];
+    }
+  }
+#endif
+  for (; i < last; ++i) {
+    visible[i] = IsOutsideFrustum(planes, bounds, i) ? 0U : 1U;
+    num_visible += visible[i];
+  }
+
+  return num_visible;
+}
+
+} // namespace vks
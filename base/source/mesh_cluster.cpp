@@ -0,0 +1,166 @@
+#include <EASTL/algorithm.h>
+#include <cmath>
+#include <cstring>
+#include <mesh_cluster.h>
+
+namespace vks {
+
+const uint32_t kMeshClusterMaxVertices = 64U;
+const uint32_t kMeshClusterMaxTriangles = 124U;
+
+MeshCluster::MeshCluster()
+    : bounding_sphere(0.f), aabb_min(0.f), aabb_max(0.f),
+      cone_apex_cutoff(0.f, 0.f, 0.f, 1.f), cone_axis(0.f), first_index(0U),
+      index_count(0U), mesh_idx(0U), num_vertices(0U) {}
+
+static glm::vec3 ReadPosition(const uint8_t *positions, uint32_t stride,
+                              uint32_t idx) {
+  glm::vec3 pos;
+  memcpy(&pos, positions + static_cast<size_t>(idx) * stride,
+         sizeof(glm::vec3));
+  return pos;
+}
+
+static void ComputeClusterBounds(const uint8_t *positions, uint32_t stride,
+                                 const uint32_t *indices,
+                                 MeshCluster &cluster) {
+  const uint32_t *cluster_indices = indices + cluster.first_index;
+  uint32_t num_tris = cluster.index_count / 3U;
+
+  glm::vec3 aabb_min(ReadPosition(positions, stride, cluster_indices[0U]));
+  glm::vec3 aabb_max(aabb_min);
+  for (uint32_t i = 1U; i < cluster.index_count; ++i) {
+    glm::vec3 pos = ReadPosition(positions, stride, cluster_indices[i]);
+    aabb_min = glm::min(aabb_min, pos);
+    aabb_max = glm::max(aabb_max, pos);
+  }
+
+  glm::vec3 centre = (aabb_min + aabb_max) * 0.5f;
+  float radius_sq = 0.f;
+  for (uint32_t i = 0U; i < cluster.index_count; ++i) {
+    glm::vec3 diff =
+        ReadPosition(positions, stride, cluster_indices[i]) - centre;
+    radius_sq = eastl::max(radius_sq, glm::dot(diff, diff));
+  }
+
+  cluster.aabb_min = glm::vec4(aabb_min, 0.f);
+  cluster.aabb_max = glm::vec4(aabb_max, 0.f);
+  cluster.bounding_sphere = glm::vec4(centre, sqrtf(radius_sq));
+
+  // Normal cone; the axis is the average of the triangle normals
+  eastl::vector<glm::vec3> normals(num_tris);
+  glm::vec3 axis(0.f);
+  for (uint32_t t = 0U; t < num_tris; ++t) {
+    glm::vec3 p0 = ReadPosition(positions, stride, cluster_indices[t * 3U]);
+    glm::vec3 p1 =
+        ReadPosition(positions, stride, cluster_indices[t * 3U + 1U]);
+    glm::vec3 p2 =
+        ReadPosition(positions, stride, cluster_indices[t * 3U + 2U]);
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float length = glm::length(normal);
+    normals[t] = (length > 0.f) ? normal / length : glm::vec3(0.f);
+    axis += normals[t];
+  }
+
+  float axis_length = glm::length(axis);
+  float min_dot = 1.f;
+  if (axis_length > 0.f) {
+    axis /= axis_length;
+    for (uint32_t t = 0U; t < num_tris; ++t) {
+      min_dot = eastl::min(min_dot, glm::dot(axis, normals[t]));
+    }
+  } else {
+    min_dot = -1.f;
+  }
+
+  // Normals spread over more than a hemisphere can never be culled
+  if (min_dot <= 0.f) {
+    cluster.cone_axis = glm::vec4(axis, 0.f);
+    cluster.cone_apex_cutoff = glm::vec4(centre, 1.f);
+    return;
+  }
+
+  // Move the apex back along the axis until it is behind every triangle
+  float max_t = 0.f;
+  for (uint32_t t = 0U; t < num_tris; ++t) {
+    glm::vec3 p0 = ReadPosition(positions, stride, cluster_indices[t * 3U]);
+    float dc = glm::dot(centre - p0, normals[t]);
+    float dn = glm::dot(axis, normals[t]);
+    max_t = eastl::max(max_t, dc / dn);
+  }
+
+  cluster.cone_axis = glm::vec4(axis, 0.f);
+  cluster.cone_apex_cutoff =
+      glm::vec4(centre - axis * max_t, sqrtf(1.f - min_dot * min_dot));
+}
+
+// Gather the vertices of a triangle which are not in the cluster yet
+static uint32_t GetNewVertices(const uint32_t *tri,
+                               const uint32_t *cluster_vertices,
+                               uint32_t num_cluster_vertices,
+                               uint32_t *new_vertices) {
+  uint32_t num_new_vertices = 0U;
+  for (uint32_t k = 0U; k < 3U; ++k) {
+    bool found = false;
+    for (uint32_t i = 0U; i < num_cluster_vertices && !found; ++i) {
+      found = cluster_vertices[i] == tri[k];
+    }
+    for (uint32_t i = 0U; i < num_new_vertices && !found; ++i) {
+      found = new_vertices[i] == tri[k];
+    }
+    if (!found) {
+      new_vertices[num_new_vertices++] = tri[k];
+    }
+  }
+
+  return num_new_vertices;
+}
+
+void BuildMeshClusters(const uint8_t *positions, uint32_t stride,
+                       const uint32_t *indices, uint32_t first_index,
+                       uint32_t index_count, uint32_t mesh_idx,
+                       eastl::vector<MeshCluster> &clusters) {
+  uint32_t cluster_vertices[kMeshClusterMaxVertices];
+  uint32_t num_cluster_vertices = 0U;
+
+  MeshCluster cluster;
+  cluster.first_index = first_index;
+  cluster.mesh_idx = mesh_idx;
+
+  uint32_t num_tris = index_count / 3U;
+  for (uint32_t t = 0U; t < num_tris; ++t) {
+    const uint32_t *tri = indices + first_index + t * 3U;
+
+    uint32_t new_vertices[3U];
+    uint32_t num_new_vertices = GetNewVertices(
+        tri, cluster_vertices, num_cluster_vertices, new_vertices);
+
+    // Close the current cluster if the triangle doesn't fit in it
+    if (num_cluster_vertices + num_new_vertices > kMeshClusterMaxVertices ||
+        cluster.index_count / 3U == kMeshClusterMaxTriangles) {
+      cluster.num_vertices = num_cluster_vertices;
+      ComputeClusterBounds(positions, stride, indices, cluster);
+      clusters.push_back(cluster);
+
+      cluster = MeshCluster();
+      cluster.first_index = first_index + t * 3U;
+      cluster.mesh_idx = mesh_idx;
+      num_cluster_vertices = 0U;
+      num_new_vertices = GetNewVertices(tri, cluster_vertices,
+                                        num_cluster_vertices, new_vertices);
+    }
+
+    for (uint32_t i = 0U; i < num_new_vertices; ++i) {
+      cluster_vertices[num_cluster_vertices++] = new_vertices[i];
+    }
+    cluster.index_count += 3U;
+  }
+
+  if (cluster.index_count > 0U) {
+    cluster.num_vertices = num_cluster_vertices;
+    ComputeClusterBounds(positions, stride, indices, cluster);
+    clusters.push_back(cluster);
+  }
+}
+
+} // namespace vks
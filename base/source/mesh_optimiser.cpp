@@ -0,0 +1,242 @@
+#include <cmath>
+#include <mesh_optimiser.h>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+const uint32_t kVertexCacheAnalysisSize = 16U;
+
+// Tunables of the scoring function, as in Forsyth's paper
+static const uint32_t kForsythCacheSize = 32U;
+static const float kForsythCacheDecayPower = 1.5f;
+static const float kForsythLastTriScore = 0.75f;
+static const float kForsythValenceBoostScale = 2.0f;
+static const float kForsythValenceBoostPower = 0.5f;
+
+static float ForsythVertexScore(int32_t cache_pos, uint32_t remaining_tris) {
+  // Vertices with no triangles left to add shouldn't attract anything
+  if (remaining_tris == 0U) {
+    return -1.f;
+  }
+
+  float score = 0.f;
+  if (cache_pos >= 0) {
+    if (cache_pos < 3) {
+      // Used by the last triangle; penalised on purpose so that strips
+      // aren't favoured over fans
+      score = kForsythLastTriScore;
+    } else {
+      const float scaler = 1.f / SCAST_FLOAT(kForsythCacheSize - 3U);
+      score = 1.f - SCAST_FLOAT(cache_pos - 3) * scaler;
+      score = powf(score, kForsythCacheDecayPower);
+    }
+  }
+
+  // Favour vertices with few triangles left, to avoid leaving lone
+  // triangles behind
+  score += kForsythValenceBoostScale *
+           powf(SCAST_FLOAT(remaining_tris), -kForsythValenceBoostPower);
+
+  return score;
+}
+
+VertexCacheStats::VertexCacheStats()
+    : transformed_vertices(0U), num_triangles(0U), num_unique_vertices(0U) {}
+
+float VertexCacheStats::acmr() const {
+  return (num_triangles == 0U) ? 0.f
+                               : SCAST_FLOAT(transformed_vertices) /
+                                     SCAST_FLOAT(num_triangles);
+}
+
+float VertexCacheStats::atvr() const {
+  return (num_unique_vertices == 0U) ? 0.f
+                                     : SCAST_FLOAT(transformed_vertices) /
+                                           SCAST_FLOAT(num_unique_vertices);
+}
+
+void VertexCacheStats::Accumulate(const VertexCacheStats &other) {
+  transformed_vertices += other.transformed_vertices;
+  num_triangles += other.num_triangles;
+  num_unique_vertices += other.num_unique_vertices;
+}
+
+VertexCacheStats AnalyseVertexCache(const uint32_t *indices,
+                                    uint32_t num_indices,
+                                    uint32_t num_vertices,
+                                    uint32_t cache_size) {
+  VertexCacheStats stats;
+  stats.num_triangles = num_indices / 3U;
+
+  // A vertex is in the FIFO if less than cache_size vertices have been
+  // pushed since it was
+  eastl::vector<uint32_t> timestamps(num_vertices, 0U);
+  uint32_t timestamp = cache_size + 1U;
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    uint32_t idx = indices[i];
+    if (timestamps[idx] == 0U) {
+      stats.num_unique_vertices++;
+    }
+    if (timestamp - timestamps[idx] > cache_size) {
+      timestamps[idx] = timestamp++;
+      stats.transformed_vertices++;
+    }
+  }
+
+  return stats;
+}
+
+void OptimiseVertexCache(uint32_t *indices, uint32_t num_indices,
+                         uint32_t num_vertices) {
+  uint32_t num_tris = num_indices / 3U;
+  if (num_tris == 0U) {
+    return;
+  }
+
+  // Triangles using each vertex; the first remaining_tris[v] entries of a
+  // vertex's list are the triangles not yet added
+  eastl::vector<uint32_t> remaining_tris(num_vertices, 0U);
+  for (uint32_t i = 0U; i < num_tris * 3U; ++i) {
+    remaining_tris[indices[i]]++;
+  }
+  eastl::vector<uint32_t> tris_offsets(num_vertices + 1U, 0U);
+  for (uint32_t v = 0U; v < num_vertices; ++v) {
+    tris_offsets[v + 1U] = tris_offsets[v] + remaining_tris[v];
+  }
+  eastl::vector<uint32_t> vertex_tris(num_tris * 3U);
+  eastl::vector<uint32_t> fill_counts(num_vertices, 0U);
+  for (uint32_t i = 0U; i < num_tris * 3U; ++i) {
+    uint32_t v = indices[i];
+    vertex_tris[tris_offsets[v] + fill_counts[v]++] = i / 3U;
+  }
+
+  eastl::vector<int32_t> cache_pos(num_vertices, -1);
+  eastl::vector<float> vertex_scores(num_vertices);
+  for (uint32_t v = 0U; v < num_vertices; ++v) {
+    vertex_scores[v] = ForsythVertexScore(-1, remaining_tris[v]);
+  }
+
+  eastl::vector<float> tri_scores(num_tris);
+  eastl::vector<uint8_t> tri_added(num_tris, 0U);
+  int32_t best_tri = -1;
+  float best_score = -1.f;
+  for (uint32_t t = 0U; t < num_tris; ++t) {
+    tri_scores[t] = vertex_scores[indices[t * 3U]] +
+                    vertex_scores[indices[t * 3U + 1U]] +
+                    vertex_scores[indices[t * 3U + 2U]];
+    if (tri_scores[t] > best_score) {
+      best_score = tri_scores[t];
+      best_tri = static_cast<int32_t>(t);
+    }
+  }
+
+  eastl::vector<uint32_t> output(num_tris * 3U);
+  uint32_t cache[kForsythCacheSize + 3U];
+  uint32_t cache_count = 0U;
+  uint32_t scan_pos = 0U;
+  for (uint32_t n = 0U; n < num_tris; ++n) {
+    // Nothing in the cache leads anywhere; continue from the first
+    // triangle not yet added
+    if (best_tri < 0) {
+      while (tri_added[scan_pos] != 0U) {
+        ++scan_pos;
+      }
+      best_tri = static_cast<int32_t>(scan_pos);
+    }
+
+    uint32_t tri = SCAST_U32(best_tri);
+    tri_added[tri] = 1U;
+    const uint32_t *tri_vertices = indices + tri * 3U;
+    output[n * 3U] = tri_vertices[0U];
+    output[n * 3U + 1U] = tri_vertices[1U];
+    output[n * 3U + 2U] = tri_vertices[2U];
+
+    // Remove the triangle from the lists of its vertices
+    for (uint32_t k = 0U; k < 3U; ++k) {
+      uint32_t v = tri_vertices[k];
+      uint32_t *tris = vertex_tris.data() + tris_offsets[v];
+      for (uint32_t i = 0U; i < remaining_tris[v]; ++i) {
+        if (tris[i] == tri) {
+          tris[i] = tris[remaining_tris[v] - 1U];
+          break;
+        }
+      }
+      remaining_tris[v]--;
+    }
+
+    // The vertices of the triangle go to the front of the LRU cache
+    uint32_t new_cache[kForsythCacheSize + 3U];
+    uint32_t new_cache_count = 0U;
+    for (uint32_t k = 0U; k < 3U; ++k) {
+      new_cache[new_cache_count++] = tri_vertices[k];
+    }
+    for (uint32_t i = 0U; i < cache_count; ++i) {
+      uint32_t v = cache[i];
+      if (v != tri_vertices[0U] && v != tri_vertices[1U] &&
+          v != tri_vertices[2U]) {
+        new_cache[new_cache_count++] = v;
+      }
+    }
+
+    // Update the scores of the vertices which moved or fell off the cache,
+    // and the ones of their triangles
+    for (uint32_t i = 0U; i < new_cache_count; ++i) {
+      uint32_t v = new_cache[i];
+      cache_pos[v] = (i < kForsythCacheSize) ? static_cast<int32_t>(i) : -1;
+      float score = ForsythVertexScore(cache_pos[v], remaining_tris[v]);
+      float score_diff = score - vertex_scores[v];
+      vertex_scores[v] = score;
+
+      const uint32_t *tris = vertex_tris.data() + tris_offsets[v];
+      for (uint32_t j = 0U; j < remaining_tris[v]; ++j) {
+        tri_scores[tris[j]] += score_diff;
+      }
+    }
+
+    cache_count = (new_cache_count < kForsythCacheSize) ? new_cache_count
+                                                        : kForsythCacheSize;
+    for (uint32_t i = 0U; i < cache_count; ++i) {
+      cache[i] = new_cache[i];
+    }
+
+    // Only triangles using cached vertices are candidates for the next
+    // step, which is what keeps the algorithm linear
+    best_tri = -1;
+    best_score = -1.f;
+    for (uint32_t i = 0U; i < cache_count; ++i) {
+      uint32_t v = cache[i];
+      const uint32_t *tris = vertex_tris.data() + tris_offsets[v];
+      for (uint32_t j = 0U; j < remaining_tris[v]; ++j) {
+        if (tri_scores[tris[j]] > best_score) {
+          best_score = tri_scores[tris[j]];
+          best_tri = static_cast<int32_t>(tris[j]);
+        }
+      }
+    }
+  }
+
+  for (uint32_t i = 0U; i < num_tris * 3U; ++i) {
+    indices[i] = output[i];
+  }
+}
+
+void GetVertexFetchRemap(const uint32_t *indices, uint32_t num_indices,
+                         uint32_t num_vertices,
+                         eastl::vector<uint32_t> &remap) {
+  remap.assign(num_vertices, UINT32_MAX);
+
+  uint32_t next_vertex = 0U;
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    if (remap[indices[i]] == UINT32_MAX) {
+      remap[indices[i]] = next_vertex++;
+    }
+  }
+
+  for (uint32_t v = 0U; v < num_vertices; ++v) {
+    if (remap[v] == UINT32_MAX) {
+      remap[v] = next_vertex++;
+    }
+  }
+}
+
+} // namespace vks
@@ -0,0 +1,372 @@
+#include <EASTL/algorithm.h>
+#include <EASTL/sort.h>
+#include <cmath>
+#include <cstring>
+#define GLM_FORCE_CXX11
+#include <glm/glm.hpp>
+#include <mesh_simplifier.h>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+const uint32_t kMaxMeshLods = 4U;
+const float kMeshLodIndexRatio = 0.5f;
+const float kMeshLodMaxKeptRatio = 0.85f;
+
+// Collapsing is done in passes; each vertex moves at most once per pass
+static const uint32_t kSimplifyMaxPasses = 64U;
+// Collapses turning a triangle by more than about 75 degrees are rejected
+static const double kSimplifyMinNormalCos = 0.25;
+
+// Sum of the squared distances to a set of planes, weighted by area
+struct Quadric {
+  double a00, a11, a22, a01, a02, a12;
+  double b0, b1, b2;
+  double c;
+  double weight;
+}; // struct Quadric
+
+struct EdgeCollapse {
+  uint32_t from;
+  uint32_t to;
+  double error;
+}; // struct EdgeCollapse
+
+static Quadric GetPlaneQuadric(const glm::dvec3 &normal, double distance,
+                               double weight) {
+  Quadric q;
+  q.a00 = normal.x * normal.x * weight;
+  q.a11 = normal.y * normal.y * weight;
+  q.a22 = normal.z * normal.z * weight;
+  q.a01 = normal.x * normal.y * weight;
+  q.a02 = normal.x * normal.z * weight;
+  q.a12 = normal.y * normal.z * weight;
+  q.b0 = normal.x * distance * weight;
+  q.b1 = normal.y * distance * weight;
+  q.b2 = normal.z * distance * weight;
+  q.c = distance * distance * weight;
+  q.weight = weight;
+
+  return q;
+}
+
+static void AddQuadric(Quadric &dst, const Quadric &src) {
+  dst.a00 += src.a00;
+  dst.a11 += src.a11;
+  dst.a22 += src.a22;
+  dst.a01 += src.a01;
+  dst.a02 += src.a02;
+  dst.a12 += src.a12;
+  dst.b0 += src.b0;
+  dst.b1 += src.b1;
+  dst.b2 += src.b2;
+  dst.c += src.c;
+  dst.weight += src.weight;
+}
+
+// Mean squared distance of a point to the planes of a pair of quadrics
+static double GetQuadricError(const Quadric &lhs, const Quadric &rhs,
+                              const glm::dvec3 &p) {
+  Quadric q = lhs;
+  AddQuadric(q, rhs);
+
+  double error = q.a00 * p.x * p.x + q.a11 * p.y * p.y + q.a22 * p.z * p.z +
+                 2.0 * (q.a01 * p.x * p.y + q.a02 * p.x * p.z +
+                        q.a12 * p.y * p.z) +
+                 2.0 * (q.b0 * p.x + q.b1 * p.y + q.b2 * p.z) + q.c;
+
+  return (q.weight > 0.0) ? fabs(error) / q.weight : fabs(error);
+}
+
+static glm::dvec3 GetTriangleNormal(const glm::dvec3 &p0,
+                                    const glm::dvec3 &p1,
+                                    const glm::dvec3 &p2) {
+  return glm::cross(p1 - p0, p2 - p0);
+}
+
+// Whether moving a vertex would flip any of the triangles around it
+static bool CollapseFlipsTriangles(
+    const eastl::vector<uint32_t> &indices,
+    const eastl::vector<uint32_t> &canonical,
+    const eastl::vector<glm::dvec3> &positions,
+    const eastl::vector<uint32_t> &adjacency_offsets,
+    const eastl::vector<uint32_t> &adjacency, uint32_t from, uint32_t to) {
+  for (uint32_t a = adjacency_offsets[from]; a < adjacency_offsets[from + 1U];
+       ++a) {
+    const uint32_t *tri = indices.data() + adjacency[a] * 3U;
+    uint32_t v0 = canonical[tri[0U]];
+    uint32_t v1 = canonical[tri[1U]];
+    uint32_t v2 = canonical[tri[2U]];
+
+    // Triangles on the collapsed edge go away
+    if (v0 == to || v1 == to || v2 == to) {
+      continue;
+    }
+
+    glm::dvec3 before =
+        GetTriangleNormal(positions[v0], positions[v1], positions[v2]);
+    glm::dvec3 after = GetTriangleNormal(positions[(v0 == from) ? to : v0],
+                                         positions[(v1 == from) ? to : v1],
+                                         positions[(v2 == from) ? to : v2]);
+    if (glm::dot(before, after) <=
+        kSimplifyMinNormalCos * glm::length(before) * glm::length(after)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+float SimplifyMesh(const uint32_t *indices, uint32_t num_indices,
+                   const uint8_t *positions, uint32_t stride,
+                   uint32_t target_num_indices,
+                   eastl::vector<uint32_t> &result) {
+  num_indices -= num_indices % 3U;
+  result.clear();
+  if (num_indices == 0U) {
+    return 0.f;
+  }
+
+  // Work on indices local to the range of vertices used by the mesh
+  uint32_t min_idx = UINT32_MAX;
+  uint32_t max_idx = 0U;
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    min_idx = eastl::min(min_idx, indices[i]);
+    max_idx = eastl::max(max_idx, indices[i]);
+  }
+  uint32_t num_vertices = max_idx - min_idx + 1U;
+
+  eastl::vector<uint32_t> local_indices(num_indices);
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    local_indices[i] = indices[i] - min_idx;
+  }
+
+  eastl::vector<glm::dvec3> local_positions(num_vertices);
+  for (uint32_t v = 0U; v < num_vertices; ++v) {
+    glm::vec3 pos;
+    memcpy(&pos, positions + static_cast<size_t>(min_idx + v) * stride,
+           sizeof(glm::vec3));
+    local_positions[v] = glm::dvec3(pos);
+  }
+
+  // Vertices sharing a position are one vertex as far as the topology goes;
+  // the first one of each group stands for the others
+  eastl::vector<uint32_t> sorted_vertices(num_vertices);
+  for (uint32_t v = 0U; v < num_vertices; ++v) {
+    sorted_vertices[v] = v;
+  }
+  eastl::sort(sorted_vertices.begin(), sorted_vertices.end(),
+              [&local_positions](uint32_t lhs, uint32_t rhs) {
+                const glm::dvec3 &l = local_positions[lhs];
+                const glm::dvec3 &r = local_positions[rhs];
+                if (l.x != r.x) {
+                  return l.x < r.x;
+                }
+                if (l.y != r.y) {
+                  return l.y < r.y;
+                }
+                if (l.z != r.z) {
+                  return l.z < r.z;
+                }
+                return lhs < rhs;
+              });
+
+  eastl::vector<uint32_t> canonical(num_vertices);
+  eastl::vector<uint32_t> num_twins(num_vertices, 0U);
+  for (uint32_t i = 0U; i < num_vertices; ++i) {
+    uint32_t v = sorted_vertices[i];
+    bool same_as_prev =
+        i > 0U &&
+        local_positions[sorted_vertices[i - 1U]] == local_positions[v];
+    canonical[v] = same_as_prev ? canonical[sorted_vertices[i - 1U]] : v;
+    ++num_twins[canonical[v]];
+  }
+
+  // Border and non-manifold edges have no single matching opposite edge
+  uint32_t num_tris = num_indices / 3U;
+  eastl::vector<uint64_t> half_edges(num_indices);
+  for (uint32_t t = 0U; t < num_tris; ++t) {
+    for (uint32_t k = 0U; k < 3U; ++k) {
+      uint64_t a = canonical[local_indices[t * 3U + k]];
+      uint64_t b = canonical[local_indices[t * 3U + (k + 1U) % 3U]];
+      half_edges[t * 3U + k] = (a << 32U) | b;
+    }
+  }
+  eastl::sort(half_edges.begin(), half_edges.end());
+
+  // Only vertices which are on their own and fully surrounded can move
+  eastl::vector<bool> locked(num_vertices, false);
+  for (uint32_t v = 0U; v < num_vertices; ++v) {
+    locked[v] = num_twins[canonical[v]] > 1U;
+  }
+  for (eastl::vector<uint64_t>::iterator itor = half_edges.begin();
+       itor != half_edges.end(); ++itor) {
+    uint64_t a = *itor >> 32U;
+    uint64_t b = *itor & 0xffffffffU;
+    uint64_t opposite = (b << 32U) | a;
+    eastl::pair<eastl::vector<uint64_t>::iterator,
+                eastl::vector<uint64_t>::iterator>
+        range = eastl::equal_range(half_edges.begin(), half_edges.end(),
+                                   opposite);
+    eastl::pair<eastl::vector<uint64_t>::iterator,
+                eastl::vector<uint64_t>::iterator>
+        same_range =
+            eastl::equal_range(half_edges.begin(), half_edges.end(), *itor);
+    if (range.second - range.first != 1 ||
+        same_range.second - same_range.first != 1) {
+      locked[SCAST_U32(a)] = true;
+      locked[SCAST_U32(b)] = true;
+    }
+  }
+
+  // Quadrics of the planes of the triangles around each vertex
+  Quadric zero_quadric;
+  memset(&zero_quadric, 0, sizeof(zero_quadric));
+  eastl::vector<Quadric> quadrics(num_vertices, zero_quadric);
+  for (uint32_t t = 0U; t < num_tris; ++t) {
+    uint32_t v0 = canonical[local_indices[t * 3U]];
+    uint32_t v1 = canonical[local_indices[t * 3U + 1U]];
+    uint32_t v2 = canonical[local_indices[t * 3U + 2U]];
+    glm::dvec3 normal = GetTriangleNormal(
+        local_positions[v0], local_positions[v1], local_positions[v2]);
+    double area = glm::length(normal);
+    if (area == 0.0) {
+      continue;
+    }
+    normal /= area;
+
+    Quadric q = GetPlaneQuadric(
+        normal, -glm::dot(normal, local_positions[v0]), area * 0.5);
+    AddQuadric(quadrics[v0], q);
+    AddQuadric(quadrics[v1], q);
+    AddQuadric(quadrics[v2], q);
+  }
+
+  double max_error = 0.0;
+  eastl::vector<uint32_t> adjacency_offsets(num_vertices + 1U);
+  eastl::vector<uint32_t> adjacency;
+  eastl::vector<EdgeCollapse> collapses;
+  eastl::vector<bool> touched(num_vertices);
+  eastl::vector<uint32_t> collapse_to(num_vertices);
+  for (uint32_t pass = 0U;
+       pass < kSimplifyMaxPasses && local_indices.size() > target_num_indices;
+       ++pass) {
+    num_tris = SCAST_U32(local_indices.size()) / 3U;
+
+    // Triangles around each vertex
+    eastl::fill(adjacency_offsets.begin(), adjacency_offsets.end(), 0U);
+    for (uint32_t i = 0U; i < num_tris * 3U; ++i) {
+      ++adjacency_offsets[canonical[local_indices[i]] + 1U];
+    }
+    for (uint32_t v = 0U; v < num_vertices; ++v) {
+      adjacency_offsets[v + 1U] += adjacency_offsets[v];
+    }
+    adjacency.resize(num_tris * 3U);
+    eastl::vector<uint32_t> fill_offsets(adjacency_offsets.begin(),
+                                         adjacency_offsets.end() - 1U);
+    for (uint32_t i = 0U; i < num_tris * 3U; ++i) {
+      adjacency[fill_offsets[canonical[local_indices[i]]]++] = i / 3U;
+    }
+
+    // Cheapest direction of every edge which can collapse at all
+    collapses.clear();
+    for (uint32_t i = 0U; i < num_tris * 3U; ++i) {
+      uint32_t a = canonical[local_indices[i]];
+      uint32_t b = canonical[local_indices[i - i % 3U + (i + 1U) % 3U]];
+      if (a > b) {
+        continue;
+      }
+
+      // The remaining vertex must not be split either, or the triangles
+      // of the removed one could pick up the wrong attributes
+      EdgeCollapse collapse = {0U, 0U, -1.0};
+      if (!locked[a] && num_twins[b] == 1U) {
+        collapse.from = a;
+        collapse.to = b;
+        collapse.error =
+            GetQuadricError(quadrics[a], quadrics[b], local_positions[b]);
+      }
+      if (!locked[b] && num_twins[a] == 1U) {
+        double error =
+            GetQuadricError(quadrics[a], quadrics[b], local_positions[a]);
+        if (collapse.error < 0.0 || error < collapse.error) {
+          collapse.from = b;
+          collapse.to = a;
+          collapse.error = error;
+        }
+      }
+      if (collapse.error >= 0.0) {
+        collapses.push_back(collapse);
+      }
+    }
+
+    eastl::sort(collapses.begin(), collapses.end(),
+                [](const EdgeCollapse &lhs, const EdgeCollapse &rhs) {
+                  return lhs.error < rhs.error;
+                });
+
+    // Each collapse removes about two triangles
+    uint32_t target_tris = target_num_indices / 3U;
+    uint32_t max_collapses = (num_tris - target_tris) / 2U + 1U;
+    uint32_t num_collapses = 0U;
+    eastl::fill(touched.begin(), touched.end(), false);
+    for (uint32_t v = 0U; v < num_vertices; ++v) {
+      collapse_to[v] = v;
+    }
+
+    for (eastl::vector<EdgeCollapse>::iterator itor = collapses.begin();
+         itor != collapses.end() && num_collapses < max_collapses; ++itor) {
+      if (touched[itor->from] || touched[itor->to] ||
+          CollapseFlipsTriangles(local_indices, canonical, local_positions,
+                                 adjacency_offsets, adjacency, itor->from,
+                                 itor->to)) {
+        continue;
+      }
+
+      // Nothing around the moved vertex can change again in this pass, or
+      // the flip test above would not hold anymore
+      for (uint32_t a = adjacency_offsets[itor->from];
+           a < adjacency_offsets[itor->from + 1U]; ++a) {
+        const uint32_t *tri = local_indices.data() + adjacency[a] * 3U;
+        touched[canonical[tri[0U]]] = true;
+        touched[canonical[tri[1U]]] = true;
+        touched[canonical[tri[2U]]] = true;
+      }
+
+      collapse_to[itor->from] = itor->to;
+      AddQuadric(quadrics[itor->to], quadrics[itor->from]);
+      max_error = eastl::max(max_error, itor->error);
+      ++num_collapses;
+    }
+
+    if (num_collapses == 0U) {
+      break;
+    }
+
+    // Moved vertices are never split, so they are their own canonical one
+    uint32_t write_idx = 0U;
+    for (uint32_t t = 0U; t < num_tris; ++t) {
+      uint32_t v0 = collapse_to[local_indices[t * 3U]];
+      uint32_t v1 = collapse_to[local_indices[t * 3U + 1U]];
+      uint32_t v2 = collapse_to[local_indices[t * 3U + 2U]];
+      if (canonical[v0] == canonical[v1] || canonical[v1] == canonical[v2] ||
+          canonical[v0] == canonical[v2]) {
+        continue;
+      }
+
+      local_indices[write_idx++] = v0;
+      local_indices[write_idx++] = v1;
+      local_indices[write_idx++] = v2;
+    }
+    local_indices.resize(write_idx);
+  }
+
+  result.resize(local_indices.size());
+  for (uint32_t i = 0U; i < SCAST_U32(local_indices.size()); ++i) {
+    result[i] = local_indices[i] + min_idx;
+  }
+
+  return SCAST_FLOAT(sqrt(max_error));
+}
+
+} // namespace vks
@@ -1,10 +1,12 @@
 #include <meshes_heap.h>
+#include <vertex_encoding.h>
 #include <vertex_setup.h>
 #include <vulkan_device.h>
 #include <vulkan_tools.h>
 #include <glm/gtc/type_ptr.hpp>
 #include <cstring>
 #include <model.h>
+#include <EASTL/algorithm.h>
 #include <EASTL/sort.h>
 #include <base_system.h>
 #include <logger.hpp>
@@ -18,6 +20,14 @@ extern const uint32_t kIndirectDrawCmdsBindingPos = 3U;
 extern const uint32_t kIdxBufferBindPos = 2U;
 extern const uint32_t kModelMatxsBufferBindPos = 0U;
 extern const uint32_t kMaterialIDsBufferBindPos = 1U;
+// Comes after the vertex buffers, one per VertexElementType
+extern const uint32_t kMeshClustersBufferBindPos = 10U;
+// Mesh of every instance, for the passes which only know the instance
+extern const uint32_t kInstanceMeshesBufferBindPos = 11U;
+// Bounds of every mesh, see MeshBounds
+extern const uint32_t kMeshBoundsBufferBindPos = 12U;
+// Instances which survived culling, see ModelManager::CullInstances
+extern const uint32_t kVisibleInstancesBufferBindPos = 13U;
 
 MeshesHeapBuilder::MeshesHeapBuilder(
     const VertexSetup &vtx_setup,
@@ -54,6 +64,34 @@ void MeshesHeapBuilder::AddIndex(uint32_t index) {
 }
 
 void MeshesHeapBuilder::AddVertex(const Vertex &vertex) {
+  SetVertex(AllocateVertices(1U), vertex);
+}
+
+uint32_t MeshesHeapBuilder::AllocateVertices(uint32_t count) {
+  uint32_t first_vertex = current_vertex_;
+  current_vertex_ += count;
+
+  uint32_t elm_idx = 0U;
+  for (eastl::vector<eastl::vector<uint8_t>>::iterator i =
+         vertices_data_.begin();
+       i != vertices_data_.end();
+       ++i, ++elm_idx) {
+    i->resize(current_vertex_ * vtx_setup_->GetElementSize(elm_idx));
+  }
+
+  return first_vertex;
+}
+
+uint32_t MeshesHeapBuilder::AllocateIndices(uint32_t count) {
+  uint32_t first_index = SCAST_U32(indices_data_.size());
+  indices_data_.resize(first_index + count);
+
+  return first_index;
+}
+
+void MeshesHeapBuilder::SetVertex(
+    uint32_t vtx_idx,
+    const Vertex &vertex) {
   // Use a vector to layout the data in memory as specified by the layout 
   uint32_t elm_idx = 0U;
   for (eastl::vector<eastl::vector<uint8_t>>::iterator i =
@@ -61,51 +99,45 @@ void MeshesHeapBuilder::AddVertex(const Vertex &vertex) {
        i != vertices_data_.end();
        ++i, ++elm_idx) {
     uint32_t element_size = vtx_setup_->GetElementSize(elm_idx);
-    if (i->size() < (current_vertex_ + 1U) * element_size) {
-      i->resize(i->size() + element_size);
-    }
 
     unsigned char *dst =
       i->data() +
-      (element_size * current_vertex_);
-
-    const void *read_location = nullptr;
-    switch (vtx_setup_->vertex_types_layout()[elm_idx]) {
-      case VertexElementType::POSITION: {
-        read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.pos));
-        break;
-      }
-      case VertexElementType::NORMAL: {
-        read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.normal));
-        break;
-      }
-      case VertexElementType::COLOUR: {
-        read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.colour));
-        break;
-      }
-      case VertexElementType::UV: {
-        read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.uv));
-        break;
-      }
-      case VertexElementType::TANGENT: {
-        read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.tangent));
-        break;
-      }
-      case VertexElementType::BITANGENT: {
-        read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.bitangent));
-        break;
-      }
-      default:
-        ELOG_WARN("Unsupported vertex element type!");
-    }
-
-    memcpy(
+      (element_size * vtx_idx);
+
+    // Heaps have no model bounds, so positions can't be quantised here
+    EncodeVertexElement(
+        vtx_setup_->GetElementEncoding(elm_idx),
+        static_cast<const float *>(GetVertexElementData(
+            vertex,
+            vtx_setup_->vertex_types_layout()[elm_idx])),
         dst,
-        read_location,
         element_size);
   } 
+}
 
-  current_vertex_++;
+void MeshesHeapBuilder::SetVertexElementArray(
+    VertexElementType type,
+    uint32_t first_vertex,
+    uint32_t num_vertices,
+    const void *data,
+    uint32_t stride) {
+  const eastl::vector<VertexElementType> &layout =
+    vtx_setup_->vertex_types_layout();
+  eastl::vector<VertexElementType>::const_iterator itor =
+    eastl::find(layout.begin(), layout.end(), type);
+  if (itor == layout.end()) {
+    return;
+  }
+
+  uint32_t elm_idx = SCAST_U32(itor - layout.begin());
+  uint32_t element_size = vtx_setup_->GetElementSize(elm_idx);
+  EncodeVertexElementArray(
+      vtx_setup_->GetElementEncoding(elm_idx),
+      data,
+      stride,
+      num_vertices,
+      vertices_data_[elm_idx].data() + first_vertex * element_size,
+      element_size);
 }
 
 MeshesHeap::MeshesHeap(const VulkanDevice &device,
@@ -113,6 +145,7 @@ MeshesHeap::MeshesHeap(const VulkanDevice &device,
   : meshes_(),
     vertex_buffers_(),
     index_buffer_(),
+    index_type_(VK_INDEX_TYPE_UINT32),
     vertex_input_state_create_info_(
         tools::inits::PipelineVertexInputStateCreateInfo()),
     bindings_(),
@@ -165,10 +198,9 @@ void MeshesHeap::CreateBuffers(const VulkanDevice &device,
        ++i, ++elm_idx) { 
     init_info.buffer_usage_flags = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-    init_info.memory_property_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    init_info.memory_usage = MemoryUsage::GPU_ONLY;
     init_info.size = SCAST_U32(builder.vertices_data(elm_idx).size()) *
-      SCAST_U32(sizeof(uint8_t)),
-    init_info.cmd_buff = vulkan()->copy_cmd_buff();
+      SCAST_U32(sizeof(uint8_t));
     i->Init(
         device,
         init_info, 
@@ -176,42 +208,39 @@ void MeshesHeap::CreateBuffers(const VulkanDevice &device,
     LOG("BUFF: " << i->buffer());
   }
 
-  init_info.size = SCAST_U32(builder.indices_data().size()) *
-    SCAST_U32(sizeof(uint32_t));
+  // Heaps with few vertices get half the index bandwidth
+  index_type_ = GetIndexType(builder.current_vertex());
+  eastl::vector<uint8_t> packed_indices;
+  PackIndices(
+      builder.indices_data().data(),
+      SCAST_U32(builder.indices_data().size()),
+      index_type_,
+      packed_indices);
+
+  init_info.size = SCAST_U32(packed_indices.size());
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   index_buffer_.Init(
       device,
       init_info, 
-      SCAST_CVOIDPTR(builder.indices_data().data()));
+      SCAST_CVOIDPTR(packed_indices.data()));
 
   // Create model matrices buffer
   init_info.size = meshes_count * SCAST_U32(sizeof(glm::mat4));
-  init_info.memory_property_flags = /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   model_matxs_buff_.Init(device, init_info);
 
-  // Upload the data to it
-  uint32_t mat4_size = SCAST_U32(sizeof(glm::mat4));
-  uint32_t counter = 0U;
+  // Write the data straight into the mapped buffer
+  glm::mat4 *matrices = model_matxs_buff_.MappedAs<glm::mat4>();
   for (eastl::vector<Mesh>::iterator itor = meshes_.begin();
        itor != meshes_.end();
-       ++itor, ++counter) { 
-      void *data = nullptr;
-      model_matxs_buff_.Map(device, &data, mat4_size, counter * mat4_size);
-      *static_cast<glm::mat4 *>(data) = itor->model_mat();
-      model_matxs_buff_.Unmap(device);
+       ++itor, ++matrices) { 
+      *matrices = itor->model_mat();
   }
+  model_matxs_buff_.Flush(device);
  
-  // Create the materials ID buffer
-  init_info.size = SCAST_U32(sizeof(uint32_t)) *
-    meshes_count;
-  init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-
-  materialIDs_buff_.Init(device, init_info);
-
-  // Upload data to it
+  // Create the materials ID buffer, in device local memory
   eastl::vector<uint32_t> material_ids(meshes_count);
   eastl::vector<Mesh>::iterator m_itor = meshes_.begin();
   for (eastl::vector<uint32_t>::iterator itor = material_ids.begin();
@@ -219,22 +248,19 @@ void MeshesHeap::CreateBuffers(const VulkanDevice &device,
        ++itor, ++m_itor) { 
     *itor = m_itor->material_id();
   }
-  void *mapped_memory = nullptr; 
-  materialIDs_buff_.Map(
-      vulkan()->device(),
-      &mapped_memory,
-      SCAST_U32(materialIDs_buff_.size()));
-  memcpy(mapped_memory, SCAST_CVOIDPTR(material_ids.data()),
-      SCAST_U32(material_ids.size()) *
-        SCAST_U32(sizeof(uint32_t)));
-  materialIDs_buff_.Unmap(vulkan()->device());
+  init_info.size = SCAST_U32(sizeof(uint32_t)) *
+    meshes_count;
+  init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  init_info.memory_usage = MemoryUsage::GPU_ONLY;
+
+  materialIDs_buff_.Init(device, init_info,
+      SCAST_CVOIDPTR(material_ids.data()));
  
   // Setup indirect draw buffers
   init_info.size = SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)) *
     meshes_count;
   VKS_ASSERT(init_info.size > 0U, "Size of init_info is zero!");
-  init_info.memory_property_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-    /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/ VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
@@ -253,15 +279,11 @@ void MeshesHeap::CreateBuffers(const VulkanDevice &device,
     itor->vertexOffset = m_itor->vertex_offset();
     itor->firstInstance = 0U;
   }
-  indirect_draw_buff_.Map(
-      vulkan()->device(),
-      &mapped_memory, 
+  indirect_draw_buff_.Write(
+      device,
+      SCAST_CVOIDPTR(indirect_draw_cmds_.data()),
       SCAST_U32(indirect_draw_cmds_.size()) *
         SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)));
-  memcpy(mapped_memory, SCAST_CVOIDPTR(indirect_draw_cmds_.data()),
-     SCAST_U32(indirect_draw_cmds_.size()) *
-      SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)));
-  indirect_draw_buff_.Unmap(vulkan()->device());
 }
 
 void MeshesHeap::CreateDescriptorSet(VkDescriptorSetLayout heap_set_layout) {
@@ -385,7 +407,7 @@ void MeshesHeap::BindIndexBuffer(VkCommandBuffer cmd_buff) const {
       cmd_buff,
       index_buffer_.buffer(),
       0U,
-      VK_INDEX_TYPE_UINT32);
+      index_type_);
 }
 
 void MeshesHeap::Render(
@@ -12,6 +12,7 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include <assimp/vector3.h>
+#include <assimp_ingest.h>
 
 namespace vks {
 
@@ -55,9 +56,12 @@ void MeshesHeapManager::LoadOtherModel(
   
   uint32_t mat_idx_offset = material_manager()->GetMaterialInstancesCount();
 
-  // For each shape, which corresponds to a mesh in the model
+  // For each shape, which corresponds to a mesh in the model; meshes are
+  // laid out in their heap first, then converted concurrently right before
+  // the heap gets created
   uint32_t meshes_count = scene->mNumMeshes;
   uint32_t idx_offset = 0U;
+  eastl::vector<AssimpMeshRange> heap_ranges;
   for (uint32_t mi = 0U; mi < meshes_count; mi++) {
     const aiMesh *ai_mesh = scene->mMeshes[mi];
 
@@ -65,6 +69,10 @@ void MeshesHeapManager::LoadOtherModel(
     if (!current_heap_builder->TestMesh(ai_mesh->mNumVertices,
                                         ai_mesh->mNumFaces * 3U)) {
         // Create heap 
+        IngestAssimpMeshes(
+            heap_ranges,
+            assimp_post_process_steps,
+            *current_heap_builder.get());
         current_model->AddHeap(
           eastl::make_unique<MeshesHeap>(device, *current_heap_builder.get()));
 
@@ -77,75 +85,30 @@ void MeshesHeapManager::LoadOtherModel(
 
         // Reset counters
         idx_offset = 0U;
+        heap_ranges.clear();
     }
 
     // Create a mesh
     current_heap_builder->AddMesh(ai_mesh->mMaterialIndex + mat_idx_offset - 1U,
                                   ai_mesh->mNumFaces * 3U);
 
-    //meshes[mi] = Mesh(
-    //    SCAST_U32(model_builder.indices_data().size()),
-    //    ai_mesh->mNumFaces * 3U,
-    //    0U,
-    //    ai_mesh->mMaterialIndex + mat_idx_offset - 1U);
-   
-    // Load the vertices for this mesh 
-    for (uint32_t i = 0U; i < ai_mesh->mNumVertices; i++) {
-      Vertex vertex; 
-      vertex.pos = {
-        ai_mesh->mVertices[i].x,
-        ai_mesh->mVertices[i].y,
-        ai_mesh->mVertices[i].z
-      };
-      vertex.normal = {
-        ai_mesh->mNormals[i].x,
-        ai_mesh->mNormals[i].y,
-        ai_mesh->mNormals[i].z
-      };
-      if (ai_mesh->mTextureCoords[0U]) {
-        vertex.uv = {
-          ai_mesh->mTextureCoords[0U][i].x,
-          ai_mesh->mTextureCoords[0U][i].y,
-          ai_mesh->mTextureCoords[0U][i].z
-        };
-      }
-      else {
-        vertex.uv = { 0.f, 0.f, 0.f};
-      }
-      if (assimp_post_process_steps & aiProcess_CalcTangentSpace) {
-        vertex.bitangent = {
-          ai_mesh->mBitangents[i].x,
-          ai_mesh->mBitangents[i].y,
-          ai_mesh->mBitangents[i].z
-        };
-        vertex.tangent = {
-          ai_mesh->mTangents[i].x,
-          ai_mesh->mTangents[i].y,
-          ai_mesh->mTangents[i].z
-        };
-
-        if (glm::dot(glm::cross(vertex.normal, vertex.tangent),
-                     vertex.bitangent) < 0.0f) {
-          vertex.tangent = vertex.tangent * -1.0f;
-        }
-      }
-      
-      current_heap_builder->AddVertex(vertex);
-    }
-
-    // Load indices
-    for (uint32_t i = 0U; i < ai_mesh->mNumFaces; i++) {
-      aiFace &face = ai_mesh->mFaces[i];
-      // Superfluous; all faces are triangulated
-      for (uint32_t j = 0U; j < face.mNumIndices; j++) {
-        current_heap_builder->AddIndex(face.mIndices[j] + idx_offset);
-      }
-    }
+    AssimpMeshRange range;
+    range.ai_mesh = ai_mesh;
+    range.first_vertex =
+      current_heap_builder->AllocateVertices(ai_mesh->mNumVertices);
+    range.first_index =
+      current_heap_builder->AllocateIndices(CountAssimpMeshIndices(ai_mesh));
+    range.idx_offset = idx_offset;
+    heap_ranges.push_back(range);
     
     idx_offset += ai_mesh->mNumVertices;
   }
         
   // Create heap 
+  IngestAssimpMeshes(
+      heap_ranges,
+      assimp_post_process_steps,
+      *current_heap_builder.get());
   current_model->AddHeap(
     eastl::make_unique<MeshesHeap>(device, *current_heap_builder.get()));
 
@@ -1,6 +1,11 @@
+#include <EASTL/algorithm.h>
+#include <EASTL/hash_map.h>
+#include <EASTL/sort.h>
 #include <EASTL/vector.h>
 #include <algorithm>
 #include <base_system.h>
+#include <cfloat>
+#include <cmath>
 #include <cstring>
 #include <deferred_renderer.h>
 #include <deque>
@@ -9,8 +14,13 @@
 #include <iostream>
 #include <logger.hpp>
 #include <material_texture_type.h>
+#include <mesh_optimiser.h>
+#include <mesh_simplifier.h>
 #include <model.h>
+#include <model_cache.h>
 #include <queue>
+#include <thread_pool.h>
+#include <vertex_encoding.h>
 #include <vulkan_device.h>
 #include <vulkan_tools.h>
 
@@ -21,6 +31,14 @@ extern const uint32_t kIndirectDrawCmdsBindingPos;
 extern const uint32_t kIdxBufferBindPos;
 extern const uint32_t kModelMatxsBufferBindPos;
 extern const uint32_t kMaterialIDsBufferBindPos;
+extern const uint32_t kMeshClustersBufferBindPos;
+extern const uint32_t kInstanceMeshesBufferBindPos;
+extern const uint32_t kMeshBoundsBufferBindPos;
+extern const uint32_t kVisibleInstancesBufferBindPos;
+
+const float kLodMaxPixelError = 1.f;
+// Vertices addressable with 16-bit indices
+static const uint32_t kMaxIndex16Vertices = 1U << 16U;
 
 Vertex::Vertex()
     : pos(0.f), normal(0.f), uv(0.f), colour(0.f), bitangent(0.f),
@@ -29,76 +47,576 @@ Vertex::Vertex()
 ModelBuilder::ModelBuilder(const VertexSetup &vertex_setup,
                            VkDescriptorPool desc_pool)
     : vertices_data_(vertex_setup.num_elements()), indices_data_(), meshes_(),
-      vertex_size_(vertex_setup.vertex_size()), current_vertex_(0U),
-      vertex_setup_(&vertex_setup), desc_pool_(desc_pool) {}
+      instances_(), nodes_(), vertex_size_(vertex_setup.vertex_size()),
+      current_vertex_(0U), vertex_setup_(&vertex_setup), desc_pool_(desc_pool),
+      pending_position_quantisation_(
+          vertex_setup.HasElement(VertexElementType::POSITION) &&
+          vertex_setup.GetElementEncoding(VertexElementType::POSITION) ==
+              VertexElementEncoding::AABB_UNORM_16),
+      position_dequant_(0.f, 0.f, 0.f, 1.f) {}
+
+uint32_t ModelBuilder::GetStreamElementSize(uint32_t elm_idx) const {
+  // Positions stay as floats until they are quantised
+  if (pending_position_quantisation_ &&
+      vertex_setup_->vertex_types_layout()[elm_idx] ==
+          VertexElementType::POSITION) {
+    return SCAST_U32(sizeof(glm::vec3));
+  }
+
+  return vertex_setup_->GetElementSize(elm_idx);
+}
 
 void ModelBuilder::AddIndex(uint32_t index) { indices_data_.push_back(index); }
 
-void AddVertexElementArray(const void *data, uint32_t size,
-                           VertexElementType type) {}
+// Find the stream holding the positions
+static bool GetPositionElement(const VertexSetup &vertex_setup,
+                               uint32_t &elm_idx) {
+  const eastl::vector<VertexElementType> &layout =
+      vertex_setup.vertex_types_layout();
+  for (elm_idx = 0U; elm_idx < SCAST_U32(layout.size()); ++elm_idx) {
+    if (layout[elm_idx] == VertexElementType::POSITION) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Whether the load-time passes can read the positions as they are stored
+static bool IsFloatPosition(const VertexSetup &vertex_setup,
+                            uint32_t elm_idx) {
+  VkFormat format = vertex_setup.GetElementVulkanFormat(elm_idx);
+  return vertex_setup.GetElementEncoding(elm_idx) ==
+             VertexElementEncoding::RAW &&
+         (format == VK_FORMAT_R32G32B32_SFLOAT ||
+          format == VK_FORMAT_R32G32B32A32_SFLOAT);
+}
+
+// Reorder a list of triangles for the post-transform cache; the optimiser
+// works on indices local to the range of vertices used by the list
+static void OptimiseTrianglesOrder(uint32_t *indices, uint32_t num_indices,
+                                   VertexCacheStats *stats_before,
+                                   VertexCacheStats *stats_after) {
+  uint32_t min_idx = UINT32_MAX;
+  uint32_t max_idx = 0U;
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    min_idx = eastl::min(min_idx, indices[i]);
+    max_idx = eastl::max(max_idx, indices[i]);
+  }
+  uint32_t num_vertices = max_idx - min_idx + 1U;
+
+  eastl::vector<uint32_t> local_indices(num_indices);
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    local_indices[i] = indices[i] - min_idx;
+  }
+
+  if (stats_before != nullptr) {
+    stats_before->Accumulate(AnalyseVertexCache(local_indices.data(),
+                                                num_indices, num_vertices,
+                                                kVertexCacheAnalysisSize));
+  }
+  OptimiseVertexCache(local_indices.data(), num_indices, num_vertices);
+  if (stats_after != nullptr) {
+    stats_after->Accumulate(AnalyseVertexCache(local_indices.data(),
+                                               num_indices, num_vertices,
+                                               kVertexCacheAnalysisSize));
+  }
+
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    indices[i] = local_indices[i] + min_idx;
+  }
+}
+
+// FNV-1a over the vertices a mesh references, in index order, so that
+// meshes made of the same vertices hash the same wherever they are stored
+static uint32_t HashMeshGeometry(
+    const eastl::vector<eastl::vector<uint8_t>> &streams,
+    const eastl::vector<uint32_t> &element_sizes, const uint32_t *indices,
+    const Mesh &mesh) {
+  uint32_t hash = 2166136261U;
+  uint32_t values[2U] = {mesh.index_count(), mesh.material_id()};
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(values);
+  for (uint32_t b = 0U; b < SCAST_U32(sizeof(values)); ++b) {
+    hash = (hash ^ bytes[b]) * 16777619U;
+  }
+
+  for (uint32_t i = 0U; i < mesh.index_count(); ++i) {
+    uint32_t vertex = indices[mesh.start_index() + i] + mesh.vertex_offset();
+    for (uint32_t elm_idx = 0U; elm_idx < SCAST_U32(streams.size());
+         ++elm_idx) {
+      bytes = streams[elm_idx].data() + vertex * element_sizes[elm_idx];
+      for (uint32_t b = 0U; b < element_sizes[elm_idx]; ++b) {
+        hash = (hash ^ bytes[b]) * 16777619U;
+      }
+    }
+  }
+
+  return hash;
+}
+
+const void *GetVertexElementData(const Vertex &vertex,
+                                 VertexElementType type) {
+  switch (type) {
+  case VertexElementType::POSITION: {
+    return SCAST_CVOIDPTR(glm::value_ptr(vertex.pos));
+  }
+  case VertexElementType::NORMAL: {
+    return SCAST_CVOIDPTR(glm::value_ptr(vertex.normal));
+  }
+  case VertexElementType::COLOUR: {
+    return SCAST_CVOIDPTR(glm::value_ptr(vertex.colour));
+  }
+  case VertexElementType::UV: {
+    return SCAST_CVOIDPTR(glm::value_ptr(vertex.uv));
+  }
+  case VertexElementType::TANGENT: {
+    return SCAST_CVOIDPTR(glm::value_ptr(vertex.tangent));
+  }
+  case VertexElementType::BITANGENT: {
+    return SCAST_CVOIDPTR(glm::value_ptr(vertex.bitangent));
+  }
+  default:
+    ELOG_WARN("Unsupported vertex element type!");
+  }
+
+  return nullptr;
+}
+
+VkIndexType GetIndexType(uint32_t num_vertices) {
+  return (num_vertices <= kMaxIndex16Vertices) ? VK_INDEX_TYPE_UINT16
+                                               : VK_INDEX_TYPE_UINT32;
+}
+
+void PackIndices(const uint32_t *indices, uint32_t num_indices,
+                 VkIndexType index_type, eastl::vector<uint8_t> &packed) {
+  if (index_type == VK_INDEX_TYPE_UINT32) {
+    packed.resize(num_indices * sizeof(uint32_t));
+    memcpy(packed.data(), indices, packed.size());
+    return;
+  }
+
+  uint32_t num_words = (num_indices + 1U) / 2U;
+  packed.assign(num_words * sizeof(uint32_t), 0U);
+  uint16_t *dst = reinterpret_cast<uint16_t *>(packed.data());
+  for (uint32_t i = 0U; i < num_indices; ++i) {
+    VKS_ASSERT(indices[i] < kMaxIndex16Vertices,
+               "Index doesn't fit in 16 bits!");
+    dst[i] = static_cast<uint16_t>(indices[i]);
+  }
+}
 
 void ModelBuilder::AddVertex(const Vertex &vertex) {
+  SetVertex(AllocateVertices(1U), vertex);
+}
+
+uint32_t ModelBuilder::AllocateVertices(uint32_t count) {
+  uint32_t first_vertex = current_vertex_;
+  current_vertex_ += count;
 
-  // Use a vector to layout the data in memory as specified by the layout
-  // uint32_t layout_count = vertex_setup_->num_elements();
   uint32_t elm_idx = 0U;
   for (eastl::vector<eastl::vector<uint8_t>>::iterator
            i = vertices_data_.begin();
        i != vertices_data_.end(); ++i, ++elm_idx) {
-    uint32_t element_size = vertex_setup_->GetElementSize(elm_idx);
-    if (i->size() < (current_vertex_ + 1U) * element_size) {
-      i->resize(i->size() + element_size);
+    i->resize(current_vertex_ * GetStreamElementSize(elm_idx));
+  }
+
+  return first_vertex;
+}
+
+void ModelBuilder::SetVertexElementArray(VertexElementType type,
+                                         uint32_t first_vertex,
+                                         uint32_t num_vertices,
+                                         const void *data, uint32_t stride) {
+  const eastl::vector<VertexElementType> &layout =
+      vertex_setup_->vertex_types_layout();
+  eastl::vector<VertexElementType>::const_iterator itor =
+      eastl::find(layout.begin(), layout.end(), type);
+  if (itor == layout.end()) {
+    return;
+  }
+
+  uint32_t elm_idx = SCAST_U32(itor - layout.begin());
+  uint32_t element_size = GetStreamElementSize(elm_idx);
+  VKS_ASSERT((first_vertex + num_vertices) <= current_vertex_,
+             "Vertices have not been allocated!");
+
+  // Pending positions are kept as floats
+  VertexElementEncoding encoding =
+      (element_size != vertex_setup_->GetElementSize(elm_idx))
+          ? VertexElementEncoding::RAW
+          : vertex_setup_->GetElementEncoding(elm_idx);
+  EncodeVertexElementArray(
+      encoding, data, stride, num_vertices,
+      vertices_data_[elm_idx].data() + first_vertex * element_size,
+      element_size);
+}
+
+uint32_t ModelBuilder::AllocateIndices(uint32_t count) {
+  uint32_t first_index = SCAST_U32(indices_data_.size());
+  indices_data_.resize(first_index + count);
+
+  return first_index;
+}
+
+void ModelBuilder::SetVertex(uint32_t vtx_idx, const Vertex &vertex) {
+  // Each element goes to its own stream, encoded as specified by the layout
+  uint32_t elm_idx = 0U;
+  for (eastl::vector<eastl::vector<uint8_t>>::iterator
+           i = vertices_data_.begin();
+       i != vertices_data_.end(); ++i, ++elm_idx) {
+    uint32_t element_size = GetStreamElementSize(elm_idx);
+    unsigned char *dst = i->data() + (element_size * vtx_idx);
+    const float *src = static_cast<const float *>(GetVertexElementData(
+        vertex, vertex_setup_->vertex_types_layout()[elm_idx]));
+
+    if (element_size != vertex_setup_->GetElementSize(elm_idx)) {
+      memcpy(dst, src, element_size);
+    } else {
+      EncodeVertexElement(vertex_setup_->GetElementEncoding(elm_idx), src,
+                          dst, element_size);
+    }
+  }
+}
+
+void ModelBuilder::AddMesh(Mesh *mesh) { meshes_.push_back(mesh); }
+
+void ModelBuilder::AddInstance(uint32_t mesh_idx, const glm::mat4 &model_mat) {
+  instances_.push_back(MeshInstance(mesh_idx, model_mat));
+}
+
+void ModelBuilder::AddInstance(uint32_t mesh_idx, uint32_t node_idx) {
+  instances_.push_back(
+      MeshInstance(mesh_idx, nodes_.world_mat(node_idx), node_idx));
+}
+
+uint32_t ModelBuilder::AddNode(uint32_t parent, const glm::mat4 &local_mat) {
+  return nodes_.AddNode(parent, local_mat);
+}
+
+bool ModelBuilder::IsSameGeometry(const Mesh &lhs, const Mesh &rhs) const {
+  if (lhs.index_count() != rhs.index_count() ||
+      lhs.material_id() != rhs.material_id()) {
+    return false;
+  }
+
+  for (uint32_t i = 0U; i < lhs.index_count(); ++i) {
+    uint32_t lhs_vertex =
+        indices_data_[lhs.start_index() + i] + lhs.vertex_offset();
+    uint32_t rhs_vertex =
+        indices_data_[rhs.start_index() + i] + rhs.vertex_offset();
+    if (lhs_vertex == rhs_vertex) {
+      continue;
+    }
+
+    for (uint32_t elm_idx = 0U; elm_idx < SCAST_U32(vertices_data_.size());
+         ++elm_idx) {
+      uint32_t element_size = GetStreamElementSize(elm_idx);
+      if (memcmp(vertices_data_[elm_idx].data() + lhs_vertex * element_size,
+                 vertices_data_[elm_idx].data() + rhs_vertex * element_size,
+                 element_size) != 0) {
+        return false;
+      }
     }
+  }
 
-    unsigned char *dst = i->data() + (element_size * current_vertex_);
+  return true;
+}
 
-    const void *read_location = nullptr;
-    switch (vertex_setup_->vertex_types_layout()[elm_idx]) {
-    case VertexElementType::POSITION: {
-      read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.pos));
-      break;
+void ModelBuilder::InstanceDuplicateMeshes() {
+  uint32_t num_meshes = SCAST_U32(meshes_.size());
+  for (eastl::vector<Mesh *>::const_iterator itor = meshes_.begin();
+       itor != meshes_.end(); ++itor) {
+    if ((*itor)->num_lods() > 1U) {
+      ELOG_WARN("Meshes already have LODs, they won't be instanced");
+      return;
     }
-    case VertexElementType::NORMAL: {
-      read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.normal));
-      break;
+  }
+
+  eastl::vector<uint32_t> element_sizes(vertices_data_.size());
+  for (uint32_t elm_idx = 0U; elm_idx < SCAST_U32(element_sizes.size());
+       ++elm_idx) {
+    element_sizes[elm_idx] = GetStreamElementSize(elm_idx);
+  }
+
+  eastl::vector<uint32_t> hashes(num_meshes);
+  thread_pool()->ParallelFor(num_meshes, [&](uint32_t mesh_idx) {
+    hashes[mesh_idx] = HashMeshGeometry(vertices_data_, element_sizes,
+                                        indices_data_.data(),
+                                        *meshes_[mesh_idx]);
+  });
+
+  // Map every mesh to the first one with the same geometry
+  eastl::vector<uint32_t> originals(num_meshes);
+  eastl::hash_multimap<uint32_t, uint32_t> originals_by_hash;
+  uint32_t num_duplicates = 0U;
+  for (uint32_t mesh_idx = 0U; mesh_idx < num_meshes; ++mesh_idx) {
+    originals[mesh_idx] = mesh_idx;
+
+    typedef eastl::hash_multimap<uint32_t, uint32_t>::iterator HashItor;
+    eastl::pair<HashItor, HashItor> candidates =
+        originals_by_hash.equal_range(hashes[mesh_idx]);
+    for (HashItor itor = candidates.first; itor != candidates.second; ++itor) {
+      if (IsSameGeometry(*meshes_[itor->second], *meshes_[mesh_idx])) {
+        originals[mesh_idx] = itor->second;
+        ++num_duplicates;
+        break;
+      }
     }
-    case VertexElementType::COLOUR: {
-      read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.colour));
-      break;
+
+    if (originals[mesh_idx] == mesh_idx) {
+      originals_by_hash.insert(
+          eastl::make_pair(hashes[mesh_idx], mesh_idx));
     }
-    case VertexElementType::UV: {
-      read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.uv));
-      break;
+  }
+
+  if (num_duplicates == 0U) {
+    return;
+  }
+
+  // Duplicates become instances, so every mesh needs to be placed first
+  eastl::vector<bool> placed(num_meshes, false);
+  for (eastl::vector<MeshInstance>::const_iterator itor = instances_.begin();
+       itor != instances_.end(); ++itor) {
+    placed[itor->mesh_idx] = true;
+  }
+  for (uint32_t mesh_idx = 0U; mesh_idx < num_meshes; ++mesh_idx) {
+    if (!placed[mesh_idx]) {
+      AddInstance(mesh_idx, meshes_[mesh_idx]->model_mat());
     }
-    case VertexElementType::TANGENT: {
-      read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.tangent));
-      break;
+  }
+
+  // Keep the indices of the originals only
+  eastl::vector<uint32_t> new_mesh_idxs(num_meshes);
+  eastl::vector<Mesh *> kept_meshes;
+  eastl::vector<uint32_t> kept_indices;
+  for (uint32_t mesh_idx = 0U; mesh_idx < num_meshes; ++mesh_idx) {
+    if (originals[mesh_idx] != mesh_idx) {
+      // Originals always come first
+      new_mesh_idxs[mesh_idx] = new_mesh_idxs[originals[mesh_idx]];
+      continue;
     }
-    case VertexElementType::BITANGENT: {
-      read_location = SCAST_CVOIDPTR(glm::value_ptr(vertex.bitangent));
-      break;
+
+    Mesh *mesh = meshes_[mesh_idx];
+    const uint32_t *mesh_indices = indices_data_.data() + mesh->start_index();
+    new_mesh_idxs[mesh_idx] = SCAST_U32(kept_meshes.size());
+    mesh->set_start_index(SCAST_U32(kept_indices.size()));
+    kept_indices.insert(kept_indices.end(), mesh_indices,
+                        mesh_indices + mesh->index_count());
+    kept_meshes.push_back(mesh);
+  }
+
+  for (eastl::vector<MeshInstance>::iterator itor = instances_.begin();
+       itor != instances_.end(); ++itor) {
+    itor->mesh_idx = new_mesh_idxs[itor->mesh_idx];
+  }
+  meshes_.swap(kept_meshes);
+  indices_data_.swap(kept_indices);
+
+  // Then drop the vertices only the duplicates used
+  eastl::vector<bool> referenced(current_vertex_, false);
+  uint32_t num_referenced = 0U;
+  for (eastl::vector<uint32_t>::const_iterator itor = indices_data_.begin();
+       itor != indices_data_.end(); ++itor) {
+    if (!referenced[*itor]) {
+      referenced[*itor] = true;
+      ++num_referenced;
     }
-    default:
-      ELOG_WARN("Unsupported vertex element type!");
+  }
+
+  eastl::vector<uint32_t> remap;
+  GetVertexFetchRemap(indices_data_.data(), SCAST_U32(indices_data_.size()),
+                      current_vertex_, remap);
+  for (eastl::vector<uint32_t>::iterator itor = indices_data_.begin();
+       itor != indices_data_.end(); ++itor) {
+    *itor = remap[*itor];
+  }
+  uint32_t num_vertices_before = current_vertex_;
+  RemapVertices(remap, num_referenced);
+
+  LOG("Instanced " << num_duplicates << " duplicate meshes, keeping "
+                   << meshes_.size() << " meshes and " << current_vertex_
+                   << " of " << num_vertices_before << " vertices");
+}
+
+void ModelBuilder::RemapVertices(const eastl::vector<uint32_t> &remap,
+                                 uint32_t num_vertices) {
+  uint32_t elm_idx = 0U;
+  for (eastl::vector<eastl::vector<uint8_t>>::iterator
+           i = vertices_data_.begin();
+       i != vertices_data_.end(); ++i, ++elm_idx) {
+    uint32_t element_size = GetStreamElementSize(elm_idx);
+    eastl::vector<uint8_t> reordered(num_vertices * element_size);
+    for (uint32_t v = 0U; v < current_vertex_; ++v) {
+      if (remap[v] < num_vertices) {
+        memcpy(reordered.data() + remap[v] * element_size,
+               i->data() + v * element_size, element_size);
+      }
     }
+    i->swap(reordered);
+  }
+
+  current_vertex_ = num_vertices;
+}
+
+void ModelBuilder::OptimiseVertexOrder() {
+  VertexCacheStats stats_before;
+  VertexCacheStats stats_after;
 
-    memcpy(dst, read_location, element_size);
+  // Reorder the triangles within each mesh
+  for (eastl::vector<Mesh *>::const_iterator itor = meshes_.begin();
+       itor != meshes_.end(); ++itor) {
+    uint32_t num_indices =
+        (*itor)->index_count() - (*itor)->index_count() % 3U;
+    if (num_indices == 0U) {
+      continue;
+    }
+
+    OptimiseTrianglesOrder(indices_data_.data() + (*itor)->start_index(),
+                           num_indices, &stats_before, &stats_after);
   }
 
-  // unsigned char *dst = vertices_data_.data() + (vertex_size_ *
-  // current_vertex_);
-  current_vertex_++;
+  // Then move the vertices in the order they get fetched, over the whole
+  // index buffer so that vertices shared between meshes stay shared
+  eastl::vector<uint32_t> remap;
+  GetVertexFetchRemap(indices_data_.data(), SCAST_U32(indices_data_.size()),
+                      current_vertex_, remap);
+
+  for (eastl::vector<uint32_t>::iterator itor = indices_data_.begin();
+       itor != indices_data_.end(); ++itor) {
+    *itor = remap[*itor];
+  }
+
+  RemapVertices(remap, current_vertex_);
+
+  LOG("Vertex cache ACMR: " << stats_before.acmr() << " -> "
+                            << stats_after.acmr()
+                            << ", ATVR: " << stats_before.atvr() << " -> "
+                            << stats_after.atvr());
 }
 
-void ModelBuilder::AddMesh(const Mesh *mesh) { meshes_.push_back(mesh); }
+void ModelBuilder::GenerateLods() {
+  uint32_t pos_elm_idx = 0U;
+  if (!GetPositionElement(*vertex_setup_, pos_elm_idx) ||
+      (!pending_position_quantisation_ &&
+       !IsFloatPosition(*vertex_setup_, pos_elm_idx))) {
+    ELOG_WARN("Unsupported position stream, LODs won't be generated");
+    return;
+  }
+
+  const uint8_t *positions = vertices_data_[pos_elm_idx].data();
+  uint32_t stride = GetStreamElementSize(pos_elm_idx);
+
+  // Simplify the meshes concurrently; every LOD starts from the previous
+  // one, so the chain gets cheaper to build as it goes
+  uint32_t num_meshes = SCAST_U32(meshes_.size());
+  eastl::vector<eastl::vector<eastl::vector<uint32_t>>> lods_indices(
+      num_meshes);
+  eastl::vector<eastl::vector<float>> lods_errors(num_meshes);
+  thread_pool()->ParallelFor(num_meshes, [&](uint32_t mesh_idx) {
+    eastl::vector<eastl::vector<uint32_t>> &mesh_lods =
+        lods_indices[mesh_idx];
+    mesh_lods.reserve(kMaxMeshLods - 1U);
+
+    const uint32_t *src_indices =
+        indices_data_.data() + meshes_[mesh_idx]->start_index();
+    uint32_t src_num_indices = meshes_[mesh_idx]->index_count();
+    float error = 0.f;
+    for (uint32_t lod = 1U; lod < kMaxMeshLods; ++lod) {
+      uint32_t target_num_indices =
+          SCAST_U32(SCAST_FLOAT(src_num_indices) * kMeshLodIndexRatio);
+      target_num_indices -= target_num_indices % 3U;
+
+      eastl::vector<uint32_t> lod_indices;
+      // The errors of the steps add up, which keeps the total conservative
+      error += SimplifyMesh(src_indices, src_num_indices, positions, stride,
+                            target_num_indices, lod_indices);
+      if (lod_indices.empty() ||
+          SCAST_FLOAT(lod_indices.size()) >
+              SCAST_FLOAT(src_num_indices) * kMeshLodMaxKeptRatio) {
+        break;
+      }
+
+      OptimiseTrianglesOrder(lod_indices.data(),
+                             SCAST_U32(lod_indices.size()), nullptr, nullptr);
+      mesh_lods.push_back(eastl::move(lod_indices));
+      lods_errors[mesh_idx].push_back(error);
+
+      src_indices = mesh_lods.back().data();
+      src_num_indices = SCAST_U32(mesh_lods.back().size());
+    }
+  });
+
+  // The LODs go after all the full detail meshes
+  uint32_t num_lods = 0U;
+  uint32_t num_lod_indices = 0U;
+  for (uint32_t mesh_idx = 0U; mesh_idx < num_meshes; ++mesh_idx) {
+    for (uint32_t lod = 0U; lod < SCAST_U32(lods_indices[mesh_idx].size());
+         ++lod) {
+      const eastl::vector<uint32_t> &lod_indices = lods_indices[mesh_idx][lod];
+      uint32_t start_index = AllocateIndices(SCAST_U32(lod_indices.size()));
+      memcpy(indices_data_.data() + start_index, lod_indices.data(),
+             lod_indices.size() * sizeof(uint32_t));
+      meshes_[mesh_idx]->AddLod(MeshLod(start_index,
+                                        SCAST_U32(lod_indices.size()),
+                                        lods_errors[mesh_idx][lod]));
+
+      ++num_lods;
+      num_lod_indices += SCAST_U32(lod_indices.size());
+    }
+  }
+
+  LOG("Generated " << num_lods << " LODs for " << num_meshes
+                   << " meshes, adding " << num_lod_indices << " indices");
+}
+
+void ModelBuilder::QuantisePositions() {
+  uint32_t pos_elm_idx = 0U;
+  if (!pending_position_quantisation_ ||
+      !GetPositionElement(*vertex_setup_, pos_elm_idx)) {
+    return;
+  }
+
+  eastl::vector<uint8_t> &stream = vertices_data_[pos_elm_idx];
+  const glm::vec3 *positions = reinterpret_cast<const glm::vec3 *>(
+      stream.data());
+
+  glm::vec3 aabb_min(FLT_MAX);
+  glm::vec3 aabb_max(-FLT_MAX);
+  for (uint32_t v = 0U; v < current_vertex_; ++v) {
+    aabb_min = glm::min(aabb_min, positions[v]);
+    aabb_max = glm::max(aabb_max, positions[v]);
+  }
+  if (current_vertex_ == 0U) {
+    aabb_min = aabb_max = glm::vec3(0.f);
+  }
+  position_dequant_ = GetPositionDequantisation(aabb_min, aabb_max);
+
+  uint32_t element_size = vertex_setup_->GetElementSize(pos_elm_idx);
+  eastl::vector<uint8_t> quantised(current_vertex_ * element_size);
+  for (uint32_t v = 0U; v < current_vertex_; ++v) {
+    QuantisePosition(
+        positions[v], position_dequant_,
+        reinterpret_cast<uint16_t *>(quantised.data() + v * element_size));
+  }
+  stream.swap(quantised);
+  pending_position_quantisation_ = false;
+
+  LOG("Quantised positions with a step of "
+      << position_dequant_.w / 65535.f);
+}
 
 Model::Model()
-    : meshes_(), vertex_buffers_(), index_buffer_(),
+    : meshes_(), instances_(), transforms_(), first_instance_node_(0U),
+      changed_nodes_(), vertex_buffers_(), index_buffer_(),
+      index_type_(VK_INDEX_TYPE_UINT32),
       vertex_input_state_create_info_(
           tools::inits::PipelineVertexInputStateCreateInfo()),
-      bindings_(), attributes_(), model_matxs_buff_(), materialIDs_buff_(),
-      indirect_draws_buff_(), desc_set_(VK_NULL_HANDLE),
-      desc_pool_(VK_NULL_HANDLE), vtx_setup_() {}
+      bindings_(), attributes_(), model_matxs_buff_(), bounds_buff_(),
+      materialIDs_buff_(), instance_meshes_buff_(), visible_instances_buff_(),
+      indirect_draws_buff_(), clusters_(), clusters_buff_(), bounds_(),
+      instance_bounds_(), instance_visibility_(), num_visible_instances_(0U),
+      selected_lods_(), position_dequant_(0.f, 0.f, 0.f, 1.f),
+      desc_set_(VK_NULL_HANDLE), desc_pool_(VK_NULL_HANDLE), vtx_setup_() {}
 
 void Model::Init(const VulkanDevice &device,
                  const ModelBuilder &model_builder) {
@@ -113,113 +631,338 @@ void Model::Init(const VulkanDevice &device,
   //  return (lhs.material_id() < rhs.material_id());
   //});
 
+  VKS_ASSERT(!model_builder.pending_position_quantisation(),
+             "Positions of the model have not been quantised!");
+
   vtx_setup_ = *model_builder.vertex_setup();
   desc_pool_ = model_builder.desc_pool();
+  position_dequant_ = model_builder.position_dequant();
+  SetupInstances(model_builder.instances(), model_builder.nodes());
 
   CreateBuffers(device, model_builder);
 }
 
+void Model::Init(const VulkanDevice &device, const ModelCacheFile &cache,
+                 const VertexSetup &vertex_setup, VkDescriptorPool desc_pool,
+                 uint32_t mat_idx_offset) {
+  cache.GetMeshes(mat_idx_offset, meshes_);
+  eastl::vector<MeshInstance> instances;
+  TransformHierarchy nodes;
+  cache.GetInstances(instances);
+  cache.GetNodes(nodes);
+  SetupInstances(instances, nodes);
+
+  vtx_setup_ = vertex_setup;
+  desc_pool_ = desc_pool;
+  position_dequant_ = cache.position_dequant();
+
+  uint32_t num_elements = cache.num_elements();
+  eastl::vector<const void *> elms_data(num_elements);
+  eastl::vector<uint32_t> elms_sizes(num_elements);
+  for (uint32_t i = 0U; i < num_elements; ++i) {
+    elms_data[i] = cache.vertices_data(i);
+    elms_sizes[i] = cache.vertices_data_size(i);
+  }
+
+  uint32_t num_vertices =
+      cache.vertices_data_size(0U) / vertex_setup.GetElementSize(0U);
+  CreateGeometryBuffers(device, elms_data, elms_sizes, num_vertices,
+                        cache.indices_data(), cache.num_indices());
+  BuildClusters(elms_data, num_vertices, cache.indices_data());
+  CreateMeshesBuffers(device);
+}
+
 void Model::CreateBuffers(const VulkanDevice &device,
                           const ModelBuilder &builder) {
-  uint32_t meshes_count = SCAST_U32(builder.meshes().size());
+  uint32_t num_elements = builder.vertex_setup()->num_elements();
+  eastl::vector<const void *> elms_data(num_elements);
+  eastl::vector<uint32_t> elms_sizes(num_elements);
+  for (uint32_t i = 0U; i < num_elements; ++i) {
+    elms_data[i] = SCAST_CVOIDPTR(builder.vertices_data(i).data());
+    elms_sizes[i] = SCAST_U32(builder.vertices_data(i).size());
+  }
+  const eastl::vector<uint32_t> &indices = builder.indices_data();
+
+  CreateGeometryBuffers(device, elms_data, elms_sizes,
+                        builder.current_vertex(), indices.data(),
+                        SCAST_U32(indices.size()));
+  BuildClusters(elms_data, builder.current_vertex(), indices.data());
+  CreateMeshesBuffers(device);
+}
 
+void Model::CreateGeometryBuffers(const VulkanDevice &device,
+                                  const eastl::vector<const void *> &elms_data,
+                                  const eastl::vector<uint32_t> &elms_sizes,
+                                  uint32_t num_vertices,
+                                  const uint32_t *indices,
+                                  uint32_t num_indices) {
   // Create buffers for the vertex and index buffers
   VulkanBufferInitInfo init_info;
+  init_info.memory_usage = MemoryUsage::GPU_ONLY;
 
-  vertex_buffers_.resize(builder.vertex_setup()->num_elements());
+  vertex_buffers_.resize(elms_data.size());
   uint32_t elm_idx = 0U;
   for (eastl::vector<VulkanBuffer>::iterator i = vertex_buffers_.begin();
        i != vertex_buffers_.end(); ++i, ++elm_idx) {
     init_info.buffer_usage_flags =
         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-    init_info.memory_property_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-    init_info.size = SCAST_U32(builder.vertices_data(elm_idx).size()) *
-                     SCAST_U32(sizeof(uint8_t)),
-    init_info.cmd_buff = vulkan()->copy_cmd_buff();
-    i->Init(device, init_info,
-            SCAST_CVOIDPTR(builder.vertices_data(elm_idx).data()));
+    init_info.size = elms_sizes[elm_idx] * SCAST_U32(sizeof(uint8_t));
+    i->Init(device, init_info, elms_data[elm_idx]);
   }
 
-  init_info.size =
-      SCAST_U32(builder.indices_data().size()) * SCAST_U32(sizeof(uint32_t));
+  // Models with few vertices get half the index bandwidth
+  index_type_ = GetIndexType(num_vertices);
+  eastl::vector<uint8_t> packed_indices;
+  PackIndices(indices, num_indices, index_type_, packed_indices);
+
+  init_info.size = SCAST_U32(packed_indices.size());
   init_info.buffer_usage_flags =
       VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-  index_buffer_.Init(device, init_info,
-                     SCAST_CVOIDPTR(builder.indices_data().data()));
-
-  // Create model matrices buffer
-  init_info.size = meshes_count * SCAST_U32(sizeof(glm::mat4));
-  init_info.memory_property_flags = /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  index_buffer_.Init(device, init_info, SCAST_CVOIDPTR(packed_indices.data()));
+}
+
+void Model::BuildClusters(const eastl::vector<const void *> &elms_data,
+                          uint32_t num_vertices, const uint32_t *indices) {
+  clusters_.clear();
+  bounds_.Clear();
+
+  uint32_t elm_idx = 0U;
+  if (!GetPositionElement(vtx_setup_, elm_idx)) {
+    ELOG_WARN("No position stream, clusters won't be built");
+    return;
+  }
+
+  const uint8_t *positions = static_cast<const uint8_t *>(elms_data[elm_idx]);
+  uint32_t stride = vtx_setup_.GetElementSize(elm_idx);
+
+  // Bounds are in model space, so quantised positions are expanded first
+  eastl::vector<glm::vec3> dequantised;
+  if (vtx_setup_.GetElementEncoding(elm_idx) ==
+      VertexElementEncoding::AABB_UNORM_16) {
+    dequantised.resize(num_vertices);
+    for (uint32_t v = 0U; v < num_vertices; ++v) {
+      dequantised[v] = DequantisePosition(
+          reinterpret_cast<const uint16_t *>(positions + v * stride),
+          position_dequant_);
+    }
+    positions = reinterpret_cast<const uint8_t *>(dequantised.data());
+    stride = SCAST_U32(sizeof(glm::vec3));
+  } else if (!IsFloatPosition(vtx_setup_, elm_idx)) {
+    ELOG_WARN("Unsupported position stream, clusters won't be built");
+    return;
+  }
+  // Meshes are bound independently of each other
+  bounds_.Resize(SCAST_U32(meshes_.size()));
+  thread_pool()->ParallelFor(
+      SCAST_U32(meshes_.size()), [&](uint32_t mesh_idx) {
+        MeshBounds bounds;
+        ComputeMeshBounds(positions, stride, indices,
+                          meshes_[mesh_idx].start_index(),
+                          meshes_[mesh_idx].index_count(), bounds);
+        bounds_.Set(mesh_idx, bounds);
+      });
+
+  uint32_t mesh_idx = 0U;
+  for (eastl::vector<Mesh>::iterator itor = meshes_.begin();
+       itor != meshes_.end(); ++itor, ++mesh_idx) {
+    uint32_t first_cluster = SCAST_U32(clusters_.size());
+    BuildMeshClusters(positions, stride, indices, itor->start_index(),
+                      itor->index_count(), mesh_idx, clusters_);
+    itor->set_clusters(first_cluster,
+                       SCAST_U32(clusters_.size()) - first_cluster);
+  }
+
+  LOG("Built " << clusters_.size() << " clusters for " << meshes_.size()
+               << " meshes");
+}
+
+void Model::SetupInstances(const eastl::vector<MeshInstance> &instances,
+                           const TransformHierarchy &nodes) {
+  uint32_t meshes_count = SCAST_U32(meshes_.size());
+  instances_ = instances;
+
+  eastl::vector<bool> placed(meshes_count, false);
+  for (eastl::vector<MeshInstance>::const_iterator itor = instances_.begin();
+       itor != instances_.end(); ++itor) {
+    VKS_ASSERT(itor->mesh_idx < meshes_count, "Instance of an unknown mesh!");
+    placed[itor->mesh_idx] = true;
+  }
+  for (uint32_t mesh_idx = 0U; mesh_idx < meshes_count; ++mesh_idx) {
+    if (!placed[mesh_idx]) {
+      instances_.push_back(
+          MeshInstance(mesh_idx, meshes_[mesh_idx].model_mat()));
+    }
+  }
+
+  // The instances of a mesh are drawn together, so they have to be adjacent
+  eastl::stable_sort(instances_.begin(), instances_.end(),
+                     [](const MeshInstance &lhs, const MeshInstance &rhs) {
+                       return lhs.mesh_idx < rhs.mesh_idx;
+                     });
+
+  uint32_t first_instance = 0U;
+  for (uint32_t mesh_idx = 0U; mesh_idx < meshes_count; ++mesh_idx) {
+    uint32_t instance_idx = first_instance;
+    while (instance_idx < SCAST_U32(instances_.size()) &&
+           instances_[instance_idx].mesh_idx == mesh_idx) {
+      ++instance_idx;
+    }
+
+    meshes_[mesh_idx].set_instances(first_instance,
+                                    instance_idx - first_instance);
+    first_instance = instance_idx;
+  }
+
+  // Every instance gets a leaf of its own, so that it can also move alone.
+  // Instances without a node hang from the root with their own matrix
+  transforms_.Clear();
+  uint32_t root_idx = transforms_.AddNode(kNoTransformNode, glm::mat4(1.f));
+  for (uint32_t i = 0U; i < nodes.size(); ++i) {
+    uint32_t parent = nodes.parent(i);
+    transforms_.AddNode(parent == kNoTransformNode ? root_idx : parent + 1U,
+                        nodes.local_mat(i));
+  }
+  first_instance_node_ = transforms_.size();
+  for (eastl::vector<MeshInstance>::iterator itor = instances_.begin();
+       itor != instances_.end(); ++itor) {
+    VKS_ASSERT(itor->node_idx == kNoTransformNode ||
+                   itor->node_idx < nodes.size(),
+               "Instance of an unknown node!");
+    uint32_t node_idx =
+        itor->node_idx == kNoTransformNode
+            ? transforms_.AddNode(root_idx, itor->model_mat)
+            : transforms_.AddNode(itor->node_idx + 1U, glm::mat4(1.f));
+    itor->model_mat = transforms_.world_mat(node_idx);
+  }
+
+  LOG("Placed " << meshes_count << " meshes as " << instances_.size()
+                << " instances, under " << nodes.size() << " nodes");
+}
+
+void Model::CreateMeshesBuffers(const VulkanDevice &device) {
+  uint32_t meshes_count = SCAST_U32(meshes_.size());
+  uint32_t instances_count = SCAST_U32(instances_.size());
+  VulkanBufferInitInfo init_info;
+
+  // Create model matrices buffer, with one matrix per instance
+  init_info.size = instances_count * SCAST_U32(sizeof(glm::mat4));
+  init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   model_matxs_buff_.Init(device, init_info);
 
-  // Upload the data to it
-  uint32_t mat4_size = SCAST_U32(sizeof(glm::mat4));
-  uint32_t counter = 0U;
-  for (eastl::vector<Mesh>::iterator itor = meshes_.begin();
-       itor != meshes_.end(); ++itor, ++counter) {
-    void *data = nullptr;
-    model_matxs_buff_.Map(device, &data, mat4_size, counter * mat4_size);
-    *static_cast<glm::mat4 *>(data) = itor->model_mat();
-    model_matxs_buff_.Unmap(device);
+  // Write the matrices straight into the mapped buffer. Quantised
+  // positions are brought back to model space on the way
+  const glm::mat4 dequant_mat =
+      GetPositionDequantisationMatrix(position_dequant_);
+  glm::mat4 *matrices = model_matxs_buff_.MappedAs<glm::mat4>();
+  for (eastl::vector<MeshInstance>::iterator itor = instances_.begin();
+       itor != instances_.end(); ++itor, ++matrices) {
+    *matrices = itor->model_mat * dequant_mat;
+  }
+  model_matxs_buff_.Flush(device);
+
+  // Create the bounds buffer; it stays zeroed if there are no bounds, and
+  // can't be empty as it is always bound
+  eastl::vector<MeshBounds> meshes_bounds(eastl::max(meshes_count, 1U));
+  for (uint32_t i = 0U; i < bounds_.size(); ++i) {
+    meshes_bounds[i] = bounds_.Get(i);
   }
+  VulkanBufferInitInfo bounds_init_info;
+  bounds_init_info.size =
+      SCAST_U32(sizeof(MeshBounds)) * SCAST_U32(meshes_bounds.size());
+  bounds_init_info.memory_usage = MemoryUsage::GPU_ONLY;
+  bounds_init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  bounds_buff_.Init(device, bounds_init_info,
+                    SCAST_CVOIDPTR(meshes_bounds.data()));
 
-  // Create the materials ID buffer
-  init_info.size = SCAST_U32(sizeof(uint32_t)) * meshes_count;
+  // Create the materials ID buffer; instances use the material of their mesh.
+  // It never changes, so it lives in device local memory
+  eastl::vector<uint32_t> material_ids(instances_count);
+  eastl::vector<uint32_t> instance_meshes(instances_count);
+  eastl::vector<MeshInstance>::const_iterator i_itor = instances_.begin();
+  for (uint32_t i = 0U; i < instances_count; ++i, ++i_itor) {
+    material_ids[i] = meshes_[i_itor->mesh_idx].material_id();
+    instance_meshes[i] = i_itor->mesh_idx;
+  }
+  VulkanBufferInitInfo static_init_info;
+  static_init_info.size = SCAST_U32(sizeof(uint32_t)) * instances_count;
+  static_init_info.memory_usage = MemoryUsage::GPU_ONLY;
+  static_init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  materialIDs_buff_.Init(device, static_init_info,
+                         SCAST_CVOIDPTR(material_ids.data()));
+
+  // Create the buffer of the mesh of every instance
+  instance_meshes_buff_.Init(device, static_init_info,
+                             SCAST_CVOIDPTR(instance_meshes.data()));
+
+  // Create the list of the visible instances of every mesh, laid out like
+  // the instances; until the first culling everything is visible
+  init_info.size = SCAST_U32(sizeof(uint32_t)) * instances_count;
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  visible_instances_buff_.Init(device, init_info);
 
-  materialIDs_buff_.Init(device, init_info);
+  eastl::vector<uint32_t> visible_instances(instances_count);
+  for (uint32_t i = 0U; i < instances_count; ++i) {
+    visible_instances[i] = i;
+  }
+  visible_instances_buff_.Write(
+      device, SCAST_CVOIDPTR(visible_instances.data()),
+      SCAST_U32(visible_instances.size()) * SCAST_U32(sizeof(uint32_t)));
+  instance_visibility_.assign(instances_count, 1U);
+  num_visible_instances_ = instances_count;
 
-  // Upload data to it
-  eastl::vector<uint32_t> material_ids(meshes_count);
-  eastl::vector<Mesh>::iterator m_itor = meshes_.begin();
-  for (eastl::vector<uint32_t>::iterator itor = material_ids.begin();
-       itor != material_ids.end(); ++itor, ++m_itor) {
-    *itor = m_itor->material_id();
-    LOG("MAT ID: " << *itor);
+  // World space bounds of the instances, for culling
+  instance_bounds_.Clear();
+  if (bounds_.size() == meshes_count) {
+    instance_bounds_.Resize(instances_count);
+    for (uint32_t i = 0U; i < instances_count; ++i) {
+      instance_bounds_.Set(
+          i, TransformMeshBounds(bounds_.Get(instances_[i].mesh_idx),
+                                 instances_[i].model_mat));
+    }
   }
-  void *mapped_memory = nullptr;
-  materialIDs_buff_.Map(vulkan()->device(), &mapped_memory);
-  memcpy(mapped_memory, SCAST_CVOIDPTR(material_ids.data()),
-         SCAST_U32(material_ids.size()) * SCAST_U32(sizeof(uint32_t)));
-  materialIDs_buff_.Unmap(vulkan()->device());
 
   // Setup indirect draw buffers
   init_info.size =
       SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)) * meshes_count;
   VKS_ASSERT(init_info.size > 0U, "Size of init_info is zero!");
-  init_info.memory_property_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                    /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   init_info.buffer_usage_flags =
       VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
   indirect_draws_buff_.Init(device, init_info);
 
-  // Upload data to it
-  m_itor = meshes_.begin();
+  // Upload data to it; the instance index only counts the instances of the
+  // draw, the vertex stages add the first one themselves
+  eastl::vector<Mesh>::iterator m_itor = meshes_.begin();
   eastl::vector<VkDrawIndexedIndirectCommand> indirect_draw_cmds(meshes_count);
   for (eastl::vector<VkDrawIndexedIndirectCommand>::iterator
            itor = indirect_draw_cmds.begin();
        itor != indirect_draw_cmds.end(); ++itor, ++m_itor) {
     LOG("idx count: " << m_itor->index_count());
     itor->indexCount = m_itor->index_count();
-    itor->instanceCount = 1U;
+    itor->instanceCount = m_itor->instance_count();
     LOG("start count: " << m_itor->start_index());
     itor->firstIndex = m_itor->start_index();
     itor->vertexOffset = m_itor->vertex_offset();
     itor->firstInstance = 0U;
   }
-  indirect_draws_buff_.Map(vulkan()->device(), &mapped_memory,
-                           SCAST_U32(indirect_draw_cmds.size()) *
-                               SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)));
-  uint32_t sizedrawinx = sizeof(VkDrawIndexedIndirectCommand);
-  memcpy(mapped_memory, SCAST_CVOIDPTR(indirect_draw_cmds.data()),
-         SCAST_U32(indirect_draw_cmds.size()) *
-             SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)));
-  indirect_draws_buff_.Unmap(vulkan()->device());
+  indirect_draws_buff_.Write(
+      device, SCAST_CVOIDPTR(indirect_draw_cmds.data()),
+      SCAST_U32(indirect_draw_cmds.size()) *
+          SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)));
+
+  // The clusters never change, so they live in device memory. The buffer
+  // can't be empty as it is always bound
+  MeshCluster empty_cluster;
+  VulkanBufferInitInfo clusters_init_info;
+  clusters_init_info.size = SCAST_U32(sizeof(MeshCluster)) *
+                            eastl::max(SCAST_U32(clusters_.size()), 1U);
+  clusters_init_info.memory_usage = MemoryUsage::GPU_ONLY;
+  clusters_init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  clusters_buff_.Init(device, clusters_init_info,
+                      clusters_.empty() ? SCAST_CVOIDPTR(&empty_cluster)
+                                        : SCAST_CVOIDPTR(clusters_.data()));
 }
 
 void Model::Shutdown(const VulkanDevice &device) {
@@ -229,8 +972,12 @@ void Model::Shutdown(const VulkanDevice &device) {
     i->Shutdown(device);
   }
   indirect_draws_buff_.Shutdown(device);
+  clusters_buff_.Shutdown(device);
   model_matxs_buff_.Shutdown(device);
+  bounds_buff_.Shutdown(device);
   materialIDs_buff_.Shutdown(device);
+  instance_meshes_buff_.Shutdown(device);
+  visible_instances_buff_.Shutdown(device);
 }
 
 void Model::BindVertexBuffer(VkCommandBuffer cmd_buff) const {
@@ -249,8 +996,7 @@ void Model::BindVertexBuffer(VkCommandBuffer cmd_buff) const {
 }
 
 void Model::BindIndexBuffer(VkCommandBuffer cmd_buff) const {
-  vkCmdBindIndexBuffer(cmd_buff, index_buffer_.buffer(), 0U,
-                       VK_INDEX_TYPE_UINT32);
+  vkCmdBindIndexBuffer(cmd_buff, index_buffer_.buffer(), 0U, index_type_);
 }
 
 void Model::CreateDescriptorSet(const VulkanDevice &device,
@@ -300,6 +1046,26 @@ void Model::WriteDescriptorSet(const VulkanDevice &device) {
       VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &materialIDs_buff_info,
       nullptr));
 
+  VkDescriptorBufferInfo bounds_buff_info =
+      bounds_buff_.GetDescriptorBufferInfo();
+  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
+      desc_set_, kMeshBoundsBufferBindPos, 0U, 1U,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &bounds_buff_info, nullptr));
+
+  VkDescriptorBufferInfo visible_instances_buff_info =
+      visible_instances_buff_.GetDescriptorBufferInfo();
+  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
+      desc_set_, kVisibleInstancesBufferBindPos, 0U, 1U,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &visible_instances_buff_info,
+      nullptr));
+
+  VkDescriptorBufferInfo instance_meshes_buff_info =
+      instance_meshes_buff_.GetDescriptorBufferInfo();
+  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
+      desc_set_, kInstanceMeshesBufferBindPos, 0U, 1U,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &instance_meshes_buff_info,
+      nullptr));
+
   VkDescriptorBufferInfo desc_indirect_draw_buff_info =
       indirect_draws_buff_.GetDescriptorBufferInfo();
   write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
@@ -307,6 +1073,13 @@ void Model::WriteDescriptorSet(const VulkanDevice &device) {
       VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &desc_indirect_draw_buff_info,
       nullptr));
 
+  VkDescriptorBufferInfo clusters_buff_info =
+      clusters_buff_.GetDescriptorBufferInfo();
+  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
+      desc_set_, kMeshClustersBufferBindPos, 0U, 1U,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &clusters_buff_info,
+      nullptr));
+
   vkUpdateDescriptorSets(device.device(), SCAST_U32(write_desc_sets.size()),
                          write_desc_sets.data(), 0U, nullptr);
 }
@@ -323,13 +1096,17 @@ void Model::RenderMeshesByMaterial(VkCommandBuffer cmd_buff,
   uint32_t uint32_t_size = SCAST_U32(sizeof(uint32_t));
   for (eastl::vector<Mesh>::const_iterator itor = meshes_.begin();
        itor != meshes_.end(); itor++, mesh_idx++) {
-    // Set the mesh ID
+    // Set the ID of the first instance of the mesh
+    uint32_t first_instance = itor->first_instance();
     vkCmdPushConstants(cmd_buff, pipe_layout, VK_SHADER_STAGE_VERTEX_BIT, 0U,
-                       uint32_t_size, &mesh_idx);
+                       uint32_t_size, &first_instance);
 
-    // Render the mesh
-    vkCmdDrawIndexed(cmd_buff, itor->index_count(), 1U, itor->start_index(),
-                     itor->vertex_offset(), 0U);
+    // Render the mesh; the draw is read from the buffer so that the LOD
+    // can change without recording the command buffer again
+    vkCmdDrawIndexedIndirect(
+        cmd_buff, indirect_draws_buff_.buffer(),
+        mesh_idx * SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)), 1U,
+        SCAST_U32(sizeof(VkDrawIndexedIndirectCommand)));
   }
 
   // typedef std::map<uint32_t, eastl::vector<const Mesh *>>::const_iterator
@@ -368,24 +1145,63 @@ void Model::RenderMeshesByMaterial(VkCommandBuffer cmd_buff,
 }
 
 void Model::SetModelMatrixForAllMeshes(const glm::mat4 &mat) {
-  // std::for_each(
-  //    meshes_.begin(),
-  //    meshes_.end(),
-  //    [&](Mesh &mesh){
-  //      mesh.set_model_mat(mat);
-  //      void *data = nullptr;
-  //      matx_buff_.Map(
-  //          vulkan()->device(),
-  //          &data);
-  //
-  //      memcpy(
-  //          data,
-  //          &mat,
-  //          SCAST_U32(sizeof(glm::mat4)));
+  transforms_.SetLocalMatrix(0U, mat);
+}
 
-  //      matx_buff_.Unmap(vulkan()->device());
+void Model::SetNodeLocalMatrix(uint32_t node_idx, const glm::mat4 &local_mat) {
+  transforms_.SetLocalMatrix(node_idx, local_mat);
+}
+
+bool Model::UpdateTransforms(eastl::vector<uint32_t> &moved_instances) {
+  moved_instances.clear();
+  if (!transforms_.Update(changed_nodes_)) {
+    return false;
+  }
 
-  //    });
+  // The leaves of the instances come last and in order
+  for (eastl::vector<uint32_t>::const_iterator
+           itor = eastl::lower_bound(changed_nodes_.begin(),
+                                     changed_nodes_.end(),
+                                     first_instance_node_);
+       itor != changed_nodes_.end(); ++itor) {
+    moved_instances.push_back(*itor - first_instance_node_);
+  }
+  if (moved_instances.empty()) {
+    return false;
+  }
+
+  // Write the moved matrices and flush every run of adjacent ones
+  const VulkanDevice &device = vulkan()->device();
+  const VkDeviceSize mat_size = sizeof(glm::mat4);
+  const glm::mat4 dequant_mat =
+      GetPositionDequantisationMatrix(position_dequant_);
+  glm::mat4 *matrices = model_matxs_buff_.MappedAs<glm::mat4>();
+  bool has_bounds = instance_bounds_.size() == SCAST_U32(instances_.size());
+  uint32_t run_start = moved_instances.front();
+  uint32_t run_end = run_start;
+  for (eastl::vector<uint32_t>::const_iterator itor = moved_instances.begin();
+       itor != moved_instances.end(); ++itor) {
+    if (*itor != run_end) {
+      model_matxs_buff_.Flush(device, (run_end - run_start) * mat_size,
+                              run_start * mat_size);
+      run_start = *itor;
+    }
+    run_end = *itor + 1U;
+
+    MeshInstance &instance = instances_[*itor];
+    instance.model_mat = transforms_.world_mat(first_instance_node_ + *itor);
+    matrices[*itor] = instance.model_mat * dequant_mat;
+    if (has_bounds) {
+      instance_bounds_.Set(
+          *itor,
+          TransformMeshBounds(bounds_.Get(instance.mesh_idx),
+                              instance.model_mat));
+    }
+  }
+  model_matxs_buff_.Flush(device, (run_end - run_start) * mat_size,
+                          run_start * mat_size);
+
+  return true;
 }
 
 void Model::CreateAndWriteDescriptorSets(
@@ -397,4 +1213,157 @@ void Model::CreateAndWriteDescriptorSets(
 
 uint32_t Model::NumMeshes() const { return SCAST_U32(meshes_.size()); }
 
+void Model::SelectLods(const glm::vec3 &view_pos, const szt::Frustum &frustum,
+                       float viewport_height, float max_pixel_error) {
+  // Meshes without bounds stay at full detail
+  if (bounds_.size() != SCAST_U32(meshes_.size())) {
+    return;
+  }
+
+  selected_lods_.resize(meshes_.size(), 0U);
+
+  // Pixels covered by one unit at a distance of one unit
+  float proj_scale =
+      viewport_height / (2.f * tanf(glm::radians(frustum.fov_y()) * 0.5f));
+
+  VkDrawIndexedIndirectCommand *draw_cmds = nullptr;
+  uint32_t mesh_idx = 0U;
+  for (eastl::vector<Mesh>::const_iterator itor = meshes_.begin();
+       itor != meshes_.end(); ++itor, ++mesh_idx) {
+    glm::vec4 bounds = bounds_.GetSphere(mesh_idx);
+
+    // The nearest instance decides the detail of all of them
+    uint32_t lod = itor->num_lods() - 1U;
+    uint32_t last_instance = itor->first_instance() + itor->instance_count();
+    for (uint32_t i = itor->first_instance(); i < last_instance && lod > 0U;
+         ++i) {
+      const glm::mat4 &model_mat = instances_[i].model_mat;
+      float scale =
+          eastl::max(glm::length(glm::vec3(model_mat[0])),
+                     eastl::max(glm::length(glm::vec3(model_mat[1])),
+                                glm::length(glm::vec3(model_mat[2]))));
+      glm::vec3 centre =
+          glm::vec3(model_mat * glm::vec4(glm::vec3(bounds), 1.f));
+      float distance = eastl::max(glm::length(centre - view_pos) -
+                                      bounds.w * scale,
+                                  frustum.near());
+
+      uint32_t instance_lod = 0U;
+      while (instance_lod + 1U < itor->num_lods() &&
+             itor->GetLod(instance_lod + 1U).error * scale * proj_scale /
+                     distance <=
+                 max_pixel_error) {
+        ++instance_lod;
+      }
+      lod = eastl::min(lod, instance_lod);
+    }
+
+    if (lod == selected_lods_[mesh_idx]) {
+      continue;
+    }
+    selected_lods_[mesh_idx] = lod;
+
+    if (draw_cmds == nullptr) {
+      draw_cmds = indirect_draws_buff_.MappedAs<VkDrawIndexedIndirectCommand>();
+    }
+    MeshLod mesh_lod = itor->GetLod(lod);
+    draw_cmds[mesh_idx].indexCount = mesh_lod.index_count;
+    draw_cmds[mesh_idx].firstIndex = mesh_lod.start_index;
+  }
+
+  if (draw_cmds != nullptr) {
+    indirect_draws_buff_.Flush(vulkan()->device());
+  }
+}
+
+void Model::GetMaterialScreenSizes(const glm::vec3 &view_pos,
+                                   const szt::Frustum &frustum,
+                                   float viewport_height,
+                                   eastl::vector<float> &screen_sizes) const {
+  bool has_bounds = bounds_.size() == SCAST_U32(meshes_.size());
+  bool culled = instance_visibility_.size() == instances_.size();
+  float proj_scale =
+      viewport_height / (2.f * tanf(glm::radians(frustum.fov_y()) * 0.5f));
+
+  uint32_t mesh_idx = 0U;
+  for (eastl::vector<Mesh>::const_iterator itor = meshes_.begin();
+       itor != meshes_.end(); ++itor, ++mesh_idx) {
+    if (itor->material_id() >= SCAST_U32(screen_sizes.size())) {
+      screen_sizes.resize(itor->material_id() + 1U, 0.f);
+    }
+    float &screen_size = screen_sizes[itor->material_id()];
+
+    uint32_t last_instance = itor->first_instance() + itor->instance_count();
+    for (uint32_t i = itor->first_instance(); i < last_instance; ++i) {
+      if (culled && instance_visibility_[i] == 0U) {
+        continue;
+      }
+      if (!has_bounds) {
+        screen_size = FLT_MAX;
+        break;
+      }
+
+      glm::vec4 bounds = bounds_.GetSphere(mesh_idx);
+      const glm::mat4 &model_mat = instances_[i].model_mat;
+      float scale =
+          eastl::max(glm::length(glm::vec3(model_mat[0])),
+                     eastl::max(glm::length(glm::vec3(model_mat[1])),
+                                glm::length(glm::vec3(model_mat[2]))));
+      glm::vec3 centre =
+          glm::vec3(model_mat * glm::vec4(glm::vec3(bounds), 1.f));
+      float distance = eastl::max(glm::length(centre - view_pos) -
+                                      bounds.w * scale,
+                                  frustum.near());
+      screen_size = eastl::max(screen_size, 2.f * bounds.w * scale *
+                                                proj_scale / distance);
+    }
+  }
+}
+
+uint32_t Model::SetInstancesVisibility(const uint8_t *visibility) {
+  uint32_t instances_count = SCAST_U32(instances_.size());
+  if (eastl::equal(visibility, visibility + instances_count,
+                   instance_visibility_.begin())) {
+    return num_visible_instances_;
+  }
+  instance_visibility_.assign(visibility, visibility + instances_count);
+  num_visible_instances_ = 0U;
+  for (uint32_t i = 0U; i < instances_count; ++i) {
+    num_visible_instances_ += instance_visibility_[i] != 0U ? 1U : 0U;
+  }
+
+  // Compact the visible instances of every mesh at the start of its range,
+  // and only draw those
+  uint32_t *visible_instances = visible_instances_buff_.MappedAs<uint32_t>();
+  VkDrawIndexedIndirectCommand *draw_cmds =
+      indirect_draws_buff_.MappedAs<VkDrawIndexedIndirectCommand>();
+
+  uint32_t mesh_idx = 0U;
+  for (eastl::vector<Mesh>::const_iterator itor = meshes_.begin();
+       itor != meshes_.end(); ++itor, ++mesh_idx) {
+    uint32_t count = 0U;
+    uint32_t last_instance = itor->first_instance() + itor->instance_count();
+    for (uint32_t i = itor->first_instance(); i < last_instance; ++i) {
+      if (instance_visibility_[i] != 0U) {
+        visible_instances[itor->first_instance() + count] = i;
+        ++count;
+      }
+    }
+    draw_cmds[mesh_idx].instanceCount = count;
+  }
+
+  indirect_draws_buff_.Flush(vulkan()->device());
+  visible_instances_buff_.Flush(vulkan()->device());
+
+  return num_visible_instances_;
+}
+
+void Model::SetInstanceModelMatrix(uint32_t instance_idx,
+                                   const glm::mat4 &mat) {
+  uint32_t node_idx = GetInstanceNode(instance_idx);
+  const glm::mat4 &parent_mat =
+      transforms_.world_mat(transforms_.parent(node_idx));
+  transforms_.SetLocalMatrix(node_idx, glm::inverse(parent_mat) * mat);
+}
+
 } // namespace vks
@@ -0,0 +1,611 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <glm/gtc/type_ptr.hpp>
+#include <logger.hpp>
+#include <model.h>
+#include <model_cache.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vertex_setup.h>
+#include <vulkan_tools.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace vks {
+
+const uint32_t kModelCacheVersion = 7U;
+const uint32_t kCookVertexOrderOptimised = 1U << 0U;
+const uint32_t kCookLodsGenerated = 1U << 1U;
+
+// "VKSM" when read as bytes
+static const uint32_t kModelCacheMagic = 0x4d534b56U;
+// Every block in the file starts at a multiple of this
+static const uint64_t kModelCacheBlockAlignment = 16U;
+static const char *kModelCacheExtension = ".vksmesh";
+
+struct ModelCacheElement {
+  uint32_t type;
+  uint32_t size_bytes;
+  uint32_t format;
+  uint32_t encoding;
+  uint64_t offset;
+  uint64_t size;
+}; // struct ModelCacheElement
+
+struct ModelCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t post_process_steps;
+  uint32_t cook_flags;
+  uint32_t num_elements;
+  uint32_t padding;
+  uint64_t source_size;
+  int64_t source_mtime;
+  uint32_t num_vertices;
+  uint32_t num_indices;
+  uint32_t num_meshes;
+  uint32_t num_materials;
+  uint32_t num_lods;
+  uint32_t num_instances;
+  uint32_t num_nodes;
+  float position_dequant[4];
+  uint64_t indices_offset;
+  uint64_t meshes_offset;
+  uint64_t lods_offset;
+  uint64_t instances_offset;
+  uint64_t nodes_offset;
+  uint64_t materials_offset;
+  uint64_t file_size;
+  ModelCacheElement elements[SCAST_U32(VertexElementType::num_items)];
+}; // struct ModelCacheHeader
+
+struct ModelCacheMesh {
+  uint32_t start_index;
+  uint32_t index_count;
+  uint32_t vertex_offset;
+  // Relative to the first material of the model
+  uint32_t material_idx;
+}; // struct ModelCacheMesh
+
+// LODs beyond the full detail one, sorted by mesh and then by detail
+struct ModelCacheLod {
+  uint32_t mesh_idx;
+  uint32_t start_index;
+  uint32_t index_count;
+  float error;
+}; // struct ModelCacheLod
+
+// Placements of the meshes which were given some; column major matrices
+struct ModelCacheInstance {
+  uint32_t mesh_idx;
+  uint32_t node_idx;
+  float model_mat[16];
+}; // struct ModelCacheInstance
+
+// Transform hierarchy, parents first; column major matrices
+struct ModelCacheNode {
+  uint32_t parent;
+  float local_mat[16];
+}; // struct ModelCacheNode
+
+static bool GetSourceFileStats(const eastl::string &filename, uint64_t &size,
+                               int64_t &mtime) {
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0) {
+    return false;
+  }
+
+  size = static_cast<uint64_t>(info.st_size);
+  mtime = static_cast<int64_t>(info.st_mtime);
+  return true;
+}
+
+static void AppendBytes(eastl::vector<uint8_t> &blob, const void *data,
+                        uint64_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  blob.insert(blob.end(), bytes, bytes + size);
+}
+
+static void AlignBlob(eastl::vector<uint8_t> &blob, uint64_t alignment) {
+  uint64_t remainder = blob.size() % alignment;
+  if (remainder != 0U) {
+    blob.resize(blob.size() + (alignment - remainder), 0U);
+  }
+}
+
+static void AppendString(eastl::vector<uint8_t> &blob,
+                         const eastl::string &str) {
+  uint32_t length = SCAST_U32(str.size());
+  AppendBytes(blob, &length, sizeof(length));
+  AppendBytes(blob, str.data(), length);
+  AlignBlob(blob, sizeof(uint32_t));
+}
+
+static bool ReadBytes(const uint8_t *data, uint64_t data_size,
+                      uint64_t &offset, void *dst, uint64_t size) {
+  if (offset + size > data_size) {
+    return false;
+  }
+
+  memcpy(dst, data + offset, size);
+  offset += size;
+  return true;
+}
+
+static bool ReadString(const uint8_t *data, uint64_t data_size,
+                       uint64_t &offset, eastl::string &str) {
+  uint32_t length = 0U;
+  if (!ReadBytes(data, data_size, offset, &length, sizeof(length)) ||
+      offset + length > data_size) {
+    return false;
+  }
+
+  str.assign(reinterpret_cast<const char *>(data + offset), length);
+  offset += length;
+  offset += (sizeof(uint32_t) - (offset % sizeof(uint32_t))) %
+            sizeof(uint32_t);
+  return true;
+}
+
+CookedMaterial::CookedMaterial() : name(), consts(), textures() {}
+
+ModelCacheFile::ModelCacheFile()
+    : data_(nullptr), size_(0U), num_elements_(0U), num_indices_(0U),
+      num_meshes_(0U), num_lods_(0U), num_instances_(0U), num_nodes_(0U),
+      position_dequant_(0.f, 0.f, 0.f, 1.f), materials_() {}
+
+ModelCacheFile::~ModelCacheFile() { Close(); }
+
+eastl::string ModelCacheFile::GetCachePath(const eastl::string &source_filename,
+                                           uint32_t post_process_steps,
+                                           uint32_t cook_flags) {
+  char flags_str[32U];
+  snprintf(flags_str, sizeof(flags_str), ".%08x.%02x", post_process_steps,
+           cook_flags);
+
+  return source_filename + flags_str + kModelCacheExtension;
+}
+
+bool ModelCacheFile::Open(const eastl::string &source_filename,
+                          uint32_t post_process_steps, uint32_t cook_flags,
+                          const VertexSetup &vertex_setup) {
+  Close();
+
+  uint64_t source_size = 0U;
+  int64_t source_mtime = 0;
+  if (!GetSourceFileStats(source_filename, source_size, source_mtime)) {
+    return false;
+  }
+
+  if (!Map(GetCachePath(source_filename, post_process_steps, cook_flags))) {
+    return false;
+  }
+
+  ModelCacheHeader header;
+  if (size_ < sizeof(header)) {
+    Close();
+    return false;
+  }
+  memcpy(&header, data_, sizeof(header));
+
+  bool is_valid = header.magic == kModelCacheMagic &&
+                  header.version == kModelCacheVersion &&
+                  header.post_process_steps == post_process_steps &&
+                  header.cook_flags == cook_flags &&
+                  header.source_size == source_size &&
+                  header.source_mtime == source_mtime &&
+                  header.file_size == size_ &&
+                  header.num_elements == vertex_setup.num_elements() &&
+                  header.indices_offset +
+                          header.num_indices * sizeof(uint32_t) <=
+                      size_ &&
+                  header.meshes_offset +
+                          header.num_meshes * sizeof(ModelCacheMesh) <=
+                      size_ &&
+                  header.lods_offset +
+                          header.num_lods * sizeof(ModelCacheLod) <=
+                      size_ &&
+                  header.instances_offset +
+                          header.num_instances * sizeof(ModelCacheInstance) <=
+                      size_ &&
+                  header.nodes_offset +
+                          header.num_nodes * sizeof(ModelCacheNode) <=
+                      size_;
+
+  // The streams are stored already laid out, so the layout has to match
+  for (uint32_t i = 0U; is_valid && i < header.num_elements; ++i) {
+    const ModelCacheElement &element = header.elements[i];
+    is_valid =
+        element.type ==
+            SCAST_U32(vertex_setup.vertex_types_layout()[i]) &&
+        element.size_bytes == vertex_setup.GetElementSize(i) &&
+        element.format == SCAST_U32(vertex_setup.GetElementVulkanFormat(i)) &&
+        element.encoding == SCAST_U32(vertex_setup.GetElementEncoding(i)) &&
+        element.size ==
+            static_cast<uint64_t>(element.size_bytes) * header.num_vertices &&
+        element.offset + element.size <= size_;
+  }
+
+  // Parents have to come first for the hierarchy to be rebuilt in order
+  const ModelCacheNode *cached_nodes =
+      reinterpret_cast<const ModelCacheNode *>(data_ + header.nodes_offset);
+  for (uint32_t i = 0U; is_valid && i < header.num_nodes; ++i) {
+    is_valid = cached_nodes[i].parent == kNoTransformNode ||
+               cached_nodes[i].parent < i;
+  }
+
+  if (!is_valid || !ReadMaterials(header.materials_offset)) {
+    LOG("Cooked model for " + source_filename + " is stale; re-cooking.");
+    Close();
+    return false;
+  }
+
+  num_elements_ = header.num_elements;
+  num_indices_ = header.num_indices;
+  num_meshes_ = header.num_meshes;
+  num_lods_ = header.num_lods;
+  num_instances_ = header.num_instances;
+  num_nodes_ = header.num_nodes;
+  position_dequant_ =
+      glm::vec4(header.position_dequant[0], header.position_dequant[1],
+                header.position_dequant[2], header.position_dequant[3]);
+
+  return true;
+}
+
+bool ModelCacheFile::Map(const eastl::string &cache_path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(cache_path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0U, 0U, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    return false;
+  }
+
+  // The view keeps the mapping alive, so the handles can go
+  void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0U, 0U, 0U);
+  CloseHandle(mapping);
+  if (view == nullptr) {
+    return false;
+  }
+
+  data_ = static_cast<const uint8_t *>(view);
+  size_ = static_cast<uint64_t>(file_size.QuadPart);
+#else
+  int fd = open(cache_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                    MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED) {
+    return false;
+  }
+
+  data_ = static_cast<const uint8_t *>(view);
+  size_ = static_cast<uint64_t>(info.st_size);
+#endif
+
+  return true;
+}
+
+void ModelCacheFile::Close() {
+  if (data_ != nullptr) {
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<uint8_t *>(data_), static_cast<size_t>(size_));
+#endif
+  }
+
+  data_ = nullptr;
+  size_ = 0U;
+  num_elements_ = 0U;
+  num_indices_ = 0U;
+  num_meshes_ = 0U;
+  num_lods_ = 0U;
+  num_instances_ = 0U;
+  num_nodes_ = 0U;
+  materials_.clear();
+}
+
+bool ModelCacheFile::ReadMaterials(uint64_t offset) {
+  ModelCacheHeader header;
+  memcpy(&header, data_, sizeof(header));
+
+  materials_.resize(header.num_materials);
+  for (eastl::vector<CookedMaterial>::iterator itor = materials_.begin();
+       itor != materials_.end(); ++itor) {
+    uint32_t num_textures = 0U;
+    if (!ReadString(data_, size_, offset, itor->name) ||
+        !ReadBytes(data_, size_, offset, &itor->consts,
+                   sizeof(MaterialConstants)) ||
+        !ReadBytes(data_, size_, offset, &num_textures,
+                   sizeof(num_textures))) {
+      return false;
+    }
+
+    itor->textures.resize(num_textures);
+    for (eastl::vector<MaterialBuilderTexture>::iterator
+             t_itor = itor->textures.begin();
+         t_itor != itor->textures.end(); ++t_itor) {
+      uint32_t type = 0U;
+      if (!ReadBytes(data_, size_, offset, &type, sizeof(type)) ||
+          type >= SCAST_U32(MatTextureType::size) ||
+          !ReadString(data_, size_, offset, t_itor->name)) {
+        return false;
+      }
+      t_itor->type = static_cast<MatTextureType>(type);
+    }
+  }
+
+  return true;
+}
+
+const void *ModelCacheFile::vertices_data(uint32_t i) const {
+  VKS_ASSERT(IsOpen() && i < num_elements_, "Invalid cached vertex stream!");
+
+  const ModelCacheHeader *header =
+      reinterpret_cast<const ModelCacheHeader *>(data_);
+  return SCAST_CVOIDPTR(data_ + header->elements[i].offset);
+}
+
+uint32_t ModelCacheFile::vertices_data_size(uint32_t i) const {
+  VKS_ASSERT(IsOpen() && i < num_elements_, "Invalid cached vertex stream!");
+
+  const ModelCacheHeader *header =
+      reinterpret_cast<const ModelCacheHeader *>(data_);
+  return SCAST_U32(header->elements[i].size);
+}
+
+const uint32_t *ModelCacheFile::indices_data() const {
+  VKS_ASSERT(IsOpen(), "Model cache is not open!");
+
+  const ModelCacheHeader *header =
+      reinterpret_cast<const ModelCacheHeader *>(data_);
+  return reinterpret_cast<const uint32_t *>(data_ + header->indices_offset);
+}
+
+void ModelCacheFile::GetMeshes(uint32_t mat_idx_offset,
+                               eastl::vector<Mesh> &meshes) const {
+  VKS_ASSERT(IsOpen(), "Model cache is not open!");
+
+  const ModelCacheHeader *header =
+      reinterpret_cast<const ModelCacheHeader *>(data_);
+  const ModelCacheMesh *cached_meshes =
+      reinterpret_cast<const ModelCacheMesh *>(data_ + header->meshes_offset);
+
+  meshes.resize(num_meshes_);
+  for (uint32_t i = 0U; i < num_meshes_; ++i) {
+    meshes[i] = Mesh(cached_meshes[i].start_index,
+                     cached_meshes[i].index_count,
+                     cached_meshes[i].vertex_offset,
+                     cached_meshes[i].material_idx + mat_idx_offset);
+  }
+
+  const ModelCacheLod *cached_lods =
+      reinterpret_cast<const ModelCacheLod *>(data_ + header->lods_offset);
+  for (uint32_t i = 0U; i < num_lods_; ++i) {
+    VKS_ASSERT(cached_lods[i].mesh_idx < num_meshes_, "Invalid cached LOD!");
+    meshes[cached_lods[i].mesh_idx].AddLod(
+        MeshLod(cached_lods[i].start_index, cached_lods[i].index_count,
+                cached_lods[i].error));
+  }
+}
+
+void ModelCacheFile::GetInstances(
+    eastl::vector<MeshInstance> &instances) const {
+  VKS_ASSERT(IsOpen(), "Model cache is not open!");
+
+  const ModelCacheHeader *header =
+      reinterpret_cast<const ModelCacheHeader *>(data_);
+  const ModelCacheInstance *cached_instances =
+      reinterpret_cast<const ModelCacheInstance *>(data_ +
+                                                   header->instances_offset);
+
+  instances.resize(num_instances_);
+  for (uint32_t i = 0U; i < num_instances_; ++i) {
+    VKS_ASSERT(cached_instances[i].mesh_idx < num_meshes_ &&
+                   (cached_instances[i].node_idx == kNoTransformNode ||
+                    cached_instances[i].node_idx < num_nodes_),
+               "Invalid cached instance!");
+    instances[i] = MeshInstance(cached_instances[i].mesh_idx,
+                                glm::make_mat4(cached_instances[i].model_mat),
+                                cached_instances[i].node_idx);
+  }
+}
+
+void ModelCacheFile::GetNodes(TransformHierarchy &nodes) const {
+  VKS_ASSERT(IsOpen(), "Model cache is not open!");
+
+  const ModelCacheHeader *header =
+      reinterpret_cast<const ModelCacheHeader *>(data_);
+  const ModelCacheNode *cached_nodes =
+      reinterpret_cast<const ModelCacheNode *>(data_ + header->nodes_offset);
+
+  nodes.Clear();
+  for (uint32_t i = 0U; i < num_nodes_; ++i) {
+    nodes.AddNode(cached_nodes[i].parent,
+                  glm::make_mat4(cached_nodes[i].local_mat));
+  }
+}
+
+bool ModelCacheFile::Write(const eastl::string &source_filename,
+                           uint32_t post_process_steps, uint32_t cook_flags,
+                           const ModelBuilder &builder, uint32_t mat_idx_offset,
+                           const eastl::vector<CookedMaterial> &materials) {
+  ModelCacheHeader header;
+  memset(&header, 0, sizeof(header));
+
+  if (!GetSourceFileStats(source_filename, header.source_size,
+                          header.source_mtime)) {
+    return false;
+  }
+
+  const VertexSetup *vertex_setup = builder.vertex_setup();
+  header.magic = kModelCacheMagic;
+  header.version = kModelCacheVersion;
+  header.post_process_steps = post_process_steps;
+  header.cook_flags = cook_flags;
+  header.num_elements = vertex_setup->num_elements();
+  header.num_vertices = builder.current_vertex();
+  header.num_indices = SCAST_U32(builder.indices_data().size());
+  header.num_meshes = SCAST_U32(builder.meshes().size());
+  header.num_materials = SCAST_U32(materials.size());
+  const glm::vec4 &position_dequant = builder.position_dequant();
+  for (uint32_t i = 0U; i < 4U; ++i) {
+    header.position_dequant[i] = position_dequant[i];
+  }
+
+  // Reserve room for the header and fill it in once all offsets are known
+  eastl::vector<uint8_t> blob(sizeof(header), 0U);
+  AlignBlob(blob, kModelCacheBlockAlignment);
+
+  for (uint32_t i = 0U; i < header.num_elements; ++i) {
+    const eastl::vector<uint8_t> &elm_data = builder.vertices_data(i);
+    ModelCacheElement &element = header.elements[i];
+    element.type = SCAST_U32(vertex_setup->vertex_types_layout()[i]);
+    element.size_bytes = vertex_setup->GetElementSize(i);
+    element.format = SCAST_U32(vertex_setup->GetElementVulkanFormat(i));
+    element.encoding = SCAST_U32(vertex_setup->GetElementEncoding(i));
+    element.offset = blob.size();
+    element.size = elm_data.size();
+    AppendBytes(blob, elm_data.data(), elm_data.size());
+    AlignBlob(blob, kModelCacheBlockAlignment);
+  }
+
+  const eastl::vector<uint32_t> &indices = builder.indices_data();
+  header.indices_offset = blob.size();
+  AppendBytes(blob, indices.data(), indices.size() * sizeof(uint32_t));
+  AlignBlob(blob, kModelCacheBlockAlignment);
+
+  const eastl::vector<Mesh *> &meshes = builder.meshes();
+  header.meshes_offset = blob.size();
+  for (eastl::vector<Mesh *>::const_iterator itor = meshes.begin();
+       itor != meshes.end(); ++itor) {
+    ModelCacheMesh cached_mesh = {(*itor)->start_index(),
+                                  (*itor)->index_count(),
+                                  (*itor)->vertex_offset(),
+                                  (*itor)->material_id() - mat_idx_offset};
+    AppendBytes(blob, &cached_mesh, sizeof(cached_mesh));
+  }
+  AlignBlob(blob, kModelCacheBlockAlignment);
+
+  header.lods_offset = blob.size();
+  uint32_t mesh_idx = 0U;
+  for (eastl::vector<Mesh *>::const_iterator itor = meshes.begin();
+       itor != meshes.end(); ++itor, ++mesh_idx) {
+    for (uint32_t lod = 1U; lod < (*itor)->num_lods(); ++lod) {
+      MeshLod mesh_lod = (*itor)->GetLod(lod);
+      ModelCacheLod cached_lod = {mesh_idx, mesh_lod.start_index,
+                                  mesh_lod.index_count, mesh_lod.error};
+      AppendBytes(blob, &cached_lod, sizeof(cached_lod));
+      ++header.num_lods;
+    }
+  }
+  AlignBlob(blob, kModelCacheBlockAlignment);
+
+  const eastl::vector<MeshInstance> &instances = builder.instances();
+  header.instances_offset = blob.size();
+  header.num_instances = SCAST_U32(instances.size());
+  for (eastl::vector<MeshInstance>::const_iterator itor = instances.begin();
+       itor != instances.end(); ++itor) {
+    ModelCacheInstance cached_instance;
+    cached_instance.mesh_idx = itor->mesh_idx;
+    cached_instance.node_idx = itor->node_idx;
+    memcpy(cached_instance.model_mat, glm::value_ptr(itor->model_mat),
+           sizeof(cached_instance.model_mat));
+    AppendBytes(blob, &cached_instance, sizeof(cached_instance));
+  }
+  AlignBlob(blob, kModelCacheBlockAlignment);
+
+  const TransformHierarchy &nodes = builder.nodes();
+  header.nodes_offset = blob.size();
+  header.num_nodes = nodes.size();
+  for (uint32_t i = 0U; i < nodes.size(); ++i) {
+    ModelCacheNode cached_node;
+    cached_node.parent = nodes.parent(i);
+    memcpy(cached_node.local_mat, glm::value_ptr(nodes.local_mat(i)),
+           sizeof(cached_node.local_mat));
+    AppendBytes(blob, &cached_node, sizeof(cached_node));
+  }
+  AlignBlob(blob, kModelCacheBlockAlignment);
+
+  header.materials_offset = blob.size();
+  for (eastl::vector<CookedMaterial>::const_iterator itor = materials.begin();
+       itor != materials.end(); ++itor) {
+    AppendString(blob, itor->name);
+    AppendBytes(blob, &itor->consts, sizeof(MaterialConstants));
+    uint32_t num_textures = SCAST_U32(itor->textures.size());
+    AppendBytes(blob, &num_textures, sizeof(num_textures));
+    for (eastl::vector<MaterialBuilderTexture>::const_iterator
+             t_itor = itor->textures.begin();
+         t_itor != itor->textures.end(); ++t_itor) {
+      uint32_t type = SCAST_U32(t_itor->type);
+      AppendBytes(blob, &type, sizeof(type));
+      AppendString(blob, t_itor->name);
+    }
+  }
+
+  header.file_size = blob.size();
+  memcpy(blob.data(), &header, sizeof(header));
+
+  // Write to a temporary file first so that a crash never leaves a
+  // truncated cache behind
+  eastl::string cache_path =
+      GetCachePath(source_filename, post_process_steps, cook_flags);
+  eastl::string tmp_path = cache_path + ".tmp";
+  bool written = false;
+  {
+    std::ofstream file(tmp_path.c_str(), std::ios::out | std::ios::binary |
+                                             std::ios::trunc);
+    if (file.is_open()) {
+      file.write(reinterpret_cast<const char *>(blob.data()),
+                 static_cast<std::streamsize>(blob.size()));
+      written = file.good();
+    }
+  }
+
+  if (!written) {
+    std::remove(tmp_path.c_str());
+    ELOG_WARN("Could not write cooked model " + cache_path + "!");
+    return false;
+  }
+  if (!tools::ReplaceFile(tmp_path.c_str(), cache_path.c_str())) {
+    ELOG_WARN("Could not write cooked model " + cache_path + "!");
+    return false;
+  }
+
+  LOG("Cooked model " + cache_path + ".");
+  return true;
+}
+
+} // namespace vks
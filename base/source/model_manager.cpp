@@ -1,10 +1,10 @@
 #include <model.h>
 #include <model_manager.h>
 #define TINYOBJLOADER_IMPLEMENTATION
+#include <cstring>
 #include <iostream>
 #include <mesh.h>
 #include <tiny_obj_loader.h>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 #define GLM_SWIZZLE_XYZW
@@ -12,15 +12,21 @@
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 #include <assimp/vector3.h>
+#include <assimp_ingest.h>
 #include <base_system.h>
+#include <bounds_bvh.h>
 #include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/hash.hpp>
 #include <logger.hpp>
 #include <material.h>
 #include <material_constants.h>
 #include <material_instance.h>
+#include <model_cache.h>
 #include <string>
 #include <unordered_map>
+#include <vertex_weld.h>
+#include <vulkan_texture_manager.h>
 #include <vulkan_tools.h>
 
 namespace vks {
@@ -28,8 +34,147 @@ namespace vks {
 const eastl::string kBaseAssetsPath = "../assets/";
 const eastl::string kBaseModelAssetsPath = "../assets/models/";
 
+// Add the nodes of a hierarchy to the model, with an instance for every mesh
+// they reference, so that the meshes follow their node
+static void AddAssimpNodes(const aiNode *node, uint32_t parent,
+                           ModelBuilder &model_builder) {
+  // Assimp matrices are row major, and packed; copied out before being read
+  // through a pointer
+  float transformation_data[16U];
+  memcpy(transformation_data, &node->mTransformation,
+         sizeof(transformation_data));
+  uint32_t node_idx = model_builder.AddNode(
+      parent, glm::transpose(glm::make_mat4(transformation_data)));
+  for (uint32_t i = 0U; i < node->mNumMeshes; ++i) {
+    model_builder.AddInstance(node->mMeshes[i], node_idx);
+  }
+
+  for (uint32_t i = 0U; i < node->mNumChildren; ++i) {
+    AddAssimpNodes(node->mChildren[i], node_idx, model_builder);
+  }
+}
+
+// Read the description of the materials of a scene, skipping Assimp's
+// default one
+static void ReadAssimpMaterials(const aiScene *scene,
+                                eastl::vector<CookedMaterial> &materials) {
+  uint32_t materials_count = scene->mNumMaterials;
+  aiString assimp_default_mat_name("DefaultMaterial");
+  for (uint32_t i = 0U; i < materials_count; i++) {
+    // Avoid loading assimp's default material
+    const aiMaterial *ai_mat = scene->mMaterials[i];
+
+    aiString mat_name;
+    ai_mat->Get(AI_MATKEY_NAME, mat_name);
+    if (mat_name == assimp_default_mat_name) {
+      continue;
+    }
+
+    CookedMaterial cooked_mat;
+    cooked_mat.name = mat_name.C_Str();
+
+    MaterialConstants mat_consts;
+    aiColor4D colour;
+    if (ai_mat->Get(AI_MATKEY_COLOR_AMBIENT, colour) == AI_SUCCESS) {
+      mat_consts.ambient = glm::vec3(colour.r, colour.g, colour.b);
+    };
+    if (ai_mat->Get(AI_MATKEY_COLOR_DIFFUSE, colour) == AI_SUCCESS) {
+      mat_consts.diffuse_dissolve =
+          glm::vec4(colour.r, colour.g, colour.b, 2.f);
+    };
+    if (ai_mat->Get(AI_MATKEY_COLOR_SPECULAR, colour) == AI_SUCCESS) {
+      mat_consts.specular_shininess =
+          glm::vec4(colour.r, colour.g, colour.b, 10.f);
+    };
+    if (ai_mat->Get(AI_MATKEY_COLOR_EMISSIVE, colour) == AI_SUCCESS) {
+      mat_consts.emission = glm::vec3(colour.r, colour.g, colour.b);
+    };
+    float value = 0.f;
+    if (ai_mat->Get(AI_MATKEY_SHININESS, value) == AI_SUCCESS) {
+      mat_consts.specular_shininess.w = value;
+    };
+    if (ai_mat->Get(AI_MATKEY_OPACITY, value) == AI_SUCCESS) {
+      mat_consts.diffuse_dissolve.w = value;
+    };
+
+    cooked_mat.consts = mat_consts;
+
+    MaterialBuilderTexture builder_texture;
+    aiString texture_path;
+    builder_texture.type = MatTextureType::AMBIENT;
+    if (ai_mat->GetTexture(aiTextureType_AMBIENT, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    builder_texture.type = MatTextureType::DIFFUSE;
+    builder_texture.name = "";
+    if (ai_mat->GetTexture(aiTextureType_DIFFUSE, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    builder_texture.type = MatTextureType::SPECULAR;
+    builder_texture.name = "";
+    if (ai_mat->GetTexture(aiTextureType_SPECULAR, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    builder_texture.type = MatTextureType::SPECULAR_HIGHLIGHT;
+    builder_texture.name = "";
+    if (ai_mat->GetTexture(aiTextureType_SHININESS, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    builder_texture.type = MatTextureType::NORMAL;
+    builder_texture.name = "";
+    if (ai_mat->GetTexture(aiTextureType_NORMALS, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    } else if (ai_mat->GetTexture(aiTextureType_HEIGHT, 0U, &texture_path) ==
+               AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    builder_texture.type = MatTextureType::ALPHA;
+    builder_texture.name = "";
+    if (ai_mat->GetTexture(aiTextureType_OPACITY, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    builder_texture.type = MatTextureType::DISPLACEMENT;
+    builder_texture.name = "";
+    if (ai_mat->GetTexture(aiTextureType_DISPLACEMENT, 0U, &texture_path) ==
+        AI_SUCCESS) {
+      builder_texture.name = texture_path.C_Str();
+    }
+    cooked_mat.textures.push_back(builder_texture);
+
+    materials.push_back(cooked_mat);
+  }
+}
+
+SceneBvhItem::SceneBvhItem(Model *Model, uint32_t Instance_idx)
+    : model(Model), instance_idx(Instance_idx) {}
+
+ScenePick::ScenePick()
+    : model(nullptr), instance_idx(0U), mesh_idx(0U), distance(0.f) {}
+
 ModelManager::ModelManager()
-    : models_(), deferred_gpass_set_layout_(VK_NULL_HANDLE) {}
+    : models_(), deferred_gpass_set_layout_(VK_NULL_HANDLE),
+      optimise_vertex_order_(false), generate_lods_(false), pending_loads_(),
+      uploading_loads_(), scene_bvh_(), scene_bvh_dirty_(false),
+      scene_bvh_items_(),
+      scene_bvh_first_items_(), internal_models_() {}
 
 void ModelManager::LoadObjModel(const VulkanDevice &device,
                                 const eastl::string &filename,
@@ -53,61 +198,90 @@ void ModelManager::LoadObjModel(const VulkanDevice &device,
     EXIT(err);
   }
 
-  // Group all vertex data together
-  std::unordered_map<Vertex, uint32_t> unique_vertices;
   uint32_t materials_count = SCAST_U32(materials.size());
   ModelBuilder model_builder(vertex_setup, sets_desc_pool_);
 
-  // For each shape, which corresponds to a mesh in the model
+  // Weld the corners of the faces of each shape, which corresponds to a mesh
+  // in the model; the shapes are independent, so they go in parallel
   uint32_t shapes_size = SCAST_U32(shapes.size());
+  eastl::vector<eastl::unique_ptr<VertexWeldTable>> weld_tables(shapes_size);
+  eastl::vector<eastl::vector<uint32_t>> shapes_indices(shapes_size);
+  thread_pool()->ParallelFor(shapes_size, [&](uint32_t si) {
+    const tinyobj::mesh_t &obj_mesh = shapes[si].mesh;
+    uint32_t num_corners = SCAST_U32(obj_mesh.indices.size());
+    weld_tables[si] = eastl::make_unique<VertexWeldTable>(num_corners / 2U);
+    VertexWeldTable &weld_table = *weld_tables[si];
+    eastl::vector<uint32_t> &indices = shapes_indices[si];
+    indices.resize(num_corners);
+
+    for (uint32_t c = 0U; c < num_corners; c++) {
+      tinyobj::index_t idx = obj_mesh.indices[c];
+      Vertex vertex;
+      vertex.pos = {attrib.vertices[3U * idx.vertex_index + 0U],
+                    attrib.vertices[3U * idx.vertex_index + 1U],
+                    attrib.vertices[3U * idx.vertex_index + 2U]};
+      vertex.uv = {attrib.texcoords[2U * idx.texcoord_index + 0U],
+                   attrib.texcoords[2U * idx.texcoord_index + 1U], 0.f};
+      vertex.normal = {attrib.normals[3U * idx.normal_index + 0U],
+                       attrib.normals[3U * idx.normal_index + 1U],
+                       attrib.normals[3U * idx.normal_index + 2U]};
+
+      indices[c] = weld_table.FindOrInsert(vertex);
+    }
+  });
+
+  // Lay every mesh out in the model
   eastl::vector<Mesh> meshes(shapes_size);
+  eastl::vector<uint32_t> first_vertices(shapes_size);
   for (uint32_t si = 0U; si < shapes_size; si++) {
-    uint32_t index_offset = 0U;
+    first_vertices[si] =
+        model_builder.AllocateVertices(weld_tables[si]->num_vertices());
+    uint32_t first_index = model_builder.AllocateIndices(
+        SCAST_U32(shapes_indices[si].size()));
 
     // Create a mesh
-    meshes[si] = Mesh(SCAST_U32(model_builder.indices_data().size()),
-                      SCAST_U32(shapes[si].mesh.indices.size()), 0U,
+    meshes[si] = Mesh(first_index, SCAST_U32(shapes_indices[si].size()), 0U,
                       SCAST_U32(shapes[si].mesh.material_ids[0U]));
+    model_builder.AddMesh(&meshes[si]);
+  }
 
-    // Load the vertices for this mesh
-    uint32_t num_faces = SCAST_U32(shapes[si].mesh.num_face_vertices.size());
-    for (uint32_t f = 0U; f < num_faces; f++) {
-      uint32_t fv = shapes[si].mesh.num_face_vertices[f];
-
-      for (uint32_t v = 0U; v < fv; v++) {
-        tinyobj::index_t idx = shapes[si].mesh.indices[index_offset + v];
-        Vertex vertex;
-        vertex.pos = {attrib.vertices[3U * idx.vertex_index + 0U],
-                      attrib.vertices[3U * idx.vertex_index + 1U],
-                      attrib.vertices[3U * idx.vertex_index + 2U]};
-        vertex.uv = {attrib.texcoords[2U * idx.texcoord_index + 0U],
-                     attrib.texcoords[2U * idx.texcoord_index + 1U], 0.f};
-        vertex.normal = {attrib.normals[3U * idx.normal_index + 0U],
-                         attrib.normals[3U * idx.normal_index + 1U],
-                         attrib.normals[3U * idx.normal_index + 2U]};
-
-        if (unique_vertices.count(vertex) == 0U) {
-          unique_vertices[vertex] = model_builder.current_vertex();
-          model_builder.AddVertex(vertex);
-        }
-
-        model_builder.AddIndex(unique_vertices[vertex]);
-      }
+  // Convert the welded vertices and rebase the indices into the model
+  thread_pool()->ParallelFor(shapes_size, [&](uint32_t si) {
+    const eastl::vector<Vertex> &vertices = weld_tables[si]->vertices();
+    uint32_t vertices_count = SCAST_U32(vertices.size());
+    for (uint32_t v = 0U; v < vertices_count; v++) {
+      model_builder.SetVertex(first_vertices[si] + v, vertices[v]);
+    }
 
-      index_offset += fv;
+    const eastl::vector<uint32_t> &indices = shapes_indices[si];
+    uint32_t first_index = meshes[si].start_index();
+    uint32_t indices_count = SCAST_U32(indices.size());
+    for (uint32_t i = 0U; i < indices_count; i++) {
+      model_builder.SetIndex(first_index + i, first_vertices[si] + indices[i]);
     }
 
-    model_builder.AddMesh(&meshes[si]);
+    // Done with this shape
+    weld_tables[si].reset();
+  });
+
+  // Merge repeated shapes before anything else works on the geometry
+  model_builder.InstanceDuplicateMeshes();
+  if (optimise_vertex_order_) {
+    model_builder.OptimiseVertexOrder();
   }
+  if (generate_lods_) {
+    model_builder.GenerateLods();
+  }
+  model_builder.QuantisePositions();
 
-  CreateUniqueModel(device, model_builder, filename, model);
-  LOG("Meshes count: " << shapes_size);
+  CreateUniqueModel(device, model_builder, filename, true, model);
+  LOG("Meshes count: " << model_builder.meshes().size());
 
-  // Materials
-  LOG("Materials count: " << materials_count);
+  // Materials; their textures are loaded together
+  eastl::vector<CookedMaterial> cooked_materials(materials_count);
   for (uint32_t i = 0U; i < materials_count; i++) {
-    MaterialInstanceBuilder mat_builder(materials[i].name.c_str(), material_dir,
-                                        aniso_sampler_);
+    CookedMaterial &cooked_mat = cooked_materials[i];
+    cooked_mat.name = materials[i].name.c_str();
 
     MaterialConstants mat_consts;
     mat_consts.emission =
@@ -122,33 +296,59 @@ void ModelManager::LoadObjModel(const VulkanDevice &device,
     mat_consts.specular_shininess =
         glm::vec4(materials[i].specular[0U], materials[i].specular[1U],
                   materials[i].specular[2U], materials[i].shininess);
-    mat_builder.AddConstants(mat_consts);
+    cooked_mat.consts = mat_consts;
 
     MaterialBuilderTexture builder_texture;
     builder_texture.name = materials[i].ambient_texname.c_str();
     builder_texture.type = MatTextureType::AMBIENT;
-    mat_builder.AddTexture(builder_texture);
+    cooked_mat.textures.push_back(builder_texture);
     builder_texture.name = materials[i].diffuse_texname.c_str();
     builder_texture.type = MatTextureType::DIFFUSE;
-    mat_builder.AddTexture(builder_texture);
+    cooked_mat.textures.push_back(builder_texture);
     builder_texture.name = materials[i].specular_texname.c_str();
     builder_texture.type = MatTextureType::SPECULAR;
-    mat_builder.AddTexture(builder_texture);
+    cooked_mat.textures.push_back(builder_texture);
     builder_texture.name = materials[i].specular_highlight_texname.c_str();
     builder_texture.type = MatTextureType::SPECULAR_HIGHLIGHT;
-    mat_builder.AddTexture(builder_texture);
+    cooked_mat.textures.push_back(builder_texture);
     builder_texture.name = materials[i].bump_texname.c_str();
     builder_texture.type = MatTextureType::NORMAL;
-    mat_builder.AddTexture(builder_texture);
+    cooked_mat.textures.push_back(builder_texture);
     builder_texture.name = materials[i].alpha_texname.c_str();
     builder_texture.type = MatTextureType::ALPHA;
-    mat_builder.AddTexture(builder_texture);
+    cooked_mat.textures.push_back(builder_texture);
     builder_texture.name = materials[i].displacement_texname.c_str();
     builder_texture.type = MatTextureType::DISPLACEMENT;
-    mat_builder.AddTexture(builder_texture);
-
-    material_manager()->CreateMaterialInstance(device, mat_builder);
+    cooked_mat.textures.push_back(builder_texture);
   }
+
+  TextureLoadBatch textures;
+  InspectMaterialTextures(device, material_dir, cooked_materials, textures);
+  DecodeMaterialTextures(device, textures);
+  CreateMaterialInstances(device, material_dir, cooked_materials, textures);
+}
+
+CookedModel::CookedModel()
+    : cache(), builder(), meshes(), materials(), textures() {}
+
+CookedModel::~CookedModel() {}
+
+ModelLoadRequest::ModelLoadRequest(const eastl::string &name,
+                                   const eastl::string &material_dir,
+                                   uint32_t assimp_post_process_steps,
+                                   uint32_t cook_flags,
+                                   const VertexSetup &vertex_setup)
+    : name_(name), material_dir_(material_dir),
+      assimp_post_process_steps_(assimp_post_process_steps),
+      cook_flags_(cook_flags), vertex_setup_(vertex_setup), cooked_(),
+      error_(), cook_failed_(false), cooked_done_(false), staged_(false),
+      decoded_done_(false), cancelled_(false),
+      uploading_model_(nullptr), upload_ticket_(0U), model_(nullptr),
+      failed_(false) {}
+
+uint32_t ModelManager::GetCookFlags() const {
+  return (optimise_vertex_order_ ? kCookVertexOrderOptimised : 0U) |
+         (generate_lods_ ? kCookLodsGenerated : 0U);
 }
 
 void ModelManager::LoadOtherModel(const VulkanDevice &device,
@@ -162,20 +362,153 @@ void ModelManager::LoadOtherModel(const VulkanDevice &device,
     return;
   }
 
+  CookedModel cooked;
+  eastl::string error;
+  if (!CookOtherModel(device, filename, material_dir,
+                      assimp_post_process_steps, GetCookFlags(), vertex_setup,
+                      cooked, error)) {
+    EXIT(error);
+  }
+  DecodeMaterialTextures(device, cooked.textures);
+  FinishModel(device, filename, material_dir, vertex_setup, cooked, model);
+}
+
+ModelLoadHandle
+ModelManager::LoadOtherModelAsync(const VulkanDevice &device,
+                                  const eastl::string &name,
+                                  const eastl::string &material_dir,
+                                  uint32_t assimp_post_process_steps,
+                                  const VertexSetup &vertex_setup) {
+  ModelLoadHandle request = eastl::make_shared<ModelLoadRequest>(
+      name, material_dir, assimp_post_process_steps, GetCookFlags(),
+      vertex_setup);
+
+  NameModelMap::iterator found = models_.find(name);
+  if (found != models_.end()) {
+    request->model_ = found->second.get();
+    return request;
+  }
+
+  pending_loads_.push_back(request);
+
+  // The task keeps the request alive even if the caller drops its handle
+  thread_pool()->Enqueue([this, &device, request]() {
+    if (request->cancelled_.load(std::memory_order_acquire)) {
+      request->cook_failed_ = true;
+      request->error_ = "cancelled";
+      request->cooked_done_.store(true, std::memory_order_release);
+      return;
+    }
+    request->cook_failed_ = !CookOtherModel(
+        device, request->name_, request->material_dir_,
+        request->assimp_post_process_steps_, request->cook_flags_,
+        request->vertex_setup_, request->cooked_, request->error_);
+    request->cooked_done_.store(true, std::memory_order_release);
+  });
+
+  return request;
+}
+
+void ModelManager::UpdateAsyncLoads(const VulkanDevice &device) {
+  // Uploads complete in order, so the oldest load is the first to be done
+  VulkanUploader &uploader = device.uploader();
+  while (!uploading_loads_.empty()) {
+    ModelLoadHandle request = uploading_loads_.front();
+    if (!uploader.IsComplete(device, request->upload_ticket_)) {
+      break;
+    }
+    uploading_loads_.erase(uploading_loads_.begin());
+    request->model_ = request->uploading_model_;
+  }
+
+  if (pending_loads_.empty() ||
+      !pending_loads_.front()->cooked_done_.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  // A failed load never reaches the device, so the next one can go ahead
+  ModelLoadHandle request = pending_loads_.front();
+  if (request->cook_failed_) {
+    pending_loads_.erase(pending_loads_.begin());
+    ELOG_WARN("Couldn't load model " + request->name_ + ": " +
+              request->error_);
+    request->failed_ = true;
+    return;
+  }
+
+  // The staging memory belongs to the device, so it is reserved here, and
+  // the textures are then decoded straight into it on the workers
+  if (!request->staged_) {
+    texture_manager()->StageTextures(device, request->cooked_.textures);
+    request->staged_ = true;
+    thread_pool()->Enqueue([request]() {
+      if (!request->cancelled_.load(std::memory_order_acquire)) {
+        texture_manager()->DecodeTextures(request->cooked_.textures);
+      }
+      request->decoded_done_.store(true, std::memory_order_release);
+    });
+    return;
+  }
+  if (!request->decoded_done_.load(std::memory_order_acquire)) {
+    return;
+  }
+  pending_loads_.erase(pending_loads_.begin());
+
+  // Everything was decoded on the workers; this only records the copies
+  FinishModel(device, request->name_, request->material_dir_,
+              request->vertex_setup_, request->cooked_,
+              &request->uploading_model_);
+  request->upload_ticket_ = uploader.Flush(device);
+  uploading_loads_.push_back(request);
+
+  // Only the device objects are needed from now on
+  request->cooked_.cache.reset();
+  request->cooked_.builder.reset();
+  request->cooked_.meshes.clear();
+  request->cooked_.materials.clear();
+  request->cooked_.textures = TextureLoadBatch();
+}
+
+void ModelManager::CancelAsyncLoads() {
+  for (eastl::vector<ModelLoadHandle>::iterator itor = pending_loads_.begin();
+       itor != pending_loads_.end(); ++itor) {
+    (*itor)->cancelled_.store(true, std::memory_order_release);
+  }
+}
+
+bool ModelManager::CookOtherModel(const VulkanDevice &device,
+                                  const eastl::string &filename,
+                                  const eastl::string &material_dir,
+                                  uint32_t assimp_post_process_steps,
+                                  uint32_t cook_flags,
+                                  const VertexSetup &vertex_setup,
+                                  CookedModel &cooked,
+                                  eastl::string &error) const {
+  // Use the cooked model when there is an up to date one, which avoids both
+  // the import and the per-vertex conversion
+  cooked.cache = eastl::make_unique<ModelCacheFile>();
+  if (cooked.cache->Open(filename, assimp_post_process_steps, cook_flags,
+                         vertex_setup)) {
+    cooked.materials = cooked.cache->materials();
+    InspectMaterialTextures(device, material_dir, cooked.materials,
+                            cooked.textures);
+    return true;
+  }
+  cooked.cache.reset();
+
   Assimp::Importer assimp_importer;
   const aiScene *scene =
       assimp_importer.ReadFile(filename.c_str(), assimp_post_process_steps);
 
   if (scene == nullptr || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE ||
       scene->mRootNode == nullptr) {
-    EXIT(assimp_importer.GetErrorString());
+    error = assimp_importer.GetErrorString();
+    return false;
   }
 
-  uint32_t materials_count = scene->mNumMaterials;
-
-  ModelBuilder model_builder(vertex_setup, sets_desc_pool_);
-
-  uint32_t mat_idx_offset = material_manager()->GetMaterialInstancesCount();
+  cooked.builder = eastl::make_unique<ModelBuilder>(vertex_setup,
+                                                    sets_desc_pool_);
+  ModelBuilder &model_builder = *cooked.builder;
 
   // Check the type of the loaded model; if it is OBJ, Assimp adds an
   // additional material at the beginning of the list of materials,
@@ -185,175 +518,293 @@ void ModelManager::LoadOtherModel(const VulkanDevice &device,
     obj_offset = 1U;
   }
 
-  // For each shape, which corresponds to a mesh in the model
+  // For each shape, which corresponds to a mesh in the model; lay out every
+  // mesh first so that they can then be converted concurrently
   uint32_t meshes_count = scene->mNumMeshes;
-  std::vector<Mesh> meshes(meshes_count);
+  eastl::vector<Mesh> &meshes = cooked.meshes;
+  meshes.resize(meshes_count);
+  eastl::vector<AssimpMeshRange> ranges(meshes_count);
   uint32_t idx_offset = 0U;
   for (uint32_t mi = 0U; mi < meshes_count; mi++) {
     const aiMesh *ai_mesh = scene->mMeshes[mi];
-    // Create a mesh
-    meshes[mi] = Mesh(SCAST_U32(model_builder.indices_data().size()),
-                      ai_mesh->mNumFaces * 3U, 0U,
-                      ai_mesh->mMaterialIndex + mat_idx_offset - obj_offset);
-
-    // Load the vertices for this mesh
-    for (uint32_t i = 0U; i < ai_mesh->mNumVertices; i++) {
-      Vertex vertex;
-      vertex.pos = {ai_mesh->mVertices[i].x, ai_mesh->mVertices[i].y,
-                    ai_mesh->mVertices[i].z};
-      vertex.normal = {ai_mesh->mNormals[i].x, ai_mesh->mNormals[i].y,
-                       ai_mesh->mNormals[i].z};
-      if (ai_mesh->mTextureCoords[0U]) {
-        vertex.uv = {ai_mesh->mTextureCoords[0U][i].x,
-                     ai_mesh->mTextureCoords[0U][i].y,
-                     ai_mesh->mTextureCoords[0U][i].z};
-      } else {
-        vertex.uv = {0.f, 0.f, 0.f};
-      }
-      if (assimp_post_process_steps & aiProcess_CalcTangentSpace) {
-        vertex.bitangent = {ai_mesh->mBitangents[i].x,
-                            ai_mesh->mBitangents[i].y,
-                            ai_mesh->mBitangents[i].z};
-        vertex.tangent = {ai_mesh->mTangents[i].x, ai_mesh->mTangents[i].y,
-                          ai_mesh->mTangents[i].z};
-
-        if (glm::dot(glm::cross(vertex.normal, vertex.tangent),
-                     vertex.bitangent) < 0.0f) {
-          vertex.tangent = vertex.tangent * -1.0f;
-        }
-      }
-      model_builder.AddVertex(vertex);
-    }
-
-    // Load indices
-    for (uint32_t i = 0U; i < ai_mesh->mNumFaces; i++) {
-      aiFace &face = ai_mesh->mFaces[i];
-      // Superfluous; all faces are triangulated
-      for (uint32_t j = 0U; j < face.mNumIndices; j++) {
-        model_builder.AddIndex(face.mIndices[j] + idx_offset);
-        if (i == 0U || i == ai_mesh->mNumFaces - 1) {
-        }
-      }
-    }
+    AssimpMeshRange &range = ranges[mi];
+    range.ai_mesh = ai_mesh;
+    range.first_vertex = model_builder.AllocateVertices(ai_mesh->mNumVertices);
+    range.first_index =
+        model_builder.AllocateIndices(CountAssimpMeshIndices(ai_mesh));
+    range.idx_offset = idx_offset;
+
+    // Create a mesh; the material manager offset is only known once the
+    // model is finished
+    meshes[mi] = Mesh(range.first_index, ai_mesh->mNumFaces * 3U, 0U,
+                      ai_mesh->mMaterialIndex - obj_offset);
 
     idx_offset += ai_mesh->mNumVertices;
     model_builder.AddMesh(&meshes[mi]);
   }
 
-  CreateUniqueModel(device, model_builder, filename, model);
-  LOG("Meshes count: " << meshes_count);
+  // Load the vertices and indices of all meshes
+  IngestAssimpMeshes(ranges, assimp_post_process_steps, model_builder);
 
-  // Materials
-  aiString assimp_default_mat_name("DefaultMaterial");
-  LOG("Materials count: " << materials_count);
-  for (uint32_t i = 0U; i < materials_count; i++) {
-    // Avoid loading assimp's default material
-    const aiMaterial *ai_mat = scene->mMaterials[i];
+  // Place the meshes where the nodes of the scene reference them
+  AddAssimpNodes(scene->mRootNode, kNoTransformNode, model_builder);
 
-    aiString mat_name;
-    ai_mat->Get(AI_MATKEY_NAME, mat_name);
-    if (mat_name == assimp_default_mat_name) {
-      continue;
-    }
+  // Merge repeated shapes before anything else works on the geometry
+  model_builder.InstanceDuplicateMeshes();
+  if ((cook_flags & kCookVertexOrderOptimised) != 0U) {
+    model_builder.OptimiseVertexOrder();
+  }
+  if ((cook_flags & kCookLodsGenerated) != 0U) {
+    model_builder.GenerateLods();
+  }
+  model_builder.QuantisePositions();
 
-    MaterialInstanceBuilder mat_builder(mat_name.C_Str(), material_dir,
-                                        aniso_sampler_);
+  ReadAssimpMaterials(scene, cooked.materials);
 
-    MaterialConstants mat_consts;
-    aiColor4D colour;
-    if (ai_mat->Get(AI_MATKEY_COLOR_AMBIENT, colour) == AI_SUCCESS) {
-      mat_consts.ambient = glm::vec3(colour.r, colour.g, colour.b);
-    };
-    if (ai_mat->Get(AI_MATKEY_COLOR_DIFFUSE, colour) == AI_SUCCESS) {
-      mat_consts.diffuse_dissolve =
-          glm::vec4(colour.r, colour.g, colour.b, 2.f);
-    };
-    if (ai_mat->Get(AI_MATKEY_COLOR_SPECULAR, colour) == AI_SUCCESS) {
-      mat_consts.specular_shininess =
-          glm::vec4(colour.r, colour.g, colour.b, 10.f);
-    };
-    if (ai_mat->Get(AI_MATKEY_COLOR_EMISSIVE, colour) == AI_SUCCESS) {
-      mat_consts.emission = glm::vec3(colour.r, colour.g, colour.b);
-    };
-    float value = 0.f;
-    if (ai_mat->Get(AI_MATKEY_SHININESS, value) == AI_SUCCESS) {
-      mat_consts.specular_shininess.w = value;
-    };
-    if (ai_mat->Get(AI_MATKEY_OPACITY, value) == AI_SUCCESS) {
-      mat_consts.diffuse_dissolve.w = value;
-    };
+  // Cook what has been imported so that the next run can skip Assimp
+  ModelCacheFile::Write(filename, assimp_post_process_steps, cook_flags,
+                        model_builder, 0U, cooked.materials);
 
-    mat_builder.AddConstants(mat_consts);
+  InspectMaterialTextures(device, material_dir, cooked.materials,
+                          cooked.textures);
+  return true;
+}
 
-    MaterialBuilderTexture builder_texture;
-    aiString texture_path;
-    builder_texture.type = MatTextureType::AMBIENT;
-    if (ai_mat->GetTexture(aiTextureType_AMBIENT, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
+void ModelManager::InspectMaterialTextures(
+    const VulkanDevice &device, const eastl::string &material_dir,
+    const eastl::vector<CookedMaterial> &materials,
+    TextureLoadBatch &textures) const {
+  eastl::vector<TextureLoadRequest> texture_requests;
+  for (eastl::vector<CookedMaterial>::const_iterator itor = materials.begin();
+       itor != materials.end(); ++itor) {
+    MaterialInstanceBuilder mat_builder(itor->name, material_dir,
+                                        aniso_sampler_);
+    for (eastl::vector<MaterialBuilderTexture>::const_iterator
+             t_itor = itor->textures.begin();
+         t_itor != itor->textures.end(); ++t_itor) {
+      mat_builder.AddTexture(*t_itor);
     }
-    mat_builder.AddTexture(builder_texture);
+    mat_builder.GetTextureLoadRequests(texture_requests);
+  }
 
-    builder_texture.type = MatTextureType::DIFFUSE;
-    builder_texture.name = "";
-    if (ai_mat->GetTexture(aiTextureType_DIFFUSE, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
-    }
-    mat_builder.AddTexture(builder_texture);
+  texture_manager()->InspectTextures(device, texture_requests, textures);
+}
 
-    builder_texture.type = MatTextureType::SPECULAR;
-    builder_texture.name = "";
-    if (ai_mat->GetTexture(aiTextureType_SPECULAR, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
-    }
-    mat_builder.AddTexture(builder_texture);
+void ModelManager::DecodeMaterialTextures(const VulkanDevice &device,
+                                          TextureLoadBatch &textures) const {
+  texture_manager()->StageTextures(device, textures);
+  texture_manager()->DecodeTextures(textures);
+}
 
-    builder_texture.type = MatTextureType::SPECULAR_HIGHLIGHT;
-    builder_texture.name = "";
-    if (ai_mat->GetTexture(aiTextureType_SHININESS, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
-    }
-    mat_builder.AddTexture(builder_texture);
+void ModelManager::FinishModel(const VulkanDevice &device,
+                               const eastl::string &name,
+                               const eastl::string &material_dir,
+                               const VertexSetup &vertex_setup,
+                               CookedModel &cooked, Model **model) const {
+  if (SCAST_U32(models_.count(name)) != 0U) {
+    texture_manager()->DiscardTextures(device, cooked.textures);
+    (*model) = models_[name].get();
+    return;
+  }
 
-    builder_texture.type = MatTextureType::NORMAL;
-    builder_texture.name = "";
-    if (ai_mat->GetTexture(aiTextureType_NORMALS, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
-    } else if (ai_mat->GetTexture(aiTextureType_HEIGHT, 0U, &texture_path) ==
-               AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
-    }
-    mat_builder.AddTexture(builder_texture);
+  uint32_t mat_idx_offset = material_manager()->GetMaterialInstancesCount();
 
-    builder_texture.type = MatTextureType::ALPHA;
-    builder_texture.name = "";
-    if (ai_mat->GetTexture(aiTextureType_OPACITY, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
+  if (cooked.cache) {
+    CreateUniqueModel(device, *cooked.cache, vertex_setup, name,
+                      mat_idx_offset, model);
+    LOG("Meshes count: " << cooked.cache->num_meshes());
+  } else {
+    for (eastl::vector<Mesh>::iterator itor = cooked.meshes.begin();
+         itor != cooked.meshes.end(); ++itor) {
+      itor->set_material_id(itor->material_id() + mat_idx_offset);
     }
-    mat_builder.AddTexture(builder_texture);
 
-    builder_texture.type = MatTextureType::DISPLACEMENT;
-    builder_texture.name = "";
-    if (ai_mat->GetTexture(aiTextureType_DISPLACEMENT, 0U, &texture_path) ==
-        AI_SUCCESS) {
-      builder_texture.name = texture_path.C_Str();
+    CreateUniqueModel(device, *cooked.builder, name, true, model);
+    LOG("Meshes count: " << cooked.builder->meshes().size());
+  }
+
+  CreateMaterialInstances(device, material_dir, cooked.materials,
+                          cooked.textures);
+}
+
+void ModelManager::CreateMaterialInstances(
+    const VulkanDevice &device, const eastl::string &material_dir,
+    const eastl::vector<CookedMaterial> &materials,
+    TextureLoadBatch &textures) const {
+  LOG("Materials count: " << materials.size());
+
+  // The textures were decoded ahead; the instances then find them loaded
+  texture_manager()->UploadTextures(device, textures, aniso_sampler_);
+
+  for (eastl::vector<CookedMaterial>::const_iterator itor = materials.begin();
+       itor != materials.end(); ++itor) {
+    MaterialInstanceBuilder mat_builder(itor->name, material_dir,
+                                        aniso_sampler_);
+    mat_builder.AddConstants(itor->consts);
+    for (eastl::vector<MaterialBuilderTexture>::const_iterator
+             t_itor = itor->textures.begin();
+         t_itor != itor->textures.end(); ++t_itor) {
+      mat_builder.AddTexture(*t_itor);
     }
-    mat_builder.AddTexture(builder_texture);
 
     material_manager()->CreateMaterialInstance(device, mat_builder);
   }
 }
 
 void ModelManager::Shutdown(const VulkanDevice &device) {
+  // The thread pool is already stopped, see CancelAsyncLoads
+  pending_loads_.clear();
+  uploading_loads_.clear();
+
   NameModelMap::iterator iter;
   for (iter = models_.begin(); iter != models_.end(); iter++) {
     iter->second->Shutdown(device);
   }
+
+  scene_bvh_.Clear();
+  scene_bvh_dirty_ = false;
+  scene_bvh_items_.clear();
+  scene_bvh_first_items_.clear();
+  internal_models_.clear();
+}
+
+void ModelManager::UpdateSceneBvh() const {
+  if (scene_bvh_dirty_) {
+    RebuildSceneBvh();
+    scene_bvh_dirty_ = false;
+  }
+}
+
+void ModelManager::RebuildSceneBvh() const {
+  scene_bvh_items_.clear();
+  scene_bvh_first_items_.clear();
+
+  eastl::vector<glm::vec3> items_min;
+  eastl::vector<glm::vec3> items_max;
+  NameModelMap::const_iterator iter;
+  for (iter = models_.begin(); iter != models_.end(); iter++) {
+    const MeshBoundsTable &bounds = iter->second->instance_bounds();
+    if (bounds.size() == 0U ||
+        internal_models_.find(iter->second.get()) != internal_models_.end()) {
+      continue;
+    }
+
+    scene_bvh_first_items_[iter->second.get()] =
+        SCAST_U32(scene_bvh_items_.size());
+    for (uint32_t i = 0U; i < bounds.size(); ++i) {
+      scene_bvh_items_.push_back(SceneBvhItem(iter->second.get(), i));
+      items_min.push_back(glm::vec3(bounds.min_x()[i], bounds.min_y()[i],
+                                    bounds.min_z()[i]));
+      items_max.push_back(glm::vec3(bounds.max_x()[i], bounds.max_y()[i],
+                                    bounds.max_z()[i]));
+    }
+  }
+
+  scene_bvh_.Build(items_min, items_max);
+  LOG("Scene BVH: " << scene_bvh_items_.size() << " instances, "
+                    << scene_bvh_.nodes().size() << " nodes.");
+}
+
+uint32_t
+ModelManager::CullInstances(const szt::FrustumPlanes &planes,
+                            const eastl::vector<Model *> &models) {
+  UpdateSceneBvh();
+
+  eastl::vector<uint8_t> visible;
+  scene_bvh_.QueryFrustum(planes, visible);
+
+  // Models without bounds, and internal ones, are not in the tree
+  uint32_t num_visible = 0U;
+  for (eastl::vector<Model *>::const_iterator itor = models.begin();
+       itor != models.end(); ++itor) {
+    ModelFirstItemMap::const_iterator first_item =
+        scene_bvh_first_items_.find(*itor);
+    if (first_item != scene_bvh_first_items_.end()) {
+      (*itor)->SetInstancesVisibility(visible.data() + first_item->second);
+    }
+    num_visible += (*itor)->num_visible_instances();
+  }
+
+  return num_visible;
+}
+
+bool ModelManager::Pick(const glm::vec3 &origin, const glm::vec3 &dir,
+                        float max_distance, ScenePick &pick) const {
+  UpdateSceneBvh();
+
+  BvhRayHit hit;
+  if (!scene_bvh_.Raycast(origin, dir, max_distance, hit)) {
+    return false;
+  }
+
+  const SceneBvhItem &item = scene_bvh_items_[hit.item];
+  pick.model = item.model;
+  pick.instance_idx = item.instance_idx;
+  pick.mesh_idx = item.model->instances()[item.instance_idx].mesh_idx;
+  pick.distance = hit.distance;
+
+  return true;
+}
+
+void ModelManager::SetInstanceModelMatrix(Model *model, uint32_t instance_idx,
+                                          const glm::mat4 &mat) {
+  model->SetInstanceModelMatrix(instance_idx, mat);
+}
+
+void ModelManager::UpdateTransforms(const eastl::vector<Model *> &models) {
+  UpdateSceneBvh();
+
+  eastl::vector<uint32_t> moved_instances;
+  for (eastl::vector<Model *>::const_iterator itor = models.begin();
+       itor != models.end(); ++itor) {
+    if (!(*itor)->UpdateTransforms(moved_instances)) {
+      continue;
+    }
+
+    ModelFirstItemMap::const_iterator first_item =
+        scene_bvh_first_items_.find(*itor);
+    if (first_item == scene_bvh_first_items_.end()) {
+      continue;
+    }
+    const MeshBoundsTable &bounds = (*itor)->instance_bounds();
+    for (eastl::vector<uint32_t>::const_iterator i_itor =
+             moved_instances.begin();
+         i_itor != moved_instances.end(); ++i_itor) {
+      MeshBounds instance_bounds = bounds.Get(*i_itor);
+      scene_bvh_.Refit(first_item->second + *i_itor,
+                       glm::vec3(instance_bounds.aabb_min),
+                       glm::vec3(instance_bounds.aabb_max));
+    }
+  }
+}
+
+void ModelManager::RequestTextureDetail(const eastl::vector<Model *> &models,
+                                        const glm::vec3 &view_pos,
+                                        const szt::Frustum &frustum,
+                                        float viewport_height) const {
+  eastl::vector<float> screen_sizes;
+  for (eastl::vector<Model *>::const_iterator itor = models.begin();
+       itor != models.end(); ++itor) {
+    (*itor)->GetMaterialScreenSizes(view_pos, frustum, viewport_height,
+                                    screen_sizes);
+  }
+
+  uint32_t num_materials = eastl::min(
+      SCAST_U32(screen_sizes.size()),
+      material_manager()->GetMaterialInstancesCount());
+  for (uint32_t i = 0U; i < num_materials; ++i) {
+    if (screen_sizes[i] <= 0.f) {
+      continue;
+    }
+    const MaterialInstance &material =
+        material_manager()->GetMaterialInstance(i);
+    for (uint32_t t = 0U; t < SCAST_U32(material.textures().size()); ++t) {
+      if (material.textures()[t] != nullptr) {
+        texture_manager()->RequestTextureDetail(material.textures()[t],
+                                                screen_sizes[i]);
+      }
+    }
+  }
 }
 
 void ModelManager::GetMeshesModelMatricesBuffer(
@@ -362,28 +813,25 @@ void ModelManager::GetMeshesModelMatricesBuffer(
 
   VulkanBufferInitInfo init_info;
   init_info.size = SCAST_U32(sizeof(glm::mat4)) * num_meshes;
-  init_info.memory_property_flags = /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
   // Create a large enough UBO of mat4s
   VulkanBuffer model_matrices_buff;
   model_matrices_buff.Init(device, init_info);
 
-  // Upload the data to it
-  uint32_t mat4_size = SCAST_U32(sizeof(glm::mat4));
+  // Write the matrices of every mesh in a row straight into the mapped
+  // buffer, then flush them at once
+  glm::mat4 *matrices = model_matrices_buff.MappedAs<glm::mat4>();
   uint32_t counter = 0U;
   NameModelMap::iterator iter;
-  for (iter = models_.begin(); iter != models_.end(); iter++, counter++) {
+  for (iter = models_.begin(); iter != models_.end(); iter++) {
     uint32_t meshes_count = SCAST_U32(iter->second->meshes().size());
-    for (uint32_t i = 0U; i < meshes_count; i++) {
-      void *data = nullptr;
-      model_matrices_buff.Map(device, &data, mat4_size, counter * mat4_size);
-      *static_cast<glm::mat4 *>(data) = iter->second->meshes()[i].model_mat();
-      model_matrices_buff.Unmap(device);
+    for (uint32_t i = 0U; i < meshes_count; i++, counter++) {
+      matrices[counter] = iter->second->meshes()[i].model_mat();
     }
   }
+  model_matrices_buff.Flush(device);
 
   query.buff = model_matrices_buff;
   query.num_meshes = num_meshes;
@@ -404,13 +852,13 @@ void ModelManager::CreateModel(const VulkanDevice &device,
                                const eastl::string &name,
                                const ModelBuilder &model_builder,
                                Model **model) const {
-  CreateUniqueModel(device, model_builder, name, model);
+  CreateUniqueModel(device, model_builder, name, false, model);
 }
 
 void ModelManager::CreateUniqueModel(const VulkanDevice &device,
                                      const ModelBuilder &builder,
                                      const eastl::string &name,
-                                     Model **model) const {
+                                     bool in_scene, Model **model) const {
   if (SCAST_U32(models_.count(name)) != 0U) {
     (*model) = models_[name].get();
     return;
@@ -418,7 +866,34 @@ void ModelManager::CreateUniqueModel(const VulkanDevice &device,
   models_[name] = eastl::make_unique<Model>();
   models_[name]->Init(device, builder);
   (*model) = models_[name].get();
+  if (in_scene) {
+    scene_bvh_dirty_ = true;
+  } else {
+    internal_models_.insert(*model);
+  }
+  // Send the buffers of the model to the GPU as one batch
+  device.uploader().Flush(device);
   LOG("Created model " + name + ".");
 }
 
+void ModelManager::CreateUniqueModel(const VulkanDevice &device,
+                                     const ModelCacheFile &cache,
+                                     const VertexSetup &vertex_setup,
+                                     const eastl::string &name,
+                                     uint32_t mat_idx_offset,
+                                     Model **model) const {
+  if (SCAST_U32(models_.count(name)) != 0U) {
+    (*model) = models_[name].get();
+    return;
+  }
+  models_[name] = eastl::make_unique<Model>();
+  models_[name]->Init(device, cache, vertex_setup, sets_desc_pool_,
+                      mat_idx_offset);
+  (*model) = models_[name].get();
+  scene_bvh_dirty_ = true;
+  // Send the buffers of the model to the GPU as one batch
+  device.uploader().Flush(device);
+  LOG("Created model " + name + " from cooked data.");
+}
+
 } // namespace vks
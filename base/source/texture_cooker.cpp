@@ -0,0 +1,311 @@
+#include <EASTL/algorithm.h>
+#include <block_compression.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <gli/levels.hpp>
+#include <gli/save_ktx.hpp>
+#include <lodepng.h>
+#include <texture_cooker.h>
+#include <vulkan_tools.h>
+#if defined(__SSE__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VKS_TEXTURECOOKER_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace vks {
+
+const uint32_t kTextureCacheVersion = 2U;
+
+static const char *kCookedTextureExtension = ".ktx";
+// Entries of the table which encodes linear values back to sRGB; enough for
+// the steepest part of the curve to stay within a step of 8 bits
+static const uint32_t kLinearToSRGBSize = 16384U;
+
+struct ColourTables {
+  float srgb_to_linear[256U];
+  float unorm_to_float[256U];
+  uint8_t linear_to_srgb[kLinearToSRGBSize];
+}; // struct ColourTables
+
+static float SRGBToLinear(float value) {
+  return value <= 0.04045f ? value / 12.92f
+                           : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
+
+static float LinearToSRGB(float value) {
+  return value <= 0.0031308f ? value * 12.92f
+                             : 1.055f * std::pow(value, 1.f / 2.4f) - 0.055f;
+}
+
+static ColourTables BuildColourTables() {
+  ColourTables tables;
+  for (uint32_t i = 0U; i < 256U; ++i) {
+    tables.unorm_to_float[i] = static_cast<float>(i) / 255.f;
+    tables.srgb_to_linear[i] = SRGBToLinear(tables.unorm_to_float[i]);
+  }
+  for (uint32_t i = 0U; i < kLinearToSRGBSize; ++i) {
+    float value = static_cast<float>(i) / (kLinearToSRGBSize - 1U);
+    tables.linear_to_srgb[i] =
+        static_cast<uint8_t>(LinearToSRGB(value) * 255.f + 0.5f);
+  }
+  return tables;
+}
+
+// Built once, the first time a texture is cooked
+static const ColourTables &GetColourTables() {
+  static const ColourTables tables = BuildColourTables();
+  return tables;
+}
+
+// Average four RGBA8 pixels, decoded with the tables, and scale the result
+// to the range of the encoding, rounded
+static void AveragePixels(const uint8_t *p0, const uint8_t *p1,
+                          const uint8_t *p2, const uint8_t *p3,
+                          const float *colour_lut, const float *alpha_lut,
+                          float colour_scale, float out[4U]) {
+#ifdef VKS_TEXTURECOOKER_SSE
+  __m128 sum = _mm_add_ps(
+      _mm_add_ps(_mm_set_ps(alpha_lut[p0[3U]], colour_lut[p0[2U]],
+                            colour_lut[p0[1U]], colour_lut[p0[0U]]),
+                 _mm_set_ps(alpha_lut[p1[3U]], colour_lut[p1[2U]],
+                            colour_lut[p1[1U]], colour_lut[p1[0U]])),
+      _mm_add_ps(_mm_set_ps(alpha_lut[p2[3U]], colour_lut[p2[2U]],
+                            colour_lut[p2[1U]], colour_lut[p2[0U]]),
+                 _mm_set_ps(alpha_lut[p3[3U]], colour_lut[p3[2U]],
+                            colour_lut[p3[1U]], colour_lut[p3[0U]])));
+  __m128 scale =
+      _mm_set_ps(255.f * 0.25f, colour_scale * 0.25f, colour_scale * 0.25f,
+                 colour_scale * 0.25f);
+  _mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(sum, scale), _mm_set1_ps(0.5f)));
+#else
+  for (uint32_t c = 0U; c < 4U; ++c) {
+    const float *lut = c < 3U ? colour_lut : alpha_lut;
+    float scale = c < 3U ? colour_scale : 255.f;
+    float sum = lut[p0[c]] + lut[p1[c]] + lut[p2[c]] + lut[p3[c]];
+    out[c] = sum * 0.25f * scale + 0.5f;
+  }
+#endif
+}
+
+// Halve a level with a 2x2 box filter; for odd sizes the samples past the
+// last row or column are clamped to it
+static void DownsampleLevel(const uint8_t *src, uint32_t src_width,
+                            uint32_t src_height, uint8_t *dst,
+                            uint32_t dst_width, uint32_t dst_height,
+                            bool srgb) {
+  const ColourTables &tables = GetColourTables();
+  const float *colour_lut =
+      srgb ? tables.srgb_to_linear : tables.unorm_to_float;
+  uint32_t max_colour = srgb ? kLinearToSRGBSize - 1U : 255U;
+  float colour_scale = static_cast<float>(max_colour);
+
+  for (uint32_t y = 0U; y < dst_height; ++y) {
+    const uint8_t *row0 =
+        src + static_cast<size_t>(eastl::min(y * 2U, src_height - 1U)) *
+                  src_width * 4U;
+    const uint8_t *row1 =
+        src + static_cast<size_t>(eastl::min(y * 2U + 1U, src_height - 1U)) *
+                  src_width * 4U;
+    uint8_t *out = dst + static_cast<size_t>(y) * dst_width * 4U;
+
+    for (uint32_t x = 0U; x < dst_width; ++x, out += 4U) {
+      uint32_t x0 = eastl::min(x * 2U, src_width - 1U) * 4U;
+      uint32_t x1 = eastl::min(x * 2U + 1U, src_width - 1U) * 4U;
+      float avg[4U];
+      AveragePixels(row0 + x0, row0 + x1, row1 + x0, row1 + x1, colour_lut,
+                    tables.unorm_to_float, colour_scale, avg);
+
+      for (uint32_t c = 0U; c < 3U; ++c) {
+        uint32_t value =
+            eastl::min(static_cast<uint32_t>(avg[c]), max_colour);
+        out[c] = srgb ? tables.linear_to_srgb[value]
+                      : static_cast<uint8_t>(value);
+      }
+      out[3U] = static_cast<uint8_t>(
+          eastl::min(static_cast<uint32_t>(avg[3U]), 255U));
+    }
+  }
+}
+
+eastl::string GetCookedTexturePath(const eastl::string &source_filename,
+                                   const eastl::vector<uint8_t> &source_data,
+                                   VkFormat format,
+                                   TextureCompression compression) {
+  // FNV-1a over everything the cooked data depends on
+  uint32_t hash = 2166136261U;
+  uint32_t values[3U] = {kTextureCacheVersion, static_cast<uint32_t>(format),
+                         static_cast<uint32_t>(compression)};
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(values);
+  for (uint32_t b = 0U; b < SCAST_U32(sizeof(values)); ++b) {
+    hash = (hash ^ bytes[b]) * 16777619U;
+  }
+  for (eastl::vector<uint8_t>::const_iterator itor = source_data.begin();
+       itor != source_data.end(); ++itor) {
+    hash = (hash ^ *itor) * 16777619U;
+  }
+
+  char hash_str[16U];
+  snprintf(hash_str, sizeof(hash_str), ".%08x", hash);
+
+  return source_filename + hash_str + kCookedTextureExtension;
+}
+
+void GetCompressedFormats(TextureCompression compression, VkFormat format,
+                          eastl::vector<VkFormat> &formats) {
+  bool srgb = format == VK_FORMAT_R8G8B8A8_SRGB;
+  switch (compression) {
+  case TextureCompression::NONE:
+    formats.push_back(format);
+    break;
+  case TextureCompression::MASK:
+    formats.push_back(VK_FORMAT_BC4_UNORM_BLOCK);
+  // Falls through, for the masks which aren't grey
+  case TextureCompression::COLOUR:
+    formats.push_back(srgb ? VK_FORMAT_BC1_RGB_SRGB_BLOCK
+                           : VK_FORMAT_BC1_RGB_UNORM_BLOCK);
+    formats.push_back(srgb ? VK_FORMAT_BC3_SRGB_BLOCK
+                           : VK_FORMAT_BC3_UNORM_BLOCK);
+    break;
+  case TextureCompression::NORMAL_MAP:
+    formats.push_back(VK_FORMAT_BC5_UNORM_BLOCK);
+    break;
+  }
+}
+
+uint64_t GetMipChainSize(uint32_t width, uint32_t height) {
+  uint64_t size = 0U;
+  for (;;) {
+    size += static_cast<uint64_t>(width) * height * 4U;
+    if (width == 1U && height == 1U) {
+      return size;
+    }
+    width = eastl::max(width / 2U, 1U);
+    height = eastl::max(height / 2U, 1U);
+  }
+}
+
+// Whether every texel of an RGBA8 image passes a test
+template <typename Func>
+static bool AllTexels(const gli::image &image, Func func) {
+  const uint8_t *texel = static_cast<const uint8_t *>(image.data());
+  const uint8_t *end = texel + image.size();
+  for (; texel != end; texel += 4U) {
+    if (!func(texel)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Pick the block format for the content of a texture; for grey masks
+// stored as sRGB this also moves the levels to linear space, as BC4 has no
+// sRGB version
+static BlockFormat ChooseBlockFormat(TextureCompression compression,
+                                     bool srgb, gli::texture2d &chain) {
+  if (compression == TextureCompression::NORMAL_MAP) {
+    return BlockFormat::BC5;
+  }
+
+  if (compression == TextureCompression::MASK &&
+      AllTexels(chain[0U], [](const uint8_t *texel) {
+        return texel[0U] == texel[1U] && texel[0U] == texel[2U];
+      })) {
+    if (srgb) {
+      const ColourTables &tables = GetColourTables();
+      for (size_t level = 0U; level < chain.levels(); ++level) {
+        uint8_t *texel = static_cast<uint8_t *>(chain[level].data());
+        uint8_t *end = texel + chain[level].size();
+        for (; texel != end; texel += 4U) {
+          texel[0U] = static_cast<uint8_t>(
+              tables.srgb_to_linear[texel[0U]] * 255.f + 0.5f);
+        }
+      }
+    }
+    return BlockFormat::BC4;
+  }
+
+  bool opaque = AllTexels(
+      chain[0U], [](const uint8_t *texel) { return texel[3U] == 255U; });
+  return opaque ? BlockFormat::BC1 : BlockFormat::BC3;
+}
+
+static gli::format GetBlockGLIFormat(BlockFormat block_format, bool srgb) {
+  switch (block_format) {
+  case BlockFormat::BC1:
+    return srgb ? gli::FORMAT_RGB_DXT1_SRGB_BLOCK8
+                : gli::FORMAT_RGB_DXT1_UNORM_BLOCK8;
+  case BlockFormat::BC3:
+    return srgb ? gli::FORMAT_RGBA_DXT5_SRGB_BLOCK16
+                : gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16;
+  case BlockFormat::BC4:
+    return gli::FORMAT_R_ATI1N_UNORM_BLOCK8;
+  case BlockFormat::BC5:
+    return gli::FORMAT_RG_ATI2N_UNORM_BLOCK16;
+  }
+  return gli::FORMAT_UNDEFINED;
+}
+
+bool CookPNGTexture(const eastl::vector<uint8_t> &png_data, VkFormat format,
+                    TextureCompression compression, gli::texture2d &cooked) {
+  unsigned char *pixels = nullptr;
+  uint32_t width = 0U;
+  uint32_t height = 0U;
+  uint32_t err = lodepng_decode32(&pixels, &width, &height, png_data.data(),
+                                  png_data.size());
+  if (err != 0U || width == 0U || height == 0U) {
+    free(pixels);
+    return false;
+  }
+
+  bool srgb = format == VK_FORMAT_R8G8B8A8_SRGB;
+  gli::texture2d::extent_type extent(width, height);
+  gli::texture2d chain(srgb ? gli::FORMAT_RGBA8_SRGB_PACK8
+                            : gli::FORMAT_RGBA8_UNORM_PACK8,
+                       extent, gli::levels(extent));
+  memcpy(chain[0U].data(), pixels, static_cast<size_t>(width) * height * 4U);
+  free(pixels);
+
+  // Every level is filtered from the one above it
+  for (size_t level = 1U; level < chain.levels(); ++level) {
+    gli::image src = chain[level - 1U];
+    gli::image dst = chain[level];
+    DownsampleLevel(static_cast<const uint8_t *>(src.data()),
+                    SCAST_U32(src.extent().x), SCAST_U32(src.extent().y),
+                    static_cast<uint8_t *>(dst.data()),
+                    SCAST_U32(dst.extent().x), SCAST_U32(dst.extent().y),
+                    srgb);
+  }
+
+  if (compression == TextureCompression::NONE) {
+    cooked = chain;
+    return true;
+  }
+
+  BlockFormat block_format = ChooseBlockFormat(compression, srgb, chain);
+  cooked = gli::texture2d(GetBlockGLIFormat(block_format, srgb), extent,
+                          chain.levels());
+  for (size_t level = 0U; level < chain.levels(); ++level) {
+    gli::image src = chain[level];
+    CompressBlocks(block_format, static_cast<const uint8_t *>(src.data()),
+                   SCAST_U32(src.extent().x), SCAST_U32(src.extent().y),
+                   static_cast<uint8_t *>(cooked[level].data()));
+  }
+
+  return true;
+}
+
+bool SaveCookedTexture(const gli::texture2d &cooked,
+                       const eastl::string &cooked_path) {
+  eastl::string tmp_path = cooked_path + ".tmp";
+  if (!gli::save_ktx(cooked, tmp_path.c_str())) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  return tools::ReplaceFile(tmp_path.c_str(), cooked_path.c_str());
+}
+
+} // namespace vks
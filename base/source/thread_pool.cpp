@@ -0,0 +1,145 @@
+#include <EASTL/algorithm.h>
+#include <EASTL/shared_ptr.h>
+#include <atomic>
+#include <logger.hpp>
+#include <thread_pool.h>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+ThreadPool::ThreadPool()
+    : workers_(), tasks_(), tasks_mutex_(), tasks_cv_(), stop_(false) {}
+
+ThreadPool::~ThreadPool() { Shutdown(); }
+
+void ThreadPool::Init(uint32_t num_workers) {
+  Shutdown();
+
+  if (num_workers == 0U) {
+    uint32_t hw_threads = SCAST_U32(std::thread::hardware_concurrency());
+    num_workers = (hw_threads > 1U) ? hw_threads - 1U : 0U;
+  }
+
+  stop_ = false;
+  workers_.reserve(num_workers);
+  for (uint32_t i = 0U; i < num_workers; ++i) {
+    workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+  }
+
+  LOG("Initialised thread pool with " << num_workers << " workers.");
+}
+
+void ThreadPool::Shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(tasks_mutex_);
+    stop_ = true;
+  }
+  tasks_cv_.notify_all();
+
+  for (eastl::vector<std::thread>::iterator itor = workers_.begin();
+       itor != workers_.end(); ++itor) {
+    if (itor->joinable()) {
+      itor->join();
+    }
+  }
+  workers_.clear();
+}
+
+void ThreadPool::Enqueue(std::function<void()> task) {
+  if (workers_.empty()) {
+    task();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(tasks_mutex_);
+    tasks_.push_back(eastl::move(task));
+  }
+  tasks_cv_.notify_one();
+}
+
+// State of a ParallelFor call shared with its helpers, which may only get
+// to run once the call has returned
+struct ParallelForState {
+  ParallelForState() : next_idx(0U), mutex(), cv(), active_helpers(0U),
+                       done(false) {}
+
+  std::atomic<uint32_t> next_idx;
+  std::mutex mutex;
+  std::condition_variable cv;
+  // Helpers which joined before the call was done, and may still be using
+  // its function
+  uint32_t active_helpers;
+  bool done;
+};
+
+void ThreadPool::ParallelFor(uint32_t count,
+                             const std::function<void(uint32_t)> &func) {
+  if (count == 0U) {
+    return;
+  }
+
+  uint32_t num_helpers = eastl::min(num_workers(), count - 1U);
+  if (num_helpers == 0U) {
+    for (uint32_t i = 0U; i < count; ++i) {
+      func(i);
+    }
+    return;
+  }
+
+  // Indices are handed out one at a time so that uneven items (e.g. meshes
+  // of very different sizes) still balance across threads
+  eastl::shared_ptr<ParallelForState> state =
+      eastl::make_shared<ParallelForState>();
+  const std::function<void(uint32_t)> *func_ptr = &func;
+  for (uint32_t i = 0U; i < num_helpers; ++i) {
+    Enqueue([state, func_ptr, count]() {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->done) {
+          return;
+        }
+        ++state->active_helpers;
+      }
+      for (uint32_t i = state->next_idx++; i < count; i = state->next_idx++) {
+        (*func_ptr)(i);
+      }
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        --state->active_helpers;
+      }
+      state->cv.notify_one();
+    });
+  }
+
+  for (uint32_t i = state->next_idx++; i < count; i = state->next_idx++) {
+    func(i);
+  }
+
+  // Every index is taken by now; only wait for the helpers still running
+  // theirs. The ones which haven't started never touch func, so the caller
+  // doesn't run or wait for unrelated queued work, and nested calls from
+  // workers can't deadlock
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->done = true;
+  state->cv.wait(lock, [&state]() { return state->active_helpers == 0U; });
+}
+
+void ThreadPool::WorkerLoop() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(tasks_mutex_);
+      tasks_cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (stop_ && tasks_.empty()) {
+        return;
+      }
+      task = eastl::move(tasks_.front());
+      tasks_.pop_front();
+    }
+
+    task();
+  }
+}
+
+} // namespace vks
@@ -0,0 +1,114 @@
+#include <EASTL/algorithm.h>
+#include <transform_hierarchy.h>
+#include <vulkan_tools.h>
+#if defined(__SSE__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VKS_TRANSFORMHIERARCHY_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace vks {
+
+const uint32_t kNoTransformNode = 0xFFFFFFFFU;
+
+// out = lhs * rhs, for column major matrices; out may not alias lhs
+static void MultiplyMatrices(const glm::mat4 &lhs, const glm::mat4 &rhs,
+                             glm::mat4 &out) {
+#ifdef VKS_TRANSFORMHIERARCHY_SSE
+  const float *l = &lhs[0][0];
+  const float *r = &rhs[0][0];
+  float *o = &out[0][0];
+  __m128 l0 = _mm_loadu_ps(l);
+  __m128 l1 = _mm_loadu_ps(l + 4U);
+  __m128 l2 = _mm_loadu_ps(l + 8U);
+  __m128 l3 = _mm_loadu_ps(l + 12U);
+  // Every column of the result mixes the columns of lhs
+  for (uint32_t col = 0U; col < 4U; ++col) {
+    const float *r_col = r + col * 4U;
+    __m128 res = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(l0, _mm_set1_ps(r_col[0U])),
+                   _mm_mul_ps(l1, _mm_set1_ps(r_col[1U]))),
+        _mm_add_ps(_mm_mul_ps(l2, _mm_set1_ps(r_col[2U])),
+                   _mm_mul_ps(l3, _mm_set1_ps(r_col[3U]))));
+    _mm_storeu_ps(o + col * 4U, res);
+  }
+#else
+  out = lhs * rhs;
+#endif
+}
+
+TransformHierarchy::TransformHierarchy()
+    : parents_(), local_mats_(), world_mats_(), dirty_(), first_dirty_(0U) {}
+
+void TransformHierarchy::Clear() {
+  parents_.clear();
+  local_mats_.clear();
+  world_mats_.clear();
+  dirty_.clear();
+  first_dirty_ = 0U;
+}
+
+uint32_t TransformHierarchy::AddNode(uint32_t parent,
+                                     const glm::mat4 &local_mat) {
+  VKS_ASSERT(parent == kNoTransformNode || parent < size(),
+             "Parent of a transform node must be added first!");
+
+  uint32_t node_idx = size();
+  parents_.push_back(parent);
+  local_mats_.push_back(local_mat);
+  world_mats_.push_back(local_mat);
+  dirty_.push_back(0U);
+  if (parent != kNoTransformNode) {
+    MultiplyMatrices(world_mats_[parent], local_mat, world_mats_.back());
+  }
+
+  // Keep the nodes after a pending change covered by the next Update
+  if (!IsDirty()) {
+    first_dirty_ = size();
+  }
+  return node_idx;
+}
+
+void TransformHierarchy::SetLocalMatrix(uint32_t node_idx,
+                                        const glm::mat4 &local_mat) {
+  local_mats_[node_idx] = local_mat;
+  dirty_[node_idx] = 1U;
+  first_dirty_ = eastl::min(first_dirty_, node_idx);
+}
+
+bool TransformHierarchy::Update(eastl::vector<uint32_t> &changed) {
+  changed.clear();
+  uint32_t num_nodes = size();
+
+  // Parents come first, so a single pass spreads the flags down the tree
+  for (uint32_t i = first_dirty_; i < num_nodes; ++i) {
+    uint32_t parent = parents_[i];
+    if (dirty_[i] != 0U ||
+        (parent != kNoTransformNode && dirty_[parent] != 0U)) {
+      dirty_[i] = 1U;
+      changed.push_back(i);
+    }
+  }
+
+  // Then recompute the flagged nodes as a batch, still parents first
+  for (eastl::vector<uint32_t>::const_iterator itor = changed.begin();
+       itor != changed.end(); ++itor) {
+    uint32_t parent = parents_[*itor];
+    if (parent == kNoTransformNode) {
+      world_mats_[*itor] = local_mats_[*itor];
+    } else {
+      MultiplyMatrices(world_mats_[parent], local_mats_[*itor],
+                       world_mats_[*itor]);
+    }
+  }
+
+  for (eastl::vector<uint32_t>::const_iterator itor = changed.begin();
+       itor != changed.end(); ++itor) {
+    dirty_[*itor] = 0U;
+  }
+  first_dirty_ = num_nodes;
+
+  return !changed.empty();
+}
+
+} // namespace vks
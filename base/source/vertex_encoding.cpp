@@ -0,0 +1,117 @@
+#include <EASTL/algorithm.h>
+#include <cmath>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
+#include <logger.hpp>
+#include <vertex_encoding.h>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+static const float kUnorm16Max = 65535.f;
+
+// Project onto the octahedron, then fold the lower half over the upper one
+static glm::vec2 EncodeOctahedral(const glm::vec3 &dir) {
+  float l1_norm = fabsf(dir.x) + fabsf(dir.y) + fabsf(dir.z);
+  if (l1_norm == 0.f) {
+    return glm::vec2(0.f);
+  }
+
+  glm::vec2 oct = glm::vec2(dir.x, dir.y) / l1_norm;
+  if (dir.z < 0.f) {
+    glm::vec2 sign_not_zero(oct.x >= 0.f ? 1.f : -1.f,
+                            oct.y >= 0.f ? 1.f : -1.f);
+    oct = (1.f - glm::abs(glm::vec2(oct.y, oct.x))) * sign_not_zero;
+  }
+
+  return oct;
+}
+
+void EncodeVertexElement(VertexElementEncoding encoding, const float *src,
+                         void *dst, uint32_t size_bytes) {
+  switch (encoding) {
+  case VertexElementEncoding::RAW: {
+    memcpy(dst, src, size_bytes);
+    break;
+  }
+  case VertexElementEncoding::OCTAHEDRAL_16: {
+    uint16_t packed = glm::packSnorm2x8(
+        EncodeOctahedral(glm::vec3(src[0U], src[1U], src[2U])));
+    memcpy(dst, &packed, sizeof(packed));
+    break;
+  }
+  case VertexElementEncoding::OCTAHEDRAL_32: {
+    uint32_t packed = glm::packSnorm2x16(
+        EncodeOctahedral(glm::vec3(src[0U], src[1U], src[2U])));
+    memcpy(dst, &packed, sizeof(packed));
+    break;
+  }
+  case VertexElementEncoding::HALF_FLOAT: {
+    uint32_t packed = glm::packHalf2x16(glm::vec2(src[0U], src[1U]));
+    memcpy(dst, &packed, sizeof(packed));
+    break;
+  }
+  case VertexElementEncoding::UNORM_16: {
+    uint32_t packed = glm::packUnorm2x16(glm::vec2(src[0U], src[1U]));
+    memcpy(dst, &packed, sizeof(packed));
+    break;
+  }
+  default:
+    ELOG_ERR("Element can't be encoded on its own!");
+  }
+}
+
+void EncodeVertexElementArray(VertexElementEncoding encoding, const void *src,
+                              uint32_t src_stride, uint32_t count, void *dst,
+                              uint32_t size_bytes) {
+  if (src == nullptr) {
+    memset(dst, 0, count * size_bytes);
+    return;
+  }
+  if (encoding == VertexElementEncoding::RAW && src_stride == size_bytes) {
+    memcpy(dst, src, count * size_bytes);
+    return;
+  }
+
+  const uint8_t *src_bytes = static_cast<const uint8_t *>(src);
+  uint8_t *dst_bytes = static_cast<uint8_t *>(dst);
+  for (uint32_t i = 0U; i < count; ++i) {
+    EncodeVertexElement(
+        encoding, reinterpret_cast<const float *>(src_bytes + i * src_stride),
+        dst_bytes + i * size_bytes, size_bytes);
+  }
+}
+
+glm::vec4 GetPositionDequantisation(const glm::vec3 &aabb_min,
+                                    const glm::vec3 &aabb_max) {
+  glm::vec3 extent = aabb_max - aabb_min;
+  float scale = eastl::max(extent.x, eastl::max(extent.y, extent.z));
+
+  return glm::vec4(aabb_min, (scale > 0.f) ? scale : 1.f);
+}
+
+glm::mat4 GetPositionDequantisationMatrix(const glm::vec4 &dequant) {
+  glm::mat4 mat(dequant.w);
+  mat[3] = glm::vec4(glm::vec3(dequant), 1.f);
+
+  return mat;
+}
+
+void QuantisePosition(const glm::vec3 &pos, const glm::vec4 &dequant,
+                      uint16_t *dst) {
+  glm::vec3 normalised =
+      glm::clamp((pos - glm::vec3(dequant)) / dequant.w, 0.f, 1.f);
+  for (uint32_t i = 0U; i < 3U; ++i) {
+    dst[i] = static_cast<uint16_t>(normalised[i] * kUnorm16Max + 0.5f);
+  }
+  dst[3U] = static_cast<uint16_t>(kUnorm16Max);
+}
+
+glm::vec3 DequantisePosition(const uint16_t *src, const glm::vec4 &dequant) {
+  glm::vec3 normalised(SCAST_FLOAT(src[0U]), SCAST_FLOAT(src[1U]),
+                       SCAST_FLOAT(src[2U]));
+
+  return glm::vec3(dequant) + (normalised / kUnorm16Max) * dequant.w;
+}
+
+} // namespace vks
@@ -4,11 +4,73 @@
 
 namespace vks {
 
-VertexElement::VertexElement() : type(), size_bytes(0U), format() {}
+VertexElement::VertexElement()
+    : type(), size_bytes(0U), format(), encoding(VertexElementEncoding::RAW) {}
 
 VertexElement::VertexElement(VertexElementType Type, uint32_t Size_bytes,
                              VkFormat Format)
-    : type(Type), size_bytes(Size_bytes), format(Format) {}
+    : type(Type), size_bytes(Size_bytes), format(Format),
+      encoding(VertexElementEncoding::RAW) {}
+
+VertexElement::VertexElement(VertexElementType Type,
+                             VertexElementEncoding Encoding)
+    : type(Type), size_bytes(0U), format(VK_FORMAT_UNDEFINED),
+      encoding(Encoding) {
+  bool is_direction = type == VertexElementType::NORMAL ||
+                      type == VertexElementType::TANGENT ||
+                      type == VertexElementType::BITANGENT;
+
+  switch (encoding) {
+  case VertexElementEncoding::RAW: {
+    if (type == VertexElementType::UV) {
+      size_bytes = SCAST_U32(sizeof(float)) * 2U;
+      format = VK_FORMAT_R32G32_SFLOAT;
+    } else if (type == VertexElementType::COLOUR) {
+      size_bytes = SCAST_U32(sizeof(float)) * 4U;
+      format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    } else {
+      size_bytes = SCAST_U32(sizeof(float)) * 3U;
+      format = VK_FORMAT_R32G32B32_SFLOAT;
+    }
+    break;
+  }
+  case VertexElementEncoding::OCTAHEDRAL_16: {
+    VKS_ASSERT(is_direction, "Octahedral encoding is for directions only!");
+    size_bytes = 2U;
+    format = VK_FORMAT_R8G8_SNORM;
+    break;
+  }
+  case VertexElementEncoding::OCTAHEDRAL_32: {
+    VKS_ASSERT(is_direction, "Octahedral encoding is for directions only!");
+    size_bytes = 4U;
+    format = VK_FORMAT_R16G16_SNORM;
+    break;
+  }
+  case VertexElementEncoding::HALF_FLOAT: {
+    VKS_ASSERT(type == VertexElementType::UV,
+               "Half float encoding is for UVs only!");
+    size_bytes = 4U;
+    format = VK_FORMAT_R16G16_SFLOAT;
+    break;
+  }
+  case VertexElementEncoding::UNORM_16: {
+    VKS_ASSERT(type == VertexElementType::UV,
+               "Unorm16 encoding is for UVs only!");
+    size_bytes = 4U;
+    format = VK_FORMAT_R16G16_UNORM;
+    break;
+  }
+  case VertexElementEncoding::AABB_UNORM_16: {
+    VKS_ASSERT(type == VertexElementType::POSITION,
+               "AABB encoding is for positions only!");
+    size_bytes = 8U;
+    format = VK_FORMAT_R16G16B16A16_UNORM;
+    break;
+  }
+  default:
+    ELOG_ERR("Unsupported vertex element encoding!");
+  }
+}
 
 VertexSetup::VertexSetup()
     : vertex_layout_(), vertex_types_layout_(), vertex_size_(0U),
@@ -23,7 +85,8 @@ VertexSetup::VertexSetup(const eastl::vector<VertexElement> &vertex_layout /*,
     vertex_size_ += vertex_layout[i].size_bytes;
 
     vertex_layout_[vertex_layout[i].type] = {vertex_layout[i].size_bytes,
-                                             vertex_layout[i].format};
+                                             vertex_layout[i].format,
+                                             vertex_layout[i].encoding};
 
     vertex_types_layout_.push_back(vertex_layout[i].type);
   }
@@ -61,6 +124,21 @@ VkFormat VertexSetup::GetElementVulkanFormat(VertexElementType element) const {
   return VK_FORMAT_UNDEFINED;
 }
 
+VertexElementEncoding VertexSetup::GetElementEncoding(uint32_t idx) const {
+  return GetElementEncoding(vertex_types_layout_[idx]);
+}
+
+VertexElementEncoding
+VertexSetup::GetElementEncoding(VertexElementType element) const {
+  auto it = vertex_layout_.find(element);
+  if (it != vertex_layout_.end()) {
+    return it->second.encoding;
+  }
+
+  // Elements which aren't in the layout are never read anyway
+  return VertexElementEncoding::RAW;
+}
+
 uint32_t VertexSetup::GetElementPosition(uint32_t idx) const {
   return GetElementPosition(vertex_types_layout_[idx]);
 }
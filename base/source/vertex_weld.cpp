@@ -0,0 +1,107 @@
+#include <cstring>
+#include <vertex_weld.h>
+
+namespace vks {
+
+// Smallest table; it is then kept at most half full
+const uint32_t kWeldTableMinSlots = 64U;
+
+static uint32_t RotateLeft(uint32_t value, uint32_t shift) {
+  return (value << shift) | (value >> (32U - shift));
+}
+
+// One round of MurmurHash3 over the bits of a float; both zeroes hash the
+// same, as they compare equal
+static uint32_t HashFloat(uint32_t hash, float value) {
+  if (value == 0.f) {
+    value = 0.f;
+  }
+
+  uint32_t bits = 0U;
+  memcpy(&bits, &value, sizeof(bits));
+
+  bits *= 0xcc9e2d51U;
+  bits = RotateLeft(bits, 15U);
+  bits *= 0x1b873593U;
+
+  hash ^= bits;
+  hash = RotateLeft(hash, 13U);
+  return hash * 5U + 0xe6546b64U;
+}
+
+uint32_t HashVertex(const Vertex &vertex) {
+  uint32_t hash = 0U;
+  for (uint32_t i = 0U; i < 3U; ++i) {
+    hash = HashFloat(hash, vertex.pos[i]);
+    hash = HashFloat(hash, vertex.normal[i]);
+    hash = HashFloat(hash, vertex.uv[i]);
+    hash = HashFloat(hash, vertex.bitangent[i]);
+    hash = HashFloat(hash, vertex.tangent[i]);
+  }
+  for (uint32_t i = 0U; i < 4U; ++i) {
+    hash = HashFloat(hash, vertex.colour[i]);
+  }
+
+  // Finalisation mix, so that every input bit affects the low bits used to
+  // pick a slot
+  hash ^= hash >> 16U;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13U;
+  hash *= 0xc2b2ae35U;
+  hash ^= hash >> 16U;
+  return hash;
+}
+
+VertexWeldTable::VertexWeldTable(uint32_t expected_count)
+    : slots_(), slot_hashes_(), vertices_() {
+  uint32_t num_slots = kWeldTableMinSlots;
+  while (num_slots < expected_count * 2U) {
+    num_slots *= 2U;
+  }
+
+  vertices_.reserve(expected_count);
+  Rehash(num_slots);
+}
+
+uint32_t VertexWeldTable::FindOrInsert(const Vertex &vertex) {
+  if ((num_vertices() + 1U) * 2U > SCAST_U32(slots_.size())) {
+    Rehash(SCAST_U32(slots_.size()) * 2U);
+  }
+
+  uint32_t hash = HashVertex(vertex);
+  uint32_t mask = SCAST_U32(slots_.size()) - 1U;
+
+  // Linear probing up to the vertex or the first empty slot
+  uint32_t slot = hash & mask;
+  while (slots_[slot] != 0U) {
+    if (slot_hashes_[slot] == hash && vertices_[slots_[slot] - 1U] == vertex) {
+      return slots_[slot] - 1U;
+    }
+    slot = (slot + 1U) & mask;
+  }
+
+  vertices_.push_back(vertex);
+  slots_[slot] = num_vertices();
+  slot_hashes_[slot] = hash;
+  return num_vertices() - 1U;
+}
+
+void VertexWeldTable::Rehash(uint32_t num_slots) {
+  slots_.assign(num_slots, 0U);
+  slot_hashes_.assign(num_slots, 0U);
+
+  uint32_t mask = num_slots - 1U;
+  uint32_t vertices_count = num_vertices();
+  for (uint32_t i = 0U; i < vertices_count; ++i) {
+    uint32_t hash = HashVertex(vertices_[i]);
+    uint32_t slot = hash & mask;
+    while (slots_[slot] != 0U) {
+      slot = (slot + 1U) & mask;
+    }
+
+    slots_[slot] = i + 1U;
+    slot_hashes_[slot] = hash;
+  }
+}
+
+} // namespace vks
@@ -8,6 +8,10 @@
 
 namespace vks {
 
+// Needed to query the descriptor indexing support of the devices
+static const eastl::vector<const char *> kInstanceExtensions = {
+    VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME};
+
 #ifndef NDEBUG
 static const eastl::vector<const char *> kInstanceDebugExtensions = {
     VK_EXT_DEBUG_REPORT_EXTENSION_NAME};
@@ -27,8 +31,8 @@ VulkanBase::VulkanBase()
       pre_present_cmd_buffers_(VK_NULL_HANDLE),
       post_present_cmd_buffers_(VK_NULL_HANDLE),
       graphics_queue_cmd_buffers_(VK_NULL_HANDLE),
-      copy_cmd_buff_(VK_NULL_HANDLE), callback_(VK_NULL_HANDLE),
-      surface_(VK_NULL_HANDLE), swapchain_(), device_() {}
+      callback_(VK_NULL_HANDLE), surface_(VK_NULL_HANDLE), swapchain_(),
+      device_() {}
 
 void VulkanBase::Init(GLFWwindow *window, const uint32_t width,
                       const uint32_t height) {
@@ -44,11 +48,6 @@ void VulkanBase::Init(GLFWwindow *window, const uint32_t width,
 void VulkanBase::Shutdown() {
   if (device_.IsDeviceVaild()) {
     vkDeviceWaitIdle(device_.device());
-    if (copy_cmd_buff_ != VK_NULL_HANDLE) {
-      vkFreeCommandBuffers(device_.device(), device_.graphics_queue().cmd_pool,
-                           1U, &copy_cmd_buff_);
-      copy_cmd_buff_ = VK_NULL_HANDLE;
-    }
     if (graphics_queue_cmd_buffers_.size() > 0) {
       vkFreeCommandBuffers(device_.device(), device_.graphics_queue().cmd_pool,
                            SCAST_U32(graphics_queue_cmd_buffers_.size()),
@@ -116,6 +115,8 @@ void VulkanBase::CreateInstance() {
 
   eastl::vector<const char *> extensions;
   extensions.assign(glfw_extensions, glfw_extensions + glfw_extension_count);
+  extensions.insert(extensions.end(), kInstanceExtensions.begin(),
+                    kInstanceExtensions.end());
 
   eastl::vector<const char *> layers;
 
@@ -186,10 +187,6 @@ void VulkanBase::CreateBaseCmdBuffers() {
   VK_CHECK_RESULT(vkAllocateCommandBuffers(device_.device(),
                                            &cmd_buffer_allocate_info,
                                            graphics_queue_cmd_buffers_.data()));
-
-  cmd_buffer_allocate_info.commandBufferCount = 1U;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      device_.device(), &cmd_buffer_allocate_info, &copy_cmd_buff_));
 }
 
 void VulkanBase::RecordBaseCmdBuffers() {
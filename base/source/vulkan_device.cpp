@@ -1,4 +1,6 @@
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <logger.hpp>
 #include <set>
@@ -10,7 +12,16 @@
 #include <vulkan_tools.h>
 
 static const std::vector<const char *> kDeviceExtensions = {
-    "VK_AMD_shader_explicit_vertex_parameter", VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    "VK_AMD_shader_explicit_vertex_parameter", VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    VK_KHR_MAINTENANCE3_EXTENSION_NAME,
+    VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME,
+    VK_EXT_SHADER_SUBGROUP_BALLOT_EXTENSION_NAME};
+
+// Data of the pipeline cache, kept from a run to the next
+static const char *kPipelineCacheFilename =
+    STR(ASSETS_FOLDER) "pipeline_cache.bin";
+static const uint32_t kPipelineCacheMagic = 0x43505356U;
+static const uint32_t kPipelineCacheVersion = 1U;
 
 #ifndef NDEBUG
 static const std::vector<const char *> kDeviceDebugValidationLayers = {
@@ -23,16 +34,70 @@ struct QueueFamilyIndices {
   uint32_t graphics_family;
   uint32_t present_family;
   uint32_t compute_family;
+  uint32_t transfer_family;
 };
 
 static bool
 IsQueueFamilyIndicesComplete(const QueueFamilyIndices &family_indices);
 
+// Precedes the data of the pipeline cache on disk. The data is only used by
+// the device and driver which wrote it
+struct PipelineCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t vendor_id;
+  uint32_t device_id;
+  uint32_t driver_version;
+  uint8_t cache_uuid[VK_UUID_SIZE];
+  uint64_t data_size;
+};
+
+static void
+FillPipelineCacheHeader(const VkPhysicalDeviceProperties &properties,
+                        uint64_t data_size, PipelineCacheHeader &header) {
+  memset(&header, 0, sizeof(header));
+  header.magic = kPipelineCacheMagic;
+  header.version = kPipelineCacheVersion;
+  header.vendor_id = properties.vendorID;
+  header.device_id = properties.deviceID;
+  header.driver_version = properties.driverVersion;
+  memcpy(header.cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  header.data_size = data_size;
+}
+
+// Whether a physical device can sample a bindless array of textures, indexed
+// per pixel, partially bound and written while it is bound
+static bool SupportsTextureTable(VkInstance instance,
+                                 VkPhysicalDevice physical_device) {
+  PFN_vkGetPhysicalDeviceFeatures2KHR vkGetPhysicalDeviceFeatures2KHR =
+      reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(
+          vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR"));
+  if (vkGetPhysicalDeviceFeatures2KHR == nullptr) {
+    return false;
+  }
+
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {};
+  indexing_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  VkPhysicalDeviceFeatures2KHR features = {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features.pNext = &indexing_features;
+  vkGetPhysicalDeviceFeatures2KHR(physical_device, &features);
+
+  return indexing_features.shaderSampledImageArrayNonUniformIndexing &&
+         indexing_features.descriptorBindingSampledImageUpdateAfterBind &&
+         indexing_features.descriptorBindingUpdateUnusedWhilePending &&
+         indexing_features.descriptorBindingPartiallyBound;
+}
+
 VulkanDevice::VulkanDevice()
     : physical_device_(VK_NULL_HANDLE), device_(VK_NULL_HANDLE),
       graphics_queue_(), present_queue_(), compute_queue_(),
-      physical_properties_(), physical_features_(),
-      physical_memory_properties_(), depth_format_() {}
+      transfer_queue_(), physical_properties_(), physical_features_(),
+      indexing_properties_(), physical_memory_properties_(), depth_format_(),
+      allocator_(), uploader_(), pipeline_cache_(VK_NULL_HANDLE),
+      pipeline_cache_warm_(false), num_created_pipelines_(0U),
+      pipeline_creation_ms_(0.0) {}
 
 void VulkanDevice::Init(VkInstance instance, VkSurfaceKHR surface) {
   uint32_t num_devices = 0U;
@@ -47,10 +112,12 @@ void VulkanDevice::Init(VkInstance instance, VkSurfaceKHR surface) {
 
   // This saves both the physical device which we want to use and the queue
   // family indices which we want to create queues from
-  QueueFamilyIndices queue_families = {UINT32_MAX, UINT32_MAX, UINT32_MAX};
+  QueueFamilyIndices queue_families = {UINT32_MAX, UINT32_MAX, UINT32_MAX,
+                                       UINT32_MAX};
   for (uint32_t i = 0; i < num_devices; ++i) {
     if (IsPhysicalDeviceSuitable(physical_devices[i], queue_families,
-                                 surface)) {
+                                 surface) &&
+        SupportsTextureTable(instance, physical_devices[i])) {
       physical_device_ = physical_devices[i];
       break;
     }
@@ -63,19 +130,31 @@ void VulkanDevice::Init(VkInstance instance, VkSurfaceKHR surface) {
   graphics_queue_.index = queue_families.graphics_family;
   present_queue_.index = queue_families.present_family;
   compute_queue_.index = queue_families.compute_family;
+  transfer_queue_.index = queue_families.transfer_family;
 
   // Store properties and features of the physical device for later use
   vkGetPhysicalDeviceProperties(physical_device_, &physical_properties_);
   vkGetPhysicalDeviceFeatures(physical_device_, &physical_features_);
+  PFN_vkGetPhysicalDeviceProperties2KHR vkGetPhysicalDeviceProperties2KHR =
+      reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(
+          vkGetInstanceProcAddr(instance,
+                                "vkGetPhysicalDeviceProperties2KHR"));
+  indexing_properties_.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+  VkPhysicalDeviceProperties2KHR properties = {};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+  properties.pNext = &indexing_properties_;
+  vkGetPhysicalDeviceProperties2KHR(physical_device_, &properties);
+  indexing_properties_.pNext = nullptr;
   vkGetPhysicalDeviceMemoryProperties(physical_device_,
                                       &physical_memory_properties_);
   tools::GetSupportedDepthFormat(physical_device_, depth_format_);
 
   std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
   // Use a set to select only unique family ids
-  std::set<uint32_t> unique_queue_families = {queue_families.graphics_family,
-                                              queue_families.present_family,
-                                              queue_families.compute_family};
+  std::set<uint32_t> unique_queue_families = {
+      queue_families.graphics_family, queue_families.present_family,
+      queue_families.compute_family, queue_families.transfer_family};
 
   std::set<uint32_t>::iterator it;
   // queue_priorities is a vector so that if in the future there is the need
@@ -102,8 +181,17 @@ void VulkanDevice::Init(VkInstance instance, VkSurfaceKHR surface) {
                 kDeviceDebugValidationLayers.end());
 #endif
 
+  // Only what the texture table of VulkanTextureManager needs
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {};
+  indexing_features.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  indexing_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+  indexing_features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+  indexing_features.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+  indexing_features.descriptorBindingPartiallyBound = VK_TRUE;
+
   VkDeviceCreateInfo device_create_info = {VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-                                           nullptr,
+                                           &indexing_features,
                                            0,
                                            SCAST_U32(queue_create_infos.size()),
                                            queue_create_infos.data(),
@@ -123,6 +211,8 @@ void VulkanDevice::Init(VkInstance instance, VkSurfaceKHR surface) {
                    &present_queue_.queue);
   vkGetDeviceQueue(device_, queue_families.compute_family, 0U,
                    &compute_queue_.queue);
+  vkGetDeviceQueue(device_, queue_families.transfer_family, 0U,
+                   &transfer_queue_.queue);
 
   // Create default command pools for the queues
   VkCommandPoolCreateInfo cmd_pool_create_info =
@@ -137,9 +227,27 @@ void VulkanDevice::Init(VkInstance instance, VkSurfaceKHR surface) {
   cmd_pool_create_info.queueFamilyIndex = queue_families.compute_family;
   VK_CHECK_RESULT(vkCreateCommandPool(device_, &cmd_pool_create_info, nullptr,
                                       &compute_queue_.cmd_pool));
+  cmd_pool_create_info.queueFamilyIndex = queue_families.transfer_family;
+  VK_CHECK_RESULT(vkCreateCommandPool(device_, &cmd_pool_create_info, nullptr,
+                                      &transfer_queue_.cmd_pool));
+
+  allocator_.Init(device_, physical_memory_properties_,
+                  physical_properties_.limits.bufferImageGranularity,
+                  physical_properties_.limits.nonCoherentAtomSize);
+  uploader_.Init(*this);
+
+  CreatePipelineCache();
 }
 
 void VulkanDevice::Shutdown() {
+  if (device_ != VK_NULL_HANDLE) {
+    uploader_.Shutdown(*this);
+  }
+
+  if (transfer_queue_.cmd_pool != VK_NULL_HANDLE) {
+    vkDestroyCommandPool(device_, transfer_queue_.cmd_pool, nullptr);
+    transfer_queue_.cmd_pool = VK_NULL_HANDLE;
+  }
   if (compute_queue_.cmd_pool != VK_NULL_HANDLE) {
     vkDestroyCommandPool(device_, compute_queue_.cmd_pool, nullptr);
     compute_queue_.cmd_pool = VK_NULL_HANDLE;
@@ -156,11 +264,29 @@ void VulkanDevice::Shutdown() {
   if (device_ != VK_NULL_HANDLE) {
     vkDeviceWaitIdle(device_);
 
+    allocator_.LogReport();
+    allocator_.Shutdown();
+
+    if (pipeline_cache_ != VK_NULL_HANDLE) {
+      LOG("Created " << num_created_pipelines_ << " pipelines in "
+                     << pipeline_creation_ms_ << " ms with a "
+                     << (pipeline_cache_warm_ ? "warm" : "cold")
+                     << " pipeline cache");
+      SavePipelineCache();
+      vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
+      pipeline_cache_ = VK_NULL_HANDLE;
+    }
+
     vkDestroyDevice(device_, nullptr);
     device_ = VK_NULL_HANDLE;
   }
 }
 
+void VulkanDevice::AddPipelineCreationTime(double milliseconds) const {
+  ++num_created_pipelines_;
+  pipeline_creation_ms_ += milliseconds;
+}
+
 uint32_t
 VulkanDevice::GetMemoryType(uint32_t type_bits,
                             VkMemoryPropertyFlags properties_flags) const {
@@ -177,6 +303,93 @@ VulkanDevice::GetMemoryType(uint32_t type_bits,
   return -1;
 }
 
+void VulkanDevice::CreatePipelineCache() {
+  PipelineCacheHeader expected_header;
+  FillPipelineCacheHeader(physical_properties_, 0U, expected_header);
+
+  // Only the data written by this device and driver is used, anything else
+  // starts the cache cold
+  std::vector<char> data;
+  std::ifstream file(kPipelineCacheFilename, std::ios::binary | std::ios::ate);
+  if (file.is_open()) {
+    uint64_t file_size = static_cast<uint64_t>(file.tellg());
+    PipelineCacheHeader header;
+    file.seekg(0, std::ios::beg);
+    if (file_size >= sizeof(header) &&
+        file.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+        header.magic == expected_header.magic &&
+        header.version == expected_header.version &&
+        header.vendor_id == expected_header.vendor_id &&
+        header.device_id == expected_header.device_id &&
+        header.driver_version == expected_header.driver_version &&
+        memcmp(header.cache_uuid, expected_header.cache_uuid,
+               VK_UUID_SIZE) == 0 &&
+        header.data_size == file_size - sizeof(header)) {
+      data.resize(static_cast<size_t>(header.data_size));
+      if (!file.read(data.data(), static_cast<std::streamsize>(data.size()))) {
+        data.clear();
+      }
+    }
+
+    if (data.empty()) {
+      LOG("Pipeline cache " << kPipelineCacheFilename
+                            << " doesn't match the device, ignored");
+    }
+  }
+
+  VkPipelineCacheCreateInfo cache_create_info = {
+      VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, nullptr, 0U, data.size(),
+      data.empty() ? nullptr : data.data()};
+  VK_CHECK_RESULT(vkCreatePipelineCache(device_, &cache_create_info, nullptr,
+                                        &pipeline_cache_));
+  pipeline_cache_warm_ = !data.empty();
+
+  LOG("Pipeline cache started " << (pipeline_cache_warm_ ? "warm" : "cold")
+                                << " with " << data.size() / 1024U
+                                << " KB of data");
+}
+
+void VulkanDevice::SavePipelineCache() const {
+  size_t data_size = 0U;
+  VK_CHECK_RESULT(
+      vkGetPipelineCacheData(device_, pipeline_cache_, &data_size, nullptr));
+  std::vector<char> data(data_size);
+  VK_CHECK_RESULT(vkGetPipelineCacheData(device_, pipeline_cache_, &data_size,
+                                         data.data()));
+  data.resize(data_size);
+
+  PipelineCacheHeader header;
+  FillPipelineCacheHeader(physical_properties_, data_size, header);
+
+  // Write to a temporary file first so that a crash never leaves a
+  // truncated cache behind
+  std::string cache_path = kPipelineCacheFilename;
+  std::string tmp_path = cache_path + ".tmp";
+  bool written = false;
+  {
+    std::ofstream file(tmp_path.c_str(), std::ios::out | std::ios::binary |
+                                             std::ios::trunc);
+    if (file.is_open()) {
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(data.data(), static_cast<std::streamsize>(data.size()));
+      written = file.good();
+    }
+  }
+
+  if (!written) {
+    std::remove(tmp_path.c_str());
+    ELOG_WARN("Could not write pipeline cache " + cache_path + "!");
+    return;
+  }
+  if (!tools::ReplaceFile(tmp_path, cache_path)) {
+    ELOG_WARN("Could not write pipeline cache " + cache_path + "!");
+    return;
+  }
+
+  LOG("Saved pipeline cache " << cache_path << " with " << data_size / 1024U
+                              << " KB of data");
+}
+
 bool VulkanDevice::IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
                                             QueueFamilyIndices &queue_families,
                                             VkSurfaceKHR surface) const {
@@ -250,7 +463,7 @@ bool VulkanDevice::IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
   // Scan through the enumerated queue families and select a graphics,
   // compute and present queue; they could be on two separate families
   QueueFamilyIndices selected_queue_families = {UINT32_MAX, UINT32_MAX,
-                                                UINT32_MAX};
+                                                UINT32_MAX, UINT32_MAX};
   bool is_family_complete = false;
   for (uint32_t i = 0U; i < queue_families_count; ++i) {
     // Select the first queue familiy that supports graphics
@@ -287,6 +500,21 @@ bool VulkanDevice::IsPhysicalDeviceSuitable(VkPhysicalDevice physical_device,
     return false;
   }
 
+  // Uploads go to a family which only does transfers when there is one, so
+  // that they run alongside the rendering; otherwise they share the graphics
+  // queue
+  selected_queue_families.transfer_family =
+      selected_queue_families.graphics_family;
+  for (uint32_t i = 0U; i < queue_families_count; ++i) {
+    const VkQueueFlags &flags = queue_family_properties[i].queueFlags;
+    if ((queue_family_properties[i].queueCount > 0U) &&
+        (flags & VK_QUEUE_TRANSFER_BIT) &&
+        !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+      selected_queue_families.transfer_family = i;
+      break;
+    }
+  }
+
   queue_families = selected_queue_families;
   return true;
 }
@@ -7,14 +7,14 @@
 namespace vks {
 
 VulkanImage::VulkanImage()
-    : image_(VK_NULL_HANDLE), owns_image_(false), memory_(VK_NULL_HANDLE),
-      size_(0U), default_view_(VK_NULL_HANDLE), additional_views_(),
-      memory_properties_flags_(), layout_(), extent_({0U, 0U, 0U}),
+    : image_(VK_NULL_HANDLE), owns_image_(false), allocation_(), size_(0U),
+      default_view_(VK_NULL_HANDLE), additional_views_(),
+      memory_usage_(MemoryUsage::GPU_ONLY), layout_(), extent_({0U, 0U, 0U}),
       mip_levels_(1U), array_layers_(1U), format_() {}
 
 void VulkanImage::Init(const VulkanDevice &device,
                        const VulkanImageInitInfo &info) {
-  memory_properties_flags_ = info.memory_properties_flags;
+  memory_usage_ = info.memory_usage;
   layout_ = info.create_info.initialLayout;
   extent_ = info.create_info.extent;
   mip_levels_ = info.create_info.mipLevels;
@@ -29,17 +29,20 @@ void VulkanImage::Init(const VulkanDevice &device,
   VkMemoryRequirements memory_requirements;
   vkGetImageMemoryRequirements(device.device(), image_, &memory_requirements);
 
-  // Allocate memory for the image
-  VkMemoryAllocateInfo mem_alloc_info = {
-      VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr, memory_requirements.size,
-      device.GetMemoryType(memory_requirements.memoryTypeBits,
-                           memory_properties_flags_)};
-
-  VK_CHECK_RESULT(
-      vkAllocateMemory(device.device(), &mem_alloc_info, nullptr, &memory_));
+  // Take memory for the image from the allocator; optimally tiled images
+  // must not share pages with buffers
+  AllocationTiling tiling = info.create_info.tiling == VK_IMAGE_TILING_OPTIMAL
+                                ? AllocationTiling::OPTIMAL
+                                : AllocationTiling::LINEAR;
+  if (!device.allocator().Allocate(memory_requirements, memory_usage_, tiling,
+                                   allocation_)) {
+    EXIT("Out of device memory for an image of "
+         << memory_requirements.size << " bytes!");
+  }
 
   // Assign the memory to the image
-  VK_CHECK_RESULT(vkBindImageMemory(device.device(), image_, memory_, 0U));
+  VK_CHECK_RESULT(vkBindImageMemory(device.device(), image_,
+                                    allocation_.memory, allocation_.offset));
 
   if (info.create_view == CreateView::YES) {
     // Create an image view for the texture
@@ -106,12 +109,23 @@ void VulkanImage::Shutdown(const VulkanDevice &device) {
     vkDestroyImage(device.device(), image_, nullptr);
     image_ = VK_NULL_HANDLE;
   }
-  if (memory_ != VK_NULL_HANDLE && owns_image_) {
-    vkFreeMemory(device.device(), memory_, nullptr);
-    memory_ = VK_NULL_HANDLE;
+  if (owns_image_) {
+    device.allocator().Free(allocation_);
+  }
+}
+
+VkResult VulkanImage::Map(const VulkanDevice &device,
+                          void **mapped_memory) const {
+  if (allocation_.mapped == nullptr) {
+    return VK_ERROR_MEMORY_MAP_FAILED;
   }
+
+  *mapped_memory = allocation_.mapped;
+  return VK_SUCCESS;
 }
 
+void VulkanImage::Unmap(const VulkanDevice &device) const {}
+
 VkDescriptorImageInfo
 VulkanImage::GetDescriptorImageInfo(VkSampler sampler) const {
   VkDescriptorImageInfo desc;
@@ -0,0 +1,583 @@
+#include <EASTL/algorithm.h>
+#include <logger.hpp>
+#include <vulkan_memory_allocator.h>
+#include <vulkan_tools.h>
+
+namespace vks {
+
+const VkDeviceSize kVulkanMemoryBlockSize = 64U * 1024U * 1024U;
+const VkDeviceSize kVulkanMemoryMinAllocSize = 256U;
+
+// Smallest power of two which is at least val
+static uint32_t CeilLog2(VkDeviceSize val) {
+  uint32_t order = 0U;
+  while ((static_cast<VkDeviceSize>(1U) << order) < val) {
+    ++order;
+  }
+  return order;
+}
+
+// Largest power of two which is at most val
+static uint32_t FloorLog2(VkDeviceSize val) {
+  uint32_t order = 0U;
+  while ((static_cast<VkDeviceSize>(1U) << (order + 1U)) <= val) {
+    ++order;
+  }
+  return order;
+}
+
+static uint32_t CountBits(uint32_t val) {
+  uint32_t count = 0U;
+  for (; val != 0U; val &= val - 1U) {
+    ++count;
+  }
+  return count;
+}
+
+// Flags a type must have for a usage, then the ones it would rather have,
+// then the ones it would rather not have
+static void GetUsageFlags(MemoryUsage usage, VkMemoryPropertyFlags &required,
+                          VkMemoryPropertyFlags &preferred,
+                          VkMemoryPropertyFlags &unwanted) {
+  const VkMemoryPropertyFlags host = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  switch (usage) {
+  case MemoryUsage::GPU_ONLY:
+    // Host visible device memory is scarce; keep it for the CPU writes
+    required = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    preferred = 0U;
+    unwanted = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    break;
+  case MemoryUsage::CPU_TO_GPU:
+    // Writers flush what they change, so non-coherent memory will do
+    required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    unwanted = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    break;
+  case MemoryUsage::GPU_TO_CPU:
+    required = host;
+    preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    unwanted = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    break;
+  case MemoryUsage::CPU_ONLY:
+  default:
+    required = host;
+    preferred = 0U;
+    unwanted = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    break;
+  }
+}
+
+// Whether host writes have to be flushed and device writes invalidated
+static bool IsNonCoherent(VkMemoryPropertyFlags flags) {
+  return (flags & (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) ==
+         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+// A block of device memory split in ranges with the buddy method. Free
+// ranges are listed per order, from the smallest range up to the block
+struct VulkanMemoryBlock {
+  VulkanMemoryBlock(VkDeviceMemory Memory, uint8_t *Mapped,
+                    uint32_t Memory_type, AllocationTiling Tiling,
+                    uint32_t Max_order);
+
+  // Take a free range of 2^order bytes, splitting larger ones as needed
+  bool Allocate(uint32_t order, VkDeviceSize &offset);
+  // Give a range back, merging it with its buddy while both are free
+  void Free(VkDeviceSize offset, uint32_t order);
+
+  VkDeviceSize size() const {
+    return static_cast<VkDeviceSize>(1U) << max_order;
+  }
+
+  VkDeviceMemory memory;
+  uint8_t *mapped;
+  uint32_t memory_type;
+  AllocationTiling tiling;
+  uint32_t min_order;
+  uint32_t max_order;
+  eastl::vector<eastl::vector<VkDeviceSize>> free_ranges;
+  uint32_t num_allocations;
+  VkDeviceSize allocated_bytes;
+  VkDeviceSize requested_bytes;
+}; // struct VulkanMemoryBlock
+
+VulkanMemoryBlock::VulkanMemoryBlock(VkDeviceMemory Memory, uint8_t *Mapped,
+                                     uint32_t Memory_type,
+                                     AllocationTiling Tiling,
+                                     uint32_t Max_order)
+    : memory(Memory), mapped(Mapped), memory_type(Memory_type),
+      tiling(Tiling), min_order(CeilLog2(kVulkanMemoryMinAllocSize)),
+      max_order(Max_order), free_ranges(Max_order - min_order + 1U),
+      num_allocations(0U), allocated_bytes(0U), requested_bytes(0U) {
+  free_ranges.back().push_back(0U);
+}
+
+bool VulkanMemoryBlock::Allocate(uint32_t order, VkDeviceSize &offset) {
+  uint32_t found_order = order;
+  while (found_order <= max_order &&
+         free_ranges[found_order - min_order].empty()) {
+    ++found_order;
+  }
+  if (found_order > max_order) {
+    return false;
+  }
+
+  offset = free_ranges[found_order - min_order].back();
+  free_ranges[found_order - min_order].pop_back();
+
+  // The upper halves of the splits stay free
+  while (found_order > order) {
+    --found_order;
+    free_ranges[found_order - min_order].push_back(
+        offset + (static_cast<VkDeviceSize>(1U) << found_order));
+  }
+
+  return true;
+}
+
+void VulkanMemoryBlock::Free(VkDeviceSize offset, uint32_t order) {
+  while (order < max_order) {
+    VkDeviceSize buddy = offset ^ (static_cast<VkDeviceSize>(1U) << order);
+    eastl::vector<VkDeviceSize> &ranges = free_ranges[order - min_order];
+    eastl::vector<VkDeviceSize>::iterator itor =
+        eastl::find(ranges.begin(), ranges.end(), buddy);
+    if (itor == ranges.end()) {
+      break;
+    }
+
+    ranges.erase_unsorted(itor);
+    offset = eastl::min(offset, buddy);
+    ++order;
+  }
+
+  free_ranges[order - min_order].push_back(offset);
+}
+
+VulkanAllocation::VulkanAllocation()
+    : memory(VK_NULL_HANDLE), offset(0U), size(0U), mapped(nullptr),
+      memory_type(0U), memory_property_flags(0U), block(nullptr), order(0U) {}
+
+VulkanMemoryStats::VulkanMemoryStats()
+    : num_blocks(0U), num_dedicated(0U), num_allocations(0U),
+      reserved_bytes(0U), allocated_bytes(0U), requested_bytes(0U),
+      free_bytes(0U), largest_free_range(0U), num_free_ranges(0U) {}
+
+VulkanMemoryAllocator::VulkanMemoryAllocator()
+    : device_(VK_NULL_HANDLE), memory_properties_(), separate_tilings_(true),
+      non_coherent_atom_size_(1U), heap_block_sizes_(), blocks_(),
+      num_dedicated_(0U), dedicated_bytes_(0U), mutex_() {}
+
+VulkanMemoryAllocator::~VulkanMemoryAllocator() {}
+
+void VulkanMemoryAllocator::Init(VkDevice device,
+                                 const VkPhysicalDeviceMemoryProperties &props,
+                                 VkDeviceSize buffer_image_granularity,
+                                 VkDeviceSize non_coherent_atom_size) {
+  device_ = device;
+  memory_properties_ = props;
+  non_coherent_atom_size_ = eastl::max(non_coherent_atom_size,
+                                       static_cast<VkDeviceSize>(1U));
+
+  // Ranges are aligned to their size, so if the smallest one covers whole
+  // pages linear and optimal resources never share one
+  separate_tilings_ = buffer_image_granularity > kVulkanMemoryMinAllocSize;
+
+  // Small heaps, such as the host visible part of device memory, get
+  // smaller blocks so that one block does not take all of it
+  heap_block_sizes_.resize(memory_properties_.memoryHeapCount);
+  for (uint32_t i = 0U; i < memory_properties_.memoryHeapCount; ++i) {
+    VkDeviceSize heap_size = memory_properties_.memoryHeaps[i].size;
+    heap_block_sizes_[i] =
+        eastl::min(kVulkanMemoryBlockSize,
+                   eastl::max(static_cast<VkDeviceSize>(1U)
+                                  << FloorLog2(heap_size / 8U),
+                              kVulkanMemoryMinAllocSize * 2U));
+  }
+}
+
+void VulkanMemoryAllocator::Shutdown() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  uint32_t num_alive = num_dedicated_;
+  for (eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>>::iterator itor =
+           blocks_.begin();
+       itor != blocks_.end(); ++itor) {
+    num_alive += (*itor)->num_allocations;
+    vkFreeMemory(device_, (*itor)->memory, nullptr);
+  }
+  blocks_.clear();
+
+  if (num_alive != 0U) {
+    ELOG_WARN(num_alive << " device memory allocations were not freed");
+  }
+  num_dedicated_ = 0U;
+  dedicated_bytes_ = 0U;
+  device_ = VK_NULL_HANDLE;
+}
+
+uint32_t VulkanMemoryAllocator::FindMemoryType(uint32_t type_bits,
+                                               MemoryUsage usage,
+                                               uint32_t excluded_types) const {
+  VkMemoryPropertyFlags required = 0U;
+  VkMemoryPropertyFlags preferred = 0U;
+  VkMemoryPropertyFlags unwanted = 0U;
+  GetUsageFlags(usage, required, preferred, unwanted);
+
+  uint32_t best_type = UINT32_MAX;
+  int32_t best_score = INT32_MIN;
+  for (uint32_t i = 0U; i < memory_properties_.memoryTypeCount; ++i) {
+    VkMemoryPropertyFlags flags =
+        memory_properties_.memoryTypes[i].propertyFlags;
+    if ((type_bits & (1U << i)) == 0U || (excluded_types & (1U << i)) != 0U ||
+        (flags & required) != required) {
+      continue;
+    }
+
+    int32_t score = static_cast<int32_t>(CountBits(flags & preferred)) -
+                    static_cast<int32_t>(CountBits(flags & unwanted));
+    if (score > best_score) {
+      best_score = score;
+      best_type = i;
+    }
+  }
+
+  return best_type;
+}
+
+bool VulkanMemoryAllocator::Allocate(const VkMemoryRequirements &requirements,
+                                     MemoryUsage usage,
+                                     AllocationTiling tiling,
+                                     VulkanAllocation &allocation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  uint32_t excluded_types = 0U;
+  for (;;) {
+    uint32_t memory_type = FindMemoryType(requirements.memoryTypeBits, usage,
+                                          excluded_types);
+    if (memory_type == UINT32_MAX) {
+      return false;
+    }
+
+    // Ranges of non-coherent memory cover whole atoms, so that flushing one
+    // never touches its neighbours
+    const VkMemoryType &type = memory_properties_.memoryTypes[memory_type];
+    VkDeviceSize alignment = requirements.alignment;
+    if (IsNonCoherent(type.propertyFlags)) {
+      alignment = eastl::max(alignment, non_coherent_atom_size_);
+    }
+
+    bool allocated =
+        eastl::max(requirements.size, alignment) >
+                heap_block_sizes_[type.heapIndex] / 2U
+            ? AllocateDedicated(requirements.size, memory_type, allocation)
+            : AllocateFromBlocks(requirements.size, alignment, memory_type,
+                                 tiling, allocation);
+    if (allocated) {
+      return true;
+    }
+
+    // That heap is full, try the next best type
+    excluded_types |= 1U << memory_type;
+  }
+}
+
+void VulkanMemoryAllocator::Free(VulkanAllocation &allocation) {
+  if (allocation.memory == VK_NULL_HANDLE) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  VulkanMemoryBlock *block = allocation.block;
+  if (block == nullptr) {
+    vkFreeMemory(device_, allocation.memory, nullptr);
+    --num_dedicated_;
+    dedicated_bytes_ -= allocation.size;
+  } else {
+    block->Free(allocation.offset, allocation.order);
+    --block->num_allocations;
+    block->allocated_bytes -= static_cast<VkDeviceSize>(1U)
+                              << allocation.order;
+    block->requested_bytes -= allocation.size;
+
+    // Keep one empty block per type around, so that a resource being
+    // recreated does not allocate device memory again
+    if (block->num_allocations == 0U) {
+      for (eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>>::iterator
+               itor = blocks_.begin();
+           itor != blocks_.end(); ++itor) {
+        if (itor->get() != block && (*itor)->num_allocations == 0U &&
+            (*itor)->memory_type == block->memory_type &&
+            (*itor)->tiling == block->tiling) {
+          DestroyBlock(block);
+          break;
+        }
+      }
+    }
+  }
+
+  allocation = VulkanAllocation();
+}
+
+bool VulkanMemoryAllocator::AllocateDedicated(VkDeviceSize size,
+                                              uint32_t memory_type,
+                                              VulkanAllocation &allocation) {
+  VkMemoryAllocateInfo memory_alloc_info = {
+      VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr, size, memory_type};
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  if (vkAllocateMemory(device_, &memory_alloc_info, nullptr, &memory) !=
+      VK_SUCCESS) {
+    return false;
+  }
+
+  allocation.memory = memory;
+  allocation.offset = 0U;
+  allocation.size = size;
+  allocation.mapped = MapMemory(memory, memory_type);
+  allocation.memory_type = memory_type;
+  allocation.memory_property_flags =
+      memory_properties_.memoryTypes[memory_type].propertyFlags;
+  allocation.block = nullptr;
+  allocation.order = 0U;
+
+  ++num_dedicated_;
+  dedicated_bytes_ += size;
+
+  return true;
+}
+
+bool VulkanMemoryAllocator::AllocateFromBlocks(VkDeviceSize size,
+                                               VkDeviceSize alignment,
+                                               uint32_t memory_type,
+                                               AllocationTiling tiling,
+                                               VulkanAllocation &allocation) {
+  if (!separate_tilings_) {
+    tiling = AllocationTiling::LINEAR;
+  }
+  uint32_t order = CeilLog2(eastl::max(
+      eastl::max(size, alignment), kVulkanMemoryMinAllocSize));
+
+  VulkanMemoryBlock *block = nullptr;
+  VkDeviceSize offset = 0U;
+  for (eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>>::iterator itor =
+           blocks_.begin();
+       itor != blocks_.end(); ++itor) {
+    if ((*itor)->memory_type == memory_type && (*itor)->tiling == tiling &&
+        (*itor)->Allocate(order, offset)) {
+      block = itor->get();
+      break;
+    }
+  }
+
+  if (block == nullptr) {
+    block = CreateBlock(memory_type, tiling);
+    if (block == nullptr || !block->Allocate(order, offset)) {
+      return false;
+    }
+  }
+
+  ++block->num_allocations;
+  block->allocated_bytes += static_cast<VkDeviceSize>(1U) << order;
+  block->requested_bytes += size;
+
+  allocation.memory = block->memory;
+  allocation.offset = offset;
+  allocation.size = size;
+  allocation.mapped = block->mapped != nullptr ? block->mapped + offset
+                                               : nullptr;
+  allocation.memory_type = memory_type;
+  allocation.memory_property_flags =
+      memory_properties_.memoryTypes[memory_type].propertyFlags;
+  allocation.block = block;
+  allocation.order = order;
+
+  return true;
+}
+
+VulkanMemoryBlock *
+VulkanMemoryAllocator::CreateBlock(uint32_t memory_type,
+                                   AllocationTiling tiling) {
+  uint32_t heap = memory_properties_.memoryTypes[memory_type].heapIndex;
+  VkDeviceSize block_size = heap_block_sizes_[heap];
+
+  VkMemoryAllocateInfo memory_alloc_info = {
+      VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr, block_size,
+      memory_type};
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  if (vkAllocateMemory(device_, &memory_alloc_info, nullptr, &memory) !=
+      VK_SUCCESS) {
+    return nullptr;
+  }
+
+  blocks_.push_back(eastl::make_unique<VulkanMemoryBlock>(
+      memory, MapMemory(memory, memory_type), memory_type, tiling,
+      FloorLog2(block_size)));
+  LOG("Allocated " << block_size / (1024U * 1024U)
+                   << " MB device memory block of type " << memory_type);
+
+  return blocks_.back().get();
+}
+
+void VulkanMemoryAllocator::DestroyBlock(VulkanMemoryBlock *block) {
+  for (eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>>::iterator itor =
+           blocks_.begin();
+       itor != blocks_.end(); ++itor) {
+    if (itor->get() == block) {
+      vkFreeMemory(device_, block->memory, nullptr);
+      blocks_.erase(itor);
+      return;
+    }
+  }
+}
+
+void VulkanMemoryAllocator::Flush(const VulkanAllocation &allocation,
+                                  VkDeviceSize offset,
+                                  VkDeviceSize size) const {
+  if (!IsNonCoherent(allocation.memory_property_flags)) {
+    return;
+  }
+
+  VkMappedMemoryRange range = GetMappedRange(allocation, offset, size);
+  VK_CHECK_RESULT(vkFlushMappedMemoryRanges(device_, 1U, &range));
+}
+
+void VulkanMemoryAllocator::Invalidate(const VulkanAllocation &allocation,
+                                       VkDeviceSize offset,
+                                       VkDeviceSize size) const {
+  if (!IsNonCoherent(allocation.memory_property_flags)) {
+    return;
+  }
+
+  VkMappedMemoryRange range = GetMappedRange(allocation, offset, size);
+  VK_CHECK_RESULT(vkInvalidateMappedMemoryRanges(device_, 1U, &range));
+}
+
+VkMappedMemoryRange
+VulkanMemoryAllocator::GetMappedRange(const VulkanAllocation &allocation,
+                                      VkDeviceSize offset,
+                                      VkDeviceSize size) const {
+  // Widen the range to whole atoms without leaving the range of the
+  // allocation; dedicated allocations own their whole memory
+  VkDeviceSize range_size =
+      allocation.block != nullptr
+          ? static_cast<VkDeviceSize>(1U) << allocation.order
+          : allocation.size;
+  VkDeviceSize begin = offset - offset % non_coherent_atom_size_;
+  VkDeviceSize end = range_size;
+  if (size != VK_WHOLE_SIZE) {
+    end = eastl::min(range_size, ((offset + size + non_coherent_atom_size_ -
+                                   1U) / non_coherent_atom_size_) *
+                                     non_coherent_atom_size_);
+  }
+
+  VkMappedMemoryRange range = {VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr,
+                               allocation.memory, allocation.offset + begin,
+                               end - begin};
+  if (allocation.block == nullptr && end == range_size) {
+    range.size = VK_WHOLE_SIZE;
+  }
+  return range;
+}
+
+uint8_t *VulkanMemoryAllocator::MapMemory(VkDeviceMemory memory,
+                                          uint32_t memory_type) const {
+  if ((memory_properties_.memoryTypes[memory_type].propertyFlags &
+       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0U) {
+    return nullptr;
+  }
+
+  void *mapped = nullptr;
+  VK_CHECK_RESULT(
+      vkMapMemory(device_, memory, 0U, VK_WHOLE_SIZE, 0U, &mapped));
+  return static_cast<uint8_t *>(mapped);
+}
+
+VulkanMemoryStats VulkanMemoryAllocator::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  VulkanMemoryStats stats;
+  stats.num_blocks = SCAST_U32(blocks_.size());
+  stats.num_dedicated = num_dedicated_;
+  stats.num_allocations = num_dedicated_;
+  stats.reserved_bytes = dedicated_bytes_;
+  stats.allocated_bytes = dedicated_bytes_;
+  stats.requested_bytes = dedicated_bytes_;
+
+  for (eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>>::const_iterator
+           itor = blocks_.begin();
+       itor != blocks_.end(); ++itor) {
+    const VulkanMemoryBlock &block = *itor->get();
+    stats.num_allocations += block.num_allocations;
+    stats.reserved_bytes += block.size();
+    stats.allocated_bytes += block.allocated_bytes;
+    stats.requested_bytes += block.requested_bytes;
+    stats.free_bytes += block.size() - block.allocated_bytes;
+
+    for (uint32_t order = block.min_order; order <= block.max_order;
+         ++order) {
+      uint32_t num_ranges =
+          SCAST_U32(block.free_ranges[order - block.min_order].size());
+      stats.num_free_ranges += num_ranges;
+      if (num_ranges != 0U) {
+        stats.largest_free_range =
+            eastl::max(stats.largest_free_range,
+                       static_cast<VkDeviceSize>(1U) << order);
+      }
+    }
+  }
+
+  return stats;
+}
+
+void VulkanMemoryAllocator::LogReport() const {
+  VulkanMemoryStats stats = GetStats();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t block_idx = 0U;
+    for (eastl::vector<eastl::unique_ptr<VulkanMemoryBlock>>::const_iterator
+             itor = blocks_.begin();
+         itor != blocks_.end(); ++itor, ++block_idx) {
+      const VulkanMemoryBlock &block = *itor->get();
+      uint32_t num_free_ranges = 0U;
+      for (uint32_t order = block.min_order; order <= block.max_order;
+           ++order) {
+        num_free_ranges +=
+            SCAST_U32(block.free_ranges[order - block.min_order].size());
+      }
+      LOG("Memory block " << block_idx << ": type " << block.memory_type
+                          << (block.tiling == AllocationTiling::LINEAR
+                                  ? ", linear, "
+                                  : ", optimal, ")
+                          << block.num_allocations << " allocations, "
+                          << block.allocated_bytes / 1024U << " of "
+                          << block.size() / 1024U << " KB used, "
+                          << num_free_ranges << " free ranges");
+    }
+  }
+
+  // Internal waste comes from rounding up to ranges; external fragmentation
+  // is how much of the free memory can't be handed out in one piece
+  float waste = stats.allocated_bytes != 0U
+                    ? 1.f - SCAST_FLOAT(stats.requested_bytes) /
+                                SCAST_FLOAT(stats.allocated_bytes)
+                    : 0.f;
+  float fragmentation = stats.free_bytes != 0U
+                            ? 1.f - SCAST_FLOAT(stats.largest_free_range) /
+                                        SCAST_FLOAT(stats.free_bytes)
+                            : 0.f;
+  LOG("Device memory: " << stats.num_allocations << " allocations in "
+                        << stats.num_blocks << " blocks and "
+                        << stats.num_dedicated << " dedicated, "
+                        << stats.reserved_bytes / (1024U * 1024U)
+                        << " MB reserved, "
+                        << stats.requested_bytes / (1024U * 1024U)
+                        << " MB requested, " << waste * 100.f
+                        << "% rounding waste, " << fragmentation * 100.f
+                        << "% of free memory fragmented");
+}
+
+} // namespace vks
@@ -30,6 +30,12 @@ void VulkanTexture::Shutdown(const VulkanDevice &device) {
   LOG("Shutdown tex " << name_);
 }
 
+eastl::unique_ptr<VulkanImage>
+VulkanTexture::SwapImage(eastl::unique_ptr<VulkanImage> image) {
+  eastl::swap(image_, image);
+  return image;
+}
+
 VkDescriptorImageInfo VulkanTexture::GetDescriptorImageInfo() const {
   VkDescriptorImageInfo info;
   info.imageView = image_->view();
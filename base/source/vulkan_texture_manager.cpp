@@ -1,39 +1,382 @@
 #include <vulkan_device.h>
 #include <vulkan_texture_manager.h>
 #define GLM_ENABLE_EXPERIMENTAL
+#include <EASTL/algorithm.h>
+#include <EASTL/hash_set.h>
+#include <EASTL/sort.h>
 #include <EASTL/utility.h>
+#include <base_system.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <gli/gli.hpp>
 #include <lodepng.h>
 #include <logger.hpp>
+#include <texture_cooker.h>
 #include <vulkan_tools.h>
 
 namespace vks {
 
+const uint32_t kStreamingMinResidentSize = 128U;
+const VkDeviceSize kDefaultTextureBudget = 512U * 1024U * 1024U;
+const uint32_t kMaxTableTextures = 4096U;
+
+// Binding of the texture table in its set
+static const uint32_t kTableTexturesBindingPos = 0U;
+
+// Bytes of levels UpdateResidency starts uploading at most, so that a frame
+// never fills the staging ring on its own
+static const VkDeviceSize kStreamingBytesPerUpdate = kStagingRingSize / 4U;
+
+// Size of the part of a PNG file which holds its dimensions
+static const uint32_t kPNGHeaderSize = 33U;
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+  return ((value + alignment - 1U) / alignment) * alignment;
+}
+
+static VkBufferImageCopy GetMipCopyRegion(uint32_t mip_level, uint32_t width,
+                                          uint32_t height,
+                                          VkDeviceSize buffer_offset) {
+  VkBufferImageCopy copy_region;
+  copy_region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  copy_region.imageSubresource.mipLevel = mip_level;
+  copy_region.imageSubresource.baseArrayLayer = 0U;
+  copy_region.imageSubresource.layerCount = 1U;
+  copy_region.imageExtent.width = width;
+  copy_region.imageExtent.height = height;
+  copy_region.imageExtent.depth = 1U;
+  copy_region.bufferOffset = buffer_offset;
+  copy_region.bufferRowLength = 0U;
+  copy_region.bufferImageHeight = 0U;
+  copy_region.imageOffset.x = 0U;
+  copy_region.imageOffset.y = 0U;
+  copy_region.imageOffset.z = 0U;
+  return copy_region;
+}
+
+// One region per mip level from base_level on, in the order gli stores them,
+// for an image whose first level is base_level
+static void GetMipCopyRegions(const gli::texture2d &tex_2D, uint32_t base_level,
+                              eastl::vector<VkBufferImageCopy> &regions) {
+  uint32_t mip_levels = SCAST_U32(tex_2D.levels());
+  VkDeviceSize offset = 0U;
+  for (uint32_t i = base_level; i < mip_levels; ++i) {
+    regions.push_back(GetMipCopyRegion(
+        i - base_level, SCAST_U32(tex_2D[i].extent().x),
+        SCAST_U32(tex_2D[i].extent().y), offset));
+    offset += tex_2D[i].size();
+  }
+}
+
+// Bytes of the mip levels from base_level on, which gli stores one after the
+// other
+static VkDeviceSize GetLevelsSize(const gli::texture2d &tex_2D,
+                                  uint32_t base_level) {
+  VkDeviceSize size = 0U;
+  for (uint32_t i = base_level; i < SCAST_U32(tex_2D.levels()); ++i) {
+    size += tex_2D[i].size();
+  }
+  return size;
+}
+
+// First level no bigger than kStreamingMinResidentSize, or the last one
+static uint32_t GetMinResidentLevel(const gli::texture2d &tex_2D) {
+  uint32_t mip_levels = SCAST_U32(tex_2D.levels());
+  uint32_t level = 0U;
+  while (level + 1U < mip_levels &&
+         SCAST_U32(eastl::max(tex_2D[level].extent().x,
+                              tex_2D[level].extent().y)) >
+             kStreamingMinResidentSize) {
+    ++level;
+  }
+  return level;
+}
+
+static bool ReadWholeFile(const eastl::string &filename,
+                          eastl::vector<uint8_t> &data) {
+  std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  data.resize(static_cast<size_t>(file.tellg()));
+  file.seekg(0, std::ios::beg);
+  return !data.empty() &&
+         file.read(reinterpret_cast<char *>(data.data()),
+                   static_cast<std::streamsize>(data.size()));
+}
+
+// Find out how much room the decoded data of a texture may need, without
+// decoding it. PNG files are cooked to RGBA8 with a full mip chain, unless
+// they were already, while the data of the other files is no bigger than
+// the files themselves
+static bool InspectTexture(TextureDecodeJob &job) {
+  if (!job.is_png) {
+    std::ifstream file(job.filename.c_str(),
+                       std::ios::binary | std::ios::ate);
+    job.staging_size =
+        file.is_open() ? static_cast<VkDeviceSize>(file.tellg()) : 0U;
+    return job.staging_size != 0U;
+  }
+
+  // The cooked version is keyed by the content of the source
+  eastl::vector<uint8_t> png_data;
+  if (!ReadWholeFile(job.filename, png_data) ||
+      png_data.size() < kPNGHeaderSize) {
+    return false;
+  }
+  job.cooked_path = GetCookedTexturePath(job.filename, png_data, job.format,
+                                         job.compression);
+
+  std::ifstream cooked_file(job.cooked_path.c_str(),
+                            std::ios::binary | std::ios::ate);
+  if (cooked_file.is_open()) {
+    job.staging_size = static_cast<VkDeviceSize>(cooked_file.tellg());
+    if (job.staging_size != 0U) {
+      return true;
+    }
+  }
+
+  uint32_t width = 0U;
+  uint32_t height = 0U;
+  LodePNGState state;
+  lodepng_state_init(&state);
+  uint32_t err = lodepng_inspect(&width, &height, &state, png_data.data(),
+                                 kPNGHeaderSize);
+  lodepng_state_cleanup(&state);
+
+  job.cook = true;
+  job.staging_size = GetMipChainSize(width, height);
+  return err == 0U && width != 0U && height != 0U;
+}
+
+// Copy the levels of a texture which are always resident into its staging
+// memory, and keep the others for streaming
+static bool StageTexture(TextureDecodeJob &job, const gli::texture2d &tex_2D,
+                         uint8_t *staging) {
+  if (tex_2D.empty() || tex_2D.size() > job.staging_size) {
+    return false;
+  }
+
+  job.base_level = GetMinResidentLevel(tex_2D);
+  job.staged_size = GetLevelsSize(tex_2D, job.base_level);
+  memcpy(staging, tex_2D[job.base_level].data(), job.staged_size);
+  job.width = SCAST_U32(tex_2D[job.base_level].extent().x);
+  job.height = SCAST_U32(tex_2D[job.base_level].extent().y);
+  job.mip_levels = SCAST_U32(tex_2D.levels()) - job.base_level;
+  // Can use tex_2D.format() because https://github.com/g-truc/gli/issues/85
+  job.format = static_cast<VkFormat>(tex_2D.format());
+  GetMipCopyRegions(tex_2D, job.base_level, job.copy_regions);
+  if (job.base_level != 0U) {
+    job.source = tex_2D;
+  }
+  job.decoded = true;
+  return true;
+}
+
+// Decode the file of a texture into its staging memory, cooking it first if
+// it needs to be. The decoders keep the data in buffers of their own, so it
+// is copied from there
+static void DecodeTexture(TextureDecodeJob &job, uint8_t *staging) {
+  if (!job.cook) {
+    const eastl::string &path = job.is_png ? job.cooked_path : job.filename;
+    gli::texture2d tex_2D(gli::load(path.c_str()));
+    StageTexture(job, tex_2D, staging);
+    return;
+  }
+
+  eastl::vector<uint8_t> png_data;
+  gli::texture2d cooked;
+  if (!ReadWholeFile(job.filename, png_data) ||
+      !CookPNGTexture(png_data, job.format, job.compression, cooked) ||
+      !StageTexture(job, cooked, staging)) {
+    return;
+  }
+  job.saved = SaveCookedTexture(cooked, job.cooked_path);
+}
+
+// Fall back to uncompressed textures when the device can't sample every
+// format the compression may pick
+static TextureCompression
+GetSupportedCompression(const VulkanDevice &device,
+                        TextureCompression compression, VkFormat format) {
+  if (compression == TextureCompression::NONE) {
+    return compression;
+  }
+  if (!device.physical_features().textureCompressionBC) {
+    return TextureCompression::NONE;
+  }
+
+  eastl::vector<VkFormat> formats;
+  GetCompressedFormats(compression, format, formats);
+  for (eastl::vector<VkFormat>::const_iterator itor = formats.begin();
+       itor != formats.end(); ++itor) {
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(device.physical_device(), *itor,
+                                        &format_properties);
+    if ((format_properties.optimalTilingFeatures &
+         VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) == 0U) {
+      return TextureCompression::NONE;
+    }
+  }
+  return compression;
+}
+
+static eastl::unique_ptr<VulkanImage>
+CreateTextureImage(const VulkanDevice &device, uint32_t width, uint32_t height,
+                   uint32_t array_layers, uint32_t mip_levels, VkFormat format,
+                   VkImageUsageFlags img_usage_flags,
+                   VkImageCreateFlags img_create_flags,
+                   VkImageViewType img_view_type, VkImageType img_type) {
+  VkImageCreateInfo image_create_info = tools::inits::ImageCreateInfo(
+      img_create_flags, img_type, format, {width, height, 1U}, mip_levels,
+      array_layers, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL,
+      img_usage_flags | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+      VK_SHARING_MODE_EXCLUSIVE, 0U, nullptr, VK_IMAGE_LAYOUT_UNDEFINED);
+  // Single channel textures are read as grey, as the RGB ones they replace
+  bool single_channel = format == VK_FORMAT_BC4_UNORM_BLOCK;
+  VulkanImageInitInfo image_init_info;
+  image_init_info.create_info = image_create_info;
+  image_init_info.create_view =
+      single_channel ? CreateView::NO : CreateView::YES;
+  image_init_info.view_type = img_view_type;
+  image_init_info.memory_usage = MemoryUsage::GPU_ONLY;
+  eastl::unique_ptr<VulkanImage> image = eastl::make_unique<VulkanImage>();
+  image->Init(device, image_init_info);
+
+  if (single_channel) {
+    VkImageViewCreateInfo img_view_create_info =
+        tools::inits::ImageViewCreateInfo(
+            image->image(), img_view_type, format,
+            {VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_R,
+             VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_ONE},
+            {VK_IMAGE_ASPECT_COLOR_BIT, 0U, mip_levels, 0U, array_layers});
+    VkImageView view = VK_NULL_HANDLE;
+    VK_CHECK_RESULT(vkCreateImageView(device.device(), &img_view_create_info,
+                                      nullptr, &view));
+    image->set_view(view);
+  }
+  return image;
+}
+
+static VkImageSubresourceRange GetColourRange(uint32_t mip_levels,
+                                              uint32_t array_layers) {
+  VkImageSubresourceRange subresource_range;
+  subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  subresource_range.baseMipLevel = 0U;
+  subresource_range.levelCount = mip_levels;
+  subresource_range.baseArrayLayer = 0U;
+  subresource_range.layerCount = array_layers;
+  return subresource_range;
+}
+
+TextureLoadRequest::TextureLoadRequest()
+    : filename(), format(VK_FORMAT_R8G8B8A8_UNORM),
+      compression(TextureCompression::NONE) {}
+
+TextureLoadRequest::TextureLoadRequest(const eastl::string &Filename,
+                                       VkFormat Format,
+                                       TextureCompression Compression)
+    : filename(Filename), format(Format), compression(Compression) {}
+
+TextureDecodeJob::TextureDecodeJob()
+    : filename(), format(VK_FORMAT_UNDEFINED),
+      compression(TextureCompression::NONE), is_png(false), cooked_path(),
+      cook(false), saved(false), staging_size(0U), staging_offset(0U),
+      decoded(false), width(0U), height(0U), mip_levels(0U), copy_regions(),
+      base_level(0U), staged_size(0U), source() {}
+
+TextureLoadBatch::TextureLoadBatch() : jobs(), staging_size(0U), staging() {}
+
+VulkanTextureManager::StreamedTexture::StreamedTexture()
+    : texture(nullptr), source(), img_usage_flags(0U), min_base(0U),
+      resident_base(0U), requested_base(0U), last_used_frame(0U),
+      pending_image(), pending_base(0U), pending_ticket(0U) {}
+
 VulkanTextureManager::VulkanTextureManager()
-    : cmd_buffer_(VK_NULL_HANDLE), textures_() {}
+    : textures_(), streamed_(), streamed_idxs_(),
+      residency_budget_(kDefaultTextureBudget), residency_frame_(0U),
+      table_layout_(VK_NULL_HANDLE), table_pool_(VK_NULL_HANDLE),
+      table_set_(VK_NULL_HANDLE), table_size_(0U), table_idxs_() {}
 
 void VulkanTextureManager::Init(const VulkanDevice &device) {
-  // Create a separate command buffer for submitting
-  // image barriers
-  VkCommandBufferAllocateInfo cmd_buffer_allocate_info = {
-      VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr,
-      device.graphics_queue().cmd_pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1U};
-
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      device.device(), &cmd_buffer_allocate_info, &cmd_buffer_));
+  const VkPhysicalDeviceDescriptorIndexingPropertiesEXT &limits =
+      device.indexing_properties();
+  table_size_ = eastl::min(
+      kMaxTableTextures,
+      eastl::min(limits.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                 limits.maxDescriptorSetUpdateAfterBindSampledImages));
+
+  // Entries may be left unwritten, and written while the table is bound in
+  // command buffers which don't use them
+  VkDescriptorSetLayoutBinding binding =
+      tools::inits::DescriptorSetLayoutBinding(
+          kTableTexturesBindingPos, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          table_size_, VK_SHADER_STAGE_FRAGMENT_BIT, nullptr);
+  VkDescriptorBindingFlagsEXT binding_flags =
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+      VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT |
+      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT binding_flags_create_info =
+      {};
+  binding_flags_create_info.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+  binding_flags_create_info.bindingCount = 1U;
+  binding_flags_create_info.pBindingFlags = &binding_flags;
+
+  VkDescriptorSetLayoutCreateInfo set_layout_create_info =
+      tools::inits::DescriptrorSetLayoutCreateInfo();
+  set_layout_create_info.pNext = &binding_flags_create_info;
+  set_layout_create_info.flags =
+      VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+  set_layout_create_info.bindingCount = 1U;
+  set_layout_create_info.pBindings = &binding;
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(
+      device.device(), &set_layout_create_info, nullptr, &table_layout_));
+
+  VkDescriptorPoolSize pool_size = tools::inits::DescriptorPoolSize(
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, table_size_);
+  VkDescriptorPoolCreateInfo pool_create_info =
+      tools::inits::DescriptrorPoolCreateInfo(1U, 1U, &pool_size);
+  pool_create_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+  VK_CHECK_RESULT(vkCreateDescriptorPool(device.device(), &pool_create_info,
+                                         nullptr, &table_pool_));
+
+  VkDescriptorSetAllocateInfo set_allocate_info =
+      tools::inits::DescriptorSetAllocateInfo(table_pool_, 1U, &table_layout_);
+  VK_CHECK_RESULT(vkAllocateDescriptorSets(device.device(), &set_allocate_info,
+                                           &table_set_));
+  LOG("Texture table holds up to " << table_size_ << " textures.");
 }
 
 void VulkanTextureManager::Shutdown(const VulkanDevice &device) {
+  for (eastl::vector<eastl::unique_ptr<StreamedTexture>>::iterator itor =
+           streamed_.begin();
+       itor != streamed_.end(); ++itor) {
+    if ((*itor)->pending_image) {
+      (*itor)->pending_image->Shutdown(device);
+    }
+  }
+  streamed_.clear();
+  streamed_idxs_.clear();
+
+  table_idxs_.clear();
+  if (table_pool_ != VK_NULL_HANDLE) {
+    vkDestroyDescriptorPool(device.device(), table_pool_, nullptr);
+    table_pool_ = VK_NULL_HANDLE;
+    table_set_ = VK_NULL_HANDLE;
+  }
+  if (table_layout_ != VK_NULL_HANDLE) {
+    vkDestroyDescriptorSetLayout(device.device(), table_layout_, nullptr);
+    table_layout_ = VK_NULL_HANDLE;
+  }
+
   NameTexMap::iterator iter;
   for (iter = textures_.begin(); iter != textures_.end(); iter++) {
     iter->second->Shutdown(device);
   }
-
-  if (cmd_buffer_ != VK_NULL_HANDLE) {
-    vkFreeCommandBuffers(device.device(), device.graphics_queue().cmd_pool, 1U,
-                         &cmd_buffer_);
-    cmd_buffer_ = VK_NULL_HANDLE;
-  }
 }
 
 void VulkanTextureManager::Create2DTextureFromData(
@@ -44,23 +387,7 @@ void VulkanTextureManager::Create2DTextureFromData(
 
   // Setup buffer copy regions for each mip level
   eastl::vector<VkBufferImageCopy> buffer_copy_regions;
-
-  VkBufferImageCopy copy_region;
-  copy_region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  copy_region.imageSubresource.mipLevel = 0U;
-  copy_region.imageSubresource.baseArrayLayer = 0U;
-  copy_region.imageSubresource.layerCount = 1U;
-  copy_region.imageExtent.width = width;
-  copy_region.imageExtent.height = height;
-  copy_region.imageExtent.depth = 1U;
-  copy_region.bufferOffset = 0U;
-  copy_region.bufferRowLength = 0U;
-  copy_region.bufferImageHeight = 0U;
-  copy_region.imageOffset.x = 0U;
-  copy_region.imageOffset.y = 0U;
-  copy_region.imageOffset.z = 0U;
-
-  buffer_copy_regions.push_back(copy_region);
+  buffer_copy_regions.push_back(GetMipCopyRegion(0U, width, height, 0U));
 
   CreateTexture(device, name, data, size, width, height, 1U, 1U, format,
                 buffer_copy_regions, texture, sampler, img_usage_flags);
@@ -68,8 +395,8 @@ void VulkanTextureManager::Create2DTextureFromData(
 
 void VulkanTextureManager::Load2DPNGTexture(
     const VulkanDevice &device, const eastl::string &filename_original,
-    VkFormat format, VulkanTexture **texture, const VkSampler aniso_sampler,
-    const VkImageUsageFlags img_usage_flags) {
+    VkFormat format, TextureCompression compression, VulkanTexture **texture,
+    const VkSampler aniso_sampler, const VkImageUsageFlags img_usage_flags) {
   eastl::string filename(filename_original);
   tools::Replace(filename, "\\", "/");
   tools::Replace(filename, "//", "/");
@@ -81,41 +408,39 @@ void VulkanTextureManager::Load2DPNGTexture(
     return;
   }
 
-  std::vector<unsigned char> png_data;
-  uint32_t width = 0U;
-  uint32_t height = 0U;
-
-  uint32_t err = lodepng::decode(png_data, width, height, filename.c_str());
-
-  if (err != 0U) {
+  eastl::vector<uint8_t> png_data;
+  if (!ReadWholeFile(filename, png_data)) {
     ELOG_WARN("Couldn't find or load texture " + filename + " .");
     (*texture) = nullptr;
     return;
   }
 
+  // Prefer the cooked version, and cook it if there is none yet
+  compression = GetSupportedCompression(device, compression, format);
+  eastl::string cooked_path =
+      GetCookedTexturePath(filename, png_data, format, compression);
+  gli::texture2d tex_2D(gli::load(cooked_path.c_str()));
+  if (tex_2D.empty()) {
+    if (!CookPNGTexture(png_data, format, compression, tex_2D)) {
+      ELOG_WARN("Couldn't find or load texture " + filename + " .");
+      (*texture) = nullptr;
+      return;
+    }
+    if (!SaveCookedTexture(tex_2D, cooked_path)) {
+      ELOG_WARN("Could not write cooked texture " + cooked_path + "!");
+    }
+  }
+
   // Setup buffer copy regions for each mip level
   eastl::vector<VkBufferImageCopy> buffer_copy_regions;
+  GetMipCopyRegions(tex_2D, 0U, buffer_copy_regions);
 
-  VkBufferImageCopy copy_region;
-  copy_region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  copy_region.imageSubresource.mipLevel = 0U;
-  copy_region.imageSubresource.baseArrayLayer = 0U;
-  copy_region.imageSubresource.layerCount = 1U;
-  copy_region.imageExtent.width = width;
-  copy_region.imageExtent.height = height;
-  copy_region.imageExtent.depth = 1U;
-  copy_region.bufferOffset = 0U;
-  copy_region.bufferRowLength = 0U;
-  copy_region.bufferImageHeight = 0U;
-  copy_region.imageOffset.x = 0U;
-  copy_region.imageOffset.y = 0U;
-  copy_region.imageOffset.z = 0U;
-
-  buffer_copy_regions.push_back(copy_region);
-
-  CreateTexture(device, filename, png_data.data(), SCAST_U32(png_data.size()),
-                width, height, 1U, 1U, format, buffer_copy_regions, texture,
-                aniso_sampler, img_usage_flags);
+  CreateTexture(device, filename, tex_2D.data(), SCAST_U32(tex_2D.size()),
+                SCAST_U32(tex_2D[0U].extent().x),
+                SCAST_U32(tex_2D[0U].extent().y), 1U,
+                SCAST_U32(tex_2D.levels()),
+                static_cast<VkFormat>(tex_2D.format()), buffer_copy_regions,
+                texture, aniso_sampler, img_usage_flags);
 }
 
 void VulkanTextureManager::CreateTexture(
@@ -127,125 +452,19 @@ void VulkanTextureManager::CreateTexture(
     const VkImageUsageFlags img_usage_flags,
     const VkImageCreateFlags img_create_flags,
     const VkImageViewType img_view_type, const VkImageType img_type) {
-  // Create the image
-  VkImageCreateInfo image_create_info = tools::inits::ImageCreateInfo(
-      img_create_flags, img_type, format, {width, height, 1U}, mip_levels,
-      array_layers, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL,
-      img_usage_flags | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-      VK_SHARING_MODE_EXCLUSIVE, 0U, nullptr, VK_IMAGE_LAYOUT_UNDEFINED);
-  VulkanImageInitInfo image_init_info;
-  image_init_info.create_info = image_create_info;
-  image_init_info.create_view = CreateView::YES;
-  image_init_info.view_type = img_view_type;
-  image_init_info.memory_properties_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-  eastl::unique_ptr<VulkanImage> image = eastl::make_unique<VulkanImage>();
-  image->Init(device, image_init_info);
+  eastl::unique_ptr<VulkanImage> image = CreateTextureImage(
+      device, width, height, array_layers, mip_levels, format,
+      img_usage_flags, img_create_flags, img_view_type, img_type);
 
   if (data != nullptr) {
     VKS_ASSERT(size != 0U, "Size is zero when initial data was passed!");
-    // Get the device properties for the requested texture format
-    VkFormatProperties format_proerties;
-    vkGetPhysicalDeviceFormatProperties(device.physical_device(), format,
-                                        &format_proerties);
-
-    // Create a host-visible staging buffer for containing the raw data
-    VkBufferCreateInfo buf_create_info = tools::inits::BufferCreateInfo();
-    buf_create_info.size = size;
-    buf_create_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    buf_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    buf_create_info.queueFamilyIndexCount = 0U;
-    buf_create_info.pQueueFamilyIndices = nullptr;
-
-    VkBuffer staging_buffer = VK_NULL_HANDLE;
-    VK_CHECK_RESULT(vkCreateBuffer(device.device(), &buf_create_info, nullptr,
-                                   &staging_buffer));
-
-    // Get the memory requirements for the staging buffer
-    VkMemoryRequirements memory_requirements;
-    vkGetBufferMemoryRequirements(device.device(), staging_buffer,
-                                  &memory_requirements);
-
-    // Allocate memory for the staging buffer
-    VkMemoryAllocateInfo mem_alloc_info = tools::inits::MemoryAllocateInfo();
-    mem_alloc_info.allocationSize = memory_requirements.size;
-    // Retrieve the index for a type of memory visible to the host
-    mem_alloc_info.memoryTypeIndex =
-        device.GetMemoryType(memory_requirements.memoryTypeBits,
-                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-    VkDeviceMemory staging_buffer_memory = VK_NULL_HANDLE;
-    VK_CHECK_RESULT(vkAllocateMemory(device.device(), &mem_alloc_info, nullptr,
-                                     &staging_buffer_memory));
-
-    // Then bind it to the buffer handle
-    VK_CHECK_RESULT(vkBindBufferMemory(device.device(), staging_buffer,
-                                       staging_buffer_memory, 0U));
-
-    // Now copy the texture data into the staging buffer
-    void *mapped_data = nullptr;
-    vkMapMemory(device.device(), staging_buffer_memory, 0U,
-                memory_requirements.size, 0U, &mapped_data);
-    memcpy(mapped_data, data, size);
-    vkUnmapMemory(device.device(), staging_buffer_memory);
-
-    // Use an image barrier to setup an optimal image layout for the copy
-    VkImageSubresourceRange subresource_range;
-    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    subresource_range.baseMipLevel = 0U;
-    subresource_range.levelCount = mip_levels;
-    subresource_range.baseArrayLayer = 0U;
-    subresource_range.layerCount = array_layers;
-
-    // Use the separate command buffer for texture loading
-    VkCommandBufferBeginInfo cmd_buff_begin_info =
-        tools::inits::CommandBufferBeginInfo();
-    VK_CHECK_RESULT(vkBeginCommandBuffer(cmd_buffer_, &cmd_buff_begin_info));
-
-    tools::SetImageLayout(cmd_buffer_, *image.get(), VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                          subresource_range);
-
-    // Copy the mip levels from the staging buffer into the image
-    vkCmdCopyBufferToImage(cmd_buffer_, staging_buffer, image->image(),
-                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                           SCAST_U32(copy_regions.size()), copy_regions.data());
-
-    // Change the image layout to shader read so that shaders can sample it
-    tools::SetImageLayout(
-        cmd_buffer_, *image.get(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, subresource_range);
-
-    VK_CHECK_RESULT(vkEndCommandBuffer(cmd_buffer_));
-
-    // Use a fence to make sure that the copying operations have completed
-    // and then submit the command buffer
-    VkFenceCreateInfo fence_create_info = tools::inits::FenceCreateInfo();
-    VkFence copy_fence = VK_NULL_HANDLE;
-    VK_CHECK_RESULT(vkCreateFence(device.device(), &fence_create_info, nullptr,
-                                  &copy_fence));
-
-    VkSubmitInfo submit_info = tools::inits::SubmitInfo();
-    submit_info.waitSemaphoreCount = 0U;
-    submit_info.pWaitSemaphores = nullptr;
-    submit_info.pWaitDstStageMask = nullptr;
-    submit_info.commandBufferCount = 1U;
-    submit_info.pCommandBuffers = &cmd_buffer_;
-    submit_info.signalSemaphoreCount = 0U;
-    submit_info.pSignalSemaphores = nullptr;
-
-    vkQueueSubmit(device.graphics_queue().queue, 1U, &submit_info, copy_fence);
-
-    VK_CHECK_RESULT(
-        vkWaitForFences(device.device(), 1U, &copy_fence, VK_TRUE, UINT64_MAX));
-
-    // Cleanup the staging resources
-    vkDestroyFence(device.device(), copy_fence, nullptr);
-    copy_fence = VK_NULL_HANDLE;
-    vkFreeMemory(device.device(), staging_buffer_memory, nullptr);
-    staging_buffer_memory = VK_NULL_HANDLE;
-    vkDestroyBuffer(device.device(), staging_buffer, nullptr);
-    staging_buffer = VK_NULL_HANDLE;
+
+    // The copy is batched with the other uploads, and the image moved to a
+    // layout that shaders can sample once it is done
+    device.uploader().UploadImage(device, *image.get(), data, size,
+                                  copy_regions,
+                                  GetColourRange(mip_levels, array_layers),
+                                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
   }
 
   VulkanTextureInitInfo texture_init_info;
@@ -257,6 +476,354 @@ void VulkanTextureManager::CreateTexture(
   CreateUniqueTexture(device, texture_init_info, name, texture);
 }
 
+void VulkanTextureManager::LoadTextures(
+    const VulkanDevice &device,
+    const eastl::vector<TextureLoadRequest> &requests,
+    const VkSampler aniso_sampler, const VkImageUsageFlags img_usage_flags) {
+  TextureLoadBatch batch;
+  InspectTextures(device, requests, batch);
+  StageTextures(device, batch);
+  DecodeTextures(batch);
+  UploadTextures(device, batch, aniso_sampler, img_usage_flags);
+}
+
+void VulkanTextureManager::InspectTextures(
+    const VulkanDevice &device,
+    const eastl::vector<TextureLoadRequest> &requests,
+    TextureLoadBatch &batch) const {
+  // The textures loaded meanwhile are skipped by the upload instead, as the
+  // map of the loaded ones belongs to the thread which owns the device
+  eastl::vector<TextureDecodeJob> candidates;
+  eastl::hash_set<eastl::string> queued;
+  for (eastl::vector<TextureLoadRequest>::const_iterator itor =
+           requests.begin();
+       itor != requests.end(); ++itor) {
+    TextureDecodeJob job;
+    job.filename = itor->filename;
+    tools::Replace(job.filename, "\\", "/");
+    tools::Replace(job.filename, "//", "/");
+    if (!queued.insert(job.filename).second) {
+      continue;
+    }
+
+    job.format = itor->format;
+    job.compression =
+        GetSupportedCompression(device, itor->compression, itor->format);
+    job.is_png = job.filename.find("png") != eastl::string::npos;
+    candidates.push_back(job);
+  }
+
+  // PNG files are read whole to look for their cooked version, so this is
+  // spread over the workers too
+  eastl::vector<uint8_t> inspected(candidates.size(), 0U);
+  thread_pool()->ParallelFor(SCAST_U32(candidates.size()), [&](uint32_t i) {
+    inspected[i] = InspectTexture(candidates[i]) ? 1U : 0U;
+  });
+
+  // Lay the textures out one after the other in the staging memory
+  VkDeviceSize alignment = device.uploader().GetImageCopyAlignment(device);
+  batch.staging_size = 0U;
+  for (uint32_t i = 0U; i < SCAST_U32(candidates.size()); ++i) {
+    if (inspected[i] == 0U) {
+      ELOG_WARN("Couldn't find or load texture " + candidates[i].filename +
+                " .");
+      continue;
+    }
+    candidates[i].staging_offset = AlignUp(batch.staging_size, alignment);
+    batch.staging_size =
+        candidates[i].staging_offset + candidates[i].staging_size;
+    batch.jobs.push_back(candidates[i]);
+  }
+}
+
+void VulkanTextureManager::StageTextures(const VulkanDevice &device,
+                                         TextureLoadBatch &batch) const {
+  if (batch.staging_size != 0U) {
+    batch.staging =
+        device.uploader().ReserveStaging(device, batch.staging_size);
+  }
+}
+
+void VulkanTextureManager::DecodeTextures(TextureLoadBatch &batch) const {
+  if (batch.staging.mapped == nullptr) {
+    return;
+  }
+
+  thread_pool()->ParallelFor(SCAST_U32(batch.jobs.size()), [&](uint32_t i) {
+    TextureDecodeJob &job = batch.jobs[i];
+    DecodeTexture(job, batch.staging.mapped + job.staging_offset);
+  });
+}
+
+void VulkanTextureManager::UploadTextures(
+    const VulkanDevice &device, TextureLoadBatch &batch,
+    const VkSampler aniso_sampler, const VkImageUsageFlags img_usage_flags) {
+  VulkanUploader &uploader = device.uploader();
+  uint32_t num_uploaded = 0U;
+  uint32_t num_cooked = 0U;
+  uint32_t num_streamed = 0U;
+  for (eastl::vector<TextureDecodeJob>::iterator itor = batch.jobs.begin();
+       itor != batch.jobs.end(); ++itor) {
+    const TextureDecodeJob &job = *itor;
+    if (!job.decoded) {
+      ELOG_WARN("Couldn't find or load texture " + job.filename + " .");
+      continue;
+    }
+    if (job.cook) {
+      ++num_cooked;
+      if (!job.saved) {
+        ELOG_WARN("Could not write cooked texture " + job.cooked_path + "!");
+      }
+    }
+    if (GetTextureByName(job.filename) != nullptr) {
+      continue;
+    }
+
+    StagingRegion job_staging = batch.staging;
+    job_staging.offset += job.staging_offset;
+    job_staging.mapped += job.staging_offset;
+    job_staging.size = job.staged_size;
+    eastl::unique_ptr<VulkanImage> image = CreateTextureImage(
+        device, job.width, job.height, 1U, job.mip_levels, job.format,
+        img_usage_flags, 0U, VK_IMAGE_VIEW_TYPE_2D, VK_IMAGE_TYPE_2D);
+    uploader.UploadStagedImage(device, job_staging, *image.get(),
+                               job.copy_regions,
+                               GetColourRange(job.mip_levels, 1U),
+                               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    VulkanTextureInitInfo texture_init_info;
+    texture_init_info.image = eastl::move(image);
+    texture_init_info.create_sampler = CreateSampler::NO;
+    texture_init_info.sampler = aniso_sampler;
+    texture_init_info.name = job.filename;
+
+    VulkanTexture *texture = nullptr;
+    CreateUniqueTexture(device, texture_init_info, job.filename, &texture);
+    ++num_uploaded;
+    if (job.base_level == 0U) {
+      continue;
+    }
+
+    // The larger levels are streamed in once something asks for them
+    eastl::unique_ptr<StreamedTexture> streamed =
+        eastl::make_unique<StreamedTexture>();
+    streamed->texture = texture;
+    streamed->source = job.source;
+    streamed->img_usage_flags = img_usage_flags;
+    streamed->min_base = job.base_level;
+    streamed->resident_base = job.base_level;
+    streamed->requested_base = job.base_level;
+    streamed->last_used_frame = residency_frame_;
+    streamed_idxs_[texture] = SCAST_U32(streamed_.size());
+    streamed_.push_back(eastl::move(streamed));
+    ++num_streamed;
+  }
+
+  // Freed along with the batch of the copies
+  DiscardTextures(device, batch);
+
+  LOG("Uploaded " << num_uploaded << " of " << batch.jobs.size()
+                  << " textures, cooked " << num_cooked << ", streaming "
+                  << num_streamed << ".");
+}
+
+void VulkanTextureManager::DiscardTextures(const VulkanDevice &device,
+                                           TextureLoadBatch &batch) const {
+  if (batch.staging.buffer != VK_NULL_HANDLE) {
+    device.uploader().ReleaseStaging(device, batch.staging);
+    batch.staging = StagingRegion();
+  }
+}
+
+void VulkanTextureManager::RequestTextureDetail(const VulkanTexture *texture,
+                                                float screen_size) {
+  eastl::hash_map<const VulkanTexture *, uint32_t>::const_iterator itor =
+      streamed_idxs_.find(texture);
+  if (itor == streamed_idxs_.end()) {
+    return;
+  }
+
+  // Each level halves the texels, so the one which matches the span on
+  // screen is log2 of the ratio between the two
+  StreamedTexture &streamed = *streamed_[itor->second];
+  float texels = static_cast<float>(eastl::max(
+      streamed.source[0U].extent().x, streamed.source[0U].extent().y));
+  uint32_t level = streamed.min_base;
+  if (screen_size >= texels) {
+    level = 0U;
+  } else if (screen_size > 0.f) {
+    level = eastl::min(
+        static_cast<uint32_t>(floorf(log2f(texels / screen_size))), level);
+  }
+  streamed.requested_base = eastl::min(streamed.requested_base, level);
+  streamed.last_used_frame = residency_frame_;
+}
+
+void VulkanTextureManager::UpdateResidency(const VulkanDevice &device) {
+  // Swap in the images whose levels arrived; the old ones aren't used by any
+  // frame in flight, as the caller waits for them
+  VulkanUploader &uploader = device.uploader();
+  for (eastl::vector<eastl::unique_ptr<StreamedTexture>>::iterator itor =
+           streamed_.begin();
+       itor != streamed_.end(); ++itor) {
+    StreamedTexture &streamed = **itor;
+    if (streamed.pending_image &&
+        uploader.IsComplete(device, streamed.pending_ticket)) {
+      eastl::unique_ptr<VulkanImage> old_image =
+          streamed.texture->SwapImage(eastl::move(streamed.pending_image));
+      old_image->Shutdown(device);
+      streamed.resident_base = streamed.pending_base;
+
+      eastl::hash_map<const VulkanTexture *, uint32_t>::const_iterator entry =
+          table_idxs_.find(streamed.texture);
+      if (entry != table_idxs_.end()) {
+        WriteTableEntry(device, *streamed.texture, entry->second);
+      }
+    }
+  }
+
+  // The textures used this frame which lack levels, the ones lacking the
+  // most first
+  eastl::vector<uint32_t> wanted;
+  for (uint32_t i = 0U; i < SCAST_U32(streamed_.size()); ++i) {
+    const StreamedTexture &streamed = *streamed_[i];
+    if (!streamed.pending_image &&
+        streamed.last_used_frame == residency_frame_ &&
+        streamed.requested_base < streamed.resident_base) {
+      wanted.push_back(i);
+    }
+  }
+  eastl::sort(wanted.begin(), wanted.end(), [&](uint32_t a, uint32_t b) {
+    return streamed_[a]->resident_base - streamed_[a]->requested_base >
+           streamed_[b]->resident_base - streamed_[b]->requested_base;
+  });
+
+  VkDeviceSize planned_size = GetPlannedResidentSize();
+  VkDeviceSize streamed_size = 0U;
+  for (eastl::vector<uint32_t>::const_iterator itor = wanted.begin();
+       itor != wanted.end(); ++itor) {
+    StreamedTexture &streamed = *streamed_[*itor];
+    VkDeviceSize extra_size =
+        GetLevelsSize(streamed.source, streamed.requested_base) -
+        GetLevelsSize(streamed.source, streamed.resident_base);
+    if (streamed_size != 0U &&
+        streamed_size + extra_size > kStreamingBytesPerUpdate) {
+      break;
+    }
+    if (planned_size + extra_size > residency_budget_) {
+      planned_size -= EvictUnusedLevels(
+          device, planned_size + extra_size - residency_budget_);
+      if (planned_size + extra_size > residency_budget_) {
+        continue;
+      }
+    }
+
+    StreamLevels(device, streamed, streamed.requested_base);
+    planned_size += extra_size;
+    streamed_size += extra_size;
+  }
+
+  // The budget may have been lowered since the last update
+  if (planned_size > residency_budget_) {
+    EvictUnusedLevels(device, planned_size - residency_budget_);
+  }
+
+  for (eastl::vector<eastl::unique_ptr<StreamedTexture>>::iterator itor =
+           streamed_.begin();
+       itor != streamed_.end(); ++itor) {
+    (*itor)->requested_base = (*itor)->min_base;
+  }
+  ++residency_frame_;
+}
+
+uint32_t VulkanTextureManager::GetTableIndex(const VulkanDevice &device,
+                                             const VulkanTexture *texture) {
+  eastl::hash_map<const VulkanTexture *, uint32_t>::const_iterator itor =
+      table_idxs_.find(texture);
+  if (itor != table_idxs_.end()) {
+    return itor->second;
+  }
+
+  uint32_t index = SCAST_U32(table_idxs_.size());
+  if (index >= table_size_) {
+    EXIT("The texture table is full!");
+  }
+  table_idxs_[texture] = index;
+  WriteTableEntry(device, *texture, index);
+  return index;
+}
+
+void VulkanTextureManager::WriteTableEntry(const VulkanDevice &device,
+                                           const VulkanTexture &texture,
+                                           uint32_t index) const {
+  VkDescriptorImageInfo image_info = texture.GetDescriptorImageInfo();
+  VkWriteDescriptorSet write_desc_set = tools::inits::WriteDescriptorSet(
+      table_set_, kTableTexturesBindingPos, index, 1U,
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &image_info);
+  vkUpdateDescriptorSets(device.device(), 1U, &write_desc_set, 0U, nullptr);
+}
+
+VkDeviceSize VulkanTextureManager::GetPlannedResidentSize() const {
+  VkDeviceSize size = 0U;
+  for (eastl::vector<eastl::unique_ptr<StreamedTexture>>::const_iterator
+           itor = streamed_.begin();
+       itor != streamed_.end(); ++itor) {
+    const StreamedTexture &streamed = **itor;
+    size += GetLevelsSize(streamed.source, streamed.pending_image
+                                               ? streamed.pending_base
+                                               : streamed.resident_base);
+  }
+  return size;
+}
+
+void VulkanTextureManager::StreamLevels(const VulkanDevice &device,
+                                        StreamedTexture &streamed,
+                                        uint32_t base) {
+  const gli::texture2d &source = streamed.source;
+  uint32_t mip_levels = SCAST_U32(source.levels()) - base;
+  eastl::unique_ptr<VulkanImage> image = CreateTextureImage(
+      device, SCAST_U32(source[base].extent().x),
+      SCAST_U32(source[base].extent().y), 1U, mip_levels,
+      static_cast<VkFormat>(source.format()), streamed.img_usage_flags, 0U,
+      VK_IMAGE_VIEW_TYPE_2D, VK_IMAGE_TYPE_2D);
+
+  eastl::vector<VkBufferImageCopy> copy_regions;
+  GetMipCopyRegions(source, base, copy_regions);
+  streamed.pending_ticket = device.uploader().UploadImage(
+      device, *image.get(), source[base].data(),
+      GetLevelsSize(source, base), copy_regions,
+      GetColourRange(mip_levels, 1U), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  streamed.pending_image = eastl::move(image);
+  streamed.pending_base = base;
+}
+
+VkDeviceSize VulkanTextureManager::EvictUnusedLevels(const VulkanDevice &device,
+                                                     VkDeviceSize bytes) {
+  eastl::vector<uint32_t> unused;
+  for (uint32_t i = 0U; i < SCAST_U32(streamed_.size()); ++i) {
+    const StreamedTexture &streamed = *streamed_[i];
+    if (!streamed.pending_image &&
+        streamed.last_used_frame != residency_frame_ &&
+        streamed.resident_base < streamed.min_base) {
+      unused.push_back(i);
+    }
+  }
+  eastl::sort(unused.begin(), unused.end(), [&](uint32_t a, uint32_t b) {
+    return streamed_[a]->last_used_frame < streamed_[b]->last_used_frame;
+  });
+
+  // Only the levels which are always resident are uploaded again
+  VkDeviceSize freed = 0U;
+  for (eastl::vector<uint32_t>::const_iterator itor = unused.begin();
+       itor != unused.end() && freed < bytes; ++itor) {
+    StreamedTexture &streamed = *streamed_[*itor];
+    freed += GetLevelsSize(streamed.source, streamed.resident_base) -
+             GetLevelsSize(streamed.source, streamed.min_base);
+    StreamLevels(device, streamed, streamed.min_base);
+  }
+  return freed;
+}
+
 void VulkanTextureManager::LoadCubeTexture(
     const VulkanDevice &device, const eastl::string &filename_original,
     VulkanTexture **texture, const VkSampler aniso_sampler,
@@ -383,29 +950,7 @@ void VulkanTextureManager::Load2DTexture(
 
   // Setup buffer copy regions for each mip level
   eastl::vector<VkBufferImageCopy> buffer_copy_regions;
-  // Use an offset to go through all the mip levels
-  uint32_t offset = 0U;
-
-  for (uint32_t i = 0U; i < mip_levels; ++i) {
-    VkBufferImageCopy copy_region;
-    copy_region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    copy_region.imageSubresource.mipLevel = i;
-    copy_region.imageSubresource.baseArrayLayer = 0U;
-    copy_region.imageSubresource.layerCount = 1U;
-    copy_region.imageExtent.width = SCAST_U32(tex_2D[i].extent().x);
-    copy_region.imageExtent.height = SCAST_U32(tex_2D[i].extent().y);
-    copy_region.imageExtent.depth = 1U;
-    copy_region.bufferOffset = offset;
-    copy_region.bufferRowLength = 0U;
-    copy_region.bufferImageHeight = 0U;
-    copy_region.imageOffset.x = 0U;
-    copy_region.imageOffset.y = 0U;
-    copy_region.imageOffset.z = 0U;
-
-    buffer_copy_regions.push_back(copy_region);
-
-    offset += static_cast<uint32_t>(tex_2D[i].size());
-  }
+  GetMipCopyRegions(tex_2D, 0U, buffer_copy_regions);
 
   // Can pass tex_2D.format() because https://github.com/g-truc/gli/issues/85
   CreateTexture(device, filename, tex_2D.data(), SCAST_U32(tex_2D.size()),
@@ -1,4 +1,5 @@
 #include <base_system.h>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -148,6 +149,19 @@ bool DoesFileExist(const std::string &name) {
   return f.good();
 }
 
+bool ReplaceFile(const std::string &tmp_path, const std::string &path) {
+  // rename replaces the file atomically on POSIX; only where it can't
+  // replace an existing file is the old one removed first
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0 &&
+      (std::remove(path.c_str()) != 0 ||
+       std::rename(tmp_path.c_str(), path.c_str()) != 0)) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
 VkImageUsageFlags
 GetSwapChainUsageFlags(const VkSurfaceCapabilitiesKHR &surface_capabilities) {
   // The color attachment flag must always be supported
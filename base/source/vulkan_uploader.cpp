@@ -0,0 +1,522 @@
+#include <EASTL/algorithm.h>
+#include <cstring>
+#include <logger.hpp>
+#include <vulkan_device.h>
+#include <vulkan_image.h>
+#include <vulkan_tools.h>
+#include <vulkan_uploader.h>
+
+namespace vks {
+
+const VkDeviceSize kStagingRingSize = 64U * 1024U * 1024U;
+const uint32_t kUploadMaxBatches = 8U;
+
+// Copies to images need offsets which are a multiple of the texel block
+// size, which is at most 16 bytes
+static const VkDeviceSize kImageCopyAlignment = 16U;
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+  return ((value + alignment - 1U) / alignment) * alignment;
+}
+
+StagingRegion::StagingRegion()
+    : buffer(VK_NULL_HANDLE), offset(0U), mapped(nullptr), size(0U) {}
+
+VulkanUploader::VulkanUploader()
+    : cmd_pool_(VK_NULL_HANDLE), acquire_cmd_pool_(VK_NULL_HANDLE),
+      transfer_ownership_(false), ring_(), ring_head_(0U), ring_tail_(0U),
+      batches_(), submitted_ticket_(0U), completed_ticket_(0U),
+      bytes_uploaded_(0U), num_batches_(0U), reserved_buffers_(), mutex_() {}
+
+void VulkanUploader::Init(const VulkanDevice &device) {
+  transfer_ownership_ = device.HasDedicatedTransferQueue();
+
+  // The command buffers are reset one at a time as the batches are reused
+  VkCommandPoolCreateInfo cmd_pool_create_info =
+      tools::inits::CommandPoolCreateInfo(
+          VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+  cmd_pool_create_info.queueFamilyIndex = device.GetTransferQueueIndex();
+  VK_CHECK_RESULT(vkCreateCommandPool(device.device(), &cmd_pool_create_info,
+                                      nullptr, &cmd_pool_));
+  acquire_cmd_pool_ = cmd_pool_;
+  if (transfer_ownership_) {
+    cmd_pool_create_info.queueFamilyIndex = device.GetGraphicsQueueIndex();
+    VK_CHECK_RESULT(vkCreateCommandPool(
+        device.device(), &cmd_pool_create_info, nullptr, &acquire_cmd_pool_));
+  }
+
+  batches_.resize(kUploadMaxBatches);
+  eastl::vector<VkCommandBuffer> cmd_buffs(kUploadMaxBatches);
+  eastl::vector<VkCommandBuffer> acquire_cmd_buffs(kUploadMaxBatches,
+                                                   VK_NULL_HANDLE);
+  VkCommandBufferAllocateInfo cmd_buff_allocate_info = {
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, nullptr, cmd_pool_,
+      VK_COMMAND_BUFFER_LEVEL_PRIMARY, kUploadMaxBatches};
+  VK_CHECK_RESULT(vkAllocateCommandBuffers(
+      device.device(), &cmd_buff_allocate_info, cmd_buffs.data()));
+  if (transfer_ownership_) {
+    cmd_buff_allocate_info.commandPool = acquire_cmd_pool_;
+    VK_CHECK_RESULT(vkAllocateCommandBuffers(
+        device.device(), &cmd_buff_allocate_info, acquire_cmd_buffs.data()));
+  }
+
+  VkFenceCreateInfo fence_create_info = tools::inits::FenceCreateInfo();
+  VkSemaphoreCreateInfo semaphore_create_info = {
+      VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, nullptr, 0U};
+  for (uint32_t i = 0U; i < kUploadMaxBatches; ++i) {
+    batches_[i].cmd_buff = cmd_buffs[i];
+    batches_[i].acquire_cmd_buff = acquire_cmd_buffs[i];
+    VK_CHECK_RESULT(vkCreateFence(device.device(), &fence_create_info, nullptr,
+                                  &batches_[i].fence));
+    if (transfer_ownership_) {
+      VK_CHECK_RESULT(vkCreateSemaphore(device.device(),
+                                        &semaphore_create_info, nullptr,
+                                        &batches_[i].semaphore));
+    }
+  }
+
+  VulkanBufferInitInfo ring_init_info;
+  ring_init_info.size = kStagingRingSize;
+  ring_init_info.buffer_usage_flags = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  ring_init_info.memory_usage = MemoryUsage::CPU_ONLY;
+  ring_.Init(device, ring_init_info);
+}
+
+void VulkanUploader::Shutdown(const VulkanDevice &device) {
+  if (cmd_pool_ == VK_NULL_HANDLE) {
+    return;
+  }
+
+  Wait(device, Flush(device));
+
+  eastl::vector<VulkanBuffer>::iterator buff_itr;
+  for (buff_itr = reserved_buffers_.begin();
+       buff_itr != reserved_buffers_.end(); ++buff_itr) {
+    buff_itr->Shutdown(device);
+  }
+  reserved_buffers_.clear();
+
+  LOG("Uploaded " << bytes_uploaded_ << " bytes in " << num_batches_
+                  << " batches");
+
+  eastl::vector<UploadBatch>::iterator itr;
+  for (itr = batches_.begin(); itr != batches_.end(); ++itr) {
+    vkDestroyFence(device.device(), itr->fence, nullptr);
+    if (itr->semaphore != VK_NULL_HANDLE) {
+      vkDestroySemaphore(device.device(), itr->semaphore, nullptr);
+    }
+  }
+  batches_.clear();
+
+  // Destroying the pools frees the command buffers as well
+  if (acquire_cmd_pool_ != cmd_pool_) {
+    vkDestroyCommandPool(device.device(), acquire_cmd_pool_, nullptr);
+  }
+  acquire_cmd_pool_ = VK_NULL_HANDLE;
+  vkDestroyCommandPool(device.device(), cmd_pool_, nullptr);
+  cmd_pool_ = VK_NULL_HANDLE;
+
+  ring_.Shutdown(device);
+  ring_head_ = 0U;
+  ring_tail_ = 0U;
+}
+
+UploadTicket VulkanUploader::UploadBuffer(const VulkanDevice &device,
+                                          VkBuffer dst,
+                                          VkDeviceSize dst_offset,
+                                          const void *data,
+                                          VkDeviceSize size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  StagingRegion staging = Stage(
+      device, size,
+      device.physical_properties().limits.optimalBufferCopyOffsetAlignment);
+  memcpy(staging.mapped, data, size);
+
+  UploadBatch &batch = BeginBatch(device);
+  VkBufferCopy buff_copy;
+  buff_copy.srcOffset = staging.offset;
+  buff_copy.dstOffset = dst_offset;
+  buff_copy.size = size;
+  vkCmdCopyBuffer(batch.cmd_buff, staging.buffer, dst, 1U, &buff_copy);
+
+  if (transfer_ownership_) {
+    VkBufferMemoryBarrier buffer_barrier = {
+        VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        nullptr,
+        0U,
+        0U,
+        device.GetTransferQueueIndex(),
+        device.GetGraphicsQueueIndex(),
+        dst,
+        dst_offset,
+        size};
+    batch.buffer_barriers.push_back(buffer_barrier);
+  }
+
+  return submitted_ticket_ + 1U;
+}
+
+UploadTicket VulkanUploader::UploadImage(
+    const VulkanDevice &device, VulkanImage &image, const void *data,
+    VkDeviceSize size, const eastl::vector<VkBufferImageCopy> &regions,
+    const VkImageSubresourceRange &subresource_range,
+    VkImageLayout final_layout) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  StagingRegion staging = Stage(device, size, GetImageCopyAlignment(device));
+  memcpy(staging.mapped, data, size);
+  RecordImageCopy(device, staging, image, regions, subresource_range,
+                  final_layout);
+
+  return submitted_ticket_ + 1U;
+}
+
+VkDeviceSize
+VulkanUploader::GetImageCopyAlignment(const VulkanDevice &device) const {
+  return eastl::max(
+      kImageCopyAlignment,
+      device.physical_properties().limits.optimalBufferCopyOffsetAlignment);
+}
+
+StagingRegion VulkanUploader::ReserveStaging(const VulkanDevice &device,
+                                             VkDeviceSize size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  VulkanBufferInitInfo staging_init_info;
+  staging_init_info.size = size;
+  staging_init_info.buffer_usage_flags = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  staging_init_info.memory_usage = MemoryUsage::CPU_ONLY;
+  reserved_buffers_.push_back();
+  reserved_buffers_.back().Init(device, staging_init_info);
+
+  StagingRegion staging;
+  staging.buffer = reserved_buffers_.back().buffer();
+  staging.mapped = reserved_buffers_.back().mapped();
+  staging.size = size;
+  return staging;
+}
+
+UploadTicket VulkanUploader::UploadStagedImage(
+    const VulkanDevice &device, const StagingRegion &staging,
+    VulkanImage &image, const eastl::vector<VkBufferImageCopy> &regions,
+    const VkImageSubresourceRange &subresource_range,
+    VkImageLayout final_layout) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  bytes_uploaded_ += staging.size;
+  RecordImageCopy(device, staging, image, regions, subresource_range,
+                  final_layout);
+
+  return submitted_ticket_ + 1U;
+}
+
+void VulkanUploader::ReleaseStaging(const VulkanDevice &device,
+                                    const StagingRegion &staging) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  eastl::vector<VulkanBuffer>::iterator itr;
+  for (itr = reserved_buffers_.begin(); itr != reserved_buffers_.end();
+       ++itr) {
+    if (itr->buffer() == staging.buffer) {
+      break;
+    }
+  }
+  if (itr == reserved_buffers_.end()) {
+    return;
+  }
+
+  // The last copies are either in the batch being recorded or in the last
+  // one submitted, unless that one is already done
+  UploadBatch &next = batches_[(submitted_ticket_ + 1U) % kUploadMaxBatches];
+  UploadBatch &last = batches_[submitted_ticket_ % kUploadMaxBatches];
+  if (next.recording) {
+    next.overflow_buffers.push_back(*itr);
+  } else if (completed_ticket_ < submitted_ticket_) {
+    last.overflow_buffers.push_back(*itr);
+  } else {
+    itr->Shutdown(device);
+  }
+  reserved_buffers_.erase(itr);
+}
+
+UploadTicket VulkanUploader::Flush(const VulkanDevice &device) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (batches_[(submitted_ticket_ + 1U) % kUploadMaxBatches].recording) {
+    SubmitBatch(device);
+  }
+  RetireBatches(device, false);
+
+  return submitted_ticket_;
+}
+
+bool VulkanUploader::IsComplete(const VulkanDevice &device,
+                                UploadTicket ticket) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  RetireBatches(device, false);
+  return ticket <= completed_ticket_;
+}
+
+void VulkanUploader::Wait(const VulkanDevice &device, UploadTicket ticket) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (ticket > submitted_ticket_ &&
+      batches_[(submitted_ticket_ + 1U) % kUploadMaxBatches].recording) {
+    SubmitBatch(device);
+  }
+  while (completed_ticket_ < ticket && completed_ticket_ < submitted_ticket_) {
+    RetireBatches(device, true);
+  }
+}
+
+StagingRegion VulkanUploader::Stage(const VulkanDevice &device,
+                                    VkDeviceSize size,
+                                    VkDeviceSize alignment) {
+  bytes_uploaded_ += size;
+
+  StagingRegion staging;
+  staging.size = size;
+
+  // Big uploads would hold most of the ring up, so they get their own buffer
+  if (size > kStagingRingSize / 2U) {
+    VulkanBufferInitInfo overflow_init_info;
+    overflow_init_info.size = size;
+    overflow_init_info.buffer_usage_flags = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    overflow_init_info.memory_usage = MemoryUsage::CPU_ONLY;
+    UploadBatch &batch = BeginBatch(device);
+    batch.overflow_buffers.push_back();
+    batch.overflow_buffers.back().Init(device, overflow_init_info);
+
+    staging.buffer = batch.overflow_buffers.back().buffer();
+    staging.mapped = batch.overflow_buffers.back().mapped();
+    return staging;
+  }
+
+  uint64_t position = 0U;
+  while (true) {
+    position = AlignUp(ring_head_, alignment);
+    // Data can't wrap around the end of the ring, so skip to its start
+    if ((position % kStagingRingSize) + size > kStagingRingSize) {
+      position = AlignUp(position, kStagingRingSize);
+    }
+    if (position + size - ring_tail_ <= kStagingRingSize) {
+      break;
+    }
+
+    // Make room, from the cheapest way to the most expensive one
+    RetireBatches(device, false);
+    if (ring_tail_ == ring_head_) {
+      // Nothing is using the ring, so start again from its beginning
+      ring_head_ = AlignUp(ring_head_, kStagingRingSize);
+      ring_tail_ = ring_head_;
+    } else if (completed_ticket_ < submitted_ticket_) {
+      RetireBatches(device, true);
+    } else {
+      // The data in the way is the one of the batch being recorded
+      SubmitBatch(device);
+    }
+  }
+
+  staging.buffer = ring_.buffer();
+  staging.offset = position % kStagingRingSize;
+  staging.mapped = ring_.mapped() + staging.offset;
+  ring_head_ = position + size;
+
+  return staging;
+}
+
+void VulkanUploader::RecordImageCopy(
+    const VulkanDevice &device, const StagingRegion &staging,
+    VulkanImage &image, const eastl::vector<VkBufferImageCopy> &regions,
+    const VkImageSubresourceRange &subresource_range,
+    VkImageLayout final_layout) {
+  // The regions are relative to the staging memory, so move them to where
+  // it is in the buffer
+  eastl::vector<VkBufferImageCopy> staged_regions(regions);
+  eastl::vector<VkBufferImageCopy>::iterator itr;
+  for (itr = staged_regions.begin(); itr != staged_regions.end(); ++itr) {
+    itr->bufferOffset += staging.offset;
+  }
+
+  UploadBatch &batch = BeginBatch(device);
+  tools::SetImageLayout(batch.cmd_buff, image, VK_IMAGE_LAYOUT_UNDEFINED,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                        subresource_range);
+  vkCmdCopyBufferToImage(batch.cmd_buff, staging.buffer, image.image(),
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                         SCAST_U32(staged_regions.size()),
+                         staged_regions.data());
+  if (transfer_ownership_) {
+    // The layout changes as part of the transfer to the graphics queue
+    VkImageMemoryBarrier image_barrier = tools::inits::ImageMemoryBarrier();
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    image_barrier.newLayout = final_layout;
+    image_barrier.srcQueueFamilyIndex = device.GetTransferQueueIndex();
+    image_barrier.dstQueueFamilyIndex = device.GetGraphicsQueueIndex();
+    image_barrier.image = image.image();
+    image_barrier.subresourceRange = subresource_range;
+    batch.image_barriers.push_back(image_barrier);
+    image.set_layout(final_layout);
+  } else {
+    tools::SetImageLayout(batch.cmd_buff, image,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, final_layout,
+                          subresource_range);
+  }
+}
+
+VulkanUploader::UploadBatch &
+VulkanUploader::BeginBatch(const VulkanDevice &device) {
+  const UploadTicket ticket = submitted_ticket_ + 1U;
+  UploadBatch &batch = batches_[ticket % kUploadMaxBatches];
+  if (batch.recording) {
+    return batch;
+  }
+
+  // The batch was last used kUploadMaxBatches tickets ago
+  while (completed_ticket_ + kUploadMaxBatches < ticket) {
+    RetireBatches(device, true);
+  }
+
+  VkCommandBufferBeginInfo cmd_buff_begin_info =
+      tools::inits::CommandBufferBeginInfo(
+          VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+  VK_CHECK_RESULT(vkBeginCommandBuffer(batch.cmd_buff, &cmd_buff_begin_info));
+  batch.recording = true;
+
+  return batch;
+}
+
+void VulkanUploader::SubmitBatch(const VulkanDevice &device) {
+  UploadBatch &batch = batches_[(submitted_ticket_ + 1U) % kUploadMaxBatches];
+
+  VkSubmitInfo submit_info = tools::inits::SubmitInfo();
+  submit_info.waitSemaphoreCount = 0U;
+  submit_info.pWaitSemaphores = nullptr;
+  submit_info.pWaitDstStageMask = nullptr;
+  submit_info.commandBufferCount = 1U;
+  submit_info.pCommandBuffers = &batch.cmd_buff;
+  submit_info.signalSemaphoreCount = 0U;
+  submit_info.pSignalSemaphores = nullptr;
+
+  VK_CHECK_RESULT(vkResetFences(device.device(), 1U, &batch.fence));
+
+  if (transfer_ownership_) {
+    // Release the resources on the transfer queue, then acquire them on the
+    // graphics one once the copies are done
+    RecordOwnershipBarriers(batch, batch.cmd_buff, true);
+    VK_CHECK_RESULT(vkEndCommandBuffer(batch.cmd_buff));
+
+    submit_info.signalSemaphoreCount = 1U;
+    submit_info.pSignalSemaphores = &batch.semaphore;
+    VK_CHECK_RESULT(vkQueueSubmit(device.transfer_queue().queue, 1U,
+                                  &submit_info, VK_NULL_HANDLE));
+
+    VkCommandBufferBeginInfo cmd_buff_begin_info =
+        tools::inits::CommandBufferBeginInfo(
+            VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    VK_CHECK_RESULT(
+        vkBeginCommandBuffer(batch.acquire_cmd_buff, &cmd_buff_begin_info));
+    RecordOwnershipBarriers(batch, batch.acquire_cmd_buff, false);
+    VK_CHECK_RESULT(vkEndCommandBuffer(batch.acquire_cmd_buff));
+
+    // Only the graphics work submitted after this waits for the copies
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    submit_info.waitSemaphoreCount = 1U;
+    submit_info.pWaitSemaphores = &batch.semaphore;
+    submit_info.pWaitDstStageMask = &wait_stage;
+    submit_info.pCommandBuffers = &batch.acquire_cmd_buff;
+    submit_info.signalSemaphoreCount = 0U;
+    submit_info.pSignalSemaphores = nullptr;
+    VK_CHECK_RESULT(vkQueueSubmit(device.graphics_queue().queue, 1U,
+                                  &submit_info, batch.fence));
+
+    batch.buffer_barriers.clear();
+    batch.image_barriers.clear();
+  } else {
+    // Make the copies visible to whatever is submitted after them
+    VkMemoryBarrier memory_barrier = {VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                                      nullptr, VK_ACCESS_TRANSFER_WRITE_BIT,
+                                      VK_ACCESS_MEMORY_READ_BIT |
+                                          VK_ACCESS_MEMORY_WRITE_BIT};
+    vkCmdPipelineBarrier(batch.cmd_buff, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0U, 1U,
+                         &memory_barrier, 0U, nullptr, 0U, nullptr);
+    VK_CHECK_RESULT(vkEndCommandBuffer(batch.cmd_buff));
+
+    VK_CHECK_RESULT(vkQueueSubmit(device.transfer_queue().queue, 1U,
+                                  &submit_info, batch.fence));
+  }
+
+  batch.ring_end = ring_head_;
+  batch.recording = false;
+  ++submitted_ticket_;
+  ++num_batches_;
+}
+
+void VulkanUploader::RecordOwnershipBarriers(UploadBatch &batch,
+                                             VkCommandBuffer cmd_buff,
+                                             bool release) {
+  // The release makes the copies available, the acquire makes them visible
+  VkAccessFlags src_access =
+      release ? static_cast<VkAccessFlags>(VK_ACCESS_TRANSFER_WRITE_BIT) : 0U;
+  VkAccessFlags dst_access =
+      release ? 0U
+              : static_cast<VkAccessFlags>(VK_ACCESS_MEMORY_READ_BIT |
+                                           VK_ACCESS_MEMORY_WRITE_BIT);
+
+  eastl::vector<VkBufferMemoryBarrier>::iterator b_itr;
+  for (b_itr = batch.buffer_barriers.begin();
+       b_itr != batch.buffer_barriers.end(); ++b_itr) {
+    b_itr->srcAccessMask = src_access;
+    b_itr->dstAccessMask = dst_access;
+  }
+  eastl::vector<VkImageMemoryBarrier>::iterator i_itr;
+  for (i_itr = batch.image_barriers.begin();
+       i_itr != batch.image_barriers.end(); ++i_itr) {
+    i_itr->srcAccessMask = src_access;
+    i_itr->dstAccessMask = dst_access;
+  }
+
+  vkCmdPipelineBarrier(
+      cmd_buff,
+      release ? VK_PIPELINE_STAGE_TRANSFER_BIT
+              : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      release ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+              : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+      0U, 0U, nullptr, SCAST_U32(batch.buffer_barriers.size()),
+      batch.buffer_barriers.data(), SCAST_U32(batch.image_barriers.size()),
+      batch.image_barriers.data());
+}
+
+void VulkanUploader::RetireBatches(const VulkanDevice &device, bool wait) {
+  while (completed_ticket_ < submitted_ticket_) {
+    UploadBatch &batch =
+        batches_[(completed_ticket_ + 1U) % kUploadMaxBatches];
+    if (wait) {
+      VK_CHECK_RESULT(vkWaitForFences(device.device(), 1U, &batch.fence,
+                                      VK_TRUE, UINT64_MAX));
+      wait = false;
+    } else if (vkGetFenceStatus(device.device(), batch.fence) != VK_SUCCESS) {
+      break;
+    }
+
+    // The ring may have been restarted past the data of the batch
+    ring_tail_ = eastl::max(ring_tail_, batch.ring_end);
+    eastl::vector<VulkanBuffer>::iterator itr;
+    for (itr = batch.overflow_buffers.begin();
+         itr != batch.overflow_buffers.end(); ++itr) {
+      itr->Shutdown(device);
+    }
+    batch.overflow_buffers.clear();
+    ++completed_ticket_;
+  }
+}
+
+VulkanUploader::UploadBatch::UploadBatch()
+    : cmd_buff(VK_NULL_HANDLE), acquire_cmd_buff(VK_NULL_HANDLE),
+      semaphore(VK_NULL_HANDLE), fence(VK_NULL_HANDLE), buffer_barriers(),
+      image_barriers(), ring_end(0U), overflow_buffers(), recording(false) {}
+
+} // namespace vks
@@ -65,6 +65,11 @@ public:
   // - Create necessary indirect draw calls and update relative buffer
   void RegisterModel(Model &model);
 
+  // Instances which passed frustum culling in the last frame, out of all the
+  // instances of the registered models
+  uint32_t num_visible_instances() const { return num_visible_instances_; }
+  uint32_t GetInstancesCount() const;
+
 private:
   void SetupRenderPass(const VulkanDevice &device);
   void SetupFrameBuffers(const VulkanDevice &device);
@@ -159,6 +164,7 @@ private:
   VkSampler aniso_edge_sampler_;
 
   eastl::vector<Model *> registered_models_;
+  uint32_t num_visible_instances_;
   Model *fullscreenquad_;
   Model *cube_;
 
@@ -3,6 +3,7 @@
 #include <base_system.h>
 #include <camera.h>
 #include <cassert>
+#include <cfloat>
 #include <cstring>
 #include <deferred_renderer.h>
 #include <fstream>
@@ -41,18 +42,16 @@ const uint32_t kMainStaticBuffBindingPos = 0U;
 const uint32_t kLightsArrayBindingPos = 10U;
 const uint32_t kMatConstsArrayBindingPos = 11U;
 const uint32_t kDepthBuffBindingPos = 1U;
-const uint32_t kDiffuseTexturesArrayBindingPos = 2U;
-const uint32_t kAmbientTexturesArrayBindingPos = 3U;
-const uint32_t kSpecularTexturesArrayBindingPos = 4U;
-const uint32_t kNormalTexturesArrayBindingPos = 5U;
-const uint32_t kRoughnessTexturesArrayBindingPos = 6U;
 const uint32_t kAccumulationBufferBindingPos = 7U;
 const uint32_t kMaxNumUniformBuffers = 100U;
 const uint32_t kSkyboxTextureBindingPos = 0U;
 const uint32_t kMaxNumSSBOs = 1000U;
-const uint32_t kMaxNumMatInstances = 1000U;
+// Material textures live in the texture table, so only a few are left
+const uint32_t kMaxNumImageSamplers = 4U;
 const uint32_t kNumMeshesSpecConstPos = 0U;
-const uint32_t kNumMaterialsSpecConstPos = 0U;
+const uint32_t kTableSizeSpecConstPos = 0U;
+// Set the texture table of the texture manager is bound to
+const uint32_t kTextureTableSetPos = DescSetLayoutTypes::num_items;
 const uint32_t kSSAOKernelSizeSpecConstPos = 0U;
 const uint32_t kSSAONoiseTextureSizeSpecConstPos = 0U;
 const uint32_t kSSAORadiusSizeSpecConstPos = 1U;
@@ -65,6 +64,10 @@ extern const uint32_t kIndirectDrawCmdsBindingPos;
 extern const uint32_t kIdxBufferBindPos;
 extern const uint32_t kModelMatxsBufferBindPos;
 extern const uint32_t kMaterialIDsBufferBindPos;
+extern const uint32_t kMeshClustersBufferBindPos;
+extern const uint32_t kInstanceMeshesBufferBindPos;
+extern const uint32_t kMeshBoundsBufferBindPos;
+extern const uint32_t kVisibleInstancesBufferBindPos;
 extern const int32_t kWindowWidth;
 extern const int32_t kWindowHeight;
 const eastl::string kBaseShaderAssetsPath = STR(ASSETS_FOLDER) "shaders/";
@@ -82,7 +85,8 @@ DeferredRenderer::DeferredRenderer()
       aniso_sampler_(VK_NULL_HANDLE), nearest_sampler_(VK_NULL_HANDLE),
       nearest_sampler_repeat_(VK_NULL_HANDLE),
       aniso_edge_sampler_(VK_NULL_HANDLE), registered_models_(),
-      fullscreenquad_(nullptr), cube_(nullptr), current_swapchain_img_(0U),
+      num_visible_instances_(0U), fullscreenquad_(nullptr), cube_(nullptr),
+      current_swapchain_img_(0U),
       renderpasses_fence_(VK_NULL_HANDLE), frames_captured_(0U),
       num_captures_(0U), num_captures_to_collect_(0U),
       capturing_from_positions_enabled_(false), capturing_enabled_(false),
@@ -212,6 +216,27 @@ void DeferredRenderer::UpdateBuffers(const VulkanDevice &device) {
                             glm::vec3(0.f, 1.f, 0.f));
   }
 
+  // The previous frame is done with the indirect draws and the model
+  // matrices by now; move what moved before culling
+  model_manager()->UpdateTransforms(registered_models_);
+  glm::vec3 view_pos = glm::vec3(glm::inverse(view_mat_)[3]);
+  szt::FrustumPlanes frustum_planes(proj_mat_ * view_mat_);
+  num_visible_instances_ =
+      model_manager()->CullInstances(frustum_planes, registered_models_);
+  for (eastl::vector<Model *>::iterator itor = registered_models_.begin();
+       itor != registered_models_.end(); ++itor) {
+    (*itor)->SelectLods(view_pos, cam_->frustum(),
+                        SCAST_FLOAT(cam_->viewport().height),
+                        kLodMaxPixelError);
+  }
+
+  // Stream in the texture levels the visible instances need; the texture
+  // table follows the new images without recording the commands again
+  model_manager()->RequestTextureDetail(registered_models_, view_pos,
+                                        cam_->frustum(),
+                                        SCAST_FLOAT(cam_->viewport().height));
+  texture_manager()->UpdateResidency(device);
+
   eastl::vector<Light> transformed_lights;
   UpdateLights(transformed_lights);
 
@@ -228,11 +253,10 @@ void DeferredRenderer::UpdateBuffers(const VulkanDevice &device) {
   eastl::array<glm::mat4, 4U> matxs_initial_data = {
       proj_mat_, view_mat_, inv_proj_mat_, inv_view_mat_};
 
-  void *mapped = nullptr;
-  main_static_buff_.Map(device, &mapped);
-  uint8_t *mapped_u8 = static_cast<uint8_t *>(mapped);
+  // The buffer stays mapped; write everything, then flush it at once
+  uint8_t *mapped_u8 = main_static_buff_.mapped();
 
-  memcpy(mapped, matxs_initial_data.data(), mat4_group_size);
+  memcpy(mapped_u8, matxs_initial_data.data(), mat4_group_size);
   mapped_u8 += mat4_group_size;
 
   memcpy(mapped_u8, transformed_lights.data(), lights_array_size);
@@ -247,10 +271,13 @@ void DeferredRenderer::UpdateBuffers(const VulkanDevice &device) {
   memcpy(mapped_u8 + sizeof(zero_val) * 2, &zero_val, sizeof(zero_val));
   memcpy(mapped_u8 + sizeof(zero_val) * 3, &zero_val, sizeof(zero_val));
 
-  main_static_buff_.Unmap(device);
+  main_static_buff_.Flush(device);
 }
 
 void DeferredRenderer::Render() {
+  // Uploads recorded since the last frame have to be submitted before it
+  vulkan()->device().uploader().Flush(vulkan()->device());
+
   VkSemaphore wait_semaphore = vulkan()->image_available_semaphore();
   VkSemaphore signal_semaphore = vulkan()->rendering_finished_semaphore();
   VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
@@ -500,6 +527,17 @@ void DeferredRenderer::RegisterModel(Model &model) {
   LOG("Registered model " << &model << "in DeferredRenderer.");
 }
 
+uint32_t DeferredRenderer::GetInstancesCount() const {
+  uint32_t num_instances = 0U;
+  for (eastl::vector<Model *>::const_iterator itor =
+           registered_models_.begin();
+       itor != registered_models_.end(); ++itor) {
+    num_instances += (*itor)->GetInstancesCount();
+  }
+
+  return num_instances;
+}
+
 void DeferredRenderer::SetupMaterials() {
   material_manager()->RegisterMaterialName("g_store");
   material_manager()->RegisterMaterialName("g_shade");
@@ -528,10 +566,7 @@ void DeferredRenderer::SetupUniformBuffers(const VulkanDevice &device) {
   VulkanBufferInitInfo buff_init_info;
   buff_init_info.size = mat4_group_size + lights_array_size +
                         mat_consts_array_size + perf_counters;
-  buff_init_info
-      .memory_property_flags = /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  buff_init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   buff_init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   main_static_buff_.Init(device, buff_init_info);
 
@@ -539,11 +574,10 @@ void DeferredRenderer::SetupUniformBuffers(const VulkanDevice &device) {
   eastl::array<glm::mat4, 4U> matxs_initial_data = {
       proj_mat_, view_mat_, inv_proj_mat_, inv_view_mat_};
 
-  void *mapped = nullptr;
-  main_static_buff_.Map(device, &mapped);
-  uint8_t *mapped_u8 = static_cast<uint8_t *>(mapped);
+  // The buffer stays mapped; write everything, then flush it at once
+  uint8_t *mapped_u8 = main_static_buff_.mapped();
 
-  memcpy(mapped, matxs_initial_data.data(), mat4_group_size);
+  memcpy(mapped_u8, matxs_initial_data.data(), mat4_group_size);
   mapped_u8 += mat4_group_size;
 
   memcpy(mapped_u8, transformed_lights.data(), lights_array_size);
@@ -552,7 +586,7 @@ void DeferredRenderer::SetupUniformBuffers(const VulkanDevice &device) {
   memcpy(mapped_u8, mat_consts_.data(), mat_consts_array_size);
   mapped_u8 += mat_consts_array_size;
 
-  main_static_buff_.Unmap(device);
+  main_static_buff_.Flush(device);
 }
 
 void DeferredRenderer::SetupDescriptorPool(const VulkanDevice &device) {
@@ -564,8 +598,7 @@ void DeferredRenderer::SetupDescriptorPool(const VulkanDevice &device) {
 
   // Framebuffers
   pool_sizes.push_back(tools::inits::DescriptorPoolSize(
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      kMaxNumMatInstances * SCAST_U32(MatTextureType::size) + 4U));
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, kMaxNumImageSamplers));
 
   // Storage buffers
   pool_sizes.push_back(tools::inits::DescriptorPoolSize(
@@ -619,6 +652,18 @@ void DeferredRenderer::SetupDescriptorSetAndPipeLayout(
           kModelMatxsBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
           VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
+  // Bounds of all meshes
+  bindings[DescSetLayoutTypes::HEAP].push_back(
+      tools::inits::DescriptorSetLayoutBinding(
+          kMeshBoundsBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
+          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
+
+  // Instances left after culling
+  bindings[DescSetLayoutTypes::HEAP].push_back(
+      tools::inits::DescriptorSetLayoutBinding(
+          kVisibleInstancesBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          1U, VK_SHADER_STAGE_VERTEX_BIT, nullptr));
+
   // Vertex buffer
   for (uint32_t i = 0U; i < SCAST_U32(VertexElementType::num_items); ++i) {
     bindings[DescSetLayoutTypes::HEAP].push_back(
@@ -645,42 +690,22 @@ void DeferredRenderer::SetupDescriptorSetAndPipeLayout(
           kMaterialIDsBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
           VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
-  // Depth buffer
-  bindings[DescSetLayoutTypes::GPASS_GENERIC].push_back(
+  // Mesh clusters
+  bindings[DescSetLayoutTypes::HEAP].push_back(
       tools::inits::DescriptorSetLayoutBinding(
-          kDepthBuffBindingPos, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1U,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
+          kMeshClustersBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
+          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
-  uint32_t num_mat_instances = material_manager()->GetMaterialInstancesCount();
-  // Diffuse textures as combined image samplers
-  bindings[DescSetLayoutTypes::GPASS_GENERIC].push_back(
-      tools::inits::DescriptorSetLayoutBinding(
-          kDiffuseTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Ambient textures as combined image samplers
-  bindings[DescSetLayoutTypes::GPASS_GENERIC].push_back(
-      tools::inits::DescriptorSetLayoutBinding(
-          kAmbientTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Specular textures as combined image samplers
-  bindings[DescSetLayoutTypes::GPASS_GENERIC].push_back(
-      tools::inits::DescriptorSetLayoutBinding(
-          kSpecularTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Normal textures as combined image samplers
-  bindings[DescSetLayoutTypes::GPASS_GENERIC].push_back(
+  // Mesh of every instance
+  bindings[DescSetLayoutTypes::HEAP].push_back(
       tools::inits::DescriptorSetLayoutBinding(
-          kNormalTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
+          kInstanceMeshesBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
           VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Roughness textures as combined image samplers
+
+  // Depth buffer
   bindings[DescSetLayoutTypes::GPASS_GENERIC].push_back(
       tools::inits::DescriptorSetLayoutBinding(
-          kRoughnessTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
+          kDepthBuffBindingPos, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1U,
           VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
   // Accumulation buffer
@@ -737,10 +762,15 @@ void DeferredRenderer::SetupDescriptorSetAndPipeLayout(
   VkPushConstantRange push_const_range = {VK_SHADER_STAGE_VERTEX_BIT, 0U,
                                           SCAST_U32(sizeof(uint32_t))};
 
+  // The material textures come from the texture table, after the sets above
+  eastl::vector<VkDescriptorSetLayout> pipe_set_layouts(
+      desc_set_layouts_.begin(), desc_set_layouts_.end());
+  pipe_set_layouts.push_back(texture_manager()->table_layout());
+
   VkPipelineLayoutCreateInfo pipe_layout_create_info =
       tools::inits::PipelineLayoutCreateInfo(
-          DescSetLayoutTypes::num_items, // Desc set layouts up to VISBUFF
-          desc_set_layouts_.data(), 1U, &push_const_range);
+          SCAST_U32(pipe_set_layouts.size()), pipe_set_layouts.data(), 1U,
+          &push_const_range);
 
   VK_CHECK_RESULT(
       vkCreatePipelineLayout(device.device(), &pipe_layout_create_info, nullptr,
@@ -806,61 +836,6 @@ void DeferredRenderer::SetupDescriptorSets(const VulkanDevice &device) {
       VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, &depth_buff_img_info, nullptr,
       nullptr));
 
-  eastl::vector<VkDescriptorImageInfo> diff_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::DIFFUSE,
-                                                    diff_descs_image_infos);
-
-  // Diffuse textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::GPASS_GENERIC], kDiffuseTexturesArrayBindingPos, 0U,
-      SCAST_U32(diff_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, diff_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> amb_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::AMBIENT,
-                                                    amb_descs_image_infos);
-
-  // Ambient textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::GPASS_GENERIC], kAmbientTexturesArrayBindingPos, 0U,
-      SCAST_U32(amb_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, amb_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> spec_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::SPECULAR,
-                                                    spec_descs_image_infos);
-
-  // Specular textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::GPASS_GENERIC], kSpecularTexturesArrayBindingPos, 0U,
-      SCAST_U32(spec_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, spec_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> rough_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(
-      MatTextureType::SPECULAR_HIGHLIGHT, rough_descs_image_infos);
-
-  // Roughness textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::GPASS_GENERIC], kRoughnessTexturesArrayBindingPos,
-      0U, SCAST_U32(rough_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, rough_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> norm_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::NORMAL,
-                                                    norm_descs_image_infos);
-
-  // Normal textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::GPASS_GENERIC], kNormalTexturesArrayBindingPos, 0U,
-      SCAST_U32(norm_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, norm_descs_image_infos.data(),
-      nullptr, nullptr));
-
   // Accumulation buffer
   VkDescriptorImageInfo accum_buff_img_info =
       accum_buffer_->image()->GetDescriptorImageInfo(nearest_sampler_);
@@ -940,6 +915,10 @@ void DeferredRenderer::SetupCommandBuffers() {
                             pipe_layouts_[PipeLayoutTypes::GPASS], 0U,
                             DescSetLayoutTypes::HEAP, desc_sets_.data(), 0U,
                             nullptr);
+    VkDescriptorSet table_set = texture_manager()->table_set();
+    vkCmdBindDescriptorSets(graphics_buffs[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipe_layouts_[PipeLayoutTypes::GPASS],
+                            kTextureTableSetPos, 1U, &table_set, 0U, nullptr);
 
     for (eastl::vector<Model *>::iterator itor = registered_models_.begin();
          itor != registered_models_.end(); ++itor) {
@@ -1060,14 +1039,9 @@ void DeferredRenderer::SetupMaterialPipelines(
       eastl::make_unique<MaterialShader>(kBaseShaderAssetsPath + "g_shade.vert",
                                          "main", ShaderTypes::VERTEX);
 
-  uint32_t num_materials = material_manager()->GetMaterialInstancesCount();
-  g_shade_frag->AddSpecialisationEntry(
-      kNumMaterialsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_materials);
   uint32_t num_lights = lights_manager()->GetNumLights();
   g_shade_frag->AddSpecialisationEntry(
       kNumLightsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_lights);
-  g_shade_vert->AddSpecialisationEntry(
-      kNumMaterialsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_materials);
   g_shade_vert->AddSpecialisationEntry(
       kNumLightsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_lights);
 
@@ -1106,10 +1080,13 @@ void DeferredRenderer::SetupMaterialPipelines(
       eastl::make_unique<MaterialShader>(kBaseShaderAssetsPath + "g_store.vert",
                                          "main", ShaderTypes::VERTEX);
 
-  g_store_vert->AddSpecialisationEntry(
-      kNumMaterialsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_materials);
   g_store_vert->AddSpecialisationEntry(
       kNumLightsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_lights);
+  // Sizes the texture table, which doesn't change as materials are added
+  uint32_t table_size = texture_manager()->table_size();
+  g_store_frag->AddSpecialisationEntry(
+      kTableSizeSpecConstPos, SCAST_U32(sizeof(uint32_t)), &table_size);
+  g_store_vert->AddVertexEncodingsSpecialisation(g_store_vertex_setup);
 
   eastl::unique_ptr<MaterialBuilder> builder_store =
       eastl::make_unique<MaterialBuilder>(
@@ -1307,25 +1284,24 @@ void DeferredRenderer::CaptureData() {
       // of data for 20 frames also pushes a new array in the vector of arrays
       if (frames_captured_ < kFramesCaptureNum) {
 
-        void *mapped = nullptr;
         union BufferData {
           uint32_t data_uint[4U];
           FrameMemoryData data_struct[2U];
         } mapped_data;
 
         // Position the camera at the position for capturing
-        main_static_buff_.Map(vulkan()->device(), &mapped, sizeof(uint32_t) * 4,
-                              main_static_buff_.size() -
-                                  (sizeof(uint32_t) * 4));
-        uint32_t *mapped_u32 = static_cast<uint32_t *>(mapped);
+        VkDeviceSize counters_offset =
+            main_static_buff_.size() - (sizeof(uint32_t) * 4);
+        main_static_buff_.Invalidate(vulkan()->device(), sizeof(uint32_t) * 4,
+                                     counters_offset);
+        uint32_t *mapped_u32 =
+            main_static_buff_.MappedAs<uint32_t>(counters_offset);
 
         mapped_data.data_uint[0] = *mapped_u32;
         mapped_data.data_uint[1] = *(mapped_u32 + 1U);
         mapped_data.data_uint[2] = *(mapped_u32 + 2U);
         mapped_data.data_uint[3] = *(mapped_u32 + 3U);
 
-        main_static_buff_.Unmap(vulkan()->device());
-
         mem_perf_data_reads_.back()[frames_captured_] =
             mapped_data.data_struct[0U];
         mem_perf_data_writes_.back()[frames_captured_] =
@@ -1372,6 +1348,15 @@ void DeferredRenderer::CaptureBandwidthDataFromPositions(
 
   camera_sample_positions_ = sample_positions;
   camera_sample_directions_ = sample_directions;
+
+  // Samples which look at nothing measure an empty frame
+  for (uint32_t i = 0U; i < kCapturesNum; ++i) {
+    ScenePick pick;
+    if (!model_manager()->Pick(sample_positions[i], sample_directions[i],
+                               FLT_MAX, pick)) {
+      ELOG_WARN("Capture sample " << i << " does not face any model");
+    }
+  }
 }
 
 void DeferredRenderer::CaptureBandwidthDataAtPosition() const {
@@ -1509,9 +1494,7 @@ void DeferredRenderer::CaptureScreenshot(const eastl::string &filename) const {
   VulkanImageInitInfo image_init_info;
   image_init_info.create_info = image_create_info;
   image_init_info.create_view = CreateView::NO;
-  image_init_info.memory_properties_flags =
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  image_init_info.memory_usage = MemoryUsage::GPU_TO_CPU;
   eastl::unique_ptr<VulkanImage> dst_image = eastl::make_unique<VulkanImage>();
   dst_image->Init(vulkan()->device(), image_init_info);
 
@@ -1637,8 +1620,7 @@ void DeferredRenderer::CaptureScreenshot(const eastl::string &filename) const {
 
   // Map image memory so we can start copying from it
   const char *data = nullptr;
-  vkMapMemory(vulkan()->device().device(), dst_image->memory(), 0,
-              VK_WHOLE_SIZE, 0, (void **)&data);
+  dst_image->Map(vulkan()->device(), (void **)&data);
 
   data += subresource_layout.offset;
 
@@ -1684,7 +1666,7 @@ void DeferredRenderer::CaptureScreenshot(const eastl::string &filename) const {
     }
   }
 
-  vkUnmapMemory(vulkan()->device().device(), dst_image->memory());
+  dst_image->Unmap(vulkan()->device());
 
   LOG("Screenshot " << filename.c_str() << " saved to disk.");
 }
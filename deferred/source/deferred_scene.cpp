@@ -1,6 +1,7 @@
 #include <EASTL/vector.h>
 #include <assimp/postprocess.h>
 #include <base_system.h>
+#include <cfloat>
 #include <deferred_scene.h>
 #include <frustum.h>
 #include <glm/gtc/matrix_transform.hpp>
@@ -78,6 +79,29 @@ void DeferredScene::DoRender(float delta_time) {
 void DeferredScene::DoUpdate(float delta_time) {
   cam_controller_.Update(&cam_, delta_time);
 
+  // Report how much frustum culling keeps
+  if (input_manager()->IsKeyPressed(GLFW_KEY_V)) {
+    LOG("Visible instances: " << renderer_.num_visible_instances() << " of "
+                              << renderer_.GetInstancesCount());
+  }
+
+  // Report what the camera is looking at
+  if (input_manager()->IsKeyPressed(GLFW_KEY_P)) {
+    ScenePick pick;
+    if (model_manager()->Pick(cam_.position(), cam_.GetForwardVector(),
+                              FLT_MAX, pick)) {
+      LOG("Picked instance " << pick.instance_idx << " of mesh "
+                             << pick.mesh_idx << " at " << pick.distance);
+    } else {
+      LOG("Nothing picked");
+    }
+  }
+
+  // Report how device memory is used
+  if (input_manager()->IsKeyPressed(GLFW_KEY_M)) {
+    vulkan()->device().allocator().LogReport();
+  }
+
   // Reload shaders
   if (input_manager()->IsKeyPressed(GLFW_KEY_R)) {
     renderer_.ReloadAllShaders();
@@ -68,13 +68,23 @@ public:
       const eastl::array<glm::vec3, kCapturesNum> &sample_directions) const;
   void CaptureBandwidthDataAtPosition() const;
 
-  // Register a model for rendering.
-  void RegisterModel(Model &model);
+  // Register a model for rendering; it can be done at any time, models
+  // registered after the first frame are picked up by the next one.
+  // Models with more instances or larger meshes than the vis buffer can
+  // address are rejected, and false is returned.
+  bool RegisterModel(Model &model);
+
+  // Instances which passed frustum culling in the last frame, out of all the
+  // instances of the registered models
+  uint32_t num_visible_instances() const { return num_visible_instances_; }
+  uint32_t GetInstancesCount() const;
 
 private:
   void SetupRenderPass(const VulkanDevice &device);
   void SetupFrameBuffers(const VulkanDevice &device);
   void SetupMaterials();
+  void SetupShadeMaterial(const VulkanDevice &device,
+                          const VertexSetup &g_store_vertex_setup);
   void SetupMaterialPipelines(const VulkanDevice &device,
                               const VertexSetup &g_store_vertex_setup);
   void SetupUniformBuffers(const VulkanDevice &device);
@@ -98,6 +108,14 @@ private:
   void CaptureData();
   void CaptureScreenshot(const eastl::string &filename) const;
   void FinalInit(const VulkanDevice &device);
+  /**
+   * @brief Create the sets of the newly registered models, grow the main
+   *        static buffer if the material constants outgrew it and record
+   *        the command buffers again. The shading pipeline is only created
+   *        again if the index type it is specialised on changed.
+   */
+  void Rebuild(const VulkanDevice &device);
+  void DestroyLayouts(const VulkanDevice &device);
 
   eastl::unique_ptr<Renderpass> renderpass_;
 
@@ -156,6 +174,7 @@ private:
   VkSampler aniso_edge_sampler_;
 
   eastl::vector<Model *> registered_models_;
+  uint32_t num_visible_instances_;
   Model *fullscreenquad_;
   Model *cube_;
 
@@ -184,6 +203,12 @@ private:
 
   // Used to call the second part of the initialisation
   bool first_run_;
+  // Set when a model is registered after the second part has run
+  bool rebuild_pending_;
+  // Number of registered models whose sets have been created
+  uint32_t num_models_with_sets_;
+  // Index type the shading pipeline was specialised on
+  uint32_t shade_indices_16bit_;
 
   VertexSetup vtx_setup_;
 
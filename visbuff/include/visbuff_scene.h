@@ -3,6 +3,7 @@
 
 #include <camera.h>
 #include <camera_controller.h>
+#include <model_manager.h>
 #include <renderer.h>
 #include <scene.h>
 
@@ -24,6 +25,8 @@ private:
   Renderer renderer_;
   szt::Camera cam_;
   szt::CameraController cam_controller_;
+  // Models still loading; they are registered once they are ready
+  eastl::vector<ModelLoadHandle> model_loads_;
 
 }; // class DeferredScene
 
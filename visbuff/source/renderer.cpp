@@ -1,7 +1,9 @@
+#include <EASTL/algorithm.h>
 #include <array>
 #include <base_system.h>
 #include <camera.h>
 #include <cassert>
+#include <cfloat>
 #include <fstream>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -29,11 +31,6 @@ const uint32_t kMainStaticBuffBindingPos = 0U;
 const uint32_t kLightsArrayBindingPos = 10U;
 const uint32_t kMatConstsArrayBindingPos = 9U;
 const uint32_t kDepthBuffBindingPos = 1U;
-const uint32_t kDiffuseTexturesArrayBindingPos = 2U;
-const uint32_t kAmbientTexturesArrayBindingPos = 3U;
-const uint32_t kSpecularTexturesArrayBindingPos = 4U;
-const uint32_t kNormalTexturesArrayBindingPos = 5U;
-const uint32_t kRoughnessTexturesArrayBindingPos = 6U;
 const uint32_t kVisBufferBindingPos = 7U;
 const uint32_t kAccumulationBufferBindingPos = 8U;
 const uint32_t kDerivsBarysBufferBindingPos = 11U;
@@ -41,21 +38,45 @@ const uint32_t kPerfCounterBufferBindingPos = 12U;
 const uint32_t kSkyboxTextureBindingPos = 0U;
 const uint32_t kMaxNumUniformBuffers = 5U;
 const uint32_t kMaxNumSSBOs = 1000U;
-const uint32_t kMaxNumMatInstances = 1000U;
+// Material textures live in the texture table, so only a few are left
+const uint32_t kMaxNumImageSamplers = 10U;
 const uint32_t kMaxNumInputAttachments = 5U;
-const uint32_t kNumMaterialsSpecConstPos = 0U;
+const uint32_t kTableSizeSpecConstPos = 0U;
 const uint32_t kNumLightsSpecConstPos = 1U;
+// Set the texture table of the texture manager is bound to
+const uint32_t kTextureTableSetPos = DescSetLayoutTypes::num_items;
 const uint32_t kTonemapExposureSpecConstPos = 0U;
 const float kTonemapExposure = 0.02f;
+// Bits of the vis buffer IDs; they must match vis_store_amd.frag
+const uint32_t kVisBufferMaxInstances = 1U << 12U;
+const uint32_t kVisBufferMaxTriangles = 1U << 19U;
 extern const uint32_t kVertexBuffersBaseBindPos;
 extern const uint32_t kIndirectDrawCmdsBindingPos;
 extern const uint32_t kIdxBufferBindPos;
 extern const uint32_t kModelMatxsBufferBindPos;
 extern const uint32_t kMaterialIDsBufferBindPos;
+extern const uint32_t kMeshClustersBufferBindPos;
+extern const uint32_t kInstanceMeshesBufferBindPos;
+extern const uint32_t kMeshBoundsBufferBindPos;
+extern const uint32_t kVisibleInstancesBufferBindPos;
 extern const int32_t kWindowWidth;
 extern const int32_t kWindowHeight;
 const eastl::string kBaseShaderAssetsPath = STR(ASSETS_FOLDER) "shaders/";
 
+// Number of material constants in the main static buffer; kept non-zero so
+// that its range stays valid before any model has been loaded
+static uint32_t GetNumMaterialSlots() {
+  return eastl::max(material_manager()->GetMaterialInstancesCount(), 1U);
+}
+
+// The shading pass fetches the indices from the buffer of the last model
+static uint32_t GetShadeIndices16Bit(const eastl::vector<Model *> &models) {
+  return (!models.empty() &&
+          models.back()->index_type() == VK_INDEX_TYPE_UINT16)
+             ? 1U
+             : 0U;
+}
+
 Renderer::Renderer()
     : renderpass_(), framebuffers_(), current_swapchain_img_(0U),
       cmd_buffers_(), vis_buffer_(), depth_buffer_(), vis_shade_material_(),
@@ -65,13 +86,15 @@ Renderer::Renderer()
       main_static_buff_(), proj_mat_(1.f), view_mat_(1.f), inv_proj_mat_(1.f),
       inv_view_mat_(1.f), cam_(nullptr), aniso_sampler_(VK_NULL_HANDLE),
       nearest_sampler_(VK_NULL_HANDLE), aniso_edge_sampler_(VK_NULL_HANDLE),
-      registered_models_(), fullscreenquad_(nullptr), cube_(nullptr),
-      mat_consts_(), renderpasses_fence_(VK_NULL_HANDLE), frames_captured_(0U),
+      registered_models_(), num_visible_instances_(0U),
+      fullscreenquad_(nullptr), cube_(nullptr), mat_consts_(),
+      renderpasses_fence_(VK_NULL_HANDLE), frames_captured_(0U),
       num_captures_(0U), num_captures_to_collect_(0U),
       capturing_from_positions_enabled_(false), capturing_enabled_(false),
       mem_perf_data_reads_(), mem_perf_data_writes_(),
       camera_sample_positions_(), camera_sample_directions_(),
-      capture_screenshot_(false), first_run_(true), vtx_setup_() {}
+      capture_screenshot_(false), first_run_(true), rebuild_pending_(false),
+      num_models_with_sets_(0U), shade_indices_16bit_(0U), vtx_setup_() {}
 
 void Renderer::Init(szt::Camera *cam, const VertexSetup &vtx_setup) {
   cam_ = cam;
@@ -110,12 +133,64 @@ void Renderer::FinalInit(const VulkanDevice &device) {
     (*itor)->CreateAndWriteDescriptorSets(
         vulkan()->device(), desc_set_layouts_[DescSetLayoutTypes::HEAP]);
   }
+  num_models_with_sets_ = SCAST_U32(registered_models_.size());
   SetupUniformBuffers(device);
   SetupMaterialPipelines(device, vtx_setup_);
   SetupDescriptorSets(device);
   SetupCommandBuffers();
 }
 
+void Renderer::Rebuild(const VulkanDevice &device) {
+  vkDeviceWaitIdle(device.device());
+
+  // Only the models registered since the last (re)build need their sets;
+  // the layouts don't depend on the models
+  for (uint32_t i = num_models_with_sets_; i < registered_models_.size();
+       i++) {
+    registered_models_[i]->CreateAndWriteDescriptorSets(
+        device, desc_set_layouts_[DescSetLayoutTypes::HEAP]);
+  }
+  num_models_with_sets_ = SCAST_U32(registered_models_.size());
+
+  // The material constants are sized on the instances; the buffer is only
+  // reallocated, and the generic set pointed at it, when they outgrow it
+  if (GetNumMaterialSlots() > mat_consts_.size()) {
+    main_static_buff_.Shutdown(device);
+    SetupUniformBuffers(device);
+    SetupDescriptorSets(device);
+  } else {
+    uint32_t num_mat_slots = SCAST_U32(mat_consts_.size());
+    mat_consts_ = material_manager()->GetMaterialConstants();
+    mat_consts_.resize(num_mat_slots);
+  }
+
+  // The vertex encodings are fixed at Init, so the only specialisation
+  // input a model can change is the index type the shading pass reads
+  if (GetShadeIndices16Bit(registered_models_) != shade_indices_16bit_) {
+    material_manager()->DestroyMaterial(device, "vis_shade");
+    SetupShadeMaterial(device, vtx_setup_);
+  }
+
+  SetupCommandBuffers();
+  LOG("Rebuilt VisbuffRenderer for " << registered_models_.size()
+                                     << " models.");
+}
+
+void Renderer::DestroyLayouts(const VulkanDevice &device) {
+  for (eastl::vector<VkPipelineLayout>::iterator itor = pipe_layouts_.begin();
+       itor != pipe_layouts_.end(); ++itor) {
+    vkDestroyPipelineLayout(device.device(), *itor, nullptr);
+  }
+  pipe_layouts_.clear();
+
+  for (eastl::vector<VkDescriptorSetLayout>::iterator itor =
+           desc_set_layouts_.begin();
+       itor != desc_set_layouts_.end(); ++itor) {
+    vkDestroyDescriptorSetLayout(device.device(), *itor, nullptr);
+  }
+  desc_set_layouts_.clear();
+}
+
 void Renderer::CreateFences(const VulkanDevice &device) {
   VkFenceCreateInfo fence_create_info = tools::inits::FenceCreateInfo();
 
@@ -175,17 +250,7 @@ void Renderer::Shutdown() {
     desc_pool_ = VK_NULL_HANDLE;
   }
 
-  for (uint32_t i = 0U; i < PipeLayoutTypes::num_items; i++) {
-    vkDestroyPipelineLayout(vulkan()->device().device(), pipe_layouts_[i],
-                            nullptr);
-  }
-  pipe_layouts_.clear();
-
-  for (uint32_t i = 0U; i < DescSetLayoutTypes::num_items; i++) {
-    vkDestroyDescriptorSetLayout(vulkan()->device().device(),
-                                 desc_set_layouts_[i], nullptr);
-  }
-  desc_set_layouts_.clear();
+  DestroyLayouts(vulkan()->device());
 
   if (aniso_sampler_ != VK_NULL_HANDLE) {
     vkDestroySampler(vulkan()->device().device(), aniso_sampler_, nullptr);
@@ -215,6 +280,10 @@ void Renderer::PreRender() {
   if (first_run_) {
     FinalInit(vulkan()->device());
     first_run_ = false;
+    rebuild_pending_ = false;
+  } else if (rebuild_pending_) {
+    Rebuild(vulkan()->device());
+    rebuild_pending_ = false;
   }
 
   UpdateBuffers(vulkan()->device());
@@ -235,11 +304,33 @@ void Renderer::UpdateBuffers(const VulkanDevice &device) {
                             glm::vec3(0.f, 1.f, 0.f));
   }
 
+  // The previous frame is done with the indirect draws and the model
+  // matrices by now; move what moved before culling
+  model_manager()->UpdateTransforms(registered_models_);
+  glm::vec3 view_pos = glm::vec3(glm::inverse(view_mat_)[3]);
+  szt::FrustumPlanes frustum_planes(proj_mat_ * view_mat_);
+  num_visible_instances_ =
+      model_manager()->CullInstances(frustum_planes, registered_models_);
+  for (eastl::vector<Model *>::iterator itor = registered_models_.begin();
+       itor != registered_models_.end(); ++itor) {
+    (*itor)->SelectLods(view_pos, cam_->frustum(),
+                        SCAST_FLOAT(cam_->viewport().height),
+                        kLodMaxPixelError);
+  }
+
+  // Stream in the texture levels the visible instances need; the texture
+  // table follows the new images without recording the commands again
+  model_manager()->RequestTextureDetail(registered_models_, view_pos,
+                                        cam_->frustum(),
+                                        SCAST_FLOAT(cam_->viewport().height));
+  texture_manager()->UpdateResidency(device);
+
   eastl::vector<Light> transformed_lights;
   UpdateLights(transformed_lights);
 
-  // Cache some sizes
-  uint32_t num_mat_instances = material_manager()->GetMaterialInstancesCount();
+  // Cache some sizes; the buffer was laid out for the constants gathered at
+  // the last (re)build
+  uint32_t num_mat_instances = SCAST_U32(mat_consts_.size());
   uint32_t num_lights = SCAST_U32(transformed_lights.size());
   uint32_t mat4_size = SCAST_U32(sizeof(glm::mat4));
   uint32_t mat4_group_size = mat4_size * 4U;
@@ -251,11 +342,10 @@ void Renderer::UpdateBuffers(const VulkanDevice &device) {
   eastl::array<glm::mat4, 4U> matxs_initial_data = {
       proj_mat_, view_mat_, inv_proj_mat_, inv_view_mat_};
 
-  void *mapped = nullptr;
-  main_static_buff_.Map(device, &mapped);
-  uint8_t *mapped_u8 = static_cast<uint8_t *>(mapped);
+  // The buffer stays mapped; write everything, then flush it at once
+  uint8_t *mapped_u8 = main_static_buff_.mapped();
 
-  memcpy(mapped, matxs_initial_data.data(), mat4_group_size);
+  memcpy(mapped_u8, matxs_initial_data.data(), mat4_group_size);
   mapped_u8 += mat4_group_size;
 
   memcpy(mapped_u8, transformed_lights.data(), lights_array_size);
@@ -270,10 +360,13 @@ void Renderer::UpdateBuffers(const VulkanDevice &device) {
   memcpy(mapped_u8 + sizeof(zero_val) * 2, &zero_val, sizeof(zero_val));
   memcpy(mapped_u8 + sizeof(zero_val) * 3, &zero_val, sizeof(zero_val));
 
-  main_static_buff_.Unmap(device);
+  main_static_buff_.Flush(device);
 }
 
 void Renderer::Render() {
+  // Uploads recorded since the last frame have to be submitted before it
+  vulkan()->device().uploader().Flush(vulkan()->device());
+
   VkSemaphore wait_semaphore = vulkan()->image_available_semaphore();
   VkSemaphore signal_semaphore = vulkan()->rendering_finished_semaphore();
   VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
@@ -520,10 +613,43 @@ void Renderer::CreateFramebufferAttachment(const VulkanDevice &device,
       img_usage_flags);
 }
 
-void Renderer::RegisterModel(Model &model) {
+bool Renderer::RegisterModel(Model &model) {
+  // Anything beyond what the vis buffer can address would alias the IDs of
+  // something else and be shaded as it, so it isn't rendered at all
+  if (model.GetInstancesCount() > kVisBufferMaxInstances) {
+    ELOG_WARN("Model " << &model << " rejected, it has "
+                       << model.GetInstancesCount()
+                       << " instances and the vis buffer can only address "
+                       << kVisBufferMaxInstances);
+    return false;
+  }
+  for (eastl::vector<Mesh>::const_iterator itor = model.meshes().begin();
+       itor != model.meshes().end(); ++itor) {
+    if (itor->index_count() / 3U > kVisBufferMaxTriangles) {
+      ELOG_WARN("Model " << &model << " rejected, a mesh has "
+                         << itor->index_count() / 3U
+                         << " triangles and the vis buffer can only address "
+                         << kVisBufferMaxTriangles);
+      return false;
+    }
+  }
+
   registered_models_.push_back(&model);
+  rebuild_pending_ = true;
 
   LOG("Registered model " << &model << "in VisbuffRenderer.");
+  return true;
+}
+
+uint32_t Renderer::GetInstancesCount() const {
+  uint32_t num_instances = 0U;
+  for (eastl::vector<Model *>::const_iterator itor =
+           registered_models_.begin();
+       itor != registered_models_.end(); ++itor) {
+    num_instances += (*itor)->GetInstancesCount();
+  }
+
+  return num_instances;
 }
 
 void Renderer::SetupMaterials() {
@@ -535,7 +661,8 @@ void Renderer::SetupMaterials() {
 void Renderer::SetupUniformBuffers(const VulkanDevice &device) {
   // Materials
   mat_consts_ = material_manager()->GetMaterialConstants();
-  uint32_t num_mat_instances = material_manager()->GetMaterialInstancesCount();
+  uint32_t num_mat_instances = GetNumMaterialSlots();
+  mat_consts_.resize(num_mat_instances);
 
   // Lights array
   eastl::vector<Light> transformed_lights;
@@ -554,10 +681,7 @@ void Renderer::SetupUniformBuffers(const VulkanDevice &device) {
   VulkanBufferInitInfo buff_init_info;
   buff_init_info.size = mat4_group_size + lights_array_size +
                         mat_consts_array_size + perf_counters;
-  buff_init_info
-      .memory_property_flags = /*VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |*/
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  buff_init_info.memory_usage = MemoryUsage::CPU_TO_GPU;
   buff_init_info.buffer_usage_flags = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   main_static_buff_.Init(device, buff_init_info);
 }
@@ -571,8 +695,7 @@ void Renderer::SetupDescriptorPool(const VulkanDevice &device) {
 
   // Framebuffers
   pool_sizes.push_back(tools::inits::DescriptorPoolSize(
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      kMaxNumMatInstances * SCAST_U32(MatTextureType::size) + 10U));
+      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, kMaxNumImageSamplers));
 
   // Storage buffers
   pool_sizes.push_back(tools::inits::DescriptorPoolSize(
@@ -626,6 +749,18 @@ void Renderer::SetupDescriptorSetAndPipeLayout(const VulkanDevice &device) {
           kModelMatxsBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
           VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
+  // Bounds of all meshes
+  bindings[DescSetLayoutTypes::HEAP].push_back(
+      tools::inits::DescriptorSetLayoutBinding(
+          kMeshBoundsBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
+          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
+
+  // Instances left after culling
+  bindings[DescSetLayoutTypes::HEAP].push_back(
+      tools::inits::DescriptorSetLayoutBinding(
+          kVisibleInstancesBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          1U, VK_SHADER_STAGE_VERTEX_BIT, nullptr));
+
   // Indirect draw buffers
   bindings[DescSetLayoutTypes::HEAP].push_back(
       tools::inits::DescriptorSetLayoutBinding(
@@ -652,42 +787,22 @@ void Renderer::SetupDescriptorSetAndPipeLayout(const VulkanDevice &device) {
           kMaterialIDsBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
           VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
-  // Depth buffer
-  bindings[DescSetLayoutTypes::VIS_GENERIC].push_back(
+  // Mesh clusters
+  bindings[DescSetLayoutTypes::HEAP].push_back(
       tools::inits::DescriptorSetLayoutBinding(
-          kDepthBuffBindingPos, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1U,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
+          kMeshClustersBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
+          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
-  uint32_t num_mat_instances = material_manager()->GetMaterialInstancesCount();
-  // Diffuse textures as combined image samplers
-  bindings[DescSetLayoutTypes::VIS_GENERIC].push_back(
-      tools::inits::DescriptorSetLayoutBinding(
-          kDiffuseTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Ambient textures as combined image samplers
-  bindings[DescSetLayoutTypes::VIS_GENERIC].push_back(
-      tools::inits::DescriptorSetLayoutBinding(
-          kAmbientTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Specular textures as combined image samplers
-  bindings[DescSetLayoutTypes::VIS_GENERIC].push_back(
-      tools::inits::DescriptorSetLayoutBinding(
-          kSpecularTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
-          VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Normal textures as combined image samplers
-  bindings[DescSetLayoutTypes::VIS_GENERIC].push_back(
+  // Mesh of every instance
+  bindings[DescSetLayoutTypes::HEAP].push_back(
       tools::inits::DescriptorSetLayoutBinding(
-          kNormalTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
+          kInstanceMeshesBufferBindPos, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1U,
           VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
-  // Roughness textures as combined image samplers
+
+  // Depth buffer
   bindings[DescSetLayoutTypes::VIS_GENERIC].push_back(
       tools::inits::DescriptorSetLayoutBinding(
-          kRoughnessTexturesArrayBindingPos,
-          VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, num_mat_instances,
+          kDepthBuffBindingPos, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 1U,
           VK_SHADER_STAGE_FRAGMENT_BIT, nullptr));
 
   // Vis buffer
@@ -747,10 +862,15 @@ void Renderer::SetupDescriptorSetAndPipeLayout(const VulkanDevice &device) {
   VkPushConstantRange push_const_range = {VK_SHADER_STAGE_VERTEX_BIT, 0U,
                                           SCAST_U32(sizeof(uint32_t))};
 
+  // The material textures come from the texture table, after the sets above
+  eastl::vector<VkDescriptorSetLayout> pipe_set_layouts(
+      desc_set_layouts_.begin(), desc_set_layouts_.end());
+  pipe_set_layouts.push_back(texture_manager()->table_layout());
+
   VkPipelineLayoutCreateInfo pipe_layout_create_info =
       tools::inits::PipelineLayoutCreateInfo(
-          DescSetLayoutTypes::num_items, // Desc set layouts up to VISBUFF
-          desc_set_layouts_.data(), 1U, &push_const_range);
+          SCAST_U32(pipe_set_layouts.size()), pipe_set_layouts.data(), 1U,
+          &push_const_range);
 
   VK_CHECK_RESULT(
       vkCreatePipelineLayout(device.device(), &pipe_layout_create_info, nullptr,
@@ -762,7 +882,7 @@ void Renderer::SetupDescriptorSets(const VulkanDevice &device) {
   eastl::vector<VkWriteDescriptorSet> write_desc_sets;
 
   // Cache some sizes
-  uint32_t num_mat_instances = material_manager()->GetMaterialInstancesCount();
+  uint32_t num_mat_instances = GetNumMaterialSlots();
   uint32_t num_lights = lights_manager()->GetNumLights();
   uint32_t mat4_size = SCAST_U32(sizeof(glm::mat4));
   uint32_t mat4_group_size = mat4_size * 4U;
@@ -816,61 +936,6 @@ void Renderer::SetupDescriptorSets(const VulkanDevice &device) {
       VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, &depth_buff_img_info, nullptr,
       nullptr));
 
-  eastl::vector<VkDescriptorImageInfo> diff_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::DIFFUSE,
-                                                    diff_descs_image_infos);
-
-  // Diffuse textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::VIS_GENERIC], kDiffuseTexturesArrayBindingPos, 0U,
-      SCAST_U32(diff_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, diff_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> amb_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::AMBIENT,
-                                                    amb_descs_image_infos);
-
-  // Ambient textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::VIS_GENERIC], kAmbientTexturesArrayBindingPos, 0U,
-      SCAST_U32(amb_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, amb_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> spec_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::SPECULAR,
-                                                    spec_descs_image_infos);
-
-  // Specular textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::VIS_GENERIC], kSpecularTexturesArrayBindingPos, 0U,
-      SCAST_U32(spec_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, spec_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> rough_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(
-      MatTextureType::SPECULAR_HIGHLIGHT, rough_descs_image_infos);
-
-  // Roughness textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::VIS_GENERIC], kRoughnessTexturesArrayBindingPos, 0U,
-      SCAST_U32(rough_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, rough_descs_image_infos.data(),
-      nullptr, nullptr));
-
-  eastl::vector<VkDescriptorImageInfo> norm_descs_image_infos;
-  material_manager()->GetDescriptorImageInfosByType(MatTextureType::NORMAL,
-                                                    norm_descs_image_infos);
-
-  // Normal textures as combined image samplers
-  write_desc_sets.push_back(tools::inits::WriteDescriptorSet(
-      desc_sets_[SetTypes::VIS_GENERIC], kNormalTexturesArrayBindingPos, 0U,
-      SCAST_U32(norm_descs_image_infos.size()),
-      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, norm_descs_image_infos.data(),
-      nullptr, nullptr));
-
   // Visibility buffer
   VkDescriptorImageInfo desc_vis_buff_info =
       vis_buffer_->image()->GetDescriptorImageInfo();
@@ -954,6 +1019,10 @@ void Renderer::SetupCommandBuffers() {
                             pipe_layouts_[PipeLayoutTypes::VPASS], 0U,
                             DescSetLayoutTypes::HEAP, desc_sets_.data(), 0U,
                             nullptr);
+    VkDescriptorSet table_set = texture_manager()->table_set();
+    vkCmdBindDescriptorSets(graphics_buffs[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipe_layouts_[PipeLayoutTypes::VPASS],
+                            kTextureTableSetPos, 1U, &table_set, 0U, nullptr);
 
     for (eastl::vector<Model *>::iterator itor = registered_models_.begin();
          itor != registered_models_.end(); ++itor) {
@@ -973,7 +1042,10 @@ void Renderer::SetupCommandBuffers() {
     fullscreenquad_->BindVertexBuffer(graphics_buffs[i]);
     fullscreenquad_->BindIndexBuffer(graphics_buffs[i]);
 
-    vkCmdDrawIndexed(graphics_buffs[i], 6U, 1U, 0U, 0U, 0U);
+    // Shading reads the heap set bound by the last model
+    if (!registered_models_.empty()) {
+      vkCmdDrawIndexed(graphics_buffs[i], 6U, 1U, 0U, 0U, 0U);
+    }
 
     // Tonemapping pass
     renderpass_->NextSubpass(graphics_buffs[i], VK_SUBPASS_CONTENTS_INLINE);
@@ -1004,8 +1076,8 @@ void Renderer::SetupCommandBuffers() {
   }
 }
 
-void Renderer::SetupMaterialPipelines(const VulkanDevice &device,
-                                      const VertexSetup &g_store_vertex_setup) {
+void Renderer::SetupShadeMaterial(const VulkanDevice &device,
+                                  const VertexSetup &g_store_vertex_setup) {
   eastl::vector<VertexElement> vtx_layout;
   vtx_layout.push_back(VertexElement(VertexElementType::POSITION,
                                      SCAST_U32(sizeof(glm::vec3)),
@@ -1013,7 +1085,6 @@ void Renderer::SetupMaterialPipelines(const VulkanDevice &device,
 
   VertexSetup vertex_setup_quads(vtx_layout);
 
-  // Setup visibility shade material
   eastl::unique_ptr<MaterialShader> vis_shade_frag =
       eastl::make_unique<MaterialShader>(kBaseShaderAssetsPath +
                                              "vis_shade_amd.frag",
@@ -1025,16 +1096,22 @@ void Renderer::SetupMaterialPipelines(const VulkanDevice &device,
                                              "vis_shade.vert",
                                          "main", ShaderTypes::VERTEX);
 
-  uint32_t num_materials = material_manager()->GetMaterialInstancesCount();
+  // Sizes the texture table, which doesn't change as materials are added
+  uint32_t table_size = texture_manager()->table_size();
   vis_shade_frag->AddSpecialisationEntry(
-      kNumMaterialsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_materials);
+      kTableSizeSpecConstPos, SCAST_U32(sizeof(uint32_t)), &table_size);
   uint32_t num_lights = lights_manager()->GetNumLights();
   vis_shade_frag->AddSpecialisationEntry(
       kNumLightsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_lights);
-  vis_shade_vert->AddSpecialisationEntry(
-      kNumMaterialsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_materials);
   vis_shade_vert->AddSpecialisationEntry(
       kNumLightsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_lights);
+  // The shading pass fetches the vertices of the stored triangles itself,
+  // from the buffers of the last model drawn
+  vis_shade_frag->AddVertexEncodingsSpecialisation(g_store_vertex_setup);
+  shade_indices_16bit_ = GetShadeIndices16Bit(registered_models_);
+  vis_shade_frag->AddSpecialisationEntry(kIndices16SpecConstPos,
+                                         SCAST_U32(sizeof(uint32_t)),
+                                         &shade_indices_16bit_);
 
   eastl::unique_ptr<MaterialBuilder> builder_shade =
       eastl::make_unique<MaterialBuilder>(
@@ -1071,6 +1148,21 @@ void Renderer::SetupMaterialPipelines(const VulkanDevice &device,
 
   vis_shade_material_ =
       material_manager()->CreateMaterial(device, eastl::move(builder_shade));
+}
+
+void Renderer::SetupMaterialPipelines(const VulkanDevice &device,
+                                      const VertexSetup &g_store_vertex_setup) {
+  eastl::vector<VertexElement> vtx_layout;
+  vtx_layout.push_back(VertexElement(VertexElementType::POSITION,
+                                     SCAST_U32(sizeof(glm::vec3)),
+                                     VK_FORMAT_R32G32B32_SFLOAT));
+
+  VertexSetup vertex_setup_quads(vtx_layout);
+
+  SetupShadeMaterial(device, g_store_vertex_setup);
+
+  uint32_t num_lights = lights_manager()->GetNumLights();
+  float blend_constants[4U] = {1.f, 1.f, 1.f, 1.f};
 
   // Setup visibility storage material
   eastl::unique_ptr<MaterialShader> vis_store_frag =
@@ -1084,8 +1176,6 @@ void Renderer::SetupMaterialPipelines(const VulkanDevice &device,
                                              "vis_store_amd.vert",
                                          "main", ShaderTypes::VERTEX);
 
-  vis_store_vert->AddSpecialisationEntry(
-      kNumMaterialsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_materials);
   vis_store_vert->AddSpecialisationEntry(
       kNumLightsSpecConstPos, SCAST_U32(sizeof(uint32_t)), &num_lights);
 
@@ -1295,25 +1385,24 @@ void Renderer::CaptureData() {
       // of data for 20 frames also pushes a new array in the vector of arrays
       if (frames_captured_ < kFramesCaptureNum) {
 
-        void *mapped = nullptr;
         union BufferData {
           uint32_t data_uint[4U];
           FrameMemoryData data_struct[2U];
         } mapped_data;
 
         // Position the camera at the position for capturing
-        main_static_buff_.Map(vulkan()->device(), &mapped, sizeof(uint32_t) * 4,
-                              main_static_buff_.size() -
-                                  (sizeof(uint32_t) * 4));
-        uint32_t *mapped_u32 = static_cast<uint32_t *>(mapped);
+        VkDeviceSize counters_offset =
+            main_static_buff_.size() - (sizeof(uint32_t) * 4);
+        main_static_buff_.Invalidate(vulkan()->device(), sizeof(uint32_t) * 4,
+                                     counters_offset);
+        uint32_t *mapped_u32 =
+            main_static_buff_.MappedAs<uint32_t>(counters_offset);
 
         mapped_data.data_uint[0] = *mapped_u32;
         mapped_data.data_uint[1] = *(mapped_u32 + 1U);
         mapped_data.data_uint[2] = *(mapped_u32 + 2U);
         mapped_data.data_uint[3] = *(mapped_u32 + 3U);
 
-        main_static_buff_.Unmap(vulkan()->device());
-
         mem_perf_data_reads_.back()[frames_captured_] =
             mapped_data.data_struct[0U];
         mem_perf_data_writes_.back()[frames_captured_] =
@@ -1385,9 +1474,7 @@ void Renderer::CaptureScreenshot(const eastl::string &filename) const {
   VulkanImageInitInfo image_init_info;
   image_init_info.create_info = image_create_info;
   image_init_info.create_view = CreateView::NO;
-  image_init_info.memory_properties_flags =
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  image_init_info.memory_usage = MemoryUsage::GPU_TO_CPU;
   eastl::unique_ptr<VulkanImage> dst_image = eastl::make_unique<VulkanImage>();
   dst_image->Init(vulkan()->device(), image_init_info);
 
@@ -1514,8 +1601,7 @@ void Renderer::CaptureScreenshot(const eastl::string &filename) const {
 
   // Map image memory so we can start copying from it
   const char *data = nullptr;
-  vkMapMemory(vulkan()->device().device(), dst_image->memory(), 0,
-              VK_WHOLE_SIZE, 0, (void **)&data);
+  dst_image->Map(vulkan()->device(), (void **)&data);
 
   data += subresource_layout.offset;
 
@@ -1561,7 +1647,7 @@ void Renderer::CaptureScreenshot(const eastl::string &filename) const {
     }
   }
 
-  vkUnmapMemory(vulkan()->device().device(), dst_image->memory());
+  dst_image->Unmap(vulkan()->device());
 
   LOG("Screenshot " << filename.c_str() << " saved to disk.");
 }
@@ -1580,6 +1666,15 @@ void Renderer::CaptureBandwidthDataFromPositions(
 
   camera_sample_positions_ = sample_positions;
   camera_sample_directions_ = sample_directions;
+
+  // Samples which look at nothing measure an empty frame
+  for (uint32_t i = 0U; i < kCapturesNum; ++i) {
+    ScenePick pick;
+    if (!model_manager()->Pick(sample_positions[i], sample_directions[i],
+                               FLT_MAX, pick)) {
+      ELOG_WARN("Capture sample " << i << " does not face any model");
+    }
+  }
 }
 
 void Renderer::CaptureBandwidthDataAtPosition() const {
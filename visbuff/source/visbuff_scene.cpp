@@ -1,6 +1,7 @@
 #include <EASTL/vector.h>
 #include <assimp/postprocess.h>
 #include <base_system.h>
+#include <cfloat>
 #include <frustum.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <logger.hpp>
@@ -17,7 +18,8 @@ extern const int32_t kWindowWidth = 1920;
 extern const int32_t kWindowHeight = 1080;
 extern const char *kWindowName = "vksagres-visbuff";
 
-VisbuffScene::VisbuffScene() : Scene(), renderer_(), cam_() {}
+VisbuffScene::VisbuffScene()
+    : Scene(), renderer_(), cam_(), model_loads_() {}
 
 void VisbuffScene::DoInit() {
   input_manager()->SetCursorMode(window(), szt::MouseCursorMode::DISABLED);
@@ -36,38 +38,34 @@ void VisbuffScene::DoInit() {
                        kDefaultCameraRotationSpeed);
 
   eastl::vector<VertexElement> vtx_layout;
+  // Quantised streams; the shading pass decodes them as it fetches vertices
   vtx_layout.push_back(VertexElement(VertexElementType::POSITION,
-                                     SCAST_U32(sizeof(glm::vec3)),
-                                     VK_FORMAT_R32G32B32_SFLOAT));
+                                     VertexElementEncoding::AABB_UNORM_16));
   vtx_layout.push_back(VertexElement(VertexElementType::NORMAL,
-                                     SCAST_U32(sizeof(glm::vec3)),
-                                     VK_FORMAT_R32G32B32_SFLOAT));
+                                     VertexElementEncoding::OCTAHEDRAL_32));
   vtx_layout.push_back(VertexElement(VertexElementType::UV,
-                                     SCAST_U32(sizeof(glm::vec2)),
-                                     VK_FORMAT_R32G32_SFLOAT));
+                                     VertexElementEncoding::HALF_FLOAT));
   vtx_layout.push_back(VertexElement(VertexElementType::TANGENT,
-                                     SCAST_U32(sizeof(glm::vec3)),
-                                     VK_FORMAT_R32G32B32_SFLOAT));
+                                     VertexElementEncoding::OCTAHEDRAL_32));
   vtx_layout.push_back(VertexElement(VertexElementType::BITANGENT,
-                                     SCAST_U32(sizeof(glm::vec3)),
-                                     VK_FORMAT_R32G32B32_SFLOAT));
+                                     VertexElementEncoding::OCTAHEDRAL_32));
 
   VertexSetup vertex_setup(vtx_layout);
 
   renderer_.Init(&cam_, vertex_setup);
 
-  Model *nanosuit = nullptr;
-  model_manager()->LoadOtherModel(
+  // The scene renders straight away; the model shows up once it is loaded
+  model_manager()->set_optimise_vertex_order(true);
+  model_manager()->set_generate_lods(true);
+  model_loads_.push_back(model_manager()->LoadOtherModelAsync(
       vulkan()->device(), STR(ASSETS_FOLDER) "models/crytek-sponza/sponza.dae",
       STR(ASSETS_FOLDER) "models/crytek-sponza/",
-      // vulkan()->device(), STR(ASSETS_FOLDER) "models/rungholt/rungholt.obj",
+      // STR(ASSETS_FOLDER) "models/rungholt/rungholt.obj",
       // STR(ASSETS_FOLDER) "models/rungholt/",
       aiProcess_CalcTangentSpace | aiProcess_GenSmoothNormals |
           aiProcess_Triangulate | aiProcess_JoinIdenticalVertices |
           aiProcess_FlipUVs,
-      vertex_setup, &nanosuit);
-
-  renderer_.RegisterModel(*nanosuit);
+      vertex_setup));
 }
 
 void VisbuffScene::DoRender(float delta_time) {
@@ -79,6 +77,44 @@ void VisbuffScene::DoRender(float delta_time) {
 void VisbuffScene::DoUpdate(float delta_time) {
   cam_controller_.Update(&cam_, delta_time);
 
+  // Register the models which have finished loading
+  model_manager()->UpdateAsyncLoads(vulkan()->device());
+  eastl::vector<ModelLoadHandle>::iterator itor = model_loads_.begin();
+  while (itor != model_loads_.end()) {
+    if ((*itor)->IsReady()) {
+      renderer_.RegisterModel(*(*itor)->model());
+      itor = model_loads_.erase(itor);
+    } else if ((*itor)->IsFailed()) {
+      // Already reported; the scene keeps rendering without it
+      itor = model_loads_.erase(itor);
+    } else {
+      ++itor;
+    }
+  }
+
+  // Report how much frustum culling keeps
+  if (input_manager()->IsKeyPressed(GLFW_KEY_V)) {
+    LOG("Visible instances: " << renderer_.num_visible_instances() << " of "
+                              << renderer_.GetInstancesCount());
+  }
+
+  // Report what the camera is looking at
+  if (input_manager()->IsKeyPressed(GLFW_KEY_P)) {
+    ScenePick pick;
+    if (model_manager()->Pick(cam_.position(), cam_.GetForwardVector(),
+                              FLT_MAX, pick)) {
+      LOG("Picked instance " << pick.instance_idx << " of mesh "
+                             << pick.mesh_idx << " at " << pick.distance);
+    } else {
+      LOG("Nothing picked");
+    }
+  }
+
+  // Report how device memory is used
+  if (input_manager()->IsKeyPressed(GLFW_KEY_M)) {
+    vulkan()->device().allocator().LogReport();
+  }
+
   // Reload shaders
   if (input_manager()->IsKeyPressed(GLFW_KEY_R)) {
     renderer_.ReloadAllShaders();